@@ -0,0 +1,224 @@
+# Shared functions for the loopback tests.
+# These start a standalone UnrealIRCd on 127.0.0.1, with a generated
+# configuration file, so a test can enable whatever it wants to test
+# (eg. set::io-threads or set::tls::options::ktls).
+#
+# Set UNREALIRCD_DIR if UnrealIRCd is not installed in ~/unrealircd.
+
+UNREALIRCD_DIR="${UNREALIRCD_DIR:-$HOME/unrealircd}"
+PLAIN_PORT="${PLAIN_PORT:-5660}"
+TLS_PORT="${TLS_PORT:-5661}"
+OPENSSL="${OPENSSL:-openssl}"
+
+TESTDIR=""
+SERVER_PID=""
+
+function fail()
+{
+	echo "TEST ERROR: $*"
+	if [ -n "$TESTDIR" -a -f "$TESTDIR/ircd.log" ]; then
+		echo "== SERVER LOG =="
+		tail -n 50 "$TESTDIR/ircd.log"
+	fi
+	stop_server
+	exit 1
+}
+
+# Start the server.
+# $1: extra lines for the set { } block
+# $2: extra lines for the set::tls::options { } block
+function start_server()
+{
+	[ -x "$UNREALIRCD_DIR/bin/unrealircd" ] || fail "UnrealIRCd not found in $UNREALIRCD_DIR (set UNREALIRCD_DIR)"
+
+	TESTDIR="`mktemp -d /tmp/unrealircd-loopback.XXXXXX`"
+	$OPENSSL req -x509 -newkey rsa:2048 -nodes -days 2 -subj "/CN=test.example.org" \
+		-keyout "$TESTDIR/server.key.pem" -out "$TESTDIR/server.cert.pem" >/dev/null 2>&1 ||
+		fail "Could not generate a TLS certificate"
+
+	# GeoIP is not needed and would require a download
+	cat >"$TESTDIR/unrealircd.conf" <<EOF
+blacklist-module geoip_classic;
+include "modules.default.conf";
+loadmodule "cloak_sha256";
+include "operclass.default.conf";
+include "snomasks.default.conf";
+me { name "test.example.org"; info "Loopback test server"; sid "001"; }
+admin { "Loopback test"; }
+class clients { pingfreq 90; maxclients 100; sendq 10M; recvq 30k; }
+allow { mask *; class clients; maxperip 100; }
+listen { ip 127.0.0.1; port $PLAIN_PORT; }
+listen { ip 127.0.0.1; port $TLS_PORT; options { tls; } }
+oper test { mask *; password "test"; class clients; operclass netadmin; }
+log {
+	source { !debug; all; }
+	destination { file "$TESTDIR/ircd.log"; }
+}
+set {
+	network-name "LoopbackTest";
+	default-server "test.example.org";
+	services-server "services.example.org";
+	help-channel "#help";
+	kline-address "test@example.org";
+	handshake-delay 0;
+	handshake-boot-delay 0;
+	cloak-keys {
+		"Oozahho1raezoh0iMee4ohvegaifahv5xaepeitaich9tahdiquaid0geecipahdauVaij3zieph4ahi";
+		"Aizoh0oothahshi0Ahh0eeR1cheith3eeTh7oush8iejieNgaiNg2Oj8raich0aeCh1ahb6aivOhbVrpoiVg";
+		"Ohnai0Quo8ahf6Aeg4eiPh3ool4eiphaeDoh4Aishohpeth8Caebu8weiChi7pheegoh9uusieRV5IfLBcbf";
+	}
+	tls {
+		certificate "$TESTDIR/server.cert.pem";
+		key "$TESTDIR/server.key.pem";
+		options {
+$2
+		}
+	}
+$1
+}
+EOF
+
+	"$UNREALIRCD_DIR/bin/unrealircd" -F -f "$TESTDIR/unrealircd.conf" >"$TESTDIR/boot.log" 2>&1 &
+	SERVER_PID=$!
+
+	# Wait until it accepts connections
+	for i in `seq 1 50`
+	do
+		if (exec 3<>/dev/tcp/127.0.0.1/$PLAIN_PORT) 2>/dev/null; then
+			return 0
+		fi
+		kill -0 $SERVER_PID 2>/dev/null || break
+		sleep 0.2
+	done
+	cat "$TESTDIR/boot.log"
+	fail "Server did not start"
+}
+
+function stop_server()
+{
+	if [ -n "$SERVER_PID" ]; then
+		kill -TERM $SERVER_PID 2>/dev/null
+		wait $SERVER_PID 2>/dev/null
+		SERVER_PID=""
+	fi
+	if [ -n "$TESTDIR" ]; then
+		rm -rf "$TESTDIR"
+		TESTDIR=""
+	fi
+}
+
+# Connect to the server, stdin is sent and stdout is what we receive.
+# $1: 0 for plaintext, 1 for TLS
+# $2: for TLS, optionally a file to write the TLS protocol messages to
+function irc_connect()
+{
+	if [ "$1" = 1 -a -n "$2" ]; then
+		$OPENSSL s_client -quiet -msg -msgfile "$2" -connect 127.0.0.1:$TLS_PORT 2>/dev/null
+	elif [ "$1" = 1 ]; then
+		$OPENSSL s_client -quiet -connect 127.0.0.1:$TLS_PORT 2>/dev/null
+	else
+		exec 3<>/dev/tcp/127.0.0.1/$PLAIN_PORT || return 1
+		cat <&3 &
+		cat >&3
+		wait
+	fi
+}
+
+# Generate the payload of message number $1, of roughly $2 bytes
+function payload()
+{
+	local line="$1-"
+	while [ ${#line} -lt $2 ]
+	do
+		line="$line$1abcdefghijklmnopqrstuvwxyz"
+	done
+	echo "${line:0:$2}"
+}
+
+# Wait (up to 10 seconds) until the server sent a line matching $2 to
+# output file $1, and print that line.
+function wait_for_line()
+{
+	local i
+	for i in `seq 1 100`
+	do
+		if tr -d '\r' <"$1" 2>/dev/null | grep -m 1 -- "$2"; then
+			return 0
+		fi
+		sleep 0.1
+	done
+	return 1
+}
+
+# Register as $1 (answering the anti-spoof PING that is written to
+# output file $3), oper up (so we are exempt from flood limits),
+# send every line of file $4 to $2, then wait and quit.
+function irc_session()
+{
+	local cookie
+	echo "NICK $1"
+	echo "USER $1 0 * :Loopback test"
+	cookie="`wait_for_line "$3" '^PING :'`"
+	[ -n "$cookie" ] && echo "PONG :${cookie#PING :}"
+	wait_for_line "$3" " 001 $1 " >/dev/null
+	echo "OPER test test"
+	wait_for_line "$3" " 381 $1 " >/dev/null
+	# Give the other client time to get online too
+	sleep 1
+	sed "s/^/PRIVMSG $2 :/" "$4"
+	sleep 3
+	echo "QUIT"
+}
+
+# Write $2 lines of $3 bytes to file $1, for sending with irc_session.
+function generate_lines()
+{
+	local i
+	for i in `seq 1 $2`
+	do
+		payload $i $3
+	done >"$1"
+}
+
+# Check that output file $1 contains all lines of file $2 as
+# messages from $3, in order and with the correct contents.
+function check_received()
+{
+	local got
+	got="`tr -d '\r' <"$1" | grep "^:$3!" | grep " PRIVMSG " | sed 's/^[^ ]* PRIVMSG [^ ]* ://'`"
+	if [ "$got" != "`cat "$2"`" ]; then
+		echo "== RECEIVED FROM $3 (first lines) =="
+		echo "$got" | head -n 5
+		fail "Messages from $3 are missing, out of order or corrupt (got `echo -n "$got" | grep -c .` of `wc -l <"$2"` lines)"
+	fi
+}
+
+# Run two clients that send $2 messages of $3 bytes to each other.
+# $1: 0 for plaintext, 1 for TLS
+# For TLS, the protocol messages are written to testa.msg and testb.msg
+# in $TESTDIR (see tls_record_sizes).
+function bulk_exchange()
+{
+	generate_lines "$TESTDIR/lines" $2 $3
+	: >"$TESTDIR/testa.out"
+	: >"$TESTDIR/testb.out"
+	irc_session testa testb "$TESTDIR/testa.out" "$TESTDIR/lines" | irc_connect $1 "$TESTDIR/testa.msg" >"$TESTDIR/testa.out" &
+	local pid_a=$!
+	irc_session testb testa "$TESTDIR/testb.out" "$TESTDIR/lines" | irc_connect $1 "$TESTDIR/testb.msg" >"$TESTDIR/testb.out" &
+	local pid_b=$!
+	wait $pid_a $pid_b
+	check_received "$TESTDIR/testb.out" "$TESTDIR/lines" testa
+	check_received "$TESTDIR/testa.out" "$TESTDIR/lines" testb
+}
+
+# Print the length of every TLS application data record that was
+# received, given a file written by irc_connect with the protocol messages.
+function tls_record_sizes()
+{
+	local len
+	grep -A1 '^<<< .*RecordHeader' "$1" | awk '$1 == "17" { print $4 $5 }' |
+	while read len
+	do
+		echo $((16#$len))
+	done
+}
@@ -40,12 +40,17 @@
  * So, the way this works is we determine using the preprocessor
  * what polling backend to use for the eventloop.  We prefer epoll,
  * followed by kqueue, followed by poll, and then finally select.
+ * On Linux io_uring is used if available, with epoll as a fallback
+ * in case io_uring turns out to be unavailable at runtime.
  * Kind of ugly, but it gets the job done.  You can also fiddle with
  * this to determine what backend is used.
  */
 #ifndef _WIN32
 # ifdef HAVE_EPOLL
 #  define BACKEND_EPOLL
+#  ifdef HAVE_IO_URING
+#   define BACKEND_IO_URING
+#  endif
 # else
 #  ifdef HAVE_KQUEUE
 #   define BACKEND_KQUEUE
@@ -192,9 +197,17 @@
  * Was 2000ms in 3.2.x, 1000ms for versions below 3.4-alpha4.
  * 500ms in UnrealIRCd 4 (?)
  * 250ms in UnrealIRCd 5 and UnrealIRCd 6.
+ * Nowadays this is only used when there are clients with delayed
+ * data (see process_clients), otherwise we sleep until the next event.
  */
 #define SOCKETLOOP_MAX_DELAY 250
 
+/* When server bans are added, all local users are checked against them.
+ * With many users and bans this takes a while, so it is done in steps
+ * of at most this many milliseconds, with I/O being processed in between.
+ */
+#define BANCHECK_MAX_MSEC 25
+
 /* After how much time should we timeout downloads:
  * DOWNLOAD_CONNECT_TIMEOUT: for the DNS and connect() / TLS_connect() call
  * DOWNLOAD_TRANSFER_TIMEOUT: for the complete transfer (including connect)
@@ -33,11 +33,11 @@
  * Alignment details:
  * We don't set it to 4096 bytes exactly because we want the
  * struct 'dbufdbuf' (see further down) to be exactly 4096 bytes.
- * Since it includes some other struct members, 4072 seems to do it
+ * Since it includes some other struct members, 4056 seems to do it
  * on 64 bit archs. Note that there is no need to provide room
  * for malloc overhead as we use mempools.
  */
-#define DBUF_BLOCK_SIZE		(4072)
+#define DBUF_BLOCK_SIZE		(4056)
 
 /*
 ** dbuf is a collection of functions which can be used to
@@ -58,18 +58,36 @@ typedef struct dbuf {
 	u_int length;		/* Current number of bytes stored */
 //	u_int offset;		/* Offset to the first byte */
 	struct list_head dbuf_list;
+	struct dbufbuf *pinned;	/* Block in use by dbuf_getmsg_nocopy() */
 } dbuf;
 
+/** A shared, reference counted, buffer.
+ * This is used when the exact same data is sent to many clients,
+ * such as a channel message. Instead of copying the data into
+ * the sendQ of every client, each sendQ only references it,
+ * see dbuf_put_shared(). Create one with dbuf_shared_new() and
+ * drop your own reference with dbuf_shared_release() when done.
+ */
+typedef struct dbufshared {
+	int refcount;		/* Number of references (sendQ's + creator) */
+	int size;		/* Number of bytes in 'data' */
+	char data[1];		/* The data, allocated with the struct */
+} dbufshared;
+
 /*
 ** And this 'dbufbuf' should never be referenced outside the
 ** implementation of 'dbuf'--would be "hidden" if C had such
 ** keyword...
 ** This is exactly a page in total, see comment at
 ** DBUF_BLOCK_SIZE definition further up.
+** A block that references a dbufshared (a "slice") is allocated
+** without the 'data' member, since it does not use it.
 */
 typedef struct dbufbuf {
 	struct list_head dbuf_node;
-	size_t size;
+	size_t size;		/* Number of bytes stored, starting at 'start' */
+	char *start;		/* Start of the data, in 'data' or in 'shared->data' */
+	dbufshared *shared;	/* Shared buffer (for slices), otherwise NULL */
 	char data[DBUF_BLOCK_SIZE];
 } dbufbuf;
 
@@ -84,6 +102,10 @@ void dbuf_put(dbuf *, const char *, size_t);
 					/* Pointer to data to be stored */
 					/* Number of bytes to store */
 
+extern void dbuf_put_shared(dbuf *dyn, dbufshared *shared);
+extern dbufshared *dbuf_shared_new(const char *buf, int length);
+extern void dbuf_shared_release(dbufshared *shared);
+
 void dbuf_delete(dbuf *, size_t);
 					/* Dynamic buffer header */
 					/* Number of bytes to delete */
@@ -104,8 +126,11 @@ void dbuf_delete(dbuf *, size_t);
 #define DBufClear(dyn)	dbuf_delete((dyn),DBufLength(dyn))
 
 extern int dbuf_getmsg(dbuf *, char *);
+extern int dbuf_getmsg_nocopy(dbuf *dyn, char *buf, char **msg);
+extern void dbuf_getmsg_done(dbuf *dyn);
 extern int dbuf_get(dbuf *dyn, char **buf);
 extern void dbuf_queue_init(dbuf *dyn);
 extern void dbuf_init(void);
+extern void dbuf_test_speed(void);
 
 #endif /* __dbuf_include__ */
@@ -75,6 +75,8 @@ struct Configuration {
 	unsigned disable_cap:1;
 	unsigned check_target_nick_bans:1;
 	HideBanReasonOption hide_ban_reason;
+	int database_chunk_size;
+	UnrealDBFsyncMode database_fsync;
 	char *link_bindip;
 	long throttle_period;
 	char throttle_count;
@@ -185,6 +187,7 @@ struct Configuration {
 	int dns_client_retry;
 	int dns_dnsbl_timeout;
 	int dns_dnsbl_retry;
+	int io_threads;
 };
 
 extern MODVAR Configuration iConf;
@@ -352,4 +355,6 @@ struct SetCheck {
 	unsigned has_min_nick_length:1;
 	unsigned has_nick_length:1;
 	unsigned has_hide_ban_reason:1;
+	unsigned has_database_chunk_size:1;
+	unsigned has_database_fsync:1;
 };
@@ -19,6 +19,8 @@ typedef struct fd_entry {
 	unsigned char is_open;
 	FDCloseMethod close_method;
 	unsigned int backend_flags;
+	unsigned char write_edge;	/**< Edge-triggered write notification, see fd_write_edge() */
+	unsigned char write_pending;	/**< On the write pending list of the epoll backend (fd_write_edge only) */
 } FDEntry;
 
 extern MODVAR FDEntry fd_table[MAXCONNECTIONS + 1];
@@ -26,6 +28,7 @@ extern MODVAR FDEntry fd_table[MAXCONNECTIONS + 1];
 extern int fd_open(int fd, const char *desc, FDCloseMethod close_method);
 extern int fd_close(int fd);
 extern void fd_unnotify(int fd);
+extern void fd_write_edge(int fd);
 extern int fd_socket(int family, int type, int protocol, const char *desc);
 extern int fd_accept(int sockfd);
 extern void fd_desc(int fd, const char *desc);
@@ -43,6 +43,7 @@ extern void init_glines(void);
 extern void tkl_init(void);
 extern void process_clients(void);
 extern void unrealdb_test(void);
+extern void member_index_test_speed(void);
 extern void ignore_this_signal();
 extern void s_rehash();
 extern void s_reloadcert();
@@ -184,10 +185,14 @@ extern MODVAR struct list_head control_list;
 extern MODVAR struct list_head global_server_list;
 extern MODVAR struct list_head dead_list;
 extern MODVAR struct list_head rpc_remote_list;
+extern MODVAR struct list_head ready_list;
+extern MODVAR struct list_head dirty_list;
 extern RealCommand *find_command(const char *cmd, int flags);
 extern RealCommand *find_command_simple(const char *cmd);
 extern Membership *find_membership_link(Membership *lp, Channel *ptr);
 extern Member *find_member_link(Member *, Client *);
+extern Member *find_member(Channel *channel, Client *client);
+extern Membership *find_membership(Client *client, Channel *channel);
 extern int remove_user_from_channel(Client *client, Channel *channel, int dont_log);
 extern void add_server_to_table(Client *);
 extern void remove_server_from_table(Client *);
@@ -200,6 +205,7 @@ extern int valid_channelname(const char *);
 extern int valid_server_name(const char *name);
 extern Cmode *find_channel_mode_handler(char letter);
 extern int valid_channel_access_mode_letter(char letter);
+extern uint64_t member_modes_to_mask(const char *modes);
 extern int check_channel_access(Client *client, Channel *channel, const char *modes);
 extern int check_channel_access_membership(Membership *mb, const char *modes);
 extern int check_channel_access_member(Member *mb, const char *modes);
@@ -277,6 +283,8 @@ extern void *safe_alloc(size_t size);
 extern void set_socket_buffers(int fd, int rcvbuf, int sndbuf);
 extern int send_queued(Client *);
 extern void send_queued_cb(int fd, int revents, void *data);
+extern int send_queued_raw(Client *to, int *want_read);
+extern int send_queued_completed(Client *to, int rlen, int want_read, int saved_errno);
 extern void sendto_serv_butone_nickcmd(Client *one, MessageTag *mtags, Client *client, const char *umodes);
 extern void    sendto_message_one(Client *to, Client *from, const char *sender, const char *cmd, const char *nick, const char *msg);
 extern void sendto_channel(Channel *channel, Client *from, Client *skip,
@@ -362,6 +370,10 @@ extern void sendto_server(Client *one, unsigned long caps, unsigned long nocaps,
 extern void send_raw_direct(Client *user, FORMAT_STRING(const char *pattern), ...) __attribute__((format(printf, 2, 3)));
 extern MODVAR int writecalls, writeb[];
 extern int deliver_it(Client *cptr, char *str, int len, int *want_read);
+extern int deliver_it_raw(Client *cptr, char *str, int len, int *want_read);
+#ifndef _WIN32
+extern int deliver_it_iov_raw(Client *cptr, struct iovec *iov, int iovcnt);
+#endif
 extern int target_limit_exceeded(Client *client, void *target, const char *name);
 extern char *canonize(const char *buffer);
 extern int check_registered(Client *);
@@ -427,21 +439,35 @@ extern time_t timeout_query_list(time_t);
 extern time_t expire_cache(time_t);
 extern void del_queries(const char *);
 
-/* Hash stuff */
-#define NICK_HASH_TABLE_SIZE 32768
-#define CHAN_HASH_TABLE_SIZE 32768
-#define WHOWAS_HASH_TABLE_SIZE 32768
-#define THROTTLING_HASH_TABLE_SIZE 8192
-#define IPUSERS_HASH_TABLE_SIZE 8192
+/* Hash stuff. These are the initial (and minimum) sizes,
+ * the hash tables grow and shrink automatically.
+ */
+#define NICK_HASH_TABLE_SIZE 1024
+#define CHAN_HASH_TABLE_SIZE 1024
+#define WHOWAS_HASH_TABLE_SIZE 256
+#define THROTTLING_HASH_TABLE_SIZE 256
+#define IPUSERS_HASH_TABLE_SIZE 256
+#define COMMAND_HASH_TABLE_SIZE 256
 extern uint64_t siphash(const char *in, const char *k);
 extern uint64_t siphash_raw(const char *in, size_t len, const char *k);
 extern uint64_t siphash_nocase(const char *in, const char *k);
 extern void siphash_generate_key(char *k);
 extern void init_hash(void);
+extern void hashtable_init(HashTable *ht, const char *name, unsigned int min_size);
+extern void hashtable_add(HashTable *ht, HashNode *node, uint64_t hashv);
+extern void hashtable_del(HashTable *ht, HashNode *node);
+extern HashNode *hashtable_find_first(HashTable *ht, uint64_t hashv);
+extern HashNode *hashtable_find_next(HashNode *node);
+extern int hashtable_foreach(HashTable *ht, HashTableCallback fn, void *data);
+extern unsigned long hashtable_scan(HashTable *ht, unsigned long cursor, HashTableCallback fn, void *data);
+/** Walk all nodes in hash table 'ht' that have hash value 'hashv' */
+#define hashtable_for_each_match(ht, node, hashv) \
+	for (node = hashtable_find_first(ht, hashv); node; node = hashtable_find_next(node))
+/** Returns 1 if the node is in a hash table, 0 if not */
+#define hashnode_linked(node)	((node)->pprev != NULL)
+extern void report_hash_tables(Client *client);
 extern void add_whowas_to_clist(WhoWas **, WhoWas *);
 extern void del_whowas_from_clist(WhoWas **, WhoWas *);
-extern void add_whowas_to_list(WhoWas **, WhoWas *);
-extern void del_whowas_from_list(WhoWas **, WhoWas *);
 extern uint64_t hash_whowas_name(const char *name);
 extern void create_whowas_entry(Client *client, WhoWas *e, WhoWasEvent event);
 extern void free_whowas_fields(WhoWas *e);
@@ -452,7 +478,7 @@ extern int add_to_id_hash_table(const char *, Client *);
 extern int del_from_id_hash_table(const char *, Client *);
 extern int add_to_channel_hash_table(const char *, Channel *);
 extern void del_from_channel_hash_table(const char *, Channel *);
-extern Channel *hash_get_chan_bucket(uint64_t);
+extern unsigned long hash_scan_channels(unsigned long cursor, HashTableCallback fn, void *data);
 extern Client *hash_find_client(const char *, Client *);
 extern Client *hash_find_id(const char *, Client *);
 extern Client *hash_find_nickatserver(const char *, Client *);
@@ -461,9 +487,10 @@ extern Client *hash_find_server(const char *, Client *);
 extern IpUsersBucket *find_ipusers_bucket(Client *client);
 extern IpUsersBucket *add_ipusers_bucket(Client *client);
 extern void decrease_ipusers_bucket(Client *client);
-extern MODVAR struct ThrottlingBucket *ThrottlingHash[THROTTLING_HASH_TABLE_SIZE];
-extern MODVAR IpUsersBucket *IpUsersHash_ipv4[IPUSERS_HASH_TABLE_SIZE];
-extern MODVAR IpUsersBucket *IpUsersHash_ipv6[IPUSERS_HASH_TABLE_SIZE];
+extern MODVAR HashTable whowasTable;
+extern MODVAR HashTable throttlingTable;
+extern MODVAR HashTable ipusersTable_ipv4;
+extern MODVAR HashTable ipusersTable_ipv6;
 
 
 /* Mode externs
@@ -529,8 +556,10 @@ extern void addlettertodynamicstringsorted(char **str, char letter);
 extern int sort_character_lowercase_before_uppercase(char x, char y);
 
 /* Internal command stuff - not for modules */
-extern MODVAR RealCommand *CommandHash[256];
+extern MODVAR RealCommand *CommandList;
+extern MODVAR HashTable commandTable;
 extern void init_CommandHash(void);
+extern uint64_t hash_command_name(const char *cmd);
 
 /*
  * Close all local socket connections, invalidate client fd's
@@ -585,6 +614,7 @@ extern void outofmemory(size_t bytes);
  * @{
  */
 extern void *safe_alloc(size_t size);
+extern void *safe_realloc(void *ptr, size_t size);
 /** Free previously allocate memory pointer.
  * This also sets the pointer to NULL, since that would otherwise be common to forget.
  */
@@ -1012,6 +1042,7 @@ extern void sha256hash_binary(char *dst, const char *src, unsigned long n);
 extern void sha1hash_binary(char *dst, const char *src, unsigned long n);
 extern MODVAR TKL *tklines[TKLISTLEN];
 extern MODVAR TKL *tklines_ip_hash[TKLIPHASHLEN1][TKLIPHASHLEN2];
+extern MODVAR TKLCidrNode *tklines_cidr_tree[TKLIPHASHLEN1][2];
 extern const char *cmdname_by_spamftarget(int target);
 extern void unrealdns_delreq_bycptr(Client *cptr);
 extern void unrealdns_gethostbyname_link(const char *name, ConfigItem_link *conf, int ipv4_only);
@@ -1044,6 +1075,10 @@ extern Client *find_pending_net_duplicates(Client *cptr, Client **srv, char **si
 extern MODVAR char serveropts[];
 extern MODVAR char *ISupportStrings[];
 extern void read_packet(int fd, int revents, void *data);
+extern int read_packet_raw(Client *client, char *buf, int buflen, int *want);
+extern void read_packet_completed(Client *client, char *buf, int length, int want, int saved_errno);
+extern int io_threads_queue(Client *client, IOJobType type);
+extern void io_threads_run(void);
 extern int process_packet(Client *cptr, char *readbuf, int length, int killsafely);
 extern int parse_chanmode(ParseMode *pm, const char *modebuf_in, const char *parabuf_in);
 extern int dead_socket(Client *to, const char *notice);
@@ -1052,6 +1087,13 @@ extern void unreal_delete_match(Match *m);
 extern int unreal_match(Match *m, const char *str);
 extern int unreal_match_method_strtoval(const char *str);
 extern char *unreal_match_method_valtostr(int val);
+extern int unreal_pcre2_match(pcre2_code *re, const char *str, PCRE2_SIZE **ovector);
+extern int unreal_match_literal(Match *m, char *buf, size_t buflen);
+extern LiteralMatcher *literal_matcher_new(void);
+extern void literal_matcher_add(LiteralMatcher *lm, const char *literal, void *data);
+extern void literal_matcher_compile(LiteralMatcher *lm);
+extern void literal_matcher_scan(LiteralMatcher *lm, const char *str, void (*fn)(void *data, void *ctx), void *ctx);
+extern void literal_matcher_free(LiteralMatcher *lm);
 #ifdef _WIN32
 extern MODVAR BOOL IsService;
 #endif
@@ -1330,6 +1372,9 @@ extern UnrealDBConfig *unrealdb_get_config(UnrealDB *db);
 extern void unrealdb_free_config(UnrealDBConfig *c);
 extern UnrealDBError unrealdb_get_error_code(void);
 extern const char *unrealdb_get_error_string(void);
+extern void unrealdb_async_run(void);
+extern void unrealdb_async_flush(void);
+extern time_t unrealdb_async_written_time(const char *filename);
 /* src/unrealdb.c end */
 /* secret { } related stuff */
 extern Secret *find_secret(const char *secret_name);
@@ -1424,6 +1469,8 @@ extern void clear_scache_hash_table(void);
 extern void sendto_one(Client *, MessageTag *mtags, FORMAT_STRING(const char *), ...) __attribute__((format(printf,3,4)));
 extern void vsendto_one(Client *to, MessageTag *mtags, const char *pattern, va_list vl);
 extern void mark_data_to_send(Client *to);
+extern void flush_dirty_clients(void);
+extern void mark_data_to_process(Client *client);
 extern EVENT(garbage_collect);
 extern EVENT(loop_event);
 extern EVENT(check_pings);
@@ -817,6 +817,8 @@ struct Event {
 	struct timeval	last_run;	/**< Last time this event ran */
 	char		deleted;	/**< Set to 1 if this event is marked for deletion */
 	Module		*owner;		/**< To which module this event belongs */
+	long long	next_run;	/**< When the event should run next (msec since epoch) */
+	int		heap_index;	/**< Position in the event heap, or -1 if not in it */
 };
 
 #define EMOD_EVERY 0x0001
@@ -864,6 +866,8 @@ extern Event *EventMarkDel(Event *event);
 extern Event *EventFind(const char *name);
 extern int EventMod(Event *event, EventInfo *mods);
 extern void DoEvents(void);
+extern long TimeUntilNextEvent(void);
+extern void RescheduleEvents(void);
 extern void EventStatus(Client *client);
 extern void SetupEvents(void);
 
@@ -76,6 +76,7 @@
 
 typedef struct LoopStruct LoopStruct;
 typedef struct TKL TKL;
+typedef struct TKLCidrNode TKLCidrNode;
 typedef struct Spamfilter Spamfilter;
 typedef struct ServerBan ServerBan;
 typedef struct BanException BanException;
@@ -135,6 +136,9 @@ typedef struct Server Server;
 typedef struct RPCClient RPCClient;
 typedef struct Link Link;
 typedef struct Ban Ban;
+typedef struct HashNode HashNode;
+typedef struct HashTable HashTable;
+typedef struct BanCache BanCache;
 typedef struct Mode Mode;
 typedef struct MessageTag MessageTag;
 typedef struct MOTDFile MOTDFile; /* represents a whole MOTD, including remote MOTD support info */
@@ -144,6 +148,7 @@ typedef struct RealCommand RealCommand;
 typedef struct CommandOverride CommandOverride;
 typedef struct Member Member;
 typedef struct Membership Membership;
+typedef struct MemberIndex MemberIndex;
 
 typedef struct OutgoingWebRequest OutgoingWebRequest;
 typedef struct OutgoingWebResponse OutgoingWebResponse;
@@ -435,6 +440,7 @@ typedef enum ClientStatus {
 #define CLIENT_FLAG_IPUSERS_BUMPED	0x100000000	/**< The IpUsersBucket for this IP has been bumped (and needs to be decreased on disconnect) */
 #define CLIENT_FLAG_DEADSOCKET_IS_BANNED	0x200000000	/**< The deadsocket message should also send ERR_YOUREBANNEDCREEP and such */
 #define CLIENT_FLAG_CONNECT_FLOOD_CHECKED	0x400000000	/**< connect-flood has been checked (there are two hooks, so need this) */
+#define CLIENT_FLAG_WRITE_BLOCKED	0x800000000	/**< Could not write the entire sendQ, waiting for the socket to become writable */
 /** @} */
 
 #define OPER_SNOMASKS "+bBcdfkqsSoO"
@@ -527,6 +533,7 @@ typedef enum ClientStatus {
 #define IsULine(x)			((x)->flags & CLIENT_FLAG_ULINE)
 #define IsSvsCmdOk(x)			(((x)->flags & CLIENT_FLAG_ULINE) || ((iConf.limit_svscmds == LIMIT_SVSCMDS_SERVERS) && (IsServer((x)) || IsMe((x)))))
 #define IsVirus(x)			((x)->flags & CLIENT_FLAG_VIRUS)
+#define IsWriteBlocked(x)		((x)->flags & CLIENT_FLAG_WRITE_BLOCKED)
 #define IsIdentLookupSent(x)		((x)->flags & CLIENT_FLAG_IDENTLOOKUPSENT)
 #define IsAsyncRPC(x)			((x)->flags & CLIENT_FLAG_ASYNC_RPC)
 #define SetIdentLookup(x)		do { (x)->flags |= CLIENT_FLAG_IDENTLOOKUP; } while(0)
@@ -558,6 +565,7 @@ typedef enum ClientStatus {
 #define SetSQuit(x)			do { (x)->flags |= CLIENT_FLAG_SQUIT; } while(0)
 #define SetTLS(x)			do { (x)->flags |= CLIENT_FLAG_TLS; } while(0)
 #define SetULine(x)			do { (x)->flags |= CLIENT_FLAG_ULINE; } while(0)
+#define SetWriteBlocked(x)		do { (x)->flags |= CLIENT_FLAG_WRITE_BLOCKED; } while(0)
 #define SetVirus(x)			do { (x)->flags |= CLIENT_FLAG_VIRUS; } while(0)
 #define SetIdentLookupSent(x)		do { (x)->flags |= CLIENT_FLAG_IDENTLOOKUPSENT; } while(0)
 #define SetAsyncRPC(x)			do { (x)->flags |= CLIENT_FLAG_ASYNC_RPC; } while(0)
@@ -588,6 +596,7 @@ typedef enum ClientStatus {
 #define ClearShunned(x)			do { (x)->flags &= ~CLIENT_FLAG_SHUNNED; } while(0)
 #define ClearSQuit(x)			do { (x)->flags &= ~CLIENT_FLAG_SQUIT; } while(0)
 #define ClearTLS(x)			do { (x)->flags &= ~CLIENT_FLAG_TLS; } while(0)
+#define ClearWriteBlocked(x)		do { (x)->flags &= ~CLIENT_FLAG_WRITE_BLOCKED; } while(0)
 #define ClearULine(x)			do { (x)->flags &= ~CLIENT_FLAG_ULINE; } while(0)
 #define ClearVirus(x)			do { (x)->flags &= ~CLIENT_FLAG_VIRUS; } while(0)
 #define ClearIdentLookupSent(x)		do { (x)->flags &= ~CLIENT_FLAG_IDENTLOOKUPSENT; } while(0)
@@ -872,6 +881,35 @@ typedef enum {
 	MATCH_NONE=3, /**< No matching at all (rule-based) */
 } MatchType;
 
+/** Hash table node, embedded in the struct that is stored in a HashTable.
+ * The 'hashv' is the full 64 bit hash of the key (eg: from siphash()),
+ * so it never needs to be recalculated when the table is resized.
+ */
+struct HashNode {
+	HashNode *next;			/**< Next node in the same bucket */
+	HashNode **pprev;		/**< Pointer to the 'next' of the previous node (or the bucket), NULL if not in a table */
+	uint64_t hashv;			/**< Hash value of the key */
+};
+
+/** Chained hash table that resizes itself incrementally.
+ * When the table grows or shrinks a second bucket array is allocated and
+ * every add/del/find moves a few buckets, so there is never a pause where
+ * the entire table is rehashed at once. See src/hash.c for the functions.
+ */
+struct HashTable {
+	const char *name;		/**< Name of the table, for /STATS hash */
+	HashNode **table[2];		/**< Buckets. table[1] only exists during a resize */
+	unsigned int size[2];		/**< Number of buckets in each table, always a power of two */
+	unsigned int min_size;		/**< Never shrink below this number of buckets */
+	unsigned int count;		/**< Number of entries */
+	long rehash_index;		/**< Next bucket in table[0] to move, or -1 if not resizing */
+	int paused;			/**< Resizing is paused because an iteration is in progress */
+	unsigned long resizes;		/**< Number of resizes, for statistics */
+};
+
+/** Callback for hashtable_foreach() and hashtable_scan() */
+typedef int (*HashTableCallback)(HashNode *node, void *data);
+
 /** Match struct, which allows various matching styles, see MATCH_* */
 typedef struct Match {
 	char *str; /**< Text of the glob/regex/whatever. Always set. */
@@ -879,11 +917,15 @@ typedef struct Match {
 	union {
 		pcre2_code *pcre2_expr; /**< PCRE2 Perl-like Regex */
 	} ext;
+	unsigned char required[2]; /**< Code units that must be in the string for a regex to match (or 0), see unreal_match() */
 } Match;
 
+/** Literal prefilter for many Match entries, see literal_matcher_new() */
+typedef struct LiteralMatcher LiteralMatcher;
+
 typedef struct Whowas {
-	int  hashv;
-	char *name;
+	HashNode hash;		/* for the whowas hash table */
+	char *name;		/* NULL if this entry is not in use */
 	char *username;
 	char *hostname;
 	char *virthost;
@@ -897,8 +939,6 @@ typedef struct Whowas {
 	time_t connected_since;
 	WhoWasEvent event;
 	struct Client *online;	/* Pointer to new nickname for chasing or NULL */
-	struct Whowas *next;	/* for hash table... */
-	struct Whowas *prev;	/* for hash table... */
 	struct Whowas *cnext;	/* for client struct linked list */
 	struct Whowas *cprev;	/* for client struct linked list */
 } WhoWas;
@@ -994,9 +1034,17 @@ typedef void (*OverrideCmdFunc)(CommandOverride *ovr, Client *client, MessageTag
  * more would not benefit performance anyway.
  * Note that you cannot change this value easily afterwards
  * (you cannot read files with a different chunk size).
+ * This is the chunk size of v1 encrypted files. In v2 files the
+ * chunk size is stored in the header, see set::database-chunk-size.
  */
 #define UNREALDB_CRYPT_FILE_CHUNK_SIZE 4096
 
+/** Maximum chunk size of v2 encrypted files */
+#define UNREALDB_CRYPT_FILE_MAX_CHUNK_SIZE 1048576
+
+/** Size of the write buffer for unencrypted files */
+#define UNREALDB_WRITE_BUFFER_SIZE 65536
+
 /** The salt length. Don't change. */
 #define UNREALDB_SALT_LEN 16
 
@@ -1005,9 +1053,17 @@ typedef void (*OverrideCmdFunc)(CommandOverride *ovr, Client *client, MessageTag
  */
 typedef enum UnrealDBMode {
 	UNREALDB_MODE_READ = 0,
-	UNREALDB_MODE_WRITE = 1
+	UNREALDB_MODE_WRITE = 1,
+	UNREALDB_MODE_WRITE_ASYNC = 2 /**< Write to memory, the file is written by the writer thread on unrealdb_close() */
 } UnrealDBMode;
 
+/** When to fsync() database files (set::database-fsync) */
+typedef enum UnrealDBFsyncMode {
+	UNREALDB_FSYNC_NO = 0,				/**< Never, leave it to the OS */
+	UNREALDB_FSYNC_YES = 1,				/**< Every file, before it is renamed to the real file */
+	UNREALDB_FSYNC_BATCH = 2			/**< Write all pending files first, then fsync and rename them */
+} UnrealDBFsyncMode;
+
 typedef enum UnrealDBCipher {
 	UNREALDB_CIPHER_XCHACHA20 = 0x0001
 } UnrealDBCipher;
@@ -1049,18 +1105,33 @@ typedef enum UnrealDBError {
  * This is returned by unrealdb_open() and used by all other @ref UnrealDBFunctions
  * @ingroup UnrealDBFunctions
  */
-typedef struct UnrealDB {
+typedef struct UnrealDB UnrealDB;
+struct UnrealDB {
+	UnrealDB *next;					/**< Next in the queue of the writer thread (UNREALDB_MODE_WRITE_ASYNC) */
 	FILE *fd;					/**< File descriptor */
-	UnrealDBMode mode;				/**< UNREALDB_MODE_READ / UNREALDB_MODE_WRITE */
+	UnrealDBMode mode;				/**< UNREALDB_MODE_READ / UNREALDB_MODE_WRITE / UNREALDB_MODE_WRITE_ASYNC */
 	int crypted;					/**< Are we doing any encryption or just plaintext? */
 	uint64_t creationtime;				/**< When this file was created/updates */
 	crypto_secretstream_xchacha20poly1305_state st; /**< Internal state for crypto engine */
-	char buf[UNREALDB_CRYPT_FILE_CHUNK_SIZE];	/**< Buffer used for reading/writing */
+	char *buf;					/**< Buffer used for reading/writing (plaintext) */
+	int bufsize;					/**< Size of 'buf', for encrypted files this is the chunk size */
 	int buflen;					/**< Length of current data in buffer */
+	int bufpos;					/**< Reading: offset of the current data in buffer */
+	char *cbuf;					/**< Buffer for one encrypted chunk (bufsize + ABYTES) */
+	int sync_on_close;				/**< fsync() the file in unrealdb_close() */
+	UnrealDBFsyncMode fsync_mode;			/**< UNREALDB_MODE_WRITE_ASYNC: set::database-fsync at the time of opening */
 	UnrealDBError error_code;			/**< Last error code. Whenever this happens we will set this, never overwrite, and block further I/O */
 	char *error_string;				/**< Error string upon failure */
 	UnrealDBConfig *config;				/**< Config */
-} UnrealDB;
+	char *filename;					/**< UNREALDB_MODE_WRITE_ASYNC: the file to write on close */
+	char *membuf;					/**< UNREALDB_MODE_WRITE_ASYNC: the data to write (plaintext) */
+	size_t membuflen;				/**< UNREALDB_MODE_WRITE_ASYNC: length of the data in 'membuf' */
+	size_t membufsize;				/**< UNREALDB_MODE_WRITE_ASYNC: allocated size of 'membuf' */
+	int writer_thread;				/**< Used by the writer thread, so don't touch any global state */
+	char *map;					/**< UNREALDB_MODE_READ: the file mapped into memory (or NULL if not mapped) */
+	size_t maplen;					/**< UNREALDB_MODE_READ: length of 'map' (the file size) */
+	size_t mappos;					/**< UNREALDB_MODE_READ: current read position in 'map' */
+};
 
 /** Used for speeding up reading/writing of DBs (so we don't have to run argon2 repeatedly) */
 typedef struct SecretCache SecretCache;
@@ -1248,6 +1319,8 @@ struct Spamfilter {
 	long long hits; /**< Spamfilter hits (except exempts) */
 	long long hits_except; /**< Spamfilter hits by exempt clients */
 	SecurityGroup *except; /**< Don't run this spamfitler at all for these users (not counting towards hits_except btw) */
+	char prefilter; /**< Set if the spamfilter prefilter has a literal for this spamfilter, see match_spamfilter() */
+	uint64_t prefilter_serial; /**< Last match_spamfilter() run in which the prefilter found our literal */
 };
 
 /** Ban exception sub-struct of TKL entry (ELINE) */
@@ -1266,6 +1339,7 @@ struct BanException {
 
 #define TKL_FLAG_CONFIG			0x0001 /* Entry from configuration file. Cannot be removed by using commands. */
 #define TKL_FLAG_CENTRAL_SPAMFILTER	0x0002 /* Entry from central spamfilter. */
+#define TKL_FLAG_CHECK_USERS		0x0004 /* Spamfilter with 'warn' action that still needs to be checked against all users */
 
 /** A TKL entry, such as a KLINE, GLINE, Spamfilter, QLINE, Exception, .. */
 struct TKL {
@@ -1283,6 +1357,16 @@ struct TKL {
 	} ptr;
 };
 
+/** A node in the radix tree of CIDR server bans and exceptions, see tklines_cidr_tree */
+struct TKLCidrNode {
+	TKLCidrNode *child[2];
+	unsigned char addr[16]; /**< IPv4 or IPv6 address, with the bits after 'bits' cleared */
+	int bits; /**< Prefix length */
+	TKL **tkls; /**< TKL entries with exactly this prefix (none for intermediate nodes) */
+	int num_tkls;
+	int max_tkls;
+};
+
 /** A spamfilter except entry */
 struct SpamExcept {
 	SpamExcept *prev, *next;
@@ -1342,6 +1426,7 @@ struct NameValuePrioList {
 /** A "real" command (internal interface, not for modules) */
 struct RealCommand {
 	RealCommand		*prev, *next;
+	HashNode		hashnode; /**< For the command hash table (commandTable) */
 	char 			*cmd;
 	CmdFunc			func;
 	AliasCmdFunc		aliasfunc;
@@ -1401,6 +1486,7 @@ extern void unload_all_unused_moddata(void);
 #define TLSFLAG_FAILIFNOCERT 		0x0001
 #define TLSFLAG_NOSTARTTLS		0x0002
 #define TLSFLAG_DISABLECLIENTCERT	0x0004
+#define TLSFLAG_KTLS			0x0008
 
 /** Flood counters for local clients */
 typedef struct FloodCounter {
@@ -1446,12 +1532,14 @@ struct Client {
 	struct list_head client_node;		/**< For global client list (client_list) */
 	struct list_head lclient_node;		/**< For local client list (lclient_list) */
 	struct list_head special_node;		/**< For special lists (server || unknown || oper) */
+	struct list_head ready_node;		/**< For the list of local clients with unprocessed data (ready_list) */
+	struct list_head dirty_node;		/**< For the list of local clients with data to send (dirty_list) */
 	LocalClient *local;			/**< Additional information regarding locally connected clients */
 	User *user;				/**< Additional information, if this client is a user */
 	Server *server;				/**< Additional information, if this is a server */
 	RPCClient *rpc;				/**< RPC Client, or NULL */
 	ClientStatus status;			/**< Client status, one of CLIENT_STATUS_* */
-	struct list_head client_hash;		/**< For name hash table (clientTable) */
+	HashNode client_hash;			/**< For name hash table (clientTable) */
 	char name[HOSTLEN + 1];			/**< Unique name of the client: nickname for users, hostname for servers */
 	time_t lastnick;			/**< Timestamp on nick */
 	uint64_t flags;				/**< Client flags (one or more of CLIENT_FLAG_*) */
@@ -1463,12 +1551,18 @@ struct Client {
 	char ident[USERLEN + 1];		/**< Ident of the user, if available. Otherwise set to "unknown". */
 	char info[REALLEN + 1];			/**< Additional client information text. For users this is gecos/realname */
 	char id[IDLEN + 1];			/**< Unique ID: SID or UID */
-	struct list_head id_hash;		/**< For UID/SID hash table (idTable) */
+	HashNode id_hash;			/**< For UID/SID hash table (idTable) */
 	Client *uplink;				/**< Server on where this client is connected to (can be &me) */
 	char *ip;				/**< IP address of user or server (never NULL) */
 	ModData moddata[MODDATA_MAX_CLIENT];	/**< Client attached module data, used by the ModData system */
 };
 
+/** Type of work that can be handed over to an I/O thread, see io_threads.c */
+typedef enum IOJobType {
+	IOJOB_READ	= 0x1,	/**< Read from the socket (recv / SSL_read) */
+	IOJOB_WRITE	= 0x2,	/**< Write the sendQ to the socket (send / SSL_write) */
+} IOJobType;
+
 /** Local client information, use client->local to access these (see also @link Client @endlink).
  */
 struct LocalClient {
@@ -1509,12 +1603,15 @@ struct LocalClient {
 	RPCClient *rpc;			/**< RPC Client, or NULL */
 	Tag *tags;			/**< Tags from spamfilter */
 	int tags_serial;		/**< To keep track of 'tags' changes */
+	unsigned long bancheck_serial;	/**< Last ban check of all users that included this client, see check_bans() */
+	unsigned char io_jobs;		/**< I/O thread jobs pending for this client (IOJOB_*) */
 };
 
 /** User information (persons, not servers), you use client->user to access these (see also @link Client @endlink).
  */
 struct User {
 	Membership *channel;		/**< Channels that the user is in (linked list) */
+	MemberIndex *channel_index;	/**< Index on 'channel' if the user is in many channels, otherwise NULL */
 	Link *dccallow;			/**< DCCALLOW list (linked list) */
 	char account[ACCOUNTLEN + 1];	/**< Services account name or ID (SVID) - use IsLoggedIn(client) to check if logged in */
 	int joined;			/**< Number of channels joined */
@@ -1529,6 +1626,7 @@ struct User {
 	char *operlogin;		/**< Which oper { } block was used to oper up, otherwise NULL - used for auditting and by oper::maxlogins */
 	char *away;			/**< AWAY message, or NULL if not away */
 	time_t away_since;		/**< Last time the user went AWAY */
+	unsigned int mask_generation;	/**< Bumped when nick!user@host changes, see BanCache */
 };
 
 /** Server information (local servers and remote servers), you use client->server to access these (see also @link Client @endlink).
@@ -2344,7 +2442,7 @@ struct Link {
 struct Channel {
 	struct Channel *nextch;			/**< Next channel in linked list (channel) */
 	struct Channel *prevch;			/**< Previous channel in linked list (channel) */
-	struct Channel *hnextch;		/**< Next channel in hash table */
+	HashNode channel_hash;			/**< For channel hash table (channelTable) */
 	Mode mode;				/**< Channel Mode set on this channel */
 	time_t creationtime;			/**< When the channel was first created */
 	char *topic;				/**< Channel TOPIC */
@@ -2352,25 +2450,67 @@ struct Channel {
 	time_t topic_time;			/**< Time at which the topic was last set */
 	int users;				/**< Number of users in the channel */
 	Member *members;			/**< List of channel members (users in the channel) */
+	MemberIndex *member_index;		/**< Index on 'members' for large channels, otherwise NULL */
 	Ban *banlist;				/**< List of bans (+b) */
 	Ban *exlist;				/**< List of ban exceptions (+e) */
 	Ban *invexlist;				/**< List of invite exceptions (+I) */
+	unsigned int ban_generation;		/**< Bumped when banlist or exlist changes, see BanCache */
 	char *mode_lock;			/**< Mode lock (MLOCK) applied to channel - usually by Services */
 	ModData moddata[MODDATA_MAX_CHANNEL];	/**< Channel attached module data, used by the ModData system */
 	char name[CHANNELLEN+1];		/**< Channel name */
 };
 
+/** Cached result of matching the n!u@h masks of a channel's +b/+e lists.
+ * Only the plain masks are cached: extbans are always evaluated, since
+ * their outcome can depend on the message, the time, the account, etc.
+ * The cache is valid as long as both generations are unchanged.
+ */
+struct BanCache
+{
+	unsigned int channel_gen;	/**< Copy of channel->ban_generation */
+	unsigned int client_gen;	/**< Copy of client->user->mask_generation */
+	Ban *ban;			/**< First matching n!u@h mask in +b list, or NULL */
+	Ban *ex;			/**< First matching n!u@h mask in +e list, or NULL */
+	unsigned char valid;		/**< Cache contents are filled in */
+	unsigned char has_extbans;	/**< Any extbans in the +b or +e list? */
+};
+
+/** Hash index on the members of a large channel (key: Client) or
+ * on the memberships of a user who is in many channels (key: Channel).
+ * This uses open addressing with linear probing. The index only
+ * exists above a certain size, see find_member() and find_membership().
+ */
+struct MemberIndex
+{
+	unsigned int size;			/**< Number of slots, always a power of two */
+	unsigned int count;			/**< Number of slots in use */
+	struct {
+		const void *key;		/**< Client or Channel, NULL for an empty slot */
+		void *value;			/**< Member or Membership */
+	} *slots;
+};
+
+/** Convert a member mode letter (eg 'o') to its bit in member_modes_mask.
+ * Returns 0 for anything that is not a letter.
+ */
+#define MEMBERMODE_BIT(c)	(((c) >= 'a' && (c) <= 'z') ? (1ULL << ((c) - 'a')) : \
+				 ((c) >= 'A' && (c) <= 'Z') ? (1ULL << ((c) - 'A' + 26)) : 0)
+
 /** user/channel member struct (channel->members).
  * This is Member which is used in the linked list channel->members for each channel.
  * There is also Membership which is used in client->user->channels (see Membership for that).
  * Both must be kept synchronized 100% at all times.
+ * The fields that are used when sending to all channel members come first,
+ * so they share a cache line. Module data is stored separately.
  */
 struct Member
 {
 	struct Member *next;				/**< Next entry in list */
 	Client	      *client;				/**< The client */
+	uint64_t member_modes_mask;			/**< Bitmask of member_modes, see MEMBERMODE_BIT() */
 	char member_modes[MEMBERMODESLEN];		/**< The access of the user on this channel (eg "vhoqa") */
-	ModData moddata[MODDATA_MAX_MEMBER];		/** Member attached module data, used by the ModData system */
+	struct Member *prev;				/**< Previous entry in list */
+	ModData *moddata;				/**< Member attached module data, used by the ModData system (MODDATA_MAX_MEMBER entries) */
 };
 
 /** user/channel membership struct (client->user->channels).
@@ -2382,8 +2522,11 @@ struct Membership
 {
 	struct Membership 	*next;			/**< Next entry in list */
 	struct Channel		*channel;			/**< The channel */
+	uint64_t member_modes_mask;			/**< Bitmask of member_modes, see MEMBERMODE_BIT() */
 	char member_modes[MEMBERMODESLEN];		/**< The (new) access of the user on this channel (eg "vhoqa") */
-	ModData moddata[MODDATA_MAX_MEMBERSHIP];	/**< Membership attached module data, used by the ModData system */
+	struct Membership 	*prev;			/**< Previous entry in list */
+	BanCache bancache;				/**< Ban cache for local users, see is_banned_with_nick() */
+	ModData *moddata;				/**< Membership attached module data, used by the ModData system (MODDATA_MAX_MEMBERSHIP entries) */
 };
 
 /** @} */
@@ -2412,7 +2555,7 @@ struct Ban {
 #define	IsChannelName(name) ((name) && (*(name) == '#'))
 
 #define IsMember(blah,chan) ((blah && blah->user && \
-                find_membership_link((blah->user)->channel, chan)) ? 1 : 0)
+                find_membership(blah, chan)) ? 1 : 0)
 
 
 /* Misc macros */
@@ -2466,7 +2609,7 @@ extern MODVAR SSL_CTX *ctx_client;
 
 struct ThrottlingBucket
 {
-	struct ThrottlingBucket *prev, *next;
+	HashNode hash;
 	char *ip;
 	time_t since;
 	char count;
@@ -2475,7 +2618,7 @@ struct ThrottlingBucket
 typedef struct IpUsersBucket IpUsersBucket;
 struct IpUsersBucket
 {
-	IpUsersBucket *prev, *next;
+	HashNode hash;
 	char rawip[16];
 	int local_clients;
 	int global_clients;
@@ -2550,7 +2693,11 @@ struct MaxTarget {
 
 #define TKLISTLEN		26
 #define TKLIPHASHLEN1		4
-#define TKLIPHASHLEN2		1021
+#define TKLIPHASHLEN2		1022
+/** The last slot of each tklines_ip_hash[] row is not a hash bucket:
+ * it holds the CIDR entries (eg 1.2.0.0/16), which are also in tklines_cidr_tree.
+ */
+#define TKLIPHASH_CIDR		(TKLIPHASHLEN2-1)
 
 #define MATCH_CHECK_IP              0x0001
 #define MATCH_CHECK_REAL_HOST       0x0002
@@ -752,12 +752,27 @@ const char *get_channel_access(Client *client, Channel *channel)
 {
 	Membership *mb;
 
-	mb = find_membership_link(client->user->channel, channel);
+	mb = find_membership(client, channel);
 	if (!mb)
 		return "";
 	return mb->member_modes;
 }
 
+/** Convert member modes to a bitmask, eg "hoaq" to the bits for h, o, a and q.
+ * This is useful if you need to check the same modes for many members,
+ * eg (member->member_modes_mask & mask), see sendto_channel().
+ * @param modes		The member modes, eg "hoaq"
+ * @returns The bitmask, to be compared against member_modes_mask.
+ */
+uint64_t member_modes_to_mask(const char *modes)
+{
+	uint64_t mask = 0;
+
+	for (; *modes; modes++)
+		mask |= MEMBERMODE_BIT(*modes);
+	return mask;
+}
+
 /** Check channel access for user.
  * @param client	The client to check
  * @param channel	The channel to check
@@ -769,20 +784,15 @@ const char *get_channel_access(Client *client, Channel *channel)
 int check_channel_access(Client *client, Channel *channel, const char *modes)
 {
 	Membership *mb;
-	const char *p;
 
 	if (!IsUser(client))
 		return 0; /* eg server */
 
-	mb = find_membership_link(client->user->channel, channel);
+	mb = find_membership(client, channel);
 	if (!mb)
 		return 0; /* not a member */
 
-	for (p = mb->member_modes; *p; p++)
-		if (strchr(modes, *p))
-			return 1; /* match new style */
-
-	return 0; /* nomatch */
+	return (mb->member_modes_mask & member_modes_to_mask(modes)) ? 1 : 0;
 }
 
 /** Check channel access for user.
@@ -795,16 +805,10 @@ int check_channel_access(Client *client, Channel *channel, const char *modes)
  */
 int check_channel_access_membership(Membership *mb, const char *modes)
 {
-	const char *p;
-
 	if (!mb)
 		return 0;
 
-	for (p = mb->member_modes; *p; p++)
-		if (strchr(modes, *p))
-			return 1; /* match new style */
-
-	return 0; /* nomatch */
+	return (mb->member_modes_mask & member_modes_to_mask(modes)) ? 1 : 0;
 }
 
 /** Check channel access for user.
@@ -817,16 +821,10 @@ int check_channel_access_membership(Membership *mb, const char *modes)
  */
 int check_channel_access_member(Member *mb, const char *modes)
 {
-	const char *p;
-
 	if (!mb)
 		return 0;
 
-	for (p = mb->member_modes; *p; p++)
-		if (strchr(modes, *p))
-			return 1; /* match new style */
-
-	return 0; /* nomatch */
+	return (mb->member_modes_mask & member_modes_to_mask(modes)) ? 1 : 0;
 }
 
 /** Check channel access for user.
@@ -920,22 +918,24 @@ void add_member_mode_fast(Member *mb, Membership *mbs, char letter)
 {
 	addlettertomstring(mb->member_modes, letter);
 	addlettertomstring(mbs->member_modes, letter);
+	mb->member_modes_mask = mbs->member_modes_mask = member_modes_to_mask(mb->member_modes);
 }
 
 void del_member_mode_fast(Member *mb, Membership *mbs, char letter)
 {
 	delletterfromstring(mb->member_modes, letter);
 	delletterfromstring(mbs->member_modes, letter);
+	mb->member_modes_mask = mbs->member_modes_mask = member_modes_to_mask(mb->member_modes);
 }
 
 int find_mbs(Client *client, Channel *channel, Member **mb, Membership **mbs)
 {
 	*mbs = NULL;
 
-	if (!(*mb = find_member_link(channel->members, client)))
+	if (!(*mb = find_member(channel, client)))
 		return 0;
 
-	if (!(*mbs = find_membership_link(client->user->channel, channel)))
+	if (!(*mbs = find_membership(client, channel)))
 		return 0;
 	
 	return 1;
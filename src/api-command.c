@@ -34,15 +34,7 @@ static RealCommand *add_Command_backend(const char *cmd);
  */
 int CommandExists(const char *name)
 {
-	RealCommand *p;
-	
-	for (p = CommandHash[toupper(*name)]; p; p = p->next)
-	{
-		if (!strcasecmp(p->cmd, name))
-			return 1;
-	}
-
-	return 0;
+	return find_command_simple(name) ? 1 : 0;
 }
 
 /** Register a new command.
@@ -134,7 +126,8 @@ void CommandDelX(Command *command, RealCommand *cmd)
 {
 	CommandOverride *ovr, *ovrnext;
 
-	DelListItem(cmd, CommandHash[toupper(*cmd->cmd)]);
+	DelListItem(cmd, CommandList);
+	hashtable_del(&commandTable, &cmd->hashnode);
 	if (command && cmd->owner)
 	{
 		ModuleObject *cmdobj;
@@ -213,14 +206,18 @@ void do_cmd(Client *client, MessageTag *mtags, const char *cmd, int parc, const
  * Perhaps one day we will merge the two, if possible.
  */
 
-RealCommand *CommandHash[256]; /* one per letter */
+MODVAR RealCommand *CommandList = NULL; /**< All commands, for walking through them */
+MODVAR HashTable commandTable; /**< All commands, hashed by name, for find_command() */
+static char siphashkey_command[SIPHASH_KEY_LENGTH];
 
 /** Initialize the command API - executed on startup.
  * This also registers some core functions.
  */
 void init_CommandHash(void)
 {
-	memset(CommandHash, 0, sizeof(CommandHash));
+	CommandList = NULL;
+	siphash_generate_key(siphashkey_command);
+	hashtable_init(&commandTable, "Commands", COMMAND_HASH_TABLE_SIZE);
 	CommandAdd(NULL, MSG_ERROR, cmd_error, MAXPARA, CMD_UNREGISTERED|CMD_SERVER);
 	CommandAdd(NULL, MSG_VERSION, cmd_version, MAXPARA, CMD_UNREGISTERED|CMD_USER|CMD_SERVER);
 	CommandAdd(NULL, MSG_INFO, cmd_info, MAXPARA, CMD_USER);
@@ -239,12 +236,18 @@ static RealCommand *add_Command_backend(const char *cmd)
 
 	safe_strdup(c->cmd, cmd);
 
-	/* Add in hash with hash value = first byte */
-	AddListItem(c, CommandHash[toupper(*cmd)]);
+	AddListItem(c, CommandList);
+	hashtable_add(&commandTable, &c->hashnode, hash_command_name(cmd));
 
 	return c;
 }
 
+/** Hash value of a command name, for commandTable (case insensitive) */
+uint64_t hash_command_name(const char *cmd)
+{
+	return siphash_nocase(cmd, siphashkey_command);
+}
+
 /** @defgroup CommandAPI Command API
  * @{
  */
@@ -253,8 +256,11 @@ static RealCommand *add_Command_backend(const char *cmd)
 RealCommand *find_command(const char *cmd, int flags)
 {
 	RealCommand *p;
-	for (p = CommandHash[toupper(*cmd)]; p; p = p->next)
+	HashNode *n;
+
+	hashtable_for_each_match(&commandTable, n, hash_command_name(cmd))
 	{
+		p = container_of(n, RealCommand, hashnode);
 		if (flags & CMD_CONTROL)
 		{
 			if (!(p->flags & CMD_CONTROL))
@@ -283,11 +289,13 @@ RealCommand *find_command(const char *cmd, int flags)
 RealCommand *find_command_simple(const char *cmd)
 {
 	RealCommand *c;
+	HashNode *n;
 
-	for (c = CommandHash[toupper(*cmd)]; c; c = c->next)
+	hashtable_for_each_match(&commandTable, n, hash_command_name(cmd))
 	{
+		c = container_of(n, RealCommand, hashnode);
 		if (!strcasecmp(c->cmd, cmd))
-				return c;
+			return c;
 	}
 
 	return NULL;
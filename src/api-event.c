@@ -27,6 +27,135 @@ ID_Copyright("(C) Carsten Munk 2001");
 
 MODVAR Event *events = NULL;
 
+/* The events are also kept in a binary min-heap, ordered by 'next_run',
+ * so DoEvents() only has to look at the events that are due and
+ * SocketLoop() knows how long it can sleep, see TimeUntilNextEvent().
+ */
+static Event **event_heap = NULL;
+static int event_heap_count = 0;
+static int event_heap_size = 0;
+
+/** Set to 1 while DoEvents() is running */
+static int doevents_running = 0;
+
+/** Number of events that are marked for deletion, see CleanupEvents() */
+static int events_deleted = 0;
+
+/** Repeating events run at most this often (in msec) */
+#define EVENT_MINIMUM_INTERVAL	100
+
+/** Events that run every EVENT_COALESCE_MSEC or less often have their
+ * next run rounded up to a multiple of EVENT_COALESCE_MSEC.
+ * This is the same as SOCKETLOOP_MAX_DELAY, so these events are
+ * never less accurate than they used to be, and they run in the
+ * same wakeup of the main loop.
+ */
+#define EVENT_COALESCE_MSEC	SOCKETLOOP_MAX_DELAY
+
+/** Current time in milliseconds */
+static long long event_now(void)
+{
+	return ((long long)timeofday_tv.tv_sec * 1000) + (timeofday_tv.tv_usec / 1000);
+}
+
+static void event_heap_set(int i, Event *e)
+{
+	event_heap[i] = e;
+	e->heap_index = i;
+}
+
+static void event_heap_sift_up(int i)
+{
+	Event *e = event_heap[i];
+	int parent;
+
+	while (i > 0)
+	{
+		parent = (i - 1) / 2;
+		if (event_heap[parent]->next_run <= e->next_run)
+			break;
+		event_heap_set(i, event_heap[parent]);
+		i = parent;
+	}
+	event_heap_set(i, e);
+}
+
+static void event_heap_sift_down(int i)
+{
+	Event *e = event_heap[i];
+	int child;
+
+	while ((child = (2 * i) + 1) < event_heap_count)
+	{
+		if ((child + 1 < event_heap_count) && (event_heap[child + 1]->next_run < event_heap[child]->next_run))
+			child++;
+		if (e->next_run <= event_heap[child]->next_run)
+			break;
+		event_heap_set(i, event_heap[child]);
+		i = child;
+	}
+	event_heap_set(i, e);
+}
+
+/** Move the event at position 'i' up or down, after its 'next_run' changed */
+static void event_heap_update(int i)
+{
+	if ((i > 0) && (event_heap[i]->next_run < event_heap[(i - 1) / 2]->next_run))
+		event_heap_sift_up(i);
+	else
+		event_heap_sift_down(i);
+}
+
+static void event_heap_add(Event *e)
+{
+	if (event_heap_count == event_heap_size)
+	{
+		event_heap_size = event_heap_size ? event_heap_size * 2 : 64;
+		event_heap = safe_realloc(event_heap, sizeof(Event *) * event_heap_size);
+	}
+	event_heap_set(event_heap_count++, e);
+	event_heap_sift_up(e->heap_index);
+}
+
+static void event_heap_del(Event *e)
+{
+	int i = e->heap_index;
+
+	if (i < 0)
+		return; /* not in the heap */
+	e->heap_index = -1;
+	if (--event_heap_count == i)
+		return; /* was the last one */
+	event_heap_set(i, event_heap[event_heap_count]);
+	event_heap_update(i);
+}
+
+/** (Re)calculate when the event should run next, based on 'last_run',
+ * and update its position in the heap.
+ */
+static void event_schedule(Event *e)
+{
+	long long last_run = ((long long)e->last_run.tv_sec * 1000) + (e->last_run.tv_usec / 1000);
+	long every_msec = e->every_msec;
+
+	/* Events added by an event never run in the same DoEvents() call */
+	if (doevents_running && (last_run + every_msec <= event_now()))
+		every_msec = event_now() - last_run + 1;
+
+	e->next_run = last_run + every_msec;
+
+	/* Slow events do not need to be millisecond accurate. Round them
+	 * up so they run at the same time, which saves wakeups.
+	 */
+	if (every_msec >= EVENT_COALESCE_MSEC)
+		e->next_run = ((e->next_run + EVENT_COALESCE_MSEC - 1) / EVENT_COALESCE_MSEC) * EVENT_COALESCE_MSEC;
+
+	if (e->heap_index < 0)
+		event_heap_add(e);
+	else
+		event_heap_update(e->heap_index);
+}
+
 /** Add an event, a function that will run at regular intervals.
  * @param module	Module that this event belongs to
  * @param name		Name of the event
@@ -36,8 +165,10 @@ MODVAR Event *events = NULL;
  * @param count		After how many times we should stop calling this even (0 = infinite times)
  * @returns an Event struct
  * @note  UnrealIRCd will try to call the event every 'every_msec' milliseconds.
- *        However, in case of low traffic the minimum time is at least SOCKETLOOP_MAX_DELAY
- *        which is 250ms at the time of writing. Also, we reject any value below 100 msecs.
+ *        The main loop sleeps until the next event is due, so events with an
+ *        every_msec below 250 are accurate to the millisecond. Slower events are
+ *        rounded up to a multiple of 250ms so they can run in the same wakeup.
+ *        Repeating events run at most every 100 msecs (EVENT_MINIMUM_INTERVAL).
  *        The actual calling time will not be quicker than the specified every_msec but
  *        can be later, in case of high load, in very extreme cases even up to 1000 or 2000
  *        msec later but that would be very unusual. Just saying, it's not a guarantee..
@@ -62,7 +193,9 @@ Event *EventAdd(Module *module, const char *name, vFP event, void *data, long ev
 	newevent->last_run.tv_sec = timeofday_tv.tv_sec;
 	newevent->last_run.tv_usec = timeofday_tv.tv_usec;
 	newevent->owner = module;
+	newevent->heap_index = -1;
 	AddListItem(newevent,events);
+	event_schedule(newevent);
 	if (module)
 	{
 		ModuleObject *eventobj = safe_alloc(sizeof(ModuleObject));
@@ -84,7 +217,10 @@ void EventDel(Event *e)
 	char buf[128];
 
 	/* Mark for deletion */
+	if (!e->deleted)
+		events_deleted++;
 	e->deleted = 1;
+	event_heap_del(e);
 
 	/* Replace the name so deleted events are clearly labeled */
 	if (e->name)
@@ -136,12 +272,18 @@ static void EventDelReal(Event *e)
 static void CleanupEvents(void)
 {
 	Event *e, *e_next;
+
+	/* Nothing to do in the common case, so don't walk the list */
+	if (events_deleted == 0)
+		return;
+
 	for (e = events; e; e = e_next)
 	{
 		e_next = e->next;
 		if (e->deleted)
 			EventDelReal(e);
 	}
+	events_deleted = 0;
 }
 
 Event *EventFind(const char *name)
@@ -164,7 +306,11 @@ int EventMod(Event *event, EventInfo *mods)
 	}
 
 	if (mods->flags & EMOD_EVERY)
+	{
 		event->every_msec = mods->every_msec;
+		if (!event->deleted)
+			event_schedule(event);
+	}
 	if (mods->flags & EMOD_HOWMANY)
 		event->count = mods->count;
 	if (mods->flags & EMOD_NAME)
@@ -178,33 +324,75 @@ int EventMod(Event *event, EventInfo *mods)
 	return 0;
 }
 
+/** Run all events that are due */
 void DoEvents(void)
 {
 	Event *e;
+	long long now = event_now();
 
-	for (e = events; e; e = e->next)
+	doevents_running = 1;
+	while ((event_heap_count > 0) && (event_heap[0]->next_run <= now))
 	{
-		if (e->deleted)
-			continue;
+		e = event_heap[0];
+
+		/* Schedule the next run first, the event may
+		 * call EventDel() or EventMod() on itself.
+		 */
+		e->last_run.tv_sec = timeofday_tv.tv_sec;
+		e->last_run.tv_usec = timeofday_tv.tv_usec;
+		if (e->every_msec < EVENT_MINIMUM_INTERVAL)
+		{
+			/* Don't keep running it in a tight loop */
+			e->next_run = now + EVENT_MINIMUM_INTERVAL;
+			event_heap_sift_down(0);
+		} else {
+			event_schedule(e);
+		}
+
 		if (e->count == -1)
 		{
 			EventDel(e);
 			continue;
 		}
-		if ((e->every_msec == 0) || minimum_msec_since_last_run(&e->last_run, e->every_msec))
+		(*e->event)(e->data);
+		if (!e->deleted && (e->count > 0))
 		{
-			(*e->event)(e->data);
-			if (e->count > 0)
-			{
-				e->count--;
-				if (e->count == 0)
-				{
-					EventDel(e);
-					continue;
-				}
-			}
+			e->count--;
+			if (e->count == 0)
+				EventDel(e);
 		}
 	}
+	doevents_running = 0;
 
 	CleanupEvents();
 }
+
+/** Returns the number of milliseconds until the next event is due.
+ * This is 0 if an event is due already, and -1 if there are no events.
+ */
+long TimeUntilNextEvent(void)
+{
+	long long delay;
+
+	if (event_heap_count == 0)
+		return -1;
+	delay = event_heap[0]->next_run - event_now();
+	if (delay < 0)
+		return 0;
+	if (delay > LONG_MAX)
+		return LONG_MAX;
+	return delay;
+}
+
+/** Recalculate the next run of all events, based on 'last_run'.
+ * This is used by fix_timers() after changing 'last_run' when
+ * the clock jumped.
+ */
+void RescheduleEvents(void)
+{
+	Event *e;
+
+	for (e = events; e; e = e->next)
+		if (!e->deleted)
+			event_schedule(e);
+}
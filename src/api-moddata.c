@@ -154,7 +154,7 @@ void moddata_free_member(Member *m)
 				md->free(&moddata_member(m, md));
 		}
 
-	memset(m->moddata, 0, sizeof(m->moddata));
+	memset(m->moddata, 0, sizeof(ModData) * MODDATA_MAX_MEMBER);
 }
 
 void moddata_free_membership(Membership *m)
@@ -168,7 +168,7 @@ ModDataInfo *md;
 				md->free(&moddata_membership(m, md));
 		}
 
-	memset(m->moddata, 0, sizeof(m->moddata));
+	memset(m->moddata, 0, sizeof(ModData) * MODDATA_MAX_MEMBERSHIP);
 }
 
 /** Actually free all the ModData from all objects */
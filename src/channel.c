@@ -81,7 +81,9 @@ int Halfop_mode(long mode)
 	return TRUE;
 }
 
-/** Find client in a Member linked list (eg: channel->members) */
+/** Find client in a Member linked list (eg: channel->members).
+ * @note This walks the entire list, use find_member() instead.
+ */
 Member *find_member_link(Member *lp, Client *ptr)
 {
 	if (ptr)
@@ -96,7 +98,9 @@ Member *find_member_link(Member *lp, Client *ptr)
 	return NULL;
 }
 
-/** Find channel in a Membership linked list (eg: client->user->channel) */
+/** Find channel in a Membership linked list (eg: client->user->channel).
+ * @note This walks the entire list, use find_membership() instead.
+ */
 Membership *find_membership_link(Membership *lp, Channel *ptr)
 {
 	if (ptr)
@@ -109,17 +113,159 @@ Membership *find_membership_link(Membership *lp, Channel *ptr)
 	return NULL;
 }
 
-/** Allocate and return an empty Member struct */
+/* The member index (MemberIndex) is created when a channel has
+ * MEMBER_INDEX_MIN members, or a user is in MEMBER_INDEX_MIN channels.
+ * It is freed again when it drops below half of that.
+ */
+#define MEMBER_INDEX_MIN	32
+#define MEMBER_INDEX_MIN_SIZE	64
+
+static inline unsigned int member_index_hash(const void *key, unsigned int size)
+{
+	/* Fibonacci hashing, the low bits of a pointer are not random */
+	return (unsigned int)(((uint64_t)(uintptr_t)key * 0x9E3779B97F4A7C15ULL) >> 32) & (size - 1);
+}
+
+static void *member_index_find(MemberIndex *idx, const void *key)
+{
+	unsigned int i;
+
+	for (i = member_index_hash(key, idx->size); idx->slots[i].key; i = (i + 1) & (idx->size - 1))
+		if (idx->slots[i].key == key)
+			return idx->slots[i].value;
+	return NULL;
+}
+
+static void member_index_insert(MemberIndex *idx, const void *key, void *value)
+{
+	unsigned int i;
+
+	for (i = member_index_hash(key, idx->size); idx->slots[i].key; i = (i + 1) & (idx->size - 1))
+		;
+	idx->slots[i].key = key;
+	idx->slots[i].value = value;
+	idx->count++;
+}
+
+static void member_index_resize(MemberIndex *idx, unsigned int size)
+{
+	MemberIndex old = *idx;
+	unsigned int i;
+
+	idx->size = size;
+	idx->count = 0;
+	idx->slots = safe_alloc(sizeof(*idx->slots) * size);
+	for (i = 0; i < old.size; i++)
+		if (old.slots[i].key)
+			member_index_insert(idx, old.slots[i].key, old.slots[i].value);
+	safe_free(old.slots);
+}
+
+/** Add an entry to the index, growing it if needed (max. 50% load) */
+static void member_index_add(MemberIndex *idx, const void *key, void *value)
+{
+	if ((idx->count + 1) * 2 > idx->size)
+		member_index_resize(idx, idx->size * 2);
+	member_index_insert(idx, key, value);
+}
+
+/** Delete an entry from the index.
+ * Since this is linear probing we don't use tombstones but move
+ * the entries that follow back, if they are allowed to.
+ */
+static void member_index_del(MemberIndex *idx, const void *key)
+{
+	unsigned int mask = idx->size - 1;
+	unsigned int i, j, k;
+
+	for (i = member_index_hash(key, idx->size); idx->slots[i].key != key; i = (i + 1) & mask)
+		if (!idx->slots[i].key)
+			return; /* not found */
+
+	for (j = (i + 1) & mask; idx->slots[j].key; j = (j + 1) & mask)
+	{
+		k = member_index_hash(idx->slots[j].key, idx->size);
+		/* Entry 'j' can be moved to the hole at 'i' if its home
+		 * slot 'k' is not cyclically in the range (i, j].
+		 */
+		if ((i <= j) ? ((k <= i) || (k > j)) : ((k <= i) && (k > j)))
+		{
+			idx->slots[i] = idx->slots[j];
+			i = j;
+		}
+	}
+	idx->slots[i].key = NULL;
+	idx->slots[i].value = NULL;
+	idx->count--;
+
+	if ((idx->size > MEMBER_INDEX_MIN_SIZE) && (idx->count * 8 < idx->size))
+		member_index_resize(idx, idx->size / 2);
+}
+
+static MemberIndex *member_index_create(void)
+{
+	MemberIndex *idx = safe_alloc(sizeof(MemberIndex));
+
+	idx->size = MEMBER_INDEX_MIN_SIZE;
+	idx->slots = safe_alloc(sizeof(*idx->slots) * idx->size);
+	return idx;
+}
+
+static void member_index_free(MemberIndex **idx)
+{
+	if (*idx)
+	{
+		safe_free((*idx)->slots);
+		safe_free(*idx);
+	}
+}
+
+/** Find the Member struct of a client in a channel.
+ * For large channels this uses the member index, otherwise
+ * it walks channel->members.
+ * @param channel	The channel
+ * @param client	The client
+ * @returns The Member struct, or NULL if the client is not in the channel.
+ */
+Member *find_member(Channel *channel, Client *client)
+{
+	if (channel->member_index)
+		return client ? member_index_find(channel->member_index, client) : NULL;
+	return find_member_link(channel->members, client);
+}
+
+/** Find the Membership struct of a client in a channel.
+ * If the user is in many channels this uses the index, otherwise
+ * it walks client->user->channel.
+ * @param client	The client (must be a user)
+ * @param channel	The channel
+ * @returns The Membership struct, or NULL if the client is not in the channel.
+ */
+Membership *find_membership(Client *client, Channel *channel)
+{
+	if (client->user->channel_index)
+		return channel ? member_index_find(client->user->channel_index, channel) : NULL;
+	return find_membership_link(client->user->channel, channel);
+}
+
+/** Allocate and return an empty Member struct.
+ * The ModData array is allocated separately, so the Member struct itself
+ * stays small, and it stays with the struct while it is on the freelist.
+ */
 static Member *make_member(void)
 {
 	Member *lp;
-	unsigned int	i;
+	ModData *md;
+	unsigned int	i, n;
 
 	if (freemember == NULL)
 	{
-		for (i = 1; i <= (4072/sizeof(Member)); ++i)
+		n = 4072/sizeof(Member);
+		md = safe_alloc(sizeof(ModData) * MODDATA_MAX_MEMBER * n);
+		for (i = 0; i < n; i++)
 		{
 			lp = safe_alloc(sizeof(Member));
+			lp->moddata = md + (i * MODDATA_MAX_MEMBER);
 			lp->next = freemember;
 			freemember = lp;
 		}
@@ -133,47 +279,58 @@ static Member *make_member(void)
 /** Free a Member struct */
 static void free_member(Member *lp)
 {
+	ModData *md;
+
 	if (!lp)
 		return;
 	moddata_free_member(lp);
+	md = lp->moddata;
 	memset(lp, 0, sizeof(Member));
+	lp->moddata = md;
 	lp->next = freemember;
 	freemember = lp;
 }
 
-/** Allocate and return an empty Membership struct */
+/** Allocate and return an empty Membership struct.
+ * The ModData array is allocated separately, see make_member().
+ */
 static Membership *make_membership(void)
 {
 	Membership *m = NULL;
-	unsigned int	i;
+	ModData *md;
+	unsigned int	i, n;
 
 	if (freemembership == NULL)
 	{
-		for (i = 1; i <= (4072/sizeof(Membership)); i++)
+		n = 4072/sizeof(Membership);
+		md = safe_alloc(sizeof(ModData) * MODDATA_MAX_MEMBERSHIP * n);
+		for (i = 0; i < n; i++)
 		{
 			m = safe_alloc(sizeof(Membership));
+			m->moddata = md + (i * MODDATA_MAX_MEMBERSHIP);
 			m->next = freemembership;
 			freemembership = m;
 		}
-		m = freemembership;
-		freemembership = m->next;
-	}
-	else
-	{
-		m = freemembership;
-		freemembership = freemembership->next;
 	}
+	m = freemembership;
+	freemembership = m->next;
+	md = m->moddata;
 	memset(m, 0, sizeof(Membership));
+	m->moddata = md;
 	return m;
 }
 
 /** Free a Membership struct */
 static void free_membership(Membership *m)
 {
+	ModData *md;
+
 	if (m)
 	{
 		moddata_free_membership(m);
+		md = m->moddata;
 		memset(m, 0, sizeof(Membership));
+		m->moddata = md;
 		m->next = freemembership;
 		freemembership = m;
 	}
@@ -308,6 +465,7 @@ int add_listmode_ex(Ban **list, Client *client, Channel *channel, const char *ba
 	safe_strdup(ban->banstr, banid); /* cAsE may differ, use oldest version of it */
 	safe_strdup(ban->who, setby);
 	ban->when = seton;
+	channel->ban_generation++;
 	return isnew ? 1 : 0;
 }
 
@@ -343,6 +501,7 @@ int del_listmode(Ban **list, Channel *channel, const char *banid)
 			safe_free(tmp->banstr);
 			safe_free(tmp->who);
 			free_ban(tmp);
+			channel->ban_generation++;
 			return 0;
 		}
 	}
@@ -393,6 +552,89 @@ inline int ban_check_mask(BanContext *b)
 	}
 }
 
+/** Refresh the ban cache of a member, if it is outdated.
+ * Only the n!u@h masks are matched and remembered, extbans are
+ * not evaluated here (see BanCache for the reason).
+ */
+static void bancache_refresh(BanCache *cache, Client *client, Channel *channel)
+{
+	Ban *ban;
+
+	if (cache->valid &&
+	    (cache->channel_gen == channel->ban_generation) &&
+	    (cache->client_gen == client->user->mask_generation))
+	{
+		return; /* up to date */
+	}
+
+	cache->ban = cache->ex = NULL;
+	cache->has_extbans = 0;
+	for (ban = channel->banlist; ban; ban = ban->next)
+	{
+		if (is_extended_ban(ban->banstr))
+			cache->has_extbans = 1;
+		else if (!cache->ban && match_user(ban->banstr, client, MATCH_CHECK_ALL))
+			cache->ban = ban;
+	}
+	for (ban = channel->exlist; ban; ban = ban->next)
+	{
+		if (is_extended_ban(ban->banstr))
+			cache->has_extbans = 1;
+		else if (!cache->ex && match_user(ban->banstr, client, MATCH_CHECK_ALL))
+			cache->ex = ban;
+	}
+	cache->channel_gen = channel->ban_generation;
+	cache->client_gen = client->user->mask_generation;
+	cache->valid = 1;
+}
+
+/** Check the +b and +e lists, using the ban cache for the n!u@h masks.
+ * This gives the exact same result as the uncached loops in
+ * is_banned_with_nick(), including the order in which extbans
+ * are called, since any extban may modify b->msg.
+ */
+static Ban *is_banned_cached(BanContext *b, BanCache *cache)
+{
+	Ban *ban, *ex;
+
+	bancache_refresh(cache, b->client, b->channel);
+
+	/* Fast path: no extbans, so we know the answer already */
+	if (!cache->has_extbans)
+		return (cache->ban && !cache->ex) ? cache->ban : NULL;
+
+	for (ban = b->channel->banlist; ban; ban = ban->next)
+	{
+		if (!is_extended_ban(ban->banstr))
+		{
+			if (ban == cache->ban)
+				break;
+			continue;
+		}
+		b->banstr = ban->banstr;
+		if (ban_check_mask(b))
+			break;
+	}
+
+	if (!ban)
+		return NULL;
+
+	for (ex = b->channel->exlist; ex; ex = ex->next)
+	{
+		if (!is_extended_ban(ex->banstr))
+		{
+			if (ex == cache->ex)
+				return NULL;
+			continue;
+		}
+		b->banstr = ex->banstr;
+		if (ban_check_mask(b))
+			return NULL;
+	}
+
+	return ban;
+}
+
 /** is_banned_with_nick - Check if a user is banned on a channel.
  * @param client   Client to check (can be remote client)
  * @param channel  Channel to check
@@ -404,6 +646,7 @@ inline int ban_check_mask(BanContext *b)
 Ban *is_banned_with_nick(Client *client, Channel *channel, int type, const char *nick, const char **msg, const char **errmsg)
 {
 	Ban *ban, *ex;
+	Membership *mb;
 	char savednick[NICKLEN+1];
 	BanContext *b = safe_alloc(sizeof(BanContext));
 
@@ -434,27 +677,35 @@ Ban *is_banned_with_nick(Client *client, Channel *channel, int type, const char
 	 * If a +e was found we return NULL, if not, we return the ban.
 	 */
 
-	for (ban = channel->banlist; ban; ban = ban->next)
+	if (!nick && MyUser(client) && channel->banlist &&
+	    (mb = find_membership(client, channel)))
 	{
-		b->banstr = ban->banstr;
-		if (ban_check_mask(b))
-			break;
-	}
-
-	if (ban)
+		/* Local channel member: use the ban cache */
+		ban = is_banned_cached(b, &mb->bancache);
+	} else
 	{
-		/* Ban found, now check for +e */
-		for (ex = channel->exlist; ex; ex = ex->next)
+		for (ban = channel->banlist; ban; ban = ban->next)
 		{
-			b->banstr = ex->banstr;
+			b->banstr = ban->banstr;
 			if (ban_check_mask(b))
-			{
-				/* except matched */
-				ban = NULL;
 				break;
+		}
+
+		if (ban)
+		{
+			/* Ban found, now check for +e */
+			for (ex = channel->exlist; ex; ex = ex->next)
+			{
+				b->banstr = ex->banstr;
+				if (ban_check_mask(b))
+				{
+					/* except matched */
+					ban = NULL;
+					break;
+				}
 			}
+			/* user is not on except, 'ban' stays non-NULL. */
 		}
-		/* user is not on except, 'ban' stays non-NULL. */
 	}
 
 	if (nick)
@@ -530,15 +781,43 @@ void add_user_to_channel(Channel *channel, Client *client, const char *modes)
 	m = make_member();
 	m->client = client;
 	m->next = channel->members;
+	if (m->next)
+		m->next->prev = m;
 	channel->members = m;
 	channel->users++;
 
+	if (channel->member_index)
+	{
+		member_index_add(channel->member_index, client, m);
+	} else
+	if (channel->users >= MEMBER_INDEX_MIN)
+	{
+		Member *e;
+		channel->member_index = member_index_create();
+		for (e = channel->members; e; e = e->next)
+			member_index_add(channel->member_index, e->client, e);
+	}
+
 	mb = make_membership();
 	mb->channel = channel;
 	mb->next = client->user->channel;
+	if (mb->next)
+		mb->next->prev = mb;
 	client->user->channel = mb;
 	client->user->joined++;
 
+	if (client->user->channel_index)
+	{
+		member_index_add(client->user->channel_index, channel, mb);
+	} else
+	if (client->user->joined >= MEMBER_INDEX_MIN)
+	{
+		Membership *e;
+		client->user->channel_index = member_index_create();
+		for (e = client->user->channel; e; e = e->next)
+			member_index_add(client->user->channel_index, e->channel, e);
+	}
+
 	for (p = modes; *p; p++)
 		add_member_mode_fast(m, mb, *p);
 
@@ -556,31 +835,43 @@ void add_user_to_channel(Channel *channel, Client *client, const char *modes)
  */
 int remove_user_from_channel(Client *client, Channel *channel, int dont_log)
 {
-	Member **m;
-	Member *m2;
-	Membership **mb;
-	Membership *mb2;
+	Member *m;
+	Membership *mb;
 
 	/* Update channel->members list */
-	for (m = &channel->members; (m2 = *m); m = &m2->next)
+	if ((m = find_member(channel, client)))
 	{
-		if (m2->client == client)
+		if (m->prev)
+			m->prev->next = m->next;
+		else
+			channel->members = m->next;
+		if (m->next)
+			m->next->prev = m->prev;
+		if (channel->member_index)
 		{
-			*m = m2->next;
-			free_member(m2);
-			break;
+			member_index_del(channel->member_index, client);
+			if (channel->member_index->count < MEMBER_INDEX_MIN / 2)
+				member_index_free(&channel->member_index);
 		}
+		free_member(m);
 	}
 
 	/* Update client->user->channel list */
-	for (mb = &client->user->channel; (mb2 = *mb); mb = &mb2->next)
+	if ((mb = find_membership(client, channel)))
 	{
-		if (mb2->channel == channel)
+		if (mb->prev)
+			mb->prev->next = mb->next;
+		else
+			client->user->channel = mb->next;
+		if (mb->next)
+			mb->next->prev = mb->prev;
+		if (client->user->channel_index)
 		{
-			*mb = mb2->next;
-			free_membership(mb2);
-			break;
+			member_index_del(client->user->channel_index, channel);
+			if (client->user->channel_index->count < MEMBER_INDEX_MIN / 2)
+				member_index_free(&client->user->channel_index);
 		}
+		free_membership(mb);
 	}
 
 	/* Update user record to reflect 1 less joined */
@@ -1320,10 +1611,10 @@ int user_can_see_member(Client *user, Client *target, Channel *channel)
 		return 1;
 
 	if (IsUser(user))
-		user_member = find_membership_link(user->user->channel, channel);
+		user_member = find_membership(user, channel);
 
 	if (IsUser(target))
-		target_member = find_member_link(channel->members, target); // SLOW!
+		target_member = find_member(channel, target);
 
 	/* User is not in channel, yeah what shall we return? :D */
 	if (!target_member)
@@ -1341,7 +1632,7 @@ int invisible_user_in_channel(Client *target, Channel *channel)
 	Member *target_member;
 	int j = 0;
 
-	target_member = find_member_link(channel->members, target); // SLOW!
+	target_member = find_member(channel, target);
 	if (!target_member)
 		return 0; /* not in channel */
 
@@ -1453,3 +1744,107 @@ void free_multilinemode(MultiLineMode *m)
 	}
 	safe_free(m);
 }
+
+#if 0
+#define MEMBER_INDEX_TEST_COUNT 50000
+/** This is just for internal testing: compare the speed of the member
+ * index with walking the list, like find_member_link() does.
+ * MEMBER_INDEX_TEST_COUNT entries are added, looked up and removed
+ * again in random order, as with a mass join and part of a big channel.
+ * The keys are adjacent addresses, which is the worst case for the hash.
+ */
+void member_index_test_speed(void)
+{
+	char *keys = safe_alloc(MEMBER_INDEX_TEST_COUNT);
+	Member *members = safe_alloc(sizeof(Member) * MEMBER_INDEX_TEST_COUNT);
+	int *order = safe_alloc(sizeof(int) * MEMBER_INDEX_TEST_COUNT);
+	MemberIndex *idx;
+	Member *list = NULL, *m;
+	int i, j, tmp;
+	struct timeval tv_start, tv_end;
+
+	for (i = 0; i < MEMBER_INDEX_TEST_COUNT; i++)
+	{
+		members[i].client = (Client *)(keys + i);
+		order[i] = i;
+	}
+
+	/* Shuffle the order in which the entries are added */
+	for (i = MEMBER_INDEX_TEST_COUNT - 1; i > 0; i--)
+	{
+		j = getrandom32() % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+
+	fprintf(stderr, "*** MEMBER INDEX: %d entries ***\n", MEMBER_INDEX_TEST_COUNT);
+	idx = member_index_create();
+	gettimeofday(&tv_start, NULL);
+	for (i = 0; i < MEMBER_INDEX_TEST_COUNT; i++)
+	{
+		m = &members[order[i]];
+		if (member_index_find(idx, m->client))
+			abort();
+		member_index_add(idx, m->client, m);
+	}
+	gettimeofday(&tv_end, NULL);
+	fprintf(stderr, "Add: %lld usecs\n",
+		(long long)(((tv_end.tv_sec - tv_start.tv_sec) * 1000000) + (tv_end.tv_usec - tv_start.tv_usec)));
+
+	gettimeofday(&tv_start, NULL);
+	for (i = MEMBER_INDEX_TEST_COUNT - 1; i >= 0; i--)
+	{
+		m = &members[order[(i * 7919) % MEMBER_INDEX_TEST_COUNT]];
+		if (member_index_find(idx, m->client) != m)
+			abort();
+		member_index_del(idx, m->client);
+	}
+	gettimeofday(&tv_end, NULL);
+	fprintf(stderr, "Remove: %lld usecs\n\n",
+		(long long)(((tv_end.tv_sec - tv_start.tv_sec) * 1000000) + (tv_end.tv_usec - tv_start.tv_usec)));
+	if (idx->count != 0)
+		abort();
+	member_index_free(&idx);
+
+	fprintf(stderr, "*** LINKED LIST: %d entries ***\n", MEMBER_INDEX_TEST_COUNT);
+	gettimeofday(&tv_start, NULL);
+	for (i = 0; i < MEMBER_INDEX_TEST_COUNT; i++)
+	{
+		m = &members[order[i]];
+		if (find_member_link(list, m->client))
+			abort();
+		m->prev = NULL;
+		m->next = list;
+		if (list)
+			list->prev = m;
+		list = m;
+	}
+	gettimeofday(&tv_end, NULL);
+	fprintf(stderr, "Add: %lld usecs\n",
+		(long long)(((tv_end.tv_sec - tv_start.tv_sec) * 1000000) + (tv_end.tv_usec - tv_start.tv_usec)));
+
+	gettimeofday(&tv_start, NULL);
+	for (i = MEMBER_INDEX_TEST_COUNT - 1; i >= 0; i--)
+	{
+		m = &members[order[(i * 7919) % MEMBER_INDEX_TEST_COUNT]];
+		if (find_member_link(list, m->client) != m)
+			abort();
+		if (m->prev)
+			m->prev->next = m->next;
+		else
+			list = m->next;
+		if (m->next)
+			m->next->prev = m->prev;
+	}
+	gettimeofday(&tv_end, NULL);
+	fprintf(stderr, "Remove: %lld usecs\n\n",
+		(long long)(((tv_end.tv_sec - tv_start.tv_sec) * 1000000) + (tv_end.tv_usec - tv_start.tv_usec)));
+	if (list)
+		abort();
+
+	safe_free(order);
+	safe_free(members);
+	safe_free(keys);
+}
+#endif
@@ -155,6 +155,7 @@ static NameValue _LinkFlags[] = {
 /* This MUST be alphabetized */
 static NameValue _TLSFlags[] = {
 	{ TLSFLAG_FAILIFNOCERT, "fail-if-no-clientcert" },
+	{ TLSFLAG_KTLS, "ktls" },
 	{ TLSFLAG_DISABLECLIENTCERT, "no-client-certificate" },
 	{ TLSFLAG_NOSTARTTLS, "no-starttls" },
 };
@@ -1720,6 +1721,8 @@ void config_setdefaultsettings(Configuration *i)
 	i->ident_read_timeout = 7;
 	i->ident_connect_timeout = 3;
 	i->hide_ban_reason = HIDE_BAN_REASON_AUTO;
+	i->database_chunk_size = UNREALDB_CRYPT_FILE_CHUNK_SIZE;
+	i->database_fsync = UNREALDB_FSYNC_YES;
 	i->ban_version_tkl_time = 86400; /* 1d */
 	i->spamfilter_ban_time = 86400; /* 1d */
 	i->spamfilter_utf8 = 1;
@@ -7529,6 +7532,13 @@ void test_tlsblock(ConfigFile *conf, ConfigEntry *cep, int *totalerrors)
 							 ceppp->line_number, ceppp->name);
 					errors ++;
 				}
+#ifndef SSL_OP_ENABLE_KTLS
+				else if (!strcmp(ceppp->name, "ktls"))
+				{
+					config_warn("%s:%i: TLS option 'ktls' is not supported by your OpenSSL version (3.0.0 or later is needed), option ignored.",
+					            ceppp->file->filename, ceppp->line_number);
+				}
+#endif
 			}
 		}
 		else if (!strcmp(cepp->name, "sts-policy"))
@@ -7943,6 +7953,17 @@ int	_conf_set(ConfigFile *conf, ConfigEntry *ce)
 			else if (!strcmp(cep->value, "auto"))
 				tempiConf.hide_ban_reason = HIDE_BAN_REASON_AUTO;
 		}
+		else if (!strcmp(cep->name, "database-chunk-size")) {
+			tempiConf.database_chunk_size = config_checkval(cep->value, CFG_SIZE);
+		}
+		else if (!strcmp(cep->name, "database-fsync")) {
+			if (!strcmp(cep->value, "yes"))
+				tempiConf.database_fsync = UNREALDB_FSYNC_YES;
+			else if (!strcmp(cep->value, "no"))
+				tempiConf.database_fsync = UNREALDB_FSYNC_NO;
+			else if (!strcmp(cep->value, "batch"))
+				tempiConf.database_fsync = UNREALDB_FSYNC_BATCH;
+		}
 		else if (!strcmp(cep->name, "prefix-quit")) {
 			if (!strcmp(cep->value, "0") || !strcmp(cep->value, "no"))
 				safe_free(tempiConf.prefix_quit);
@@ -8296,6 +8317,10 @@ int	_conf_set(ConfigFile *conf, ConfigEntry *ce)
 		{
 			tempiConf.handshake_boot_delay = config_checkval(cep->value, CFG_TIME);
 		}
+		else if (!strcmp(cep->name, "io-threads"))
+		{
+			tempiConf.io_threads = atoi(cep->value);
+		}
 		else if (!strcmp(cep->name, "automatic-ban-target"))
 		{
 			tempiConf.automatic_ban_target = ban_target_strtoval(cep->value);
@@ -8752,6 +8777,32 @@ int	_test_set(ConfigFile *conf, ConfigEntry *ce)
 				continue;
 			}
 		}
+		else if (!strcmp(cep->name, "database-chunk-size")) {
+			long v;
+			CheckNull(cep);
+			CheckDuplicate(cep, database_chunk_size, "database-chunk-size");
+			v = config_checkval(cep->value, CFG_SIZE);
+			if ((v < UNREALDB_CRYPT_FILE_CHUNK_SIZE) || (v > UNREALDB_CRYPT_FILE_MAX_CHUNK_SIZE))
+			{
+				config_error("%s:%i: set::database-chunk-size must be between 4k and 1m",
+					cep->file->filename, cep->line_number);
+				errors++;
+				continue;
+			}
+		}
+		else if (!strcmp(cep->name, "database-fsync")) {
+			CheckNull(cep);
+			CheckDuplicate(cep, database_fsync, "database-fsync");
+			if (strcmp(cep->value, "yes") &&
+			    strcmp(cep->value, "no") &&
+			    strcmp(cep->value, "batch"))
+			{
+				config_error("%s:%i: set::database-fsync must be one of: yes, no, batch",
+					cep->file->filename, cep->line_number);
+				errors++;
+				continue;
+			}
+		}
 		else if (!strcmp(cep->name, "restrict-channelmodes"))
 		{
 			CheckNull(cep);
@@ -9692,6 +9743,27 @@ int	_test_set(ConfigFile *conf, ConfigEntry *ce)
 				errors++;
 			}
 		}
+		else if (!strcmp(cep->name, "io-threads"))
+		{
+			int v;
+			CheckNull(cep);
+			v = atoi(cep->value);
+#ifdef _WIN32
+			if (v != 0)
+			{
+				config_error("%s:%i: set::io-threads is not supported on Windows.",
+					cep->file->filename, cep->line_number);
+				errors++;
+			}
+#else
+			if ((v < 0) || (v > 64))
+			{
+				config_error("%s:%i: set::io-threads: value should be between 0 (disabled) and 64.",
+					cep->file->filename, cep->line_number);
+				errors++;
+			}
+#endif
+		}
 		else if (!strcmp(cep->name, "ban-include-username"))
 		{
 			config_error("%s:%i: set::ban-include-username is no longer supported. "
@@ -20,10 +20,16 @@
 #include "unrealircd.h"
 
 static mp_pool_t *dbuf_bufpool = NULL;
+static mp_pool_t *dbuf_slicepool = NULL;
+
+/* Forward declarations */
+static void dbuf_init_find_eol(void);
 
 void dbuf_init(void)
 {
 	dbuf_bufpool = mp_pool_new(sizeof(struct dbufbuf), 512 * 1024);
+	dbuf_slicepool = mp_pool_new(offsetof(struct dbufbuf, data), 64 * 1024);
+	dbuf_init_find_eol();
 }
 
 /*
@@ -37,7 +43,9 @@ static dbufbuf *dbuf_alloc(dbuf *dbuf_p)
 	assert(dbuf_p != NULL);
 
 	ptr = mp_pool_get(dbuf_bufpool);
-	memset(ptr, 0, sizeof(dbufbuf));
+	/* Only the header needs to be initialized, not the data */
+	memset(ptr, 0, offsetof(dbufbuf, data));
+	ptr->start = ptr->data;
 
 	INIT_LIST_HEAD(&ptr->dbuf_node);
 	list_add_tail(&ptr->dbuf_node, &dbuf_p->dbuf_list);
@@ -53,6 +61,8 @@ static void dbuf_free(dbufbuf *ptr)
 	assert(ptr != NULL);
 
 	list_del(&ptr->dbuf_node);
+	if (ptr->shared)
+		dbuf_shared_release(ptr->shared);
 	mp_pool_release(ptr);
 }
 
@@ -62,6 +72,14 @@ void dbuf_queue_init(dbuf *dyn)
 	INIT_LIST_HEAD(&dyn->dbuf_list);
 }
 
+/** Number of bytes that can still be appended to this block */
+static inline size_t dbuf_block_room(dbufbuf *block)
+{
+	if (block->shared)
+		return 0;
+	return DBUF_BLOCK_SIZE - (block->start - block->data) - block->size;
+}
+
 void dbuf_put(dbuf *dyn, const char *buf, size_t length)
 {
 	struct dbufbuf *block;
@@ -75,7 +93,7 @@ void dbuf_put(dbuf *dyn, const char *buf, size_t length)
 	{
 		block = container_of(dyn->dbuf_list.prev, struct dbufbuf, dbuf_node);
 
-		amount = DBUF_BLOCK_SIZE - block->size;
+		amount = dbuf_block_room(block);
 		if (!amount)
 		{
 			block = dbuf_alloc(dyn);
@@ -84,7 +102,7 @@ void dbuf_put(dbuf *dyn, const char *buf, size_t length)
 		if (amount > length)
 			amount = length;
 
-		memcpy(&block->data[block->size], buf, amount);
+		memcpy(block->start + block->size, buf, amount);
 
 		length -= amount;
 		block->size += amount;
@@ -93,6 +111,66 @@ void dbuf_put(dbuf *dyn, const char *buf, size_t length)
 	}
 }
 
+/** Create a new shared buffer with a copy of the data in 'buf'.
+ * The buffer starts with a refcount of 1, which is the reference
+ * of the caller. Use dbuf_shared_release() to drop it.
+ * @param buf		The data
+ * @param length	The length of the data
+ * @returns The new shared buffer
+ */
+dbufshared *dbuf_shared_new(const char *buf, int length)
+{
+	dbufshared *shared = safe_alloc(sizeof(dbufshared) + length);
+
+	shared->refcount = 1;
+	shared->size = length;
+	memcpy(shared->data, buf, length);
+	shared->data[length] = '\0';
+	return shared;
+}
+
+/** Drop a reference to a shared buffer, freeing it if it was the last one */
+void dbuf_shared_release(dbufshared *shared)
+{
+	if (--shared->refcount == 0)
+		safe_free(shared);
+}
+
+/** Append a shared buffer to the dbuf.
+ * Normally this does not copy any data: the dbuf gets a new
+ * block (a "slice") that references the shared buffer.
+ * If the data fits in the last block of the dbuf then it is
+ * simply copied, since that is cheaper than adding a block.
+ * @param dyn		The dbuf
+ * @param shared	The shared buffer
+ */
+void dbuf_put_shared(dbuf *dyn, dbufshared *shared)
+{
+	struct dbufbuf *block;
+
+	assert(shared->size > 0);
+
+	if (!list_empty(&dyn->dbuf_list))
+	{
+		block = container_of(dyn->dbuf_list.prev, struct dbufbuf, dbuf_node);
+		if (dbuf_block_room(block) >= shared->size)
+		{
+			dbuf_put(dyn, shared->data, shared->size);
+			return;
+		}
+	}
+
+	block = mp_pool_get(dbuf_slicepool);
+	block->size = shared->size;
+	block->start = shared->data;
+	block->shared = shared;
+	shared->refcount++;
+
+	INIT_LIST_HEAD(&block->dbuf_node);
+	list_add_tail(&block->dbuf_node, &dyn->dbuf_list);
+	dyn->length += shared->size;
+}
+
 void dbuf_delete(dbuf *dyn, size_t length)
 {
 	struct dbufbuf *block;
@@ -112,12 +190,209 @@ void dbuf_delete(dbuf *dyn, size_t length)
 
 		dyn->length -= block->size;
 		length -= block->size;
-		dbuf_free(block);
+		if (block == dyn->pinned)
+			list_del_init(&block->dbuf_node); /* freed by dbuf_getmsg_done() */
+		else
+			dbuf_free(block);
 	}
 
+	/* Partial delete of the first block: no need to move
+	 * any data around, we just start further in the block.
+	 */
+	block->start += length;
 	block->size -= length;
 	dyn->length -= length;
-	memmove(block->data, &block->data[length], block->size);
+}
+
+/* Helpers for walking the blocks of a dbuf by hand */
+#define DBUF_FIRST(dyn)		container_of((dyn)->dbuf_list.next, dbufbuf, dbuf_node)
+#define DBUF_NEXT(block)	container_of((block)->dbuf_node.next, dbufbuf, dbuf_node)
+#define DBUF_END(dyn, block)	(&(block)->dbuf_node == &(dyn)->dbuf_list)
+
+/* "Empty" characters around a line, see dbuf_getmsg() */
+#define DBUF_EMPTY_CHAR(c)	(((c) == '\r') || ((c) == '\n') || ((c) == ' '))
+
+/** Find the first CR or LF in a buffer.
+ * @param p		The buffer
+ * @param len		The length of the buffer
+ * @returns The offset of the first CR or LF, or 'len' if there is none.
+ */
+typedef size_t (*dbuf_find_eol_func)(const char *p, size_t len);
+
+static size_t dbuf_find_eol_scalar(const char *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if ((p[i] == '\r') || (p[i] == '\n'))
+			break;
+	return i;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DBUF_HAVE_SIMD
+#include <immintrin.h>
+
+/** SSE2 version of dbuf_find_eol_scalar(), 16 bytes at a time */
+__attribute__((target("sse2")))
+static size_t dbuf_find_eol_sse2(const char *p, size_t len)
+{
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i lf = _mm_set1_epi8('\n');
+	__m128i v;
+	size_t i;
+	int mask;
+
+	for (i = 0; i + 16 <= len; i += 16)
+	{
+		v = _mm_loadu_si128((const __m128i *)(p + i));
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + dbuf_find_eol_scalar(p + i, len - i);
+}
+
+/** AVX2 version of dbuf_find_eol_scalar(), 32 bytes at a time */
+__attribute__((target("avx2")))
+static size_t dbuf_find_eol_avx2(const char *p, size_t len)
+{
+	const __m256i cr = _mm256_set1_epi8('\r');
+	const __m256i lf = _mm256_set1_epi8('\n');
+	__m256i v;
+	size_t i;
+	unsigned int mask;
+
+	for (i = 0; i + 32 <= len; i += 32)
+	{
+		v = _mm256_loadu_si256((const __m256i *)(p + i));
+		mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + dbuf_find_eol_scalar(p + i, len - i);
+}
+#endif
+
+/** The line terminator scanner, chosen at runtime by dbuf_init() */
+static dbuf_find_eol_func dbuf_find_eol = dbuf_find_eol_scalar;
+
+/** Pick the fastest line terminator scanner that the CPU supports */
+static void dbuf_init_find_eol(void)
+{
+#ifdef DBUF_HAVE_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		dbuf_find_eol = dbuf_find_eol_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		dbuf_find_eol = dbuf_find_eol_sse2;
+#endif
+}
+
+/** Get a line from the dbuf - the actual implementation.
+ * See dbuf_getmsg() and dbuf_getmsg_nocopy() for details.
+ */
+static int dbuf_getmsg_real(dbuf *dyn, char *buf, char **msg)
+{
+	dbufbuf *block, *line_block;
+	size_t idx = 0, line_idx, n, line_bytes = 0, empty_bytes = 0;
+	int len;
+	char *p;
+
+	/*
+	 * Phase 0: "empty" characters before the line
+	 * Phase 1: the line itself, up to the first CR or LF
+	 * Phase 2: "empty" characters after the line
+	 *          (delete them as well and free some space in the dbuf)
+	 *
+	 * Empty characters are CR, LF and space (but, of course, not
+	 * in the middle of a line). We try to remove as much of them as we can,
+	 * since they simply eat server memory.
+	 *
+	 * --adx
+	 */
+
+	/* Phase 0 */
+	for (block = DBUF_FIRST(dyn); !DBUF_END(dyn, block); block = DBUF_NEXT(block))
+	{
+		for (idx = 0; (idx < block->size) && DBUF_EMPTY_CHAR(block->start[idx]); idx++)
+			;
+		empty_bytes += idx;
+		if (idx < block->size)
+			break;
+	}
+
+	/* Phase 1: this is where nearly all the time is spent, hence the
+	 * use of dbuf_find_eol() which may look at 16 or 32 bytes at a time.
+	 */
+	line_block = block;
+	line_idx = idx;
+	for (; !DBUF_END(dyn, block); block = DBUF_NEXT(block), idx = 0)
+	{
+		n = dbuf_find_eol(block->start + idx, block->size - idx);
+		line_bytes += n;
+		idx += n;
+		if (idx < block->size)
+			break;
+	}
+
+	if (DBUF_END(dyn, block))
+	{
+		/* We did not find a CR or LF, so this is not a
+		 * complete line. Only remove the empty characters.
+		 */
+		*buf = '\0';
+		if (msg)
+			*msg = buf;
+		dbuf_delete(dyn, empty_bytes);
+		return 0;
+	}
+
+	len = MIN(line_bytes, READBUFSIZE - 2);
+
+	if (msg && (block == line_block) && !dyn->pinned)
+	{
+		/* The entire line is in one block (including the CR or LF),
+		 * so we can give a pointer directly into the block.
+		 */
+		*msg = line_block->start + line_idx;
+		dyn->pinned = line_block;
+	} else {
+		/* Copy the line, which may be spread over multiple blocks */
+		p = buf;
+		n = len;
+		for (; n > 0; line_block = DBUF_NEXT(line_block), line_idx = 0)
+		{
+			size_t amount = MIN(line_block->size - line_idx, n);
+			memcpy(p, line_block->start + line_idx, amount);
+			p += amount;
+			n -= amount;
+		}
+		if (msg)
+			*msg = buf;
+	}
+
+	/* Phase 2, 'block' and 'idx' point to the CR or LF */
+	for (; !DBUF_END(dyn, block); block = DBUF_NEXT(block), idx = 0)
+	{
+		for (; (idx < block->size) && DBUF_EMPTY_CHAR(block->start[idx]); idx++)
+			empty_bytes++;
+		if (idx < block->size)
+			break;
+	}
+
+	/* Zero terminate the string. In the zero-copy case this
+	 * overwrites the CR or LF (or a character in the line if
+	 * it is too long), which is fine since that is deleted now.
+	 */
+	if (msg)
+		(*msg)[len] = '\0';
+	else
+		buf[len] = '\0';
+
+	/* Remove what is now unnecessary */
+	dbuf_delete(dyn, line_bytes + empty_bytes);
+	return len;
 }
 
 /*
@@ -130,6 +405,76 @@ void dbuf_delete(dbuf *dyn, size_t length)
 ** Partially based on extract_one_line() from ircd-hybrid. --kaniini
 */
 int  dbuf_getmsg(dbuf *dyn, char *buf)
+{
+	return dbuf_getmsg_real(dyn, buf, NULL);
+}
+
+/** Get a line from the dbuf, without copying it if possible.
+ * This is like dbuf_getmsg(), except that if the line is
+ * within one block, then *msg will point directly into that
+ * block instead of the line being copied to 'buf'.
+ * Otherwise it is copied to 'buf' and *msg will point to 'buf'.
+ * The caller must call dbuf_getmsg_done() once it is done with
+ * the line. Until then the line stays valid, even if the dbuf
+ * is cleared in the meantime.
+ * @param dyn		The dbuf
+ * @param buf		Buffer of READBUFSIZE bytes, used if the line needs to be copied
+ * @param msg		Will be set to the line
+ * @returns The length of the line, or 0 if there is no complete line.
+ */
+int dbuf_getmsg_nocopy(dbuf *dyn, char *buf, char **msg)
+{
+	return dbuf_getmsg_real(dyn, buf, msg);
+}
+
+/** Done with the line from dbuf_getmsg_nocopy().
+ * This frees the block that contained the line, if it is no longer in use.
+ */
+void dbuf_getmsg_done(dbuf *dyn)
+{
+	dbufbuf *block = dyn->pinned;
+
+	if (!block)
+		return;
+	dyn->pinned = NULL;
+	/* If it is no longer part of the dbuf, then dbuf_delete() left it for us */
+	if (list_empty(&block->dbuf_node))
+		mp_pool_release(block);
+}
+
+/*
+** dbuf_get
+**
+** Get the entire dbuf buffer as a newly allocated string. There is NO CR/LF processing.
+*/
+int dbuf_get(dbuf *dyn, char **buf)
+{
+	dbufbuf *block;
+	char *d;
+	int bytes = 0;
+
+	/* First calculate the room needed... */
+	list_for_each_entry2(block, dbufbuf, &dyn->dbuf_list, dbuf_node)
+		bytes += block->size;
+
+	d = *buf = safe_alloc(bytes + 1);
+
+	list_for_each_entry2(block, dbufbuf, &dyn->dbuf_list, dbuf_node)
+	{
+		memcpy(d, block->start, block->size);
+		d += block->size;
+	}
+	*d = '\0'; /* zero terminate */
+
+	/* Remove what is now unnecessary */
+	dbuf_delete(dyn, bytes);
+	return bytes;
+}
+
+/** The original byte-at-a-time dbuf_getmsg().
+ * This is only used for comparison in dbuf_test_speed().
+ */
+static int dbuf_getmsg_bytewise(dbuf *dyn, char *buf)
 {
 	dbufbuf *block;
 	int line_bytes = 0, empty_bytes = 0, phase = 0;
@@ -137,23 +482,11 @@ int  dbuf_getmsg(dbuf *dyn, char *buf)
 	char c;
 	char *p = buf;
 
-	/*
-	 * Phase 0: "empty" characters before the line
-	 * Phase 1: copying the line
-	 * Phase 2: "empty" characters after the line
-	 *          (delete them as well and free some space in the dbuf)
-	 *
-	 * Empty characters are CR, LF and space (but, of course, not
-	 * in the middle of a line). We try to remove as much of them as we can,
-	 * since they simply eat server memory.
-	 *
-	 * --adx
-	 */
 	list_for_each_entry2(block, dbufbuf, &dyn->dbuf_list, dbuf_node)
 	{
 		for (idx = 0; idx < block->size; idx++)
 		{
-			c = block->data[idx];
+			c = block->start[idx];
 			if (c == '\r' || c == '\n' || (c == ' ' && phase != 1))
 			{
 				empty_bytes++;
@@ -175,46 +508,115 @@ int  dbuf_getmsg(dbuf *dyn, char *buf)
 
 	if (phase != 2)
 	{
-		/* If we have not reached phase 2 then this is not
-		 * not a complete line and it is invalid (return 0).
-		 */
 		line_bytes = 0;
 		*buf = '\0';
 	} else {
-		/* Zero terminate the string */
 		*p = '\0';
 	}
 
-	/* Remove what is now unnecessary */
 	dbuf_delete(dyn, line_bytes + empty_bytes);
 	return MIN(line_bytes, READBUFSIZE - 2);
 }
 
-/*
-** dbuf_get
-**
-** Get the entire dbuf buffer as a newly allocated string. There is NO CR/LF processing.
-*/
-int dbuf_get(dbuf *dyn, char **buf)
+#define DBUF_SPEED_TEST_BYTES 200000000
+#define DBUF_SPEED_TEST_INPUT 1000000
+#define DBUF_SPEED_TEST_READ 4096
+/** This is just for internal testing: compare the speed of the
+ * line splitters. Lines of random length are fed into a dbuf in
+ * chunks of DBUF_SPEED_TEST_READ bytes, like read_packet() does,
+ * and then all complete lines are taken out again.
+ * Each variant must see exactly the same lines.
+ */
+void dbuf_test_speed(void)
 {
-	dbufbuf *block;
-	char *d;
-	int bytes = 0;
-
-	/* First calculate the room needed... */
-	list_for_each_entry2(block, dbufbuf, &dyn->dbuf_list, dbuf_node)
-		bytes += block->size;
-
-	d = *buf = safe_alloc(bytes + 1);
+	struct {
+		const char *name;
+		dbuf_find_eol_func func;
+		int mode; /* 0 = bytewise (old), 1 = copy, 2 = no copy */
+	} tests[] = {
+		{ "byte-at-a-time (old)", NULL, 0 },
+		{ "scalar", dbuf_find_eol_scalar, 1 },
+#ifdef DBUF_HAVE_SIMD
+		{ "sse2", dbuf_find_eol_sse2, 1 },
+		{ "avx2", dbuf_find_eol_avx2, 1 },
+#endif
+		{ "default", NULL, 1 },
+		{ "default, no copy", NULL, 2 },
+	};
+	dbuf_find_eol_func best = dbuf_find_eol;
+	char *input;
+	char buf[READBUFSIZE];
+	char *line;
+	size_t pos, inputlen = 0;
+	unsigned long long processed, lines, checksum, expected_checksum = 0;
+	int n, t, len;
+	dbuf dyn;
+	struct timeval tv_start, tv_end;
+
+	/* Generate the input: lines of 1-500 bytes, mostly ending in CRLF */
+	input = safe_alloc(DBUF_SPEED_TEST_INPUT + 1024);
+	while (inputlen < DBUF_SPEED_TEST_INPUT)
+	{
+		len = 1 + (getrandom32() % 500);
+		for (n = 0; n < len; n++)
+			input[inputlen++] = 'a' + (getrandom32() % 26);
+		if (getrandom32() % 10)
+			input[inputlen++] = '\r';
+		input[inputlen++] = '\n';
+	}
 
-	list_for_each_entry2(block, dbufbuf, &dyn->dbuf_list, dbuf_node)
+	for (t = 0; t < ARRAY_SIZEOF(tests); t++)
 	{
-		memcpy(d, block->data, block->size);
-		d += block->size;
+#ifdef DBUF_HAVE_SIMD
+		if ((tests[t].func == dbuf_find_eol_sse2) && !__builtin_cpu_supports("sse2"))
+			continue;
+		if ((tests[t].func == dbuf_find_eol_avx2) && !__builtin_cpu_supports("avx2"))
+			continue;
+#endif
+		dbuf_find_eol = tests[t].func ? tests[t].func : best;
+		dbuf_queue_init(&dyn);
+		processed = lines = checksum = 0;
+		gettimeofday(&tv_start, NULL);
+		while (processed < DBUF_SPEED_TEST_BYTES)
+		{
+			for (pos = 0; pos < inputlen; pos += DBUF_SPEED_TEST_READ)
+			{
+				dbuf_put(&dyn, input + pos, MIN(DBUF_SPEED_TEST_READ, inputlen - pos));
+				while (1)
+				{
+					if (tests[t].mode == 0)
+					{
+						len = dbuf_getmsg_bytewise(&dyn, buf);
+						line = buf;
+					} else if (tests[t].mode == 1)
+					{
+						len = dbuf_getmsg(&dyn, buf);
+						line = buf;
+					} else {
+						len = dbuf_getmsg_nocopy(&dyn, buf, &line);
+					}
+					if (len == 0)
+						break;
+					lines++;
+					checksum += len * (unsigned char)line[len-1];
+					if (tests[t].mode == 2)
+						dbuf_getmsg_done(&dyn);
+				}
+			}
+			processed += inputlen;
+		}
+		gettimeofday(&tv_end, NULL);
+		DBufClear(&dyn);
+		if (t == 0)
+			expected_checksum = checksum;
+		else if (checksum != expected_checksum)
+			fprintf(stderr, "ERROR: checksum mismatch for '%s'!\n", tests[t].name);
+		fprintf(stderr, "%-24s %lld usecs (%llu lines)\n",
+			tests[t].name,
+			(long long)(((tv_end.tv_sec - tv_start.tv_sec) * 1000000) + (tv_end.tv_usec - tv_start.tv_usec)),
+			lines);
 	}
-	*d = '\0'; /* zero terminate */
 
-	/* Remove what is now unnecessary */
-	dbuf_delete(dyn, bytes);
-	return bytes;
+	dbuf_find_eol = best;
+	safe_free(input);
 }
@@ -39,6 +39,13 @@
 #include <sys/ioctl.h>
 #endif
 
+#ifdef BACKEND_IO_URING
+# include <sys/syscall.h>
+# ifndef __NR_io_uring_setup
+#  undef BACKEND_IO_URING
+# endif
+#endif
+
 /* Not sure if this is suitable for production,
  * but let's turn it on for U6 development.
  */
@@ -410,6 +417,457 @@ void fd_select(int delay)
 }
 #endif
 
+/***************************************************************************************
+ * io_uring backend (Linux).                                                           *
+ ***************************************************************************************/
+#ifdef BACKEND_IO_URING
+
+/* This backend uses one-shot IORING_OP_POLL_ADD requests, one for
+ * each direction (read/write) of each fd. All the changes to what
+ * we are interested in are queued in the submission ring and are
+ * handed to the kernel in one go together with waiting for events,
+ * so a single io_uring_enter() call per fd_select(), instead of an
+ * epoll_ctl() for every change plus an epoll_wait().
+ * A poll is re-armed after its callback ran, so we get the same
+ * level-triggered behavior as with the other backends.
+ *
+ * If io_uring is not usable at runtime (too old kernel, disabled
+ * via sysctl or blocked by a seccomp filter) then we fall back to
+ * the epoll backend below.
+ */
+
+#include <sys/mman.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+
+/** Number of submission queue entries */
+#define URING_SQ_ENTRIES	1024
+
+/** How often to retry submitting when the submission queue stays full */
+#define URING_SUBMIT_RETRIES	10
+
+/** user_data for requests whose completion we don't care about */
+#define URING_IGNORE		0xFFFFFFFFFFFFFFFFULL
+
+/* user_data of a poll request: generation << 32 | fd << 1 | direction */
+#define URING_DIR_READ		0
+#define URING_DIR_WRITE		1
+#define URING_USER_DATA(fd,dir,gen)	(((unsigned long long)(gen) << 32) | ((fd) << 1) | (dir))
+
+static struct {
+	int fd;
+	int state;			/**< 0 = not initialized yet, 1 = in use, -1 = unavailable (use epoll) */
+	void *ring;			/**< The mmap'ed SQ and CQ ring */
+	size_t ring_size;
+	struct io_uring_sqe *sqes;	/**< The mmap'ed submission queue entries */
+	size_t sqes_size;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int sqe_tail;		/**< Our tail, may be ahead of *sq_tail until uring_enter() */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+} uring = { .fd = -1 };
+
+/** Generation of the last poll request for each fd and direction */
+static unsigned int uring_gen[MAXCONNECTIONS+1][2];
+
+/** Directions (FD_SELECT_*) that currently have a poll request armed.
+ * This is kept outside the FDEntry since fd_close() clears that one
+ * before calling fd_refresh().
+ */
+static unsigned char uring_armed[MAXCONNECTIONS+1];
+
+/* Fds for which we could not arm a poll, see uring_poll_failed().
+ * An fd is on the uring_failed_fds list if uring_failed[fd] is set.
+ */
+#define URING_FAILED_NONE	0	/**< Not on the list */
+#define URING_FAILED_CLOSE	1	/**< On the list, fail the fd in uring_select() */
+#define URING_FAILED_IGNORE	2	/**< On the list, but nothing is waiting for it anymore */
+static unsigned char uring_failed[MAXCONNECTIONS+1];
+static int uring_failed_fds[MAXCONNECTIONS+1];
+static int num_uring_failed_fds = 0;
+
+static void uring_teardown(void)
+{
+	if (uring.ring)
+		munmap(uring.ring, uring.ring_size);
+	if (uring.sqes)
+		munmap(uring.sqes, uring.sqes_size);
+	if (uring.fd >= 0)
+		close(uring.fd);
+	uring.ring = NULL;
+	uring.sqes = NULL;
+	uring.fd = -1;
+	memset(uring_armed, 0, sizeof(uring_armed));
+}
+
+/** Set up the io_uring.
+ * @returns 1 on success, 0 if io_uring is unavailable.
+ */
+static int uring_setup(void)
+{
+	struct io_uring_params p;
+	unsigned int *sq_array;
+	unsigned int i;
+	char *ring;
+
+	memset(&p, 0, sizeof(p));
+	/* Room for a completion for every poll request,
+	 * plus those of the POLL_REMOVE's (the kernel max is 64K).
+	 */
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = MIN(MAXCONNECTIONS * 4, 65536);
+
+	uring.fd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &p);
+	if (uring.fd < 0)
+		return 0;
+
+	/* We need Linux 5.11 or later */
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_NODROP) ||
+	    !(p.features & IORING_FEAT_EXT_ARG))
+	{
+		SET_ERRNO(ENOSYS);
+		uring_teardown();
+		return 0;
+	}
+
+	uring.ring_size = MAX(p.sq_off.array + p.sq_entries * sizeof(unsigned int),
+	                      p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+	ring = mmap(NULL, uring.ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED)
+	{
+		uring.ring = NULL;
+		uring_teardown();
+		return 0;
+	}
+	uring.ring = ring;
+
+	uring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	uring.sqes = mmap(NULL, uring.sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+	if (uring.sqes == MAP_FAILED)
+	{
+		uring.sqes = NULL;
+		uring_teardown();
+		return 0;
+	}
+
+	uring.sq_head = (unsigned int *)(ring + p.sq_off.head);
+	uring.sq_tail = (unsigned int *)(ring + p.sq_off.tail);
+	uring.sq_mask = *(unsigned int *)(ring + p.sq_off.ring_mask);
+	uring.sq_entries = p.sq_entries;
+	uring.sqe_tail = *uring.sq_tail;
+	uring.cq_head = (unsigned int *)(ring + p.cq_off.head);
+	uring.cq_tail = (unsigned int *)(ring + p.cq_off.tail);
+	uring.cq_mask = *(unsigned int *)(ring + p.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+	/* SQ slot i always refers to SQE i */
+	sq_array = (unsigned int *)(ring + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		sq_array[i] = i;
+
+	return 1;
+}
+
+/** Is io_uring in use? Sets it up on the first call. */
+static int uring_active(void)
+{
+	if (uring.state == 0)
+	{
+		if (uring_setup())
+		{
+			uring.state = 1;
+		} else {
+			uring.state = -1;
+			unreal_log(ULOG_INFO, "io", "IO_URING_UNAVAILABLE", NULL,
+			           "io_uring is not available ($system_error), using epoll instead.",
+			           log_data_string("system_error", strerror(errno)));
+		}
+	}
+	return uring.state == 1;
+}
+
+/** Submit all queued requests and optionally wait for completions.
+ * @param delay		Maximum time to wait in msec, 0 for no waiting at all
+ *			and -1 to wait until there is a completion.
+ */
+static void uring_enter(int delay)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int to_submit, flags = 0, min_complete = 0;
+	int ret;
+
+	__atomic_store_n(uring.sq_tail, uring.sqe_tail, __ATOMIC_RELEASE);
+	to_submit = uring.sqe_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+
+	memset(&arg, 0, sizeof(arg));
+	if (delay != 0)
+	{
+		flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+		min_complete = 1;
+		if (delay > 0)
+		{
+			ts.tv_sec = delay / 1000;
+			ts.tv_nsec = (long long)(delay % 1000) * 1000000;
+			arg.ts = (unsigned long long)&ts;
+		}
+	}
+
+	if (!to_submit && !min_complete)
+		return;
+
+	ret = syscall(__NR_io_uring_enter, uring.fd, to_submit, min_complete, flags, &arg, sizeof(arg));
+	if ((ret < 0) && (errno != EINTR) && (errno != ETIME) && (errno != EBUSY) && (errno != EAGAIN))
+	{
+		unreal_log(ULOG_ERROR, "io", "IO_URING_ENTER_FAILED", NULL,
+		           "[io] fd_select(): io_uring_enter returned error: $system_error",
+		           log_data_string("system_error", strerror(errno)));
+	}
+}
+
+/** Get a free submission queue entry, submitting what we have if the ring is full. */
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+
+	if (uring.sqe_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) >= uring.sq_entries)
+	{
+		uring_enter(0);
+		if (uring.sqe_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) >= uring.sq_entries)
+			return NULL;
+	}
+
+	sqe = &uring.sqes[uring.sqe_tail & uring.sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	uring.sqe_tail++;
+	return sqe;
+}
+
+/** We could not arm a poll for this fd, even after retrying.
+ * If we would simply leave it like that, then nobody would ever notice
+ * that the fd is readable or writable again, and it would hang around
+ * forever. So instead we shut it down and in uring_select() we call the
+ * callbacks, which will then see an error or EOF and close it.
+ */
+static void uring_poll_failed(int fd)
+{
+	unreal_log(ULOG_ERROR, "io", "IO_URING_SQ_FULL", NULL,
+	           "[io] fd_refresh(): io_uring submission queue is full, could not add poll for fd $fd ($fd_description). Closing it.",
+	           log_data_integer("fd", fd),
+	           log_data_string("fd_description", fd_table[fd].desc));
+	if (uring_failed[fd] == URING_FAILED_NONE)
+		uring_failed_fds[num_uring_failed_fds++] = fd;
+	uring_failed[fd] = URING_FAILED_CLOSE;
+}
+
+static void uring_poll_add(int fd, int dir)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int events = (dir == URING_DIR_READ) ? POLLIN : POLLOUT;
+	int tries;
+
+	for (tries = 0; !(sqe = uring_get_sqe()); tries++)
+	{
+		if (tries == URING_SUBMIT_RETRIES)
+		{
+			uring_poll_failed(fd);
+			return;
+		}
+		uring_enter(0);
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+#if __BYTE_ORDER == __BIG_ENDIAN
+	events = (events << 16) | (events >> 16);
+#endif
+	sqe->poll32_events = events;
+	sqe->user_data = URING_USER_DATA(fd, dir, ++uring_gen[fd][dir]);
+	uring_armed[fd] |= (dir == URING_DIR_READ) ? FD_SELECT_READ : FD_SELECT_WRITE;
+}
+
+static void uring_poll_remove(int fd, int dir)
+{
+	struct io_uring_sqe *sqe;
+	int tries;
+
+	/* Even if we can't remove it, we will ignore any completion of it */
+	uring_armed[fd] &= ~((dir == URING_DIR_READ) ? FD_SELECT_READ : FD_SELECT_WRITE);
+
+	/* We must not drop a POLL_REMOVE: the poll would stay armed in the
+	 * kernel and keep a reference to the file, even after the fd is
+	 * closed. So if the ring is full, submit what we have and try again.
+	 */
+	for (tries = 0; !(sqe = uring_get_sqe()); tries++)
+	{
+		if (tries == URING_SUBMIT_RETRIES)
+		{
+			unreal_log(ULOG_ERROR, "io", "IO_URING_SQ_FULL", NULL,
+			           "[io] fd_refresh(): io_uring submission queue is full, could not remove poll for fd $fd",
+			           log_data_integer("fd", fd));
+			return;
+		}
+		uring_enter(0);
+	}
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = URING_USER_DATA(fd, dir, uring_gen[fd][dir]);
+	sqe->user_data = URING_IGNORE;
+}
+
+static void uring_refresh(int fd)
+{
+	FDEntry *fde = &fd_table[fd];
+	unsigned int want = 0;
+
+	if (fde->read_callback)
+		want |= FD_SELECT_READ;
+	if (fde->write_callback)
+		want |= FD_SELECT_WRITE;
+
+	if ((want & FD_SELECT_READ) && !(uring_armed[fd] & FD_SELECT_READ))
+		uring_poll_add(fd, URING_DIR_READ);
+	else if (!(want & FD_SELECT_READ) && (uring_armed[fd] & FD_SELECT_READ))
+		uring_poll_remove(fd, URING_DIR_READ);
+
+	if ((want & FD_SELECT_WRITE) && !(uring_armed[fd] & FD_SELECT_WRITE))
+		uring_poll_add(fd, URING_DIR_WRITE);
+	else if (!(want & FD_SELECT_WRITE) && (uring_armed[fd] & FD_SELECT_WRITE))
+		uring_poll_remove(fd, URING_DIR_WRITE);
+
+	/* If the fd is closed (or no longer has callbacks) before
+	 * uring_select() got to it, then leave it alone there.
+	 */
+	if (!want && (uring_failed[fd] == URING_FAILED_CLOSE))
+		uring_failed[fd] = URING_FAILED_IGNORE;
+
+	/* So fd_close() knows we are tracking this fd */
+	fde->backend_flags = want;
+}
+
+/** Shut down the fds for which uring_poll_failed() was called
+ * and let their owners close them, see there.
+ */
+static void uring_close_failed(void)
+{
+	int i, fd, state, num = num_uring_failed_fds;
+	FDEntry *fde;
+
+	/* Fds that fail again while we are busy here are appended,
+	 * those are handled on the next call.
+	 */
+	for (i = 0; i < num; i++)
+	{
+		fd = uring_failed_fds[i];
+		state = uring_failed[fd];
+		uring_failed[fd] = URING_FAILED_NONE;
+		fde = &fd_table[fd];
+		if ((state != URING_FAILED_CLOSE) || !fde->is_open)
+			continue;
+
+		shutdown(fd, SHUT_RDWR);
+		if (fde->read_callback)
+			fde->read_callback(fd, FD_SELECT_READ, fde->data);
+		if (fde->is_open && fde->write_callback)
+			fde->write_callback(fd, FD_SELECT_WRITE, fde->data);
+		if (fde->is_open)
+			uring_refresh(fd);
+	}
+
+	num_uring_failed_fds -= num;
+	memmove(uring_failed_fds, uring_failed_fds + num, sizeof(int) * num_uring_failed_fds);
+}
+
+static void uring_select(int delay)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+	unsigned long long user_data;
+	int res, fd, dir, evflags;
+	FDEntry *fde;
+	IOCallbackFunc iocb;
+
+	uring_enter(delay);
+
+	head = *uring.cq_head;
+	while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE))
+	{
+		cqe = &uring.cqes[head & uring.cq_mask];
+		user_data = cqe->user_data;
+		res = cqe->res;
+		__atomic_store_n(uring.cq_head, ++head, __ATOMIC_RELEASE);
+
+		if (user_data == URING_IGNORE)
+			continue;
+
+		fd = (user_data & 0xFFFFFFFF) >> 1;
+		dir = user_data & 1;
+		evflags = (dir == URING_DIR_READ) ? FD_SELECT_READ : FD_SELECT_WRITE;
+
+		/* Ignore completions of polls that were removed or replaced */
+		if ((fd > MAXCONNECTIONS) || !(uring_armed[fd] & evflags) ||
+		    ((user_data >> 32) != uring_gen[fd][dir]))
+		{
+			continue;
+		}
+		uring_armed[fd] &= ~evflags;
+
+		fde = &fd_table[fd];
+		if (res < 0)
+		{
+			if (res != -ECANCELED)
+			{
+				unreal_log(ULOG_ERROR, "io", "IO_URING_POLL_FAILED", NULL,
+				           "[io] fd_select(): io_uring poll failed for fd $fd ($fd_description): $system_error",
+				           log_data_string("system_error", strerror(-res)),
+				           log_data_integer("fd", fd),
+				           log_data_string("fd_description", fde->desc));
+			}
+			continue;
+		}
+
+		iocb = (dir == URING_DIR_READ) ? fde->read_callback : fde->write_callback;
+		if (iocb != NULL)
+			iocb(fd, evflags, fde->data);
+
+		/* Re-arm (if we are still interested) */
+		if (fde->is_open)
+			uring_refresh(fd);
+	}
+
+	if (num_uring_failed_fds)
+		uring_close_failed();
+}
+
+static void uring_fork(void)
+{
+	int fd;
+
+	if (uring.state != 1)
+		return;
+
+	/* The parent, which armed the polls, is going away.
+	 * Set up a fresh ring and arm everything again.
+	 */
+	uring_teardown();
+	uring.state = 0;
+	for (fd = 0; fd < MAXCONNECTIONS; fd++)
+	{
+		if (fd_table[fd].is_open && fd_table[fd].backend_flags)
+		{
+			fd_table[fd].backend_flags = 0;
+			fd_refresh(fd);
+		}
+	}
+}
+
+#endif
+
 /***************************************************************************************
  * epoll() backend.                                                                    *
  ***************************************************************************************/
@@ -420,15 +878,144 @@ void fd_select(int delay)
 static int epoll_fd = -1;
 static struct epoll_event epfds[MAXCONNECTIONS + 1];
 
+/* Fds that use fd_write_edge() are registered only once, with
+ * EPOLLOUT|EPOLLET, in a second epoll instance. That one is in turn
+ * registered for reading in epoll_fd. This way the read events
+ * stay level-triggered, like they always were.
+ */
+static int epoll_write_fd = -1;
+static struct epoll_event epfds_write[MAXCONNECTIONS + 1];
+
+/* The fds that got a write callback set (fd_write_edge only),
+ * these will be called at the end of fd_select().
+ * An fd is on this list if fde->write_pending is set. The flag stays
+ * set until epoll_run_write_pending() takes the fd off the list.
+ * Entries of fds that were closed (and maybe reused) in the meantime
+ * are skipped there, or removed by epoll_compact_write_pending().
+ */
+static int write_pending_buf[2][MAXCONNECTIONS + 1];
+static int *write_pending_fds = write_pending_buf[0];
+static int num_write_pending_fds = 0;
+
+/* In backend_flags: the fd is registered in epoll_write_fd.
+ * In that case EPOLLOUT in backend_flags means that a write
+ * callback is set, since it is not in epoll_fd.
+ */
+#define EPOLL_WRITE_EDGE	EPOLLET
+
+static void epoll_init(void)
+{
+	struct epoll_event ep_event;
+
+	epoll_fd = epoll_create(MAXCONNECTIONS);
+	epoll_write_fd = epoll_create(MAXCONNECTIONS);
+	if (epoll_write_fd < 0)
+		return;
+
+	memset(&ep_event, 0, sizeof(ep_event));
+	ep_event.events = EPOLLIN;
+	ep_event.data.ptr = NULL; /* see fd_select() */
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, epoll_write_fd, &ep_event) != 0)
+	{
+		close(epoll_write_fd);
+		epoll_write_fd = -1;
+	}
+}
+
+/** Remove stale and duplicate entries from the write pending list.
+ * Afterwards each fd is on it at most once, so it always fits.
+ */
+static void epoll_compact_write_pending(void)
+{
+	int i, fd, n = 0;
+
+	for (i = 0; i < num_write_pending_fds; i++)
+	{
+		fd = write_pending_fds[i];
+		if (fd_table[fd].write_pending != 1)
+			continue; /* closed, or already seen */
+		fd_table[fd].write_pending = 2;
+		write_pending_fds[n++] = fd;
+	}
+	num_write_pending_fds = n;
+	for (i = 0; i < n; i++)
+		fd_table[write_pending_fds[i]].write_pending = 1;
+}
+
+static void epoll_add_write_pending(int fd)
+{
+	if (fd_table[fd].write_pending)
+		return;
+	if (num_write_pending_fds == MAXCONNECTIONS + 1)
+		epoll_compact_write_pending();
+	assert(num_write_pending_fds < MAXCONNECTIONS + 1);
+	fd_table[fd].write_pending = 1;
+	write_pending_fds[num_write_pending_fds++] = fd;
+}
+
+/** Call the write callback of all fds on the write pending list.
+ * These either write everything, or they hit EAGAIN and we will
+ * get an EPOLLOUT edge once the fd is writable again.
+ */
+static void epoll_run_write_pending(void)
+{
+	FDEntry *fde;
+	int i, fd, n = num_write_pending_fds;
+	int *list = write_pending_fds;
+
+	/* The callbacks may add fds, these go to the other list
+	 * and will be called the next time.
+	 */
+	write_pending_fds = (list == write_pending_buf[0]) ? write_pending_buf[1] : write_pending_buf[0];
+	num_write_pending_fds = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		fd = list[i];
+		fde = &fd_table[fd];
+		if (!fde->write_pending)
+			continue; /* fd was closed in the meantime, or a duplicate entry */
+		fde->write_pending = 0;
+		if (fde->is_open && fde->write_edge && fde->write_callback)
+			fde->write_callback(fd, FD_SELECT_WRITE, fde->data);
+	}
+}
+
+/** Handle the EPOLLOUT edges from epoll_write_fd */
+static void epoll_run_write_edges(void)
+{
+	FDEntry *fde;
+	int num, p;
+
+	num = epoll_wait(epoll_write_fd, epfds_write, MAXCONNECTIONS, 0);
+	for (p = 0; p < num; p++)
+	{
+		fde = epfds_write[p].data.ptr;
+		if (!fde->is_open || !fde->write_edge)
+			continue;
+		if (fde->write_callback)
+			fde->write_callback(fde->fd, FD_SELECT_WRITE, fde->data);
+	}
+}
+
 void fd_refresh(int fd)
 {
 	struct epoll_event ep_event;
 	FDEntry *fde = &fd_table[fd];
 	unsigned int pflags = 0;
+	unsigned int curflags, edgeflags = 0;
 	int op = -1;
 
+#ifdef BACKEND_IO_URING
+	if (uring_active())
+	{
+		uring_refresh(fd);
+		return;
+	}
+#endif
+
 	if (epoll_fd == -1)
-		epoll_fd = epoll_create(MAXCONNECTIONS);
+		epoll_init();
 
 	if (fde->read_callback)
 		pflags |= EPOLLIN;
@@ -436,17 +1023,56 @@ void fd_refresh(int fd)
 	if (fde->write_callback)
 		pflags |= EPOLLOUT;
 
-	if (pflags == 0 && fde->backend_flags == 0)
-		return;
+	/* What is currently registered in epoll_fd */
+	if (fde->backend_flags & EPOLL_WRITE_EDGE)
+		curflags = fde->backend_flags & EPOLLIN;
+	else
+		curflags = fde->backend_flags;
+
+	if (fde->write_edge && fde->is_open && (epoll_write_fd >= 0))
+	{
+		unsigned int had_write = fde->backend_flags & EPOLLOUT;
+
+		if (!(fde->backend_flags & EPOLL_WRITE_EDGE))
+		{
+			memset(&ep_event, 0, sizeof(ep_event));
+			ep_event.events = EPOLLOUT | EPOLLET;
+			ep_event.data.ptr = fde;
+			if ((epoll_ctl(epoll_write_fd, EPOLL_CTL_ADD, fd, &ep_event) == 0) || (errno == EEXIST))
+			{
+				edgeflags = EPOLL_WRITE_EDGE;
+				had_write = 0; /* unknown, so try writing */
+			}
+		} else {
+			edgeflags = EPOLL_WRITE_EDGE;
+		}
+
+		if (edgeflags)
+		{
+			/* A write callback got set, try it in fd_select(),
+			 * rather than asking the kernel to tell us.
+			 */
+			if ((pflags & EPOLLOUT) && !had_write)
+				epoll_add_write_pending(fd);
+			edgeflags |= pflags & EPOLLOUT;
+			pflags &= ~EPOLLOUT;
+		}
+	}
+
+	if (pflags == 0 && curflags == 0)
+		op = -1;
 	else if (pflags == 0)
 		op = EPOLL_CTL_DEL;
-	else if (fde->backend_flags == 0 && pflags != 0)
+	else if (curflags == 0 && pflags != 0)
 		op = EPOLL_CTL_ADD;
-	else if (fde->backend_flags != pflags)
+	else if (curflags != pflags)
 		op = EPOLL_CTL_MOD;
 
 	if (op == -1)
+	{
+		fde->backend_flags = pflags | edgeflags;
 		return;
+	}
 
 	memset(&ep_event, 0, sizeof(ep_event));
 	ep_event.events = pflags;
@@ -466,7 +1092,7 @@ void fd_refresh(int fd)
 		return;
 	}
 
-	fde->backend_flags = pflags;
+	fde->backend_flags = pflags | edgeflags;
 }
 
 void fd_select(int delay)
@@ -478,12 +1104,27 @@ void fd_select(int delay)
 	struct timeval oldt, t;
 	long long tdiff;
 #endif
+#ifdef BACKEND_IO_URING
+	if (uring_active())
+	{
+		uring_select(delay);
+		return;
+	}
+#endif
+
 	if (epoll_fd == -1)
-		epoll_fd = epoll_create(MAXCONNECTIONS);
+		epoll_init();
+
+	/* Don't wait if there are writes to be done */
+	if (num_write_pending_fds > 0)
+		delay = 0;
 
 	num = epoll_wait(epoll_fd, epfds, MAXCONNECTIONS, delay);
 	if (num <= 0)
+	{
+		epoll_run_write_pending();
 		return;
+	}
 
 #ifdef DETECT_HIGH_CPU
 	gettimeofday(&oldt, NULL);
@@ -501,6 +1142,12 @@ void fd_select(int delay)
 		if (revents == 0)
 			continue;
 
+		if (epfd->data.ptr == NULL)
+		{
+			epoll_run_write_edges();
+			continue;
+		}
+
 		fde = epfd->data.ptr;
 		fd = fde->fd;
 
@@ -542,6 +1189,8 @@ void fd_select(int delay)
 #endif
 	}
 
+	epoll_run_write_pending();
+
 #ifdef DETECT_HIGH_CPU
 	gettimeofday(&t, NULL);
 	tdiff = ((t.tv_sec - oldt.tv_sec) * 1000000) + (t.tv_usec - oldt.tv_usec);
@@ -561,6 +1210,9 @@ void fd_select(int delay)
 
 void fd_fork()
 {
+#ifdef BACKEND_IO_URING
+	uring_fork();
+#endif
 }
 
 #endif
@@ -121,6 +121,9 @@ int fd_close(int fd)
 
 	befl = fde->backend_flags;
 	close_method = fde->close_method;
+	/* This also clears 'write_pending', so if the fd number gets
+	 * reused it will be put on the write pending list again.
+	 */
 	memset(fde, 0, sizeof(FDEntry));
 
 	fde->fd = fd;
@@ -162,6 +165,31 @@ void fd_unnotify(int fd)
 	fd_refresh(fd);
 }
 
+/** Use edge-triggered write notification for this file descriptor.
+ * With the epoll backend the fd is then registered for write events
+ * only once, rather than adding and removing write interest every time
+ * the write callback is set or cleared. When a write callback is set,
+ * fd_select() simply calls it, and only if that hits EAGAIN we wait
+ * for the kernel to tell us the fd is writable again.
+ * This may only be used if the write callbacks of this fd handle
+ * EAGAIN properly, eg NOT while waiting for a connect() to complete.
+ * Other backends ignore this.
+ */
+void fd_write_edge(int fd)
+{
+	FDEntry *fde;
+
+	if ((fd < 0) || (fd >= MAXCONNECTIONS))
+		return;
+
+	fde = &fd_table[fd];
+	if (!fde->is_open || fde->write_edge)
+		return;
+
+	fde->write_edge = 1;
+	fd_refresh(fd);
+}
+
 int fd_socket(int family, int type, int protocol, const char *desc)
 {
 	int fd;
@@ -257,9 +257,310 @@ void siphash_generate_key(char *k)
 		k[i] = getrandom8();
 }
 
-static struct list_head clientTable[NICK_HASH_TABLE_SIZE];
-static struct list_head idTable[NICK_HASH_TABLE_SIZE];
-static Channel *channelTable[CHAN_HASH_TABLE_SIZE];
+/** @defgroup HashTableAPI Hash table API
+ * A generic chained hash table (HashTable) that resizes itself
+ * incrementally: when the load factor gets above 1 (or far below it)
+ * a new bucket array is allocated and every operation moves a few
+ * buckets from the old to the new one. This way there is never a
+ * pause where all the entries are rehashed at once.
+ *
+ * The HashNode is embedded in the struct that is stored in the table
+ * and the caller provides the full 64 bit hash value (eg: siphash()).
+ * During a resize each node is in exactly one of the two bucket arrays:
+ * in the new one if its bucket in the old one has been moved already,
+ * otherwise in the old one.
+ * @{
+ */
+
+/** Number of buckets that are moved to the new table on each
+ * hash table operation during a resize.
+ */
+#define HASHTABLE_REHASH_STEP	8
+
+/** Initialize a hash table.
+ * @param ht		The hash table
+ * @param name		Name of the hash table, shown in /STATS hash
+ * @param min_size	Initial number of buckets, must be a power of two.
+ *			The table never shrinks below this.
+ */
+void hashtable_init(HashTable *ht, const char *name, unsigned int min_size)
+{
+	memset(ht, 0, sizeof(HashTable));
+	ht->name = name;
+	ht->min_size = min_size;
+	ht->size[0] = min_size;
+	ht->table[0] = safe_alloc(sizeof(HashNode *) * min_size);
+	ht->rehash_index = -1;
+}
+
+/* Returns the bucket where a node with hash value 'hashv' lives */
+static inline HashNode **hashtable_bucket(HashTable *ht, uint64_t hashv)
+{
+	uint64_t b = hashv & (ht->size[0] - 1);
+
+	if ((ht->rehash_index >= 0) && (b < (uint64_t)ht->rehash_index))
+		return &ht->table[1][hashv & (ht->size[1] - 1)];
+	return &ht->table[0][b];
+}
+
+static inline void hashnode_link(HashNode **bucket, HashNode *node)
+{
+	node->next = *bucket;
+	if (node->next)
+		node->next->pprev = &node->next;
+	node->pprev = bucket;
+	*bucket = node;
+}
+
+static void hashtable_start_resize(HashTable *ht, unsigned int size)
+{
+	ht->size[1] = size;
+	ht->table[1] = safe_alloc(sizeof(HashNode *) * size);
+	ht->rehash_index = 0;
+	ht->resizes++;
+}
+
+/* Move a few buckets from the old to the new table, if resizing */
+static void hashtable_rehash_step(HashTable *ht)
+{
+	HashNode *node, *next;
+	int n;
+
+	if ((ht->rehash_index < 0) || ht->paused)
+		return;
+
+	for (n = 0; (n < HASHTABLE_REHASH_STEP) && (ht->rehash_index < ht->size[0]); n++, ht->rehash_index++)
+	{
+		for (node = ht->table[0][ht->rehash_index]; node; node = next)
+		{
+			next = node->next;
+			hashnode_link(&ht->table[1][node->hashv & (ht->size[1] - 1)], node);
+		}
+		ht->table[0][ht->rehash_index] = NULL;
+	}
+
+	if (ht->rehash_index == ht->size[0])
+	{
+		/* Done, the new table becomes the main table */
+		safe_free(ht->table[0]);
+		ht->table[0] = ht->table[1];
+		ht->size[0] = ht->size[1];
+		ht->table[1] = NULL;
+		ht->size[1] = 0;
+		ht->rehash_index = -1;
+	}
+}
+
+/** Add a node to a hash table.
+ * @param ht		The hash table
+ * @param node		The node, which may not be in any table already
+ * @param hashv		The hash value of the key
+ */
+void hashtable_add(HashTable *ht, HashNode *node, uint64_t hashv)
+{
+	hashtable_rehash_step(ht);
+	node->hashv = hashv;
+	hashnode_link(hashtable_bucket(ht, hashv), node);
+	ht->count++;
+	if ((ht->rehash_index < 0) && (ht->count > ht->size[0]))
+		hashtable_start_resize(ht, ht->size[0] * 2);
+}
+
+/** Delete a node from a hash table.
+ * It is safe to call this for a node that is not in the table.
+ * This may be called from a hashtable_foreach() callback.
+ */
+void hashtable_del(HashTable *ht, HashNode *node)
+{
+	if (!node->pprev)
+		return; /* not in the table */
+
+	*node->pprev = node->next;
+	if (node->next)
+		node->next->pprev = node->pprev;
+	node->next = NULL;
+	node->pprev = NULL;
+	ht->count--;
+
+	hashtable_rehash_step(ht);
+	if ((ht->rehash_index < 0) && (ht->size[0] > ht->min_size) && (ht->count < ht->size[0] / 8))
+		hashtable_start_resize(ht, ht->size[0] / 2);
+}
+
+/** Find the first node with hash value 'hashv'.
+ * The caller must still compare the key, since different keys
+ * could have the same hash value. Normally you use this via
+ * the hashtable_for_each_match() macro.
+ */
+HashNode *hashtable_find_first(HashTable *ht, uint64_t hashv)
+{
+	HashNode *node;
+
+	hashtable_rehash_step(ht);
+	for (node = *hashtable_bucket(ht, hashv); node; node = node->next)
+		if (node->hashv == hashv)
+			return node;
+	return NULL;
+}
+
+/** Find the next node with the same hash value as 'node' */
+HashNode *hashtable_find_next(HashNode *node)
+{
+	uint64_t hashv = node->hashv;
+
+	for (node = node->next; node; node = node->next)
+		if (node->hashv == hashv)
+			return node;
+	return NULL;
+}
+
+/** Call 'fn' for every node in the hash table.
+ * The callback may delete the node it is called for, but
+ * it may not add nodes. Resizing is paused during the walk.
+ * @returns 0 if all nodes were walked, otherwise the non-zero
+ *          value that was returned by the callback (which stops the walk).
+ */
+int hashtable_foreach(HashTable *ht, HashTableCallback fn, void *data)
+{
+	HashNode *node, *next;
+	unsigned int i;
+	int t, ret = 0;
+
+	ht->paused++;
+	for (t = 0; (t < 2) && !ret; t++)
+	{
+		for (i = 0; (i < ht->size[t]) && !ret; i++)
+		{
+			for (node = ht->table[t][i]; node && !ret; node = next)
+			{
+				next = node->next;
+				ret = fn(node, data);
+			}
+		}
+	}
+	ht->paused--;
+	return ret;
+}
+
+static unsigned long reverse_bits(unsigned long v)
+{
+	unsigned long s = CHAR_BIT * sizeof(v);
+	unsigned long mask = ~0UL;
+
+	while ((s >>= 1) > 0)
+	{
+		mask ^= (mask << s);
+		v = ((v >> s) & mask) | ((v << s) & ~mask);
+	}
+	return v;
+}
+
+static void hashtable_scan_bucket(HashNode *node, HashTableCallback fn, void *data)
+{
+	HashNode *next;
+
+	for (; node; node = next)
+	{
+		next = node->next;
+		fn(node, data);
+	}
+}
+
+/** Walk a hash table in steps, for walks that are spread over time.
+ * Start with a cursor of 0 and call this again with the returned
+ * cursor, until it returns 0. Each call visits one (or a few)
+ * buckets. Entries that are in the table during the entire walk
+ * are guaranteed to be visited, even if the table is resized in
+ * between. An entry may be visited twice if the table shrinks.
+ * This uses the reverse binary cursor technique from Redis' SCAN.
+ * @param ht		The hash table
+ * @param cursor	The cursor, 0 on the first call
+ * @param fn		Callback, the return value is ignored
+ * @param data		Passed to the callback
+ * @returns The cursor for the next call, or 0 if done.
+ */
+unsigned long hashtable_scan(HashTable *ht, unsigned long cursor, HashTableCallback fn, void *data)
+{
+	HashNode **t0, **t1;
+	unsigned long m0, m1;
+
+	ht->paused++;
+	if (ht->rehash_index < 0)
+	{
+		m0 = ht->size[0] - 1;
+		hashtable_scan_bucket(ht->table[0][cursor & m0], fn, data);
+		cursor |= ~m0;
+		cursor = reverse_bits(cursor);
+		cursor++;
+		cursor = reverse_bits(cursor);
+	} else {
+		/* Resizing: t0 is the smaller table, t1 the larger one */
+		if (ht->size[0] <= ht->size[1])
+		{
+			t0 = ht->table[0];
+			m0 = ht->size[0] - 1;
+			t1 = ht->table[1];
+			m1 = ht->size[1] - 1;
+		} else {
+			t0 = ht->table[1];
+			m0 = ht->size[1] - 1;
+			t1 = ht->table[0];
+			m1 = ht->size[0] - 1;
+		}
+		hashtable_scan_bucket(t0[cursor & m0], fn, data);
+		/* Visit all buckets in the larger table that expand from this one */
+		do {
+			hashtable_scan_bucket(t1[cursor & m1], fn, data);
+			cursor |= ~m1;
+			cursor = reverse_bits(cursor);
+			cursor++;
+			cursor = reverse_bits(cursor);
+		} while (cursor & (m0 ^ m1));
+	}
+	ht->paused--;
+	return cursor;
+}
+
+/** Send statistics about a hash table to a client, for /STATS hash */
+static void hashtable_report(Client *client, HashTable *ht)
+{
+	HashNode *node;
+	unsigned int i, len, used = 0, longest = 0;
+	int t;
+
+	for (t = 0; t < 2; t++)
+	{
+		for (i = 0; i < ht->size[t]; i++)
+		{
+			if (!ht->table[t][i])
+				continue;
+			used++;
+			for (len = 0, node = ht->table[t][i]; node; node = node->next)
+				len++;
+			if (len > longest)
+				longest = len;
+		}
+	}
+
+	sendtxtnumeric(client, "%s: %u entries, %u buckets (%u used), load factor %.2f, "
+	                       "average chain %.2f, longest chain %u, %lu resizes%s",
+	               ht->name, ht->count, ht->size[0] + ht->size[1], used,
+	               (double)ht->count / ht->size[0],
+	               used ? (double)ht->count / used : 0.0,
+	               longest, ht->resizes,
+	               (ht->rehash_index >= 0) ? ", resize in progress" : "");
+}
+
+/** @} */
+
+static HashTable clientTable;
+static HashTable idTable;
+static HashTable channelTable;
+
+MODVAR HashTable whowasTable;
+MODVAR HashTable throttlingTable;
+MODVAR HashTable ipusersTable_ipv4;
+MODVAR HashTable ipusersTable_ipv6;
 
 static char siphashkey_nick[SIPHASH_KEY_LENGTH];
 static char siphashkey_chan[SIPHASH_KEY_LENGTH];
@@ -272,23 +573,20 @@ extern char unreallogo[];
 /** Initialize all hash tables */
 void init_hash(void)
 {
-	int i;
-
 	siphash_generate_key(siphashkey_nick);
 	siphash_generate_key(siphashkey_chan);
 	siphash_generate_key(siphashkey_whowas);
 	siphash_generate_key(siphashkey_throttling);
 	siphash_generate_key(siphashkey_ipusers);
 
-	for (i = 0; i < NICK_HASH_TABLE_SIZE; i++)
-		INIT_LIST_HEAD(&clientTable[i]);
+	hashtable_init(&clientTable, "Client names", NICK_HASH_TABLE_SIZE);
+	hashtable_init(&idTable, "Client IDs", NICK_HASH_TABLE_SIZE);
+	hashtable_init(&channelTable, "Channels", CHAN_HASH_TABLE_SIZE);
+	hashtable_init(&whowasTable, "Whowas", WHOWAS_HASH_TABLE_SIZE);
+	hashtable_init(&ipusersTable_ipv4, "IP users (IPv4)", IPUSERS_HASH_TABLE_SIZE);
+	hashtable_init(&ipusersTable_ipv6, "IP users (IPv6)", IPUSERS_HASH_TABLE_SIZE);
 
-	for (i = 0; i < NICK_HASH_TABLE_SIZE; i++)
-		INIT_LIST_HEAD(&idTable[i]);
-
-	memset(channelTable, 0, sizeof(channelTable));
-
-	memset(ThrottlingHash, 0, sizeof(ThrottlingHash));
+	hashtable_init(&throttlingTable, "Connect-flood", THROTTLING_HASH_TABLE_SIZE);
 	/* do not call init_throttling() here, as
 	 * config file has not been read yet.
 	 * The hash table is ready, anyway.
@@ -298,19 +596,32 @@ void init_hash(void)
 		loop.tainted = 1;
 }
 
+/** Send statistics about all the core hash tables, for /STATS hash */
+void report_hash_tables(Client *client)
+{
+	hashtable_report(client, &clientTable);
+	hashtable_report(client, &idTable);
+	hashtable_report(client, &channelTable);
+	hashtable_report(client, &whowasTable);
+	hashtable_report(client, &throttlingTable);
+	hashtable_report(client, &ipusersTable_ipv4);
+	hashtable_report(client, &ipusersTable_ipv6);
+	hashtable_report(client, &commandTable);
+}
+
 uint64_t hash_client_name(const char *name)
 {
-	return siphash_nocase(name, siphashkey_nick) % NICK_HASH_TABLE_SIZE;
+	return siphash_nocase(name, siphashkey_nick);
 }
 
 uint64_t hash_channel_name(const char *name)
 {
-	return siphash_nocase(name, siphashkey_chan) % CHAN_HASH_TABLE_SIZE;
+	return siphash_nocase(name, siphashkey_chan);
 }
 
 uint64_t hash_whowas_name(const char *name)
 {
-	return siphash_nocase(name, siphashkey_whowas) % WHOWAS_HASH_TABLE_SIZE;
+	return siphash_nocase(name, siphashkey_whowas);
 }
 
 /*
@@ -318,7 +629,6 @@ uint64_t hash_whowas_name(const char *name)
  */
 int add_to_client_hash_table(const char *name, Client *client)
 {
-	unsigned int hashv;
 	/*
 	 * If you see this, you have probably found your way to why changing the 
 	 * base version made the IRCd become weird. This has been the case in all
@@ -334,8 +644,7 @@ int add_to_client_hash_table(const char *name, Client *client)
 	*/
 	if (loop.tainted)
 		return 0;
-	hashv = hash_client_name(name);
-	list_add(&client->client_hash, &clientTable[hashv]);
+	hashtable_add(&clientTable, &client->client_hash, hash_client_name(name));
 	return 0;
 }
 
@@ -344,9 +653,7 @@ int add_to_client_hash_table(const char *name, Client *client)
  */
 int add_to_id_hash_table(const char *name, Client *client)
 {
-	unsigned int hashv;
-	hashv = hash_client_name(name);
-	list_add(&client->id_hash, &idTable[hashv]);
+	hashtable_add(&idTable, &client->id_hash, hash_client_name(name));
 	return 0;
 }
 
@@ -355,11 +662,7 @@ int add_to_id_hash_table(const char *name, Client *client)
  */
 int add_to_channel_hash_table(const char *name, Channel *channel)
 {
-	unsigned int hashv;
-
-	hashv = hash_channel_name(name);
-	channel->hnextch = channelTable[hashv];
-	channelTable[hashv] = channel;
+	hashtable_add(&channelTable, &channel->channel_hash, hash_channel_name(name));
 	return 0;
 }
 /*
@@ -367,21 +670,13 @@ int add_to_channel_hash_table(const char *name, Channel *channel)
  */
 int del_from_client_hash_table(const char *name, Client *client)
 {
-	if (!list_empty(&client->client_hash))
-		list_del(&client->client_hash);
-
-	INIT_LIST_HEAD(&client->client_hash);
-
+	hashtable_del(&clientTable, &client->client_hash);
 	return 0;
 }
 
 int del_from_id_hash_table(const char *name, Client *client)
 {
-	if (!list_empty(&client->id_hash))
-		list_del(&client->id_hash);
-
-	INIT_LIST_HEAD(&client->id_hash);
-
+	hashtable_del(&idTable, &client->id_hash);
 	return 0;
 }
 
@@ -390,24 +685,7 @@ int del_from_id_hash_table(const char *name, Client *client)
  */
 void del_from_channel_hash_table(const char *name, Channel *channel)
 {
-	Channel *tmp, *prev = NULL;
-	unsigned int hashv;
-
-	hashv = hash_channel_name(name);
-	for (tmp = channelTable[hashv]; tmp; tmp = tmp->hnextch)
-	{
-		if (tmp == channel)
-		{
-			if (prev)
-				prev->hnextch = tmp->hnextch;
-			else
-				channelTable[hashv] = tmp->hnextch;
-			tmp->hnextch = NULL;
-			return; /* DONE */
-		}
-		prev = tmp;
-	}
-	return; /* NOTFOUND */
+	hashtable_del(&channelTable, &channel->channel_hash);
 }
 
 /*
@@ -415,12 +693,12 @@ void del_from_channel_hash_table(const char *name, Channel *channel)
  */
 Client *hash_find_client(const char *name, Client *client)
 {
+	HashNode *n;
 	Client *tmp;
-	unsigned int hashv;
 
-	hashv = hash_client_name(name);
-	list_for_each_entry(tmp, &clientTable[hashv], client_hash)
+	hashtable_for_each_match(&clientTable, n, hash_client_name(name))
 	{
+		tmp = container_of(n, Client, client_hash);
 		if (smycmp(name, tmp->name) == 0)
 			return tmp;
 	}
@@ -430,12 +708,12 @@ Client *hash_find_client(const char *name, Client *client)
 
 Client *hash_find_id(const char *name, Client *client)
 {
+	HashNode *n;
 	Client *tmp;
-	unsigned int hashv;
 
-	hashv = hash_client_name(name);
-	list_for_each_entry(tmp, &idTable[hashv], id_hash)
+	hashtable_for_each_match(&idTable, n, hash_client_name(name))
 	{
+		tmp = container_of(n, Client, id_hash);
 		if (smycmp(name, tmp->id) == 0)
 			return tmp;
 	}
@@ -476,12 +754,12 @@ Client *hash_find_nickatserver(const char *str, Client *def)
  */
 Client *hash_find_server(const char *server, Client *def)
 {
+	HashNode *n;
 	Client *tmp;
-	unsigned int hashv;
 
-	hashv = hash_client_name(server);
-	list_for_each_entry(tmp, &clientTable[hashv], client_hash)
+	hashtable_for_each_match(&clientTable, n, hash_client_name(server))
 	{
+		tmp = container_of(n, Client, client_hash);
 		if (!IsServer(tmp) && !IsMe(tmp))
 			continue;
 		if (smycmp(server, tmp->name) == 0)
@@ -569,25 +847,27 @@ Client *find_user(const char *name, Client *requester)
  */
 Channel *find_channel(const char *name)
 {
-	unsigned int hashv;
+	HashNode *n;
 	Channel *channel;
 
-	hashv = hash_channel_name(name);
-
-	for (channel = channelTable[hashv]; channel; channel = channel->hnextch)
+	hashtable_for_each_match(&channelTable, n, hash_channel_name(name))
+	{
+		channel = container_of(n, Channel, channel_hash);
 		if (smycmp(name, channel->name) == 0)
 			return channel;
+	}
 
 	return NULL;
 }
 
 /** @} */
 
-Channel *hash_get_chan_bucket(uint64_t hashv)
+/** Walk the channel hash table in steps, see hashtable_scan().
+ * This is used by /LIST to send the channel list in parts.
+ */
+unsigned long hash_scan_channels(unsigned long cursor, HashTableCallback fn, void *data)
 {
-	if (hashv > CHAN_HASH_TABLE_SIZE)
-		return NULL;
-	return channelTable[hashv];
+	return hashtable_scan(&channelTable, cursor, fn, data);
 }
 
 /** Find a server by the SID-part of a UID.
@@ -612,8 +892,6 @@ Client *find_server_by_uid(const char *uid)
 
 /* Note that we call this set::anti-flood::connect-flood nowadays */
 
-struct MODVAR ThrottlingBucket *ThrottlingHash[THROTTLING_HASH_TABLE_SIZE];
-
 void update_throttling_timer_settings(void)
 {
 	long v;
@@ -639,17 +917,17 @@ void update_throttling_timer_settings(void)
 
 uint64_t hash_throttling(const char *ip)
 {
-	return siphash(ip, siphashkey_throttling) % THROTTLING_HASH_TABLE_SIZE;
+	return siphash(ip, siphashkey_throttling);
 }
 
 struct ThrottlingBucket *find_throttling_bucket(Client *client)
 {
-	int hash = 0;
+	HashNode *n;
 	struct ThrottlingBucket *p;
-	hash = hash_throttling(client->ip);
-	
-	for (p = ThrottlingHash[hash]; p; p = p->next)
+
+	hashtable_for_each_match(&throttlingTable, n, hash_throttling(client->ip))
 	{
+		p = container_of(n, struct ThrottlingBucket, hash);
 		if (!strcmp(p->ip, client->ip))
 			return p;
 	}
@@ -657,25 +935,24 @@ struct ThrottlingBucket *find_throttling_bucket(Client *client)
 	return NULL;
 }
 
-EVENT(throttling_check_expire)
+static int throttling_expire_bucket(HashNode *node, void *data)
 {
-	struct ThrottlingBucket *n, *n_next;
-	int	i;
-	static time_t t = 0;
-		
-	for (i = 0; i < THROTTLING_HASH_TABLE_SIZE; i++)
+	struct ThrottlingBucket *n = container_of(node, struct ThrottlingBucket, hash);
+
+	if ((TStime() - n->since) > (THROTTLING_PERIOD ? THROTTLING_PERIOD : 15))
 	{
-		for (n = ThrottlingHash[i]; n; n = n_next)
-		{
-			n_next = n->next;
-			if ((TStime() - n->since) > (THROTTLING_PERIOD ? THROTTLING_PERIOD : 15))
-			{
-				DelListItem(n, ThrottlingHash[i]);
-				safe_free(n->ip);
-				safe_free(n);
-			}
-		}
+		hashtable_del(&throttlingTable, &n->hash);
+		safe_free(n->ip);
+		safe_free(n);
 	}
+	return 0;
+}
+
+EVENT(throttling_check_expire)
+{
+	static time_t t = 0;
+
+	hashtable_foreach(&throttlingTable, throttling_expire_bucket, NULL);
 
 	if (!t || (TStime() - t > 30))
 	{
@@ -702,16 +979,13 @@ EVENT(throttling_check_expire)
 
 void add_throttling_bucket(Client *client)
 {
-	int hash;
 	struct ThrottlingBucket *n;
 
 	n = safe_alloc(sizeof(struct ThrottlingBucket));
-	n->next = n->prev = NULL; 
 	safe_strdup(n->ip, client->ip);
 	n->since = TStime();
 	n->count = 1;
-	hash = hash_throttling(client->ip);
-	AddListItem(n, ThrottlingHash[hash]);
+	hashtable_add(&throttlingTable, &n->hash, hash_throttling(client->ip));
 	return;
 }
 
@@ -743,32 +1017,34 @@ int throttle_can_connect(Client *client)
 
 /**** IP users hash table *****/
 
-MODVAR IpUsersBucket *IpUsersHash_ipv4[IPUSERS_HASH_TABLE_SIZE];
-MODVAR IpUsersBucket *IpUsersHash_ipv6[IPUSERS_HASH_TABLE_SIZE];
-
 uint64_t hash_ipusers(const char *ip)
 {
-	return siphash(ip, siphashkey_ipusers) % IPUSERS_HASH_TABLE_SIZE;
+	return siphash(ip, siphashkey_ipusers);
 }
 
 IpUsersBucket *find_ipusers_bucket(Client *client)
 {
-	int hash = 0;
+	HashNode *n;
 	IpUsersBucket *p;
 	struct sockaddr *addr;
 
 	addr = raw_client_ip(client);
-	hash = hash_ipusers(client->ip);
 
 	if (addr->sa_family == AF_INET6)
 	{
-		for (p = IpUsersHash_ipv6[hash]; p; p = p->next)
+		hashtable_for_each_match(&ipusersTable_ipv6, n, hash_ipusers(client->ip))
+		{
+			p = container_of(n, IpUsersBucket, hash);
 			if (memcmp(p->rawip, &((struct sockaddr_in6 *)addr)->sin6_addr.s6_addr, 16) == 0)
 				return p;
+		}
 	} else {
-		for (p = IpUsersHash_ipv4[hash]; p; p = p->next)
+		hashtable_for_each_match(&ipusersTable_ipv4, n, hash_ipusers(client->ip))
+		{
+			p = container_of(n, IpUsersBucket, hash);
 			if (memcmp(p->rawip, &((struct sockaddr_in *)addr)->sin_addr.s_addr, 4) == 0)
 				return p;
+		}
 	}
 
 	return NULL;
@@ -776,30 +1052,26 @@ IpUsersBucket *find_ipusers_bucket(Client *client)
 
 IpUsersBucket *add_ipusers_bucket(Client *client)
 {
-	int hash;
 	IpUsersBucket *n;
 	struct sockaddr *addr;
 
 	addr = raw_client_ip(client);
-	hash = hash_ipusers(client->ip);
 
 	n = safe_alloc(sizeof(IpUsersBucket));
 	if (addr->sa_family == AF_INET6)
 	{
 		memcpy(n->rawip, &((struct sockaddr_in6 *)addr)->sin6_addr.s6_addr, 16);
-		AddListItem(n, IpUsersHash_ipv6[hash]);
+		hashtable_add(&ipusersTable_ipv6, &n->hash, hash_ipusers(client->ip));
 	} else {
 		memcpy(n->rawip, &((struct sockaddr_in *)addr)->sin_addr.s_addr, 4);
-		AddListItem(n, IpUsersHash_ipv4[hash]);
+		hashtable_add(&ipusersTable_ipv4, &n->hash, hash_ipusers(client->ip));
 	}
 	return n;
 }
 
 void decrease_ipusers_bucket(Client *client)
 {
-	int hash = 0;
 	IpUsersBucket *p;
-	struct sockaddr *addr;
 	char ipv6 = 0;
 
 	if (!(client->flags & CLIENT_FLAG_IPUSERS_BUMPED))
@@ -807,22 +1079,9 @@ void decrease_ipusers_bucket(Client *client)
 
 	client->flags &= ~CLIENT_FLAG_IPUSERS_BUMPED;
 
-	addr = raw_client_ip(client);
-	hash = hash_ipusers(client->ip);
-
-	ipv6 = addr->sa_family == AF_INET6 ? 1 : 0;
-
-	if (ipv6)
-	{
-		for (p = IpUsersHash_ipv6[hash]; p; p = p->next)
-			if (memcmp(p->rawip, &((struct sockaddr_in6 *)addr)->sin6_addr.s6_addr, 16) == 0)
-				break;
-	} else {
-		for (p = IpUsersHash_ipv4[hash]; p; p = p->next)
-			if (memcmp(p->rawip, &((struct sockaddr_in *)addr)->sin_addr.s_addr, 4) == 0)
-				break;
-	}
+	ipv6 = raw_client_ip(client)->sa_family == AF_INET6 ? 1 : 0;
 
+	p = find_ipusers_bucket(client);
 	if (!p)
 	{
 		unreal_log(ULOG_INFO, "user", "BUG_DECREASE_IPUSERS_BUCKET", client,
@@ -837,9 +1096,9 @@ void decrease_ipusers_bucket(Client *client)
 	if ((p->global_clients == 0) && (p->local_clients == 0))
 	{
 		if (ipv6)
-			DelListItem(p, IpUsersHash_ipv6[hash]);
+			hashtable_del(&ipusersTable_ipv6, &p->hash);
 		else
-			DelListItem(p, IpUsersHash_ipv4[hash]);
+			hashtable_del(&ipusersTable_ipv4, &p->hash);
 		safe_free(p);
 	}
 	return;
@@ -0,0 +1,359 @@
+/************************************************************************
+ * UnrealIRCd I/O threads, src/io_threads.c
+ * (C) 2026-.. Bram Matthys (Syzop) and the UnrealIRCd Team
+ * License: GPLv2 or later
+ */
+
+#include "unrealircd.h"
+
+/** @file
+ * @brief Optional I/O threads, see set::io-threads.
+ *
+ * When enabled, the actual socket reads and writes of clients
+ * (recv/send and SSL_read/SSL_write, thus including all the TLS
+ * encryption and decryption) are done by a pool of threads.
+ * Everything else, such as running the RAWPACKET_IN hooks, line
+ * framing, executing commands and all sendQ/recvQ bookkeeping
+ * stays on the main thread, like it always did.
+ *
+ * This works in phases, once per SocketLoop() iteration:
+ * 1. During fd_select() the read_packet() and send_queued_cb()
+ *    callbacks only queue a job via io_threads_queue().
+ *    The jobs are sharded by file descriptor, so a client is
+ *    always handled by the same thread.
+ * 2. io_threads_run() wakes up the threads, each one processing
+ *    its own shard, and waits until they are all done.
+ *    During this time the main thread does not touch any client,
+ *    so no locking is needed for the clients themselves.
+ * 3. The main thread processes the results: first all the writes
+ *    (so the sendQ is up to date) and then all the reads.
+ */
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <signal.h>
+
+/** Size of the read buffer for each read job */
+#define IOTHREADS_READ_SIZE		(BUFSIZE*4)
+
+/** If there are fewer jobs than this then we don't bother
+ * waking up the threads and simply do the jobs ourselves.
+ */
+#define IOTHREADS_MIN_JOBS		8
+
+typedef struct IOJob IOJob;
+struct IOJob {
+	Client *client;
+	IOJobType type;
+	int skip;		/**< Client died between queueing and running the job */
+	int result;		/**< Return value of read_packet_raw() or send_queued_raw() */
+	int want;		/**< IOJOB_READ: 'want' from read_packet_raw(), IOJOB_WRITE: 'want_read' */
+	int saved_errno;	/**< The errno value directly after the I/O call */
+	int bufoffset;		/**< IOJOB_READ: offset in the readbuf of the thread */
+};
+
+typedef struct IOThread IOThread;
+struct IOThread {
+	pthread_t thread;
+	IOJob *jobs;		/**< Jobs for this thread (shard) */
+	int num_jobs;		/**< Number of jobs in 'jobs' */
+	int max_jobs;		/**< Number of jobs allocated in 'jobs' */
+	int num_reads;		/**< Number of IOJOB_READ jobs */
+	char *readbuf;		/**< Read buffer, IOTHREADS_READ_SIZE bytes per read job */
+	int readbuf_jobs;	/**< Number of read jobs that 'readbuf' has room for */
+};
+
+/* Forward declarations */
+static void io_threads_setup(int count);
+
+/* Variables */
+static IOThread *io_threads = NULL;
+static int num_io_threads = 0;
+static int io_threads_configured = 0;	/**< set::io-threads we last acted upon */
+static int io_threads_num_jobs = 0;
+static pthread_mutex_t io_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_threads_start_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t io_threads_done_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long io_threads_generation = 0;
+static int io_threads_busy = 0;
+static int io_threads_shutdown = 0;
+
+/** Can the I/O of this TLS client be done by an I/O thread?
+ * We only do this for fully established TLSv1.3 sessions.
+ * TLSv1.2 and older allow renegotiation, which may call our
+ * TLS callbacks (SNI, verify) and those are not thread-safe.
+ */
+static int io_threads_tls_ok(Client *client)
+{
+	if (!client->local->ssl || !SSL_is_init_finished(client->local->ssl))
+		return 0;
+#ifdef TLS1_3_VERSION
+	if (SSL_version(client->local->ssl) >= TLS1_3_VERSION)
+		return 1;
+#endif
+	return 0;
+}
+
+/** Queue an I/O job for an I/O thread.
+ * Called from read_packet() and send_queued_cb().
+ * @param client	The client
+ * @param type		The type of job: IOJOB_READ or IOJOB_WRITE
+ * @returns 1 if the job is queued (the caller should do nothing),
+ *          0 if the caller should do the I/O itself (I/O threads are
+ *          disabled or this client is not eligible).
+ */
+int io_threads_queue(Client *client, IOJobType type)
+{
+	IOThread *t;
+	IOJob *j;
+
+	if ((num_io_threads == 0) || !client->local || (client->local->fd < 0) || IsDeadSocket(client))
+		return 0;
+
+	if (client->local->io_jobs & type)
+		return 1; /* already queued */
+
+	if (IsTLS(client) && !io_threads_tls_ok(client))
+		return 0;
+
+	t = &io_threads[client->local->fd % num_io_threads];
+	if (t->num_jobs == t->max_jobs)
+	{
+		t->max_jobs = t->max_jobs ? t->max_jobs * 2 : 64;
+		t->jobs = safe_realloc(t->jobs, sizeof(IOJob) * t->max_jobs);
+	}
+	j = &t->jobs[t->num_jobs++];
+	memset(j, 0, sizeof(IOJob));
+	j->client = client;
+	j->type = type;
+	if (type == IOJOB_READ)
+		j->bufoffset = IOTHREADS_READ_SIZE * t->num_reads++;
+
+	client->local->io_jobs |= type;
+	io_threads_num_jobs++;
+	return 1;
+}
+
+/** Do all the jobs of an I/O thread.
+ * This is called from the I/O thread itself (or from the main thread
+ * if there are only a few jobs). It may not touch anything but the
+ * socket and the job itself.
+ */
+static void io_thread_do_jobs(IOThread *t)
+{
+	IOJob *j;
+	int i;
+
+	for (i = 0; i < t->num_jobs; i++)
+	{
+		j = &t->jobs[i];
+		if (j->skip)
+			continue;
+		SET_ERRNO(0);
+		if (j->type == IOJOB_READ)
+			j->result = read_packet_raw(j->client, t->readbuf + j->bufoffset, IOTHREADS_READ_SIZE, &j->want);
+		else
+			j->result = send_queued_raw(j->client, &j->want);
+		j->saved_errno = ERRNO;
+	}
+}
+
+/** The main function of each I/O thread */
+static void *io_thread_main(void *arg)
+{
+	IOThread *t = arg;
+	unsigned long generation = 0;
+
+	while (1)
+	{
+		pthread_mutex_lock(&io_threads_lock);
+		while ((generation == io_threads_generation) && !io_threads_shutdown)
+			pthread_cond_wait(&io_threads_start_cond, &io_threads_lock);
+		if (io_threads_shutdown)
+		{
+			pthread_mutex_unlock(&io_threads_lock);
+			return NULL;
+		}
+		generation = io_threads_generation;
+		pthread_mutex_unlock(&io_threads_lock);
+
+		io_thread_do_jobs(t);
+
+		pthread_mutex_lock(&io_threads_lock);
+		if (--io_threads_busy == 0)
+			pthread_cond_signal(&io_threads_done_cond);
+		pthread_mutex_unlock(&io_threads_lock);
+	}
+	return NULL;
+}
+
+/** Prepare the jobs before handing them to the threads (main thread).
+ * Makes sure the read buffers are large enough and marks jobs of
+ * clients that died in the meantime as 'skip'.
+ */
+static void io_threads_prepare(void)
+{
+	IOThread *t;
+	IOJob *j;
+	int i, n;
+
+	for (n = 0; n < num_io_threads; n++)
+	{
+		t = &io_threads[n];
+		if (t->num_reads > t->readbuf_jobs)
+		{
+			t->readbuf_jobs = t->num_reads;
+			safe_free(t->readbuf);
+			t->readbuf = safe_alloc(IOTHREADS_READ_SIZE * t->readbuf_jobs);
+		}
+		for (i = 0; i < t->num_jobs; i++)
+		{
+			j = &t->jobs[i];
+			if ((j->client->local->fd < 0) || IsDeadSocket(j->client))
+				j->skip = 1;
+		}
+	}
+}
+
+/** Run all the queued I/O jobs and process the results.
+ * This is called from SocketLoop() after fd_select().
+ */
+void io_threads_run(void)
+{
+	IOThread *t;
+	IOJob *j;
+	int i, n;
+
+	if (io_threads_num_jobs > 0)
+	{
+		io_threads_prepare();
+
+		if (io_threads_num_jobs < IOTHREADS_MIN_JOBS)
+		{
+			for (n = 0; n < num_io_threads; n++)
+				io_thread_do_jobs(&io_threads[n]);
+		} else {
+			pthread_mutex_lock(&io_threads_lock);
+			io_threads_busy = num_io_threads;
+			io_threads_generation++;
+			pthread_cond_broadcast(&io_threads_start_cond);
+			while (io_threads_busy > 0)
+				pthread_cond_wait(&io_threads_done_cond, &io_threads_lock);
+			pthread_mutex_unlock(&io_threads_lock);
+		}
+
+		/* All threads are done. Clear the job flags first,
+		 * since processing the results may queue new jobs.
+		 */
+		for (n = 0; n < num_io_threads; n++)
+		{
+			t = &io_threads[n];
+			for (i = 0; i < t->num_jobs; i++)
+				t->jobs[i].client->local->io_jobs = 0;
+		}
+
+		/* First process the writes, this removes the written
+		 * data from the sendQ. This has to be done before
+		 * anything else could (directly) call send_queued().
+		 */
+		for (n = 0; n < num_io_threads; n++)
+		{
+			t = &io_threads[n];
+			for (i = 0; i < t->num_jobs; i++)
+			{
+				j = &t->jobs[i];
+				if ((j->type == IOJOB_WRITE) && !j->skip)
+					send_queued_completed(j->client, j->result, j->want, j->saved_errno);
+			}
+		}
+
+		/* Now process the reads, this will parse and execute commands */
+		for (n = 0; n < num_io_threads; n++)
+		{
+			t = &io_threads[n];
+			for (i = 0; i < t->num_jobs; i++)
+			{
+				j = &t->jobs[i];
+				if ((j->type == IOJOB_READ) && !j->skip)
+					read_packet_completed(j->client, t->readbuf + j->bufoffset, j->result, j->want, j->saved_errno);
+			}
+			t->num_jobs = 0;
+			t->num_reads = 0;
+		}
+		io_threads_num_jobs = 0;
+	}
+
+	/* Start or stop threads if set::io-threads changed */
+	if (iConf.io_threads != io_threads_configured)
+		io_threads_setup(iConf.io_threads);
+}
+
+/** Stop all I/O threads (if any) and start 'count' new ones.
+ * May only be called when there are no jobs queued.
+ */
+static void io_threads_setup(int count)
+{
+	sigset_t newmask, oldmask;
+	int n;
+
+	/* Remember this, rather than comparing against num_io_threads,
+	 * so we don't try again on every loop if we could not start all
+	 * of them (and so iConf keeps showing what was configured).
+	 */
+	io_threads_configured = count;
+
+	if (num_io_threads > 0)
+	{
+		pthread_mutex_lock(&io_threads_lock);
+		io_threads_shutdown = 1;
+		pthread_cond_broadcast(&io_threads_start_cond);
+		pthread_mutex_unlock(&io_threads_lock);
+		for (n = 0; n < num_io_threads; n++)
+		{
+			pthread_join(io_threads[n].thread, NULL);
+			safe_free(io_threads[n].jobs);
+			safe_free(io_threads[n].readbuf);
+		}
+		safe_free(io_threads);
+		num_io_threads = 0;
+		io_threads_shutdown = 0;
+	}
+
+	if (count <= 0)
+		return;
+
+	/* Signals should only be handled by the main thread */
+	sigfillset(&newmask);
+	pthread_sigmask(SIG_BLOCK, &newmask, &oldmask);
+
+	io_threads = safe_alloc(sizeof(IOThread) * count);
+	for (n = 0; n < count; n++)
+	{
+		if (pthread_create(&io_threads[n].thread, NULL, io_thread_main, &io_threads[n]) != 0)
+		{
+			unreal_log(ULOG_ERROR, "io", "IO_THREADS_CREATE_FAILED", NULL,
+			           "Could not create I/O thread: $system_error. "
+			           "Running with $count I/O thread(s) instead of $wanted_count.",
+			           log_data_string("system_error", strerror(errno)),
+			           log_data_integer("count", n),
+			           log_data_integer("wanted_count", count));
+			break;
+		}
+	}
+	num_io_threads = n;
+	if (num_io_threads == 0)
+		safe_free(io_threads);
+
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+}
+#else
+/* I/O threads are not supported on Windows */
+int io_threads_queue(Client *client, IOJobType type)
+{
+	return 0;
+}
+
+void io_threads_run(void)
+{
+}
+#endif
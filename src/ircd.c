@@ -64,6 +64,13 @@ EVENT(garbage_collect)
 		loop.do_garbage_collect = 0;
 }
 
+/** State of the ban check of all local users, see check_bans() */
+static struct {
+	unsigned long serial; /**< Serial of the ban check in progress, or 0 if none */
+	unsigned spamf_user : 1; /**< Also check 'user' spamfilters */
+	unsigned spamf_away : 1; /**< Also check 'away' spamfilters */
+} bancheck;
+
 /** Does this user match any TKL's? */
 int match_tkls(Client *client)
 {
@@ -101,10 +108,10 @@ int match_tkls(Client *client)
 		}
 	}
 
-	if (loop.do_bancheck_spamf_user && IsUser(client) && find_spamfilter_user(client, SPAMFLAG_NOWARN))
+	if (bancheck.spamf_user && IsUser(client) && find_spamfilter_user(client, SPAMFLAG_NOWARN))
 		return 1;
 
-	if (loop.do_bancheck_spamf_away && IsUser(client) &&
+	if (bancheck.spamf_away && IsUser(client) &&
 	    client->user->away != NULL &&
 	    match_spamfilter(client, client->user->away, SPAMF_AWAY, "AWAY", NULL, SPAMFLAG_NOWARN, NULL))
 	{
@@ -114,6 +121,54 @@ int match_tkls(Client *client)
 	return 0;
 }
 
+/** Check all local users against the server bans, and spamfilters if needed.
+ * This is needed after server bans or spamfilters were added, or ban
+ * exceptions were removed (see loop.do_bancheck). All such changes since
+ * the previous check are handled in one pass over the local users.
+ * With many users and bans that pass can take a while, so it is done
+ * in steps of BANCHECK_MAX_MSEC, with I/O being processed in between.
+ * @param start		Start a new check if one is needed (1), or
+ *			only continue a check that is in progress (0).
+ */
+static void check_bans(int start)
+{
+	static unsigned long last_serial = 0;
+	Client *client, *next;
+	struct timeval tv_start, tv;
+	int n = 0;
+
+	if (!bancheck.serial)
+	{
+		if (!start || !loop.do_bancheck)
+			return;
+		if (++last_serial == 0)
+			last_serial = 1;
+		bancheck.serial = last_serial;
+		bancheck.spamf_user = loop.do_bancheck_spamf_user;
+		bancheck.spamf_away = loop.do_bancheck_spamf_away;
+		/* Anything added from now on is for the next check */
+		loop.do_bancheck = loop.do_bancheck_spamf_user = loop.do_bancheck_spamf_away = 0;
+	}
+
+	gettimeofday(&tv_start, NULL);
+	list_for_each_entry_safe(client, next, &lclient_list, lclient_node)
+	{
+		if (client->local->bancheck_serial == bancheck.serial)
+			continue; /* already done */
+		client->local->bancheck_serial = bancheck.serial;
+		match_tkls(client);
+		/* don't touch 'client' after this as it may have been killed */
+		if ((++n % 64) == 0)
+		{
+			gettimeofday(&tv, NULL);
+			if ((tv.tv_sec - tv_start.tv_sec) * 1000 + (tv.tv_usec - tv_start.tv_usec) / 1000 >= BANCHECK_MAX_MSEC)
+				return; /* continue later */
+		}
+	}
+
+	bancheck.serial = 0; /* done */
+}
+
 /** Time out connections that are still in handshake. */
 EVENT(handshake_timeout)
 {
@@ -216,11 +271,11 @@ EVENT(check_pings)
 {
 	Client *client, *next;
 
+	/* Check TKLs for all users (if needed) */
+	check_bans(1);
+
 	list_for_each_entry_safe(client, next, &lclient_list, lclient_node)
 	{
-		/* Check TKLs for this user */
-		if (loop.do_bancheck && match_tkls(client))
-			continue;
 		check_ping(client);
 		/* don't touch 'client' after this as it may have been killed */
 	}
@@ -230,7 +285,6 @@ EVENT(check_pings)
 		check_ping(client);
 	}
 
-	loop.do_bancheck = loop.do_bancheck_spamf_user = loop.do_bancheck_spamf_away = 0;
 	/* done */
 }
 
@@ -310,16 +364,23 @@ extern void applymeblock(void);
 
 extern MODVAR Event *events;
 
+static int fix_throttling_timeshift(HashNode *node, void *data)
+{
+	struct ThrottlingBucket *thr = container_of(node, struct ThrottlingBucket, hash);
+
+	if (thr->since > TStime())
+		thr->since = TStime();
+	return 0;
+}
+
 /** This functions resets a couple of timers and does other things that
  * are absolutely cruicial when the clock is adjusted - particularly
  * when the clock goes backwards. -- Syzop
  */
 void fix_timers(void)
 {
-	int i, cnt;
 	Client *client;
 	Event *e;
-	struct ThrottlingBucket *thr;
 	ConfigItem_link *lnk;
 
 	list_for_each_entry(client, &lclient_list, lclient_node)
@@ -348,6 +409,7 @@ void fix_timers(void)
 			e->last_run.tv_usec = 0;
 		}
 	}
+	RescheduleEvents();
 
 	/* For throttling we only have to deal with time jumping backward, which
 	 * is a real problem as if the jump was, say, 900 seconds, then it would
@@ -355,15 +417,7 @@ void fix_timers(void)
 	 * Time going forward is "no problem", it just means we expire our entries
 	 * sonner than we should.
 	 */
-	cnt = 0;
-	for (i = 0; i < THROTTLING_HASH_TABLE_SIZE; i++)
-	{
-		for (thr = ThrottlingHash[i]; thr; thr = thr->next)
-		{
-			if (thr->since > TStime())
-				thr->since = TStime();
-		}
-	}
+	hashtable_foreach(&throttlingTable, fix_throttling_timeshift, NULL);
 
 	/* Make sure autoconnect for servers still works (lnk->hold) */
 	for (lnk = conf_link; lnk; lnk = lnk->next)
@@ -745,6 +799,9 @@ int InitUnrealIRCd(int argc, char *argv[])
 		  case '8':
 		      utf8_test();
 		      exit(0);
+		  case 'B':
+		      dbuf_test_speed();
+		      exit(0);
 		  case 'L':
 		      loop.boot_function = link_generator;
 		      break;
@@ -951,9 +1008,9 @@ int InitUnrealIRCd(int argc, char *argv[])
  */
 void SocketLoop(void *dummy)
 {
-	struct timeval doevents_tv, process_clients_tv;
+	struct timeval process_clients_tv;
+	long delay;
 
-	memset(&doevents_tv, 0, sizeof(doevents_tv));
 	memset(&process_clients_tv, 0, sizeof(process_clients_tv));
 
 	while (1)
@@ -963,8 +1020,10 @@ void SocketLoop(void *dummy)
 
 		detect_timeshift_and_warn();
 
-		if (minimum_msec_since_last_run(&doevents_tv, 250))
-			DoEvents();
+		DoEvents();
+
+		/* Log the results of database files written in the background */
+		unrealdb_async_run();
 
 		/* Update statistics */
 		if (irccounts.clients > irccounts.global_max)
@@ -972,12 +1031,34 @@ void SocketLoop(void *dummy)
 		if (irccounts.me_clients > irccounts.me_max)
 			irccounts.me_max = irccounts.me_clients;
 
-		/* Process I/O */
-		fd_select(SOCKETLOOP_MAX_DELAY);
+		/* Send everything that was queued for clients since the
+		 * last time. Any writes that were handed over to I/O
+		 * threads are done right away as well.
+		 */
+		flush_dirty_clients();
+		io_threads_run();
+
+		/* Process I/O, sleeping until the next event is due.
+		 * If there are clients with delayed data (eg. fake lag)
+		 * then we sleep no longer than SOCKETLOOP_MAX_DELAY,
+		 * so process_clients() gets to run regularly.
+		 */
+		delay = TimeUntilNextEvent();
+		if ((delay < 0) || ((delay > SOCKETLOOP_MAX_DELAY) && !list_empty(&ready_list)))
+			delay = SOCKETLOOP_MAX_DELAY;
+		if (bancheck.serial)
+			delay = 0; /* ban check in progress, don't sleep */
+		fd_select(delay);
+
+		/* Run any I/O that was handed over to I/O threads */
+		io_threads_run();
 
-		if (minimum_msec_since_last_run(&process_clients_tv, 200))
+		if (!list_empty(&ready_list) && minimum_msec_since_last_run(&process_clients_tv, 200))
 			process_clients();
 
+		/* Continue checking users against server bans, if needed */
+		check_bans(0);
+
 		/* Check if there are pending "actions".
 		 * These are actions that should be done outside of
 		 * process_clients() and fd_select() when we are not
@@ -52,6 +52,8 @@ MODVAR struct list_head oper_list;		/**< Locally connected IRC Operators */
 MODVAR struct list_head global_server_list;	/**< All servers (local and remote) */
 MODVAR struct list_head dead_list;		/**< All dead clients (local and remote) that will soon be freed in the main loop */
 MODVAR struct list_head rpc_remote_list;	/**< All remote RPC clients (very specific use-case) */
+MODVAR struct list_head ready_list;		/**< Local clients with data in their recvQ that still needs to be processed */
+MODVAR struct list_head dirty_list;		/**< Local clients with new data in their sendQ, see flush_dirty_clients() */
 
 static mp_pool_t *client_pool = NULL;
 static mp_pool_t *local_client_pool = NULL;
@@ -77,6 +79,8 @@ void initlists(void)
 	INIT_LIST_HEAD(&global_server_list);
 	INIT_LIST_HEAD(&dead_list);
 	INIT_LIST_HEAD(&rpc_remote_list);
+	INIT_LIST_HEAD(&ready_list);
+	INIT_LIST_HEAD(&dirty_list);
 
 	client_pool = mp_pool_new(sizeof(Client), 512 * 1024);
 	local_client_pool = mp_pool_new(sizeof(LocalClient), 512 * 1024);
@@ -112,8 +116,6 @@ Client *make_client(Client *from, Client *servr)
 	client->status = CLIENT_STATUS_UNKNOWN;
 
 	INIT_LIST_HEAD(&client->client_node);
-	INIT_LIST_HEAD(&client->client_hash);
-	INIT_LIST_HEAD(&client->id_hash);
 
 	strlcpy(client->ident, "unknown", sizeof(client->ident));
 	if (!from)
@@ -126,6 +128,8 @@ Client *make_client(Client *from, Client *servr)
 		
 		INIT_LIST_HEAD(&client->lclient_node);
 		INIT_LIST_HEAD(&client->special_node);
+		INIT_LIST_HEAD(&client->ready_node);
+		INIT_LIST_HEAD(&client->dirty_node);
 
 		client->local->fake_lag = client->local->last_msg_received =
 		client->lastnick = client->local->creationtime =
@@ -171,6 +175,10 @@ void free_client(Client *client)
 			list_del(&client->lclient_node);
 		if (!list_empty(&client->special_node))
 			list_del(&client->special_node);
+		if (!list_empty(&client->ready_node))
+			list_del(&client->ready_node);
+		if (!list_empty(&client->dirty_node))
+			list_del(&client->dirty_node);
 
 		RunHook(HOOKTYPE_FREE_CLIENT, client);
 		if (client->local)
@@ -377,9 +385,9 @@ void remove_client_from_list(Client *client)
 #endif
 	if (!list_empty(&client->client_node))
 		abort();
-	if (!list_empty(&client->client_hash))
+	if (hashnode_linked(&client->client_hash))
 		abort();
-	if (!list_empty(&client->id_hash))
+	if (hashnode_linked(&client->id_hash))
 		abort();
 	numclients--;
 	/* Add to killed clients list */
@@ -369,6 +369,91 @@ u_char char_atribs[] = {
 /* f0-ff */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
 };
 
+/** Shared PCRE2 match data and JIT stack, see unreal_pcre2_match().
+ * These are only used from the main thread, so one set is enough.
+ */
+static pcre2_match_data *match_data = NULL;
+static pcre2_match_context *match_context = NULL;
+static pcre2_jit_stack *match_jit_stack = NULL;
+
+/** Number of ovector pairs in the shared match data (like we always used) */
+#define MATCH_OVECTOR_PAIRS	9
+
+/** Run a compiled regex against a string, without allocating memory.
+ * This uses match data, a match context and a JIT stack that are
+ * created on first use and reused for all subsequent calls.
+ * @param re		The compiled regex
+ * @param str		The string to match against
+ * @param ovector	If not NULL, this is set to the ovector of the match,
+ *			which is only valid until the next call.
+ * @returns The return value of pcre2_match(): >0 is a match.
+ */
+int unreal_pcre2_match(pcre2_code *re, const char *str, PCRE2_SIZE **ovector)
+{
+	int ret;
+
+	if (!match_data)
+	{
+		match_data = pcre2_match_data_create(MATCH_OVECTOR_PAIRS, NULL);
+		match_context = pcre2_match_context_create(NULL);
+		/* Same as the default of 32K, but with room to grow for complex regexes */
+		match_jit_stack = pcre2_jit_stack_create(32*1024, 512*1024, NULL);
+		if (match_jit_stack)
+			pcre2_jit_stack_assign(match_context, NULL, match_jit_stack);
+	}
+
+	ret = pcre2_match(re, (PCRE2_SPTR)str, PCRE2_ZERO_TERMINATED, 0, 0, match_data, match_context);
+	if (ovector)
+		*ovector = pcre2_get_ovector_pointer(match_data);
+	return ret;
+}
+
+/** Set the code units that must be present for the regex in 'm' to match.
+ * We use the first and last code unit as reported by PCRE2, but only if
+ * they are plain ASCII, since we compare them ourselves (case insensitive).
+ * In UTF mode we also skip k and s, as these match non-ASCII characters
+ * as well (KELVIN SIGN and LATIN SMALL LETTER LONG S).
+ */
+static void match_set_required(Match *m)
+{
+	uint32_t options = 0, type, unit;
+	int i;
+
+	pcre2_pattern_info(m->ext.pcre2_expr, PCRE2_INFO_ALLOPTIONS, &options);
+	for (i = 0; i < 2; i++)
+	{
+		type = unit = 0;
+		pcre2_pattern_info(m->ext.pcre2_expr, i ? PCRE2_INFO_LASTCODETYPE : PCRE2_INFO_FIRSTCODETYPE, &type);
+		if (type != 1)
+			continue;
+		pcre2_pattern_info(m->ext.pcre2_expr, i ? PCRE2_INFO_LASTCODEUNIT : PCRE2_INFO_FIRSTCODEUNIT, &unit);
+		if ((unit == 0) || (unit >= 0x80))
+			continue;
+		if ((options & PCRE2_UTF) && strchr("kKsS", unit))
+			continue;
+		m->required[i] = unit;
+	}
+	if (m->required[0] == m->required[1])
+		m->required[1] = '\0';
+}
+
+/** Quick check if the code unit 'c' is in 'str', ignoring ASCII case */
+static int match_has_unit(const char *str, unsigned char c)
+{
+	unsigned char alt = c;
+
+	if ((c >= 'a') && (c <= 'z'))
+		alt = c - 32;
+	else if ((c >= 'A') && (c <= 'Z'))
+		alt = c + 32;
+
+	if (strchr(str, c))
+		return 1;
+	if ((alt != c) && strchr(str, alt))
+		return 1;
+	return 0;
+}
+
 /** Free up all resources of an Match entry (including the struct itself).
  * NOTE: this function may (also) be called for Match structs that have only been
  *       setup half-way, so use special care when accessing members (NULL checks!)
@@ -427,6 +512,7 @@ Match *unreal_create_match(MatchType type, const char *str, char **error)
 			return NULL;
 		}
 		pcre2_jit_compile(m->ext.pcre2_expr, PCRE2_JIT_COMPLETE);
+		match_set_required(m);
 		return m;
 	} else if (m->type == MATCH_NONE)
 	{
@@ -455,12 +541,15 @@ int unreal_match(Match *m, const char *str)
 	
 	if (m->type == MATCH_PCRE_REGEX)
 	{
-		pcre2_match_data *md = pcre2_match_data_create(9, NULL);
 		int ret;
-		
-		ret = pcre2_match(m->ext.pcre2_expr, str, PCRE2_ZERO_TERMINATED, 0, 0, md, NULL); /* run the regex */
-		pcre2_match_data_free(md); /* yeah, we never use it. unfortunately argument must be non-NULL for pcre2_match() */
-		
+
+		/* Cheap rejection before running the regex */
+		if (m->required[0] && !match_has_unit(str, m->required[0]))
+			return 0;
+		if (m->required[1] && !match_has_unit(str, m->required[1]))
+			return 0;
+
+		ret = unreal_pcre2_match(m->ext.pcre2_expr, str, NULL); /* run the regex */
 		if (ret > 0)
 			return 1; /* MATCH */		
 		return 0; /* NO MATCH */
@@ -495,6 +584,457 @@ char *unreal_match_method_valtostr(int val)
 	return "unknown";
 }
 
+/** @defgroup LiteralMatcher Literal prefilter for Match entries
+ * Used for quickly finding out which of many Match entries (eg: spamfilters)
+ * could possibly match a string, so only those need to be run.
+ * @{
+ */
+
+/** Minimum length of a literal that is worth prefiltering on */
+#define MATCH_LITERAL_MIN 3
+
+/* Helper for unreal_match_literal(): save the current run if it is the longest */
+static void match_literal_save_run(const char *run, int runlen, char *buf, size_t buflen, int *best)
+{
+	if ((runlen > *best) && ((size_t)runlen < buflen))
+	{
+		memcpy(buf, run, runlen);
+		buf[runlen] = '\0';
+		*best = runlen;
+	}
+}
+
+/* Helper for unreal_match_literal(): skip a character class, p points to the '['.
+ * Returns a pointer to the closing ']', or NULL if there is none.
+ */
+static const char *match_literal_skip_class(const char *p)
+{
+	p++;
+	if (*p == '^')
+		p++;
+	if (*p == ']')
+		p++; /* a ']' as first character is a literal */
+	for (; *p; p++)
+	{
+		if (*p == '\\')
+		{
+			if (!*++p)
+				return NULL;
+		} else
+		if ((*p == '[') && (p[1] == ':'))
+		{
+			const char *e = strstr(p + 2, ":]");
+			if (!e)
+				return NULL;
+			p = e + 1;
+		} else
+		if (*p == ']')
+		{
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/* Helper for unreal_match_literal(): the literal of a simple (glob) pattern */
+static int match_literal_simple(const char *str, char *buf, size_t buflen)
+{
+	char run[256];
+	int runlen = 0, best = 0;
+
+	for (; *str; str++)
+	{
+		/* '_' also matches a space, so that breaks a run as well */
+		if ((*str == '*') || (*str == '?') || (*str == '_') || (runlen == sizeof(run)))
+		{
+			match_literal_save_run(run, runlen, buf, buflen, &best);
+			runlen = 0;
+			if ((*str == '*') || (*str == '?') || (*str == '_'))
+				continue;
+		}
+		run[runlen++] = lc((unsigned char)*str);
+	}
+	match_literal_save_run(run, runlen, buf, buflen, &best);
+	return best;
+}
+
+/* Helper for unreal_match_literal(): the literal of a PCRE2 regex.
+ * This only looks at the top level of the regex, everything within
+ * groups and character classes is skipped. When in doubt we return 0
+ * (no literal), which simply means the regex will always be run.
+ */
+static int match_literal_regex(Match *m, char *buf, size_t buflen)
+{
+	const char *p = m->str;
+	char run[256];
+	int runlen = 0, best = 0;
+	uint32_t options = 0;
+	int utf;
+	int depth;
+
+	pcre2_pattern_info(m->ext.pcre2_expr, PCRE2_INFO_ALLOPTIONS, &options);
+	utf = (options & PCRE2_UTF) ? 1 : 0;
+
+	/* Things that change the meaning of the regex in ways we don't handle:
+	 * \Q..\E quoting, (*VERB)s like (*ACCEPT) and the extended (x) option.
+	 */
+	if (strstr(p, "\\Q") || strstr(p, "\\E") || strstr(p, "(*"))
+		return 0;
+
+#define END_RUN() do { match_literal_save_run(run, runlen, buf, buflen, &best); runlen = 0; } while(0)
+	while (*p)
+	{
+		unsigned char c = *p;
+
+		if (c == '|')
+		{
+			return 0; /* Alternation at the top level: nothing is required */
+		} else
+		if (c == '(')
+		{
+			if (p[1] == '?')
+			{
+				const char *o;
+				for (o = p + 2; *o && strchr("imnsxJU^-", *o); o++)
+					if (*o == 'x')
+						return 0;
+			}
+			END_RUN();
+			/* Skip the group, including nested groups and classes */
+			for (depth = 0; *p; p++)
+			{
+				if (*p == '\\')
+				{
+					if (!*++p)
+						return 0;
+				} else
+				if (*p == '[')
+				{
+					if (!(p = match_literal_skip_class(p)))
+						return 0;
+				} else
+				if (*p == '(')
+				{
+					depth++;
+				} else
+				if ((*p == ')') && (--depth == 0))
+				{
+					break;
+				}
+			}
+			if (!*p)
+				return 0;
+			p++;
+			continue;
+		} else
+		if (c == '[')
+		{
+			END_RUN();
+			if (!(p = match_literal_skip_class(p)))
+				return 0;
+			p++;
+			continue;
+		} else
+		if ((c == '?') || (c == '*') || (c == '{'))
+		{
+			/* The previous character is optional */
+			if (runlen > 0)
+				runlen--;
+			END_RUN();
+			if (c == '{')
+			{
+				/* Skip {n}, {n,} and {n,m} */
+				const char *e = p + 1;
+				while (isdigit(*e) || (*e == ','))
+					e++;
+				if (*e == '}')
+					p = e;
+			}
+			p++;
+			continue;
+		} else
+		if (c == '+')
+		{
+			/* The previous character is required, but maybe more than once */
+			END_RUN();
+			p++;
+			continue;
+		} else
+		if ((c == '.') || (c == '^') || (c == '$') || (c == ')'))
+		{
+			END_RUN();
+			p++;
+			continue;
+		} else
+		if (c == '\\')
+		{
+			p++;
+			if (!*p)
+				return 0;
+			c = *p;
+			if (isalnum(c))
+			{
+				/* \d, \w, \b, \x41, \x{263a}, \k<name>, \1, etc.
+				 * Skip the escape and any argument of it.
+				 */
+				END_RUN();
+				p++;
+				if (*p == '{')
+				{
+					p = strchr(p, '}');
+					if (!p)
+						return 0;
+					p++;
+				} else
+				if (((c == 'k') || (c == 'g')) && ((*p == '<') || (*p == '\'')))
+				{
+					p = strchr(p + 1, (*p == '<') ? '>' : '\'');
+					if (!p)
+						return 0;
+					p++;
+				} else
+				if (c == 'x')
+				{
+					if (isxdigit((unsigned char)*p))
+						p++;
+					if (isxdigit((unsigned char)*p))
+						p++;
+				} else
+				if (isdigit(c) || (c == 'g'))
+				{
+					while (isdigit(*p) || (*p == '-'))
+						p++;
+				} else
+				if ((c == 'c') || (c == 'p') || (c == 'P'))
+				{
+					if (*p)
+						p++;
+				}
+				continue;
+			}
+			/* Escaped special character, eg \. or \\, is a literal. Fallthrough.. */
+		}
+
+		/* A literal character */
+		if ((c >= 0x80) || (utf && strchr("kKsS", c)) || (runlen == sizeof(run)))
+		{
+			/* Non-ASCII characters may match case-insensitively to other
+			 * (multibyte) characters, and in UTF8 mode so do 'k' and 's'
+			 * (to the Kelvin sign and the long s), so these end the run.
+			 */
+			END_RUN();
+		} else {
+			run[runlen++] = lc(c);
+		}
+		p++;
+	}
+	END_RUN();
+#undef END_RUN
+	return best;
+}
+
+/** Find a literal string that must be present in any string that 'm' matches.
+ * The literal is lowercased with lc(), the same (ASCII-only) case folding
+ * that match_simple() uses, and only valid for case-insensitive matching
+ * with literal_matcher_scan(), which is what we use it for.
+ * @param m		The match entry
+ * @param buf		Buffer to store the literal in
+ * @param buflen	Size of the buffer
+ * @returns 1 if a literal was found, 0 if not (eg: the regex is too complex
+ *          or the pattern is something like "*a*").
+ */
+int unreal_match_literal(Match *m, char *buf, size_t buflen)
+{
+	int len = 0;
+
+	*buf = '\0';
+	if (m->type == MATCH_SIMPLE)
+		len = match_literal_simple(m->str, buf, buflen);
+	else if (m->type == MATCH_PCRE_REGEX)
+		len = match_literal_regex(m, buf, buflen);
+
+	return (len >= MATCH_LITERAL_MIN) ? 1 : 0;
+}
+
+typedef struct LiteralMatcherOutput {
+	void *data;
+	int next;
+} LiteralMatcherOutput;
+
+/** Aho-Corasick automaton for case-insensitive multi-literal matching */
+struct LiteralMatcher {
+	char **literals;		/**< Literals added by literal_matcher_add() */
+	void **literals_data;		/**< Data for each literal */
+	int nliterals;
+	int nstates;
+	int nclasses;			/**< Number of character classes, class 0 is "in no literal" */
+	unsigned char cls[256];		/**< Character to class */
+	int *next;			/**< Transition table, nstates * nclasses */
+	int *output;			/**< First output of each state, or -1 */
+	int *dict;			/**< Next state with output on the fail chain, or -1 */
+	LiteralMatcherOutput *outputs;
+};
+
+/** Create a new literal matcher. Add literals with literal_matcher_add()
+ * and call literal_matcher_compile() before using it.
+ */
+LiteralMatcher *literal_matcher_new(void)
+{
+	return safe_alloc(sizeof(LiteralMatcher));
+}
+
+/** Add a literal to the matcher.
+ * @param lm		The literal matcher
+ * @param literal	The literal, this is matched case-insensitive
+ * @param data		Passed to the literal_matcher_scan() callback on a match
+ */
+void literal_matcher_add(LiteralMatcher *lm, const char *literal, void *data)
+{
+	char *s;
+
+	if (!*literal)
+		return;
+	lm->literals = safe_realloc(lm->literals, sizeof(char *) * (lm->nliterals + 1));
+	lm->literals_data = safe_realloc(lm->literals_data, sizeof(void *) * (lm->nliterals + 1));
+	lm->literals[lm->nliterals] = raw_strdup(literal);
+	for (s = lm->literals[lm->nliterals]; *s; s++)
+		*s = lc((unsigned char)*s);
+	lm->literals_data[lm->nliterals] = data;
+	lm->nliterals++;
+}
+
+/** Build the automaton, after all literals have been added */
+void literal_matcher_compile(LiteralMatcher *lm)
+{
+	unsigned char folded_cls[256];
+	int maxstates = 1;
+	int *fail, *queue;
+	int i, c, s, qhead = 0, qtail = 0;
+	const unsigned char *p;
+
+	/* Only the characters that appear in a literal get their own class,
+	 * this keeps the transition table small.
+	 */
+	memset(folded_cls, 0, sizeof(folded_cls));
+	lm->nclasses = 1;
+	for (i = 0; i < lm->nliterals; i++)
+	{
+		for (p = (const unsigned char *)lm->literals[i]; *p; p++)
+			if (!folded_cls[*p])
+				folded_cls[*p] = lm->nclasses++;
+		maxstates += strlen(lm->literals[i]);
+	}
+	for (c = 0; c < 256; c++)
+		lm->cls[c] = folded_cls[lc(c)];
+
+	lm->next = safe_alloc(sizeof(int) * maxstates * lm->nclasses);
+	lm->output = safe_alloc(sizeof(int) * maxstates);
+	lm->dict = safe_alloc(sizeof(int) * maxstates);
+	lm->outputs = safe_alloc(sizeof(LiteralMatcherOutput) * (lm->nliterals + 1));
+	fail = safe_alloc(sizeof(int) * maxstates);
+	queue = safe_alloc(sizeof(int) * maxstates);
+	for (s = 0; s < maxstates; s++)
+		lm->output[s] = lm->dict[s] = -1;
+
+	/* Build the trie. A transition to state 0 means "none" at this point. */
+	lm->nstates = 1;
+	for (i = 0; i < lm->nliterals; i++)
+	{
+		s = 0;
+		for (p = (const unsigned char *)lm->literals[i]; *p; p++)
+		{
+			int *t = &lm->next[s * lm->nclasses + lm->cls[*p]];
+			if (!*t)
+				*t = lm->nstates++;
+			s = *t;
+		}
+		lm->outputs[i].data = lm->literals_data[i];
+		lm->outputs[i].next = lm->output[s];
+		lm->output[s] = i;
+	}
+
+	/* Breadth-first: set the fail links and turn the trie into a DFA */
+	for (c = 0; c < lm->nclasses; c++)
+	{
+		s = lm->next[c];
+		if (s)
+		{
+			fail[s] = 0;
+			queue[qtail++] = s;
+		}
+	}
+	while (qhead < qtail)
+	{
+		int r = queue[qhead++];
+		int f = fail[r];
+
+		lm->dict[r] = (lm->output[f] != -1) ? f : lm->dict[f];
+		for (c = 0; c < lm->nclasses; c++)
+		{
+			int *t = &lm->next[r * lm->nclasses + c];
+			if (*t)
+			{
+				fail[*t] = lm->next[f * lm->nclasses + c];
+				queue[qtail++] = *t;
+			} else {
+				*t = lm->next[f * lm->nclasses + c];
+			}
+		}
+	}
+	safe_free(fail);
+	safe_free(queue);
+	for (i = 0; i < lm->nliterals; i++)
+		safe_free(lm->literals[i]);
+	safe_free(lm->literals);
+	safe_free(lm->literals_data);
+	lm->nliterals = 0;
+}
+
+/** Scan a string for all literals in a single pass.
+ * @param lm		The literal matcher, see literal_matcher_compile()
+ * @param str		The string to scan
+ * @param fn		Called for each literal that is found, with the 'data'
+ *			from literal_matcher_add(). This can be called multiple
+ *			times for the same literal.
+ * @param ctx		Passed as the second argument to 'fn'
+ */
+void literal_matcher_scan(LiteralMatcher *lm, const char *str, void (*fn)(void *data, void *ctx), void *ctx)
+{
+	const unsigned char *p;
+	int s = 0, t, o;
+
+	if (!lm->next)
+		return; /* not compiled */
+
+	for (p = (const unsigned char *)str; *p; p++)
+	{
+		s = lm->next[s * lm->nclasses + lm->cls[*p]];
+		for (t = (lm->output[s] != -1) ? s : lm->dict[s]; t > 0; t = lm->dict[t])
+			for (o = lm->output[t]; o != -1; o = lm->outputs[o].next)
+				fn(lm->outputs[o].data, ctx);
+	}
+}
+
+/** Free a literal matcher */
+void literal_matcher_free(LiteralMatcher *lm)
+{
+	int i;
+
+	if (!lm)
+		return;
+	for (i = 0; i < lm->nliterals; i++)
+		safe_free(lm->literals[i]);
+	safe_free(lm->literals);
+	safe_free(lm->literals_data);
+	safe_free(lm->next);
+	safe_free(lm->output);
+	safe_free(lm->dict);
+	safe_free(lm->outputs);
+	safe_free(lm);
+}
+
+/** @} */
+
 /* It is unfortunately that we have 2 matching/replace systems.
  * However, the above is for spamfilter matching and stuff
  * and below is for matching on WORDS, which does specific things
@@ -678,11 +1218,9 @@ const char *stripbadwords(const char *str, ConfigItem_badword *start_bw, int *bl
 		{
 			if (this_word->action == BADWORD_BLOCK)
 			{
-				pcre2_match_data *md = pcre2_match_data_create(9, NULL);
 				int ret;
 
-				ret = pcre2_match(this_word->pcre2_expr, cleanstr, PCRE2_ZERO_TERMINATED, 0, 0, md, NULL); /* run the regex */
-				pcre2_match_data_free(md); /* yeah, we never use it. unfortunately argument must be non-NULL for pcre2_match() */
+				ret = unreal_pcre2_match(this_word->pcre2_expr, cleanstr, NULL); /* run the regex */
 				if (ret > 0)
 				{
 					*blocked = 1;
@@ -691,21 +1229,15 @@ const char *stripbadwords(const char *str, ConfigItem_badword *start_bw, int *bl
 			}
 			else
 			{
-				pcre2_match_data *md;
 				int ret;
 				PCRE2_SIZE *dd;
 				int start, end;
 
 				ptr = cleanstr; /* set pointer to start of string */
 				while(1) {
-					md = pcre2_match_data_create(9, NULL);
-					/* ^^ we need to free 'md' in ALL circumstances.
-					 * remember this if you break or continue in this loop!
-					 */
-					ret = pcre2_match(this_word->pcre2_expr, ptr, PCRE2_ZERO_TERMINATED, 0, 0, md, NULL); /* run the regex */
+					ret = unreal_pcre2_match(this_word->pcre2_expr, ptr, &dd); /* run the regex */
 					if (ret > 0)
 					{
-						dd = pcre2_get_ovector_pointer(md);
 						start = (int)dd[0];
 						end = (int)dd[1];
 						if ((start < 0) || (end < 0) || (start > strlen(ptr)) || (end > strlen(ptr)+1))
@@ -720,10 +1252,7 @@ const char *stripbadwords(const char *str, ConfigItem_badword *start_bw, int *bl
 						}
 						m = end - start;
 						if (m == 0)
-						{
-							pcre2_match_data_free(md);
 							break; /* anti-loop */
-						}
 						cleaned = 1;
 						matchlen += m;
 						strlncat(buf, ptr, sizeof buf, start);
@@ -732,10 +1261,8 @@ const char *stripbadwords(const char *str, ConfigItem_badword *start_bw, int *bl
 						else
 							strlcat(buf, REPLACEWORD, sizeof buf);
 						ptr += end; /* Set pointer after the match pos */
-						pcre2_match_data_free(md);
 						continue; /* next! */
 					}
-					pcre2_match_data_free(md);
 					break; /* NOMATCH: we are done! */
 				}
 				/* All the better to eat you with! */
@@ -2845,6 +2845,7 @@ void s_die()
 	{
 		loop.terminating = 1;
 		unload_all_modules();
+		unrealdb_async_flush();
 
 		list_for_each_entry(client, &lclient_list, lclient_node)
 			(void) send_queued(client);
@@ -2860,6 +2861,7 @@ void s_die()
 #else
 	loop.terminating = 1;
 	unload_all_modules();
+	unrealdb_async_flush();
 	unlink(conf_files ? conf_files->pid_file : IRCD_PIDFILE);
 	exit(0);
 #endif
@@ -2933,6 +2935,9 @@ void server_reboot(const char *mesg)
 	list_for_each_entry(client, &lclient_list, lclient_node)
 		(void) send_queued(client);
 
+	/* Make sure all database files are written before we exec() */
+	unrealdb_async_flush();
+
 	/*
 	 * ** fd 0 must be 'preserved' if either the -d or -i options have
 	 * ** been passed to us before restarting.
@@ -875,20 +875,19 @@ CMD_FUNC(cmd_module)
 
 	tmp[0] = '\0';
 	p = tmp;
-	for (i=0; i < 256; i++)
+	for (mptr = CommandList; mptr; mptr = mptr->next)
 	{
-		for (mptr = CommandHash[i]; mptr; mptr = mptr->next)
-			if (mptr->overriders)
+		if (mptr->overriders)
+		{
+			ircsnprintf(p, sizeof(tmp)-strlen(tmp), "%s ", mptr->cmd);
+			p += strlen(p);
+			if (p > tmp+380)
 			{
-				ircsnprintf(p, sizeof(tmp)-strlen(tmp), "%s ", mptr->cmd);
-				p += strlen(p);
-				if (p > tmp+380)
-				{
-					sendtxtnumeric(client, "Override: %s", tmp);
-					tmp[0] = '\0';
-					p = tmp;
-				}
+				sendtxtnumeric(client, "Override: %s", tmp);
+				tmp[0] = '\0';
+				p = tmp;
 			}
+		}
 	}
 	sendtxtnumeric(client, "Override: %s", tmp);
 }
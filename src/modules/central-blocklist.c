@@ -216,15 +216,11 @@ MOD_INIT()
 void do_command_overrides(ModuleInfo *modinfo)
 {
 	RealCommand *cmd;
-	int i;
 
-	for (i = 0; i < 256; i++)
+	for (cmd = CommandList; cmd; cmd = cmd->next)
 	{
-		for (cmd = CommandHash[i]; cmd; cmd = cmd->next)
-		{
-			if (cmd->flags & CMD_UNREGISTERED)
-				CommandOverrideAdd(modinfo->handle, cmd->cmd, -1, cbl_override);
-		}
+		if (cmd->flags & CMD_UNREGISTERED)
+			CommandOverrideAdd(modinfo->handle, cmd->cmd, -1, cbl_override);
 	}
 }
 
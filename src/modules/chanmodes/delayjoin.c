@@ -139,7 +139,7 @@ bool moded_member_invisible(Member* m, Channel *channel)
 
 bool moded_user_invisible(Client *client, Channel *channel)
 {
-	return moded_member_invisible(find_member_link(channel->members, client), channel);
+	return moded_member_invisible(find_member(channel, client), channel);
 }
 
 bool channel_has_invisible_users(Channel *channel)
@@ -241,7 +241,7 @@ void clear_user_invisible_announce(Channel *channel, Client *client, MessageTag
 
 void set_user_invisible(Channel *channel, Client *client)
 {
-	Member *m = find_member_link(channel->members, client);
+	Member *m = find_member(channel, client);
 	ModDataInfo *md;
 
 	if (!m)
@@ -1303,7 +1303,7 @@ int floodprot_can_send_to_channel(Client *client, Channel *channel, Membership *
 	if (ValidatePermissionsForPath("channel:override:flood",client,NULL,channel,NULL) || !IsFloodLimit(channel) || check_channel_access(client, channel, "hoaq"))
 		return HOOK_CONTINUE;
 
-	if (!(mb = find_membership_link(client->user->channel, channel)))
+	if (!(mb = find_membership(client, channel)))
 		return HOOK_CONTINUE; /* not in channel */
 
 	/* config test rejects having 't' in +F and 'r' in +f or vice versa,
@@ -117,6 +117,11 @@ void _userhost_changed(Client *client)
 		return; /* We cannot safely process this request anymore */
 	}
 
+	/* Invalidate the ban caches (BanCache) of this user, even if the
+	 * visible host did not change, as one of the other hosts may have.
+	 */
+	client->user->mask_generation++;
+
 	/* It's perfectly acceptable to call us even if the userhost didn't change. */
 	if (!strcmp(remember_user, client->user->username) && !strcmp(remember_host, GetHost(client)))
 		return; /* Nothing to do */
@@ -21,6 +21,9 @@
  */
 
 #include "unrealircd.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 ModuleHeader MOD_HEADER
   = {
@@ -42,18 +45,60 @@ struct geoip_csv_config_s {
 	int have_countries;
 };
 
-struct geoip_csv_ip_range {
-	uint32_t addr;
-	uint32_t mask;
-	int geoid;
-	struct geoip_csv_ip_range *next;
+/** A node of the compressed IP lookup table, see geoip_csv_lpm_lookup().
+ * Each node covers 6 bits of the address, so it has 64 slots. A slot
+ * either points to a child node or holds a geoid. The children of a node
+ * are stored consecutively from 'base1', and its geoids consecutively from
+ * 'base0', where a run of slots with the same geoid is stored only once.
+ * The position of a slot in these arrays is found by counting the bits
+ * in 'vector' or 'leafvec' up to and including the slot (a "poptrie").
+ */
+struct geoip_csv_lpm_node {
+	uint64_t vector;	/**< Bit set for each slot that points to a child node */
+	uint64_t leafvec;	/**< Bit set for each slot that starts a new run of geoids */
+	uint32_t base0;		/**< Index of the first geoid of this node in 'leaves' */
+	uint32_t base1;		/**< Index of the first child of this node in 'nodes' */
 };
 
-struct geoip_csv_ip6_range {
-	uint16_t addr[8];
-	uint16_t mask[8];
-	int geoid;
-	struct geoip_csv_ip6_range *next;
+/** IP lookup table for one address family */
+struct geoip_csv_lpm {
+	int bits;				/**< Address length: 32 for IPv4, 128 for IPv6 */
+	uint32_t *direct;			/**< Lookup by the first 16 bits: a geoid, or GEOIP_CSV_LPM_NODE|node */
+	struct geoip_csv_lpm_node *nodes;
+	uint32_t num_nodes;
+	uint32_t *leaves;			/**< The geoids */
+	uint32_t num_leaves;
+	void *map;				/**< The mmap'ed cache file the arrays point into, or NULL if allocated */
+	size_t map_size;
+};
+
+/** Header of the cache file, followed by the 'direct', 'nodes' and 'leaves' arrays */
+struct geoip_csv_lpm_header {
+	char magic[8];
+	uint32_t byte_order;
+	uint32_t bits;
+	uint32_t num_nodes;
+	uint32_t num_leaves;
+	int64_t source_size;	/**< Size of the CSV file this was built from */
+	int64_t source_mtime;	/**< Modification time of the CSV file this was built from */
+};
+
+#define GEOIP_CSV_LPM_MAGIC		"GEOLPM01"
+#define GEOIP_CSV_LPM_BYTE_ORDER	0x01020304
+#define GEOIP_CSV_LPM_DIRECT		65536
+#define GEOIP_CSV_LPM_NODE		0x80000000
+
+/** A network from a CSV file, only used while building the lookup table */
+struct geoip_csv_network {
+	uint8_t addr[16];
+	int cidr;
+	uint32_t geoid;
+};
+
+/** Uncompressed trie node, only used while building the lookup table */
+struct geoip_csv_build_node {
+	uint32_t leaf[64];
+	struct geoip_csv_build_node *child[64];
 };
 
 struct geoip_csv_country {
@@ -66,18 +111,15 @@ struct geoip_csv_country {
 
 /* Variables */
 struct geoip_csv_config_s geoip_csv_config;
-struct geoip_csv_ip_range *geoip_csv_ip_range_list[256]; // we are keeping a separate list for each possible first octet to speed up searching
-struct geoip_csv_ip6_range *geoip_csv_ip6_range_list = NULL; // for ipv6 there would be too many separate lists so just use a single one
+struct geoip_csv_lpm geoip_csv_v4;
+struct geoip_csv_lpm geoip_csv_v6;
 struct geoip_csv_country *geoip_csv_country_list = NULL;
 
 /* Forward declarations */
-static void geoip_csv_free_ipv4(void);
-static void geoip_csv_free_ipv6(void);
-static void geoip_csv_free_ipv6(void);
+static void geoip_csv_lpm_free(struct geoip_csv_lpm *t);
 static void geoip_csv_free_countries(void);
 static void geoip_csv_free(void);
 static int geoip_csv_read_ipv4(char *file);
-static int geoip_csv_ip6_convert(char *ip, uint16_t out[8]);
 static int geoip_csv_read_ipv6(char *file);
 static int geoip_csv_read_countries(char *file);
 static struct geoip_csv_country *geoip_csv_get_country(int id);
@@ -324,84 +366,452 @@ MOD_UNLOAD()
 	return MOD_SUCCESS;
 }
 
-static void geoip_csv_free_ipv4(void)
+static void geoip_csv_free_countries(void)
+{
+	struct geoip_csv_country *ptr, *oldptr;
+	ptr = geoip_csv_country_list;
+	geoip_csv_country_list = NULL;
+	while (ptr)
+	{
+		oldptr = ptr;
+		ptr = ptr->next;
+		safe_free(oldptr);
+	}
+}
+
+static void geoip_csv_free(void)
+{
+	geoip_csv_lpm_free(&geoip_csv_v4);
+	geoip_csv_lpm_free(&geoip_csv_v6);
+	geoip_csv_free_countries();
+}
+
+/* the IP lookup table */
+
+/** Get 6 bits of the address, starting at bit 'pos'. Bits past the end of the address are 0. */
+static inline int geoip_csv_lpm_bits(const uint8_t *addr, int bits, int pos)
+{
+	int i = pos >> 3;
+	unsigned int w = addr[i] << 8;
+
+	if ((i + 1) * 8 < bits)
+		w |= addr[i + 1];
+	return (w >> (10 - (pos & 7))) & 63;
+}
+
+/** Look up the geoid of an address (in network byte order).
+ * This is at most one memory access per 6 bits of the address after
+ * the first 16, and in practice only a few for IPv4 and IPv6 alike.
+ * @returns The geoid, or 0 if not found.
+ */
+static uint32_t geoip_csv_lpm_lookup(struct geoip_csv_lpm *t, const uint8_t *addr)
+{
+	struct geoip_csv_lpm_node *n;
+	uint32_t e;
+	int pos, slot;
+
+	if (!t->direct)
+		return 0;
+
+	e = t->direct[(addr[0] << 8) | addr[1]];
+	if (!(e & GEOIP_CSV_LPM_NODE))
+		return e;
+
+	n = &t->nodes[e & ~GEOIP_CSV_LPM_NODE];
+	for (pos = 16; pos < t->bits; pos += 6)
+	{
+		slot = geoip_csv_lpm_bits(addr, t->bits, pos);
+		if (!(n->vector & (1ULL << slot)))
+			return t->leaves[n->base0 + __builtin_popcountll(n->leafvec << (63 - slot)) - 1];
+		n = &t->nodes[n->base1 + __builtin_popcountll(n->vector << (63 - slot)) - 1];
+	}
+	return 0; /* not reached, unless the table is bad */
+}
+
+static void geoip_csv_lpm_free(struct geoip_csv_lpm *t)
+{
+#ifndef _WIN32
+	if (t->map)
+		munmap(t->map, t->map_size);
+	else
+#endif
+	{
+		safe_free(t->direct);
+		safe_free(t->nodes);
+		safe_free(t->leaves);
+	}
+	memset(t, 0, sizeof(struct geoip_csv_lpm));
+}
+
+static void geoip_csv_add_network(struct geoip_csv_network **networks, int *num_networks, int *max_networks, const uint8_t *addr, int len, int cidr, int geoid)
+{
+	struct geoip_csv_network *n;
+
+	if (*num_networks == *max_networks)
+	{
+		*max_networks = *max_networks ? *max_networks * 2 : 4096;
+		*networks = safe_realloc(*networks, sizeof(struct geoip_csv_network) * *max_networks);
+	}
+	n = &(*networks)[(*num_networks)++];
+	memset(n->addr, 0, sizeof(n->addr));
+	memcpy(n->addr, addr, len);
+	n->cidr = cidr;
+	n->geoid = geoid;
+}
+
+static int geoip_csv_network_cmp(const void *a, const void *b)
+{
+	return ((const struct geoip_csv_network *)a)->cidr - ((const struct geoip_csv_network *)b)->cidr;
+}
+
+/** Add a network to the uncompressed trie.
+ * Networks must be added shortest prefix first, so more specific
+ * networks override the slots of the less specific ones they are part of.
+ */
+static void geoip_csv_build_insert(uint32_t *root_leaf, struct geoip_csv_build_node **root_child, struct geoip_csv_network *n, int bits)
+{
+	int top = (n->addr[0] << 8) | n->addr[1];
+	struct geoip_csv_build_node **child;
+	uint32_t *leaf;
+	int pos, slot, span, i;
+
+	if (n->cidr <= 16)
+	{
+		span = 1 << (16 - n->cidr);
+		top &= ~(span - 1);
+		for (i = 0; i < span; i++)
+			root_leaf[top + i] = n->geoid;
+		return;
+	}
+
+	leaf = &root_leaf[top];
+	child = &root_child[top];
+	for (pos = 16;; pos += 6)
+	{
+		if (!*child)
+		{
+			*child = safe_alloc(sizeof(struct geoip_csv_build_node));
+			for (i = 0; i < 64; i++)
+				(*child)->leaf[i] = *leaf;
+		}
+		slot = geoip_csv_lpm_bits(n->addr, bits, pos);
+		if (n->cidr <= pos + 6)
+		{
+			span = 1 << (pos + 6 - n->cidr);
+			slot &= ~(span - 1);
+			for (i = 0; i < span; i++)
+				(*child)->leaf[slot + i] = n->geoid;
+			return;
+		}
+		leaf = &(*child)->leaf[slot];
+		child = &(*child)->child[slot];
+	}
+}
+
+/** Replace children that have the same geoid in all slots by that geoid.
+ * @returns 1 if this node itself has the same geoid in all slots.
+ */
+static int geoip_csv_build_prune(struct geoip_csv_build_node *node)
+{
+	int i, uniform = 1;
+
+	for (i = 0; i < 64; i++)
+	{
+		if (node->child[i] && geoip_csv_build_prune(node->child[i]))
+		{
+			node->leaf[i] = node->child[i]->leaf[0];
+			safe_free(node->child[i]);
+		}
+		if (node->child[i] || (node->leaf[i] != node->leaf[0]))
+			uniform = 0;
+	}
+	return uniform;
+}
+
+static void geoip_csv_build_free(struct geoip_csv_build_node *node)
 {
-	struct geoip_csv_ip_range *ptr, *oldptr;
 	int i;
-	for (i=0; i<256; i++)
+
+	for (i = 0; i < 64; i++)
+		if (node->child[i])
+			geoip_csv_build_free(node->child[i]);
+	safe_free(node);
+}
+
+/** Reserve 'count' consecutive nodes in the lookup table */
+static uint32_t geoip_csv_lpm_alloc_nodes(struct geoip_csv_lpm *t, uint32_t *max_nodes, int count)
+{
+	uint32_t idx = t->num_nodes;
+
+	t->num_nodes += count;
+	if (t->num_nodes > *max_nodes)
+	{
+		while (t->num_nodes > *max_nodes)
+			*max_nodes *= 2;
+		t->nodes = safe_realloc(t->nodes, sizeof(struct geoip_csv_lpm_node) * *max_nodes);
+	}
+	return idx;
+}
+
+/** Convert an uncompressed trie node (and its children) to node 'idx' of the lookup table */
+static void geoip_csv_lpm_compress(struct geoip_csv_lpm *t, struct geoip_csv_build_node *b, uint32_t idx, uint32_t *max_nodes, uint32_t *max_leaves)
+{
+	uint64_t vector = 0, leafvec = 0;
+	uint32_t base0 = t->num_leaves, base1;
+	int i, num_children = 0, prev_is_leaf = 0;
+
+	for (i = 0; i < 64; i++)
 	{
-		ptr = geoip_csv_ip_range_list[i];
-		geoip_csv_ip_range_list[i] = NULL;
-		while (ptr)
+		if (b->child[i])
 		{
-			oldptr = ptr;
-			ptr = ptr->next;
-			safe_free(oldptr);
+			vector |= 1ULL << i;
+			num_children++;
+			prev_is_leaf = 0;
+			continue;
 		}
+		if (prev_is_leaf && (b->leaf[i] == t->leaves[t->num_leaves - 1]))
+			continue; /* same run */
+		leafvec |= 1ULL << i;
+		if (t->num_leaves == *max_leaves)
+		{
+			*max_leaves *= 2;
+			t->leaves = safe_realloc(t->leaves, sizeof(uint32_t) * *max_leaves);
+		}
+		t->leaves[t->num_leaves++] = b->leaf[i];
+		prev_is_leaf = 1;
 	}
+
+	base1 = geoip_csv_lpm_alloc_nodes(t, max_nodes, num_children);
+	t->nodes[idx].vector = vector;
+	t->nodes[idx].leafvec = leafvec;
+	t->nodes[idx].base0 = base0;
+	t->nodes[idx].base1 = base1;
+
+	for (i = 0; i < 64; i++)
+		if (b->child[i])
+			geoip_csv_lpm_compress(t, b->child[i], base1++, max_nodes, max_leaves);
 }
 
-static void geoip_csv_free_ipv6(void)
+/** Build the lookup table from the networks read from a CSV file */
+static void geoip_csv_lpm_build(struct geoip_csv_lpm *t, struct geoip_csv_network *networks, int num_networks, int bits)
 {
-	struct geoip_csv_ip6_range *ptr, *oldptr;
-	ptr = geoip_csv_ip6_range_list;
-	geoip_csv_ip6_range_list = NULL;
-	while (ptr)
+	struct geoip_csv_build_node **root_child;
+	uint32_t max_nodes = 1024, max_leaves = 1024;
+	uint32_t idx;
+	int i;
+
+	geoip_csv_lpm_free(t);
+	t->bits = bits;
+	t->direct = safe_alloc(sizeof(uint32_t) * GEOIP_CSV_LPM_DIRECT);
+	t->nodes = safe_alloc(sizeof(struct geoip_csv_lpm_node) * max_nodes);
+	t->leaves = safe_alloc(sizeof(uint32_t) * max_leaves);
+	root_child = safe_alloc(sizeof(struct geoip_csv_build_node *) * GEOIP_CSV_LPM_DIRECT);
+
+	qsort(networks, num_networks, sizeof(struct geoip_csv_network), geoip_csv_network_cmp);
+	for (i = 0; i < num_networks; i++)
+		geoip_csv_build_insert(t->direct, root_child, &networks[i], bits);
+
+	for (i = 0; i < GEOIP_CSV_LPM_DIRECT; i++)
 	{
-		oldptr = ptr;
-		ptr = ptr->next;
-		safe_free(oldptr);
+		if (!root_child[i])
+			continue;
+		if (geoip_csv_build_prune(root_child[i]))
+		{
+			t->direct[i] = root_child[i]->leaf[0];
+		} else
+		{
+			idx = geoip_csv_lpm_alloc_nodes(t, &max_nodes, 1);
+			geoip_csv_lpm_compress(t, root_child[i], idx, &max_nodes, &max_leaves);
+			t->direct[i] = GEOIP_CSV_LPM_NODE | idx;
+		}
+		geoip_csv_build_free(root_child[i]);
 	}
+	safe_free(root_child);
 }
 
-static void geoip_csv_free_countries(void)
+/* the cache file, so the lookup table does not have to be built on every boot and rehash */
+
+#ifndef _WIN32
+static const char *geoip_csv_lpm_cache_file(const char *file)
 {
-	struct geoip_csv_country *ptr, *oldptr;
-	ptr = geoip_csv_country_list;
-	geoip_csv_country_list = NULL;
-	while (ptr)
+	char buf[512];
+
+	snprintf(buf, sizeof(buf), "geoip_csv:%s", file);
+	return unreal_mkcache(buf);
+}
+
+static size_t geoip_csv_lpm_size(uint32_t num_nodes, uint32_t num_leaves)
+{
+	return sizeof(struct geoip_csv_lpm_header) +
+	       sizeof(uint32_t) * GEOIP_CSV_LPM_DIRECT +
+	       sizeof(struct geoip_csv_lpm_node) * (size_t)num_nodes +
+	       sizeof(uint32_t) * (size_t)num_leaves;
+}
+
+/** Check that all indexes in the table are within bounds, in case the cache file is bad */
+static int geoip_csv_lpm_validate(struct geoip_csv_lpm *t)
+{
+	struct geoip_csv_lpm_node *n;
+	uint64_t leaf_slots;
+	uint32_t i;
+
+	for (i = 0; i < GEOIP_CSV_LPM_DIRECT; i++)
+		if ((t->direct[i] & GEOIP_CSV_LPM_NODE) && ((t->direct[i] & ~GEOIP_CSV_LPM_NODE) >= t->num_nodes))
+			return 0;
+
+	for (i = 0; i < t->num_nodes; i++)
 	{
-		oldptr = ptr;
-		ptr = ptr->next;
-		safe_free(oldptr);
+		n = &t->nodes[i];
+		leaf_slots = ~n->vector;
+		if (((uint64_t)n->base1 + __builtin_popcountll(n->vector) > t->num_nodes) ||
+		    ((uint64_t)n->base0 + __builtin_popcountll(n->leafvec) > t->num_leaves) ||
+		    (leaf_slots && !(n->leafvec & (leaf_slots & -leaf_slots))))
+		{
+			return 0;
+		}
 	}
+	return 1;
 }
 
-static void geoip_csv_free(void)
+/** Map the cached lookup table of a CSV file, if it is up to date.
+ * @returns 1 on success, 0 if the table needs to be built.
+ */
+static int geoip_csv_lpm_load_cache(struct geoip_csv_lpm *t, const char *file, struct stat *st, int bits)
 {
-	geoip_csv_free_ipv4();
-	geoip_csv_free_ipv6();
-	geoip_csv_free_countries();
+	const char *cache = geoip_csv_lpm_cache_file(file);
+	struct geoip_csv_lpm_header *h;
+	struct stat cst;
+	void *map;
+	int fd;
+
+	fd = open(cache, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if ((fstat(fd, &cst) < 0) || (cst.st_size < sizeof(struct geoip_csv_lpm_header)))
+	{
+		close(fd);
+		return 0;
+	}
+	map = mmap(NULL, cst.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+
+	h = map;
+	if (memcmp(h->magic, GEOIP_CSV_LPM_MAGIC, sizeof(h->magic)) ||
+	    (h->byte_order != GEOIP_CSV_LPM_BYTE_ORDER) ||
+	    (h->bits != bits) ||
+	    (h->source_size != st->st_size) ||
+	    (h->source_mtime != st->st_mtime) ||
+	    (cst.st_size != geoip_csv_lpm_size(h->num_nodes, h->num_leaves)))
+	{
+		munmap(map, cst.st_size);
+		return 0;
+	}
+
+	geoip_csv_lpm_free(t);
+	t->bits = bits;
+	t->map = map;
+	t->map_size = cst.st_size;
+	t->direct = (uint32_t *)(h + 1);
+	t->nodes = (struct geoip_csv_lpm_node *)(t->direct + GEOIP_CSV_LPM_DIRECT);
+	t->num_nodes = h->num_nodes;
+	t->leaves = (uint32_t *)(t->nodes + t->num_nodes);
+	t->num_leaves = h->num_leaves;
+
+	if (!geoip_csv_lpm_validate(t))
+	{
+		config_warn("[geoip_csv] Ignoring corrupt cache file %s", cache);
+		geoip_csv_lpm_free(t);
+		return 0;
+	}
+	return 1;
 }
 
+/** Write the lookup table to the cache file, so the next load can simply mmap it */
+static void geoip_csv_lpm_save_cache(struct geoip_csv_lpm *t, const char *file, struct stat *st)
+{
+	const char *cache = geoip_csv_lpm_cache_file(file);
+	struct geoip_csv_lpm_header h;
+	char tmpfile[PATH_MAX];
+	FILE *fd;
+	int ok;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, GEOIP_CSV_LPM_MAGIC, sizeof(h.magic));
+	h.byte_order = GEOIP_CSV_LPM_BYTE_ORDER;
+	h.bits = t->bits;
+	h.num_nodes = t->num_nodes;
+	h.num_leaves = t->num_leaves;
+	h.source_size = st->st_size;
+	h.source_mtime = st->st_mtime;
+
+	snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", cache);
+	fd = fopen(tmpfile, "wb");
+	if (!fd)
+		return;
+	ok = (fwrite(&h, sizeof(h), 1, fd) == 1) &&
+	     (fwrite(t->direct, sizeof(uint32_t), GEOIP_CSV_LPM_DIRECT, fd) == GEOIP_CSV_LPM_DIRECT) &&
+	     (fwrite(t->nodes, sizeof(struct geoip_csv_lpm_node), t->num_nodes, fd) == t->num_nodes) &&
+	     (fwrite(t->leaves, sizeof(uint32_t), t->num_leaves, fd) == t->num_leaves);
+	if ((fclose(fd) != 0) || !ok || (rename(tmpfile, cache) < 0))
+		remove(tmpfile);
+}
+#endif
+
 /* reading data from files */
 
 #define STR_HELPER(x) #x
 #define STR(x) STR_HELPER(x)
 #define BUFLEN 8191
 
+/** Load the lookup table of a blocks file from the cache, if possible */
+static int geoip_csv_read_cached(struct geoip_csv_lpm *t, char *file, struct stat *st, int bits)
+{
+	if (stat(file, st) < 0)
+		return 0;
+#ifndef _WIN32
+	return geoip_csv_lpm_load_cache(t, file, st, bits);
+#else
+	return 0;
+#endif
+}
+
+/** Build the lookup table of a blocks file and cache it */
+static void geoip_csv_build(struct geoip_csv_lpm *t, char *file, struct stat *st, int bits, struct geoip_csv_network *networks, int num_networks)
+{
+	geoip_csv_lpm_build(t, networks, num_networks, bits);
+#ifndef _WIN32
+	if (st->st_size)
+		geoip_csv_lpm_save_cache(t, file, st);
+#endif
+}
+
 static int geoip_csv_read_ipv4(char *file)
 {
 	FILE *u;
 	char buf[BUFLEN+1];
 	int cidr, geoid;
 	char ip[24];
-	char netmask[24];
-	uint32_t addr;
-	uint32_t mask;
-	struct geoip_csv_ip_range *curr[256];
-	struct geoip_csv_ip_range *ptr;
-	memset(curr, 0, sizeof(curr));
-	int i;
+	uint8_t addr[4];
+	struct geoip_csv_network *networks = NULL;
+	int num_networks = 0, max_networks = 0;
+	struct stat st;
 	char *filename = NULL;
 	
 	safe_strdup(filename, file);
 	convert_to_absolute_path(&filename, CONFDIR);
+	memset(&st, 0, sizeof(st));
+	if (geoip_csv_read_cached(&geoip_csv_v4, filename, &st, 32))
+	{
+		safe_free(filename);
+		return 0;
+	}
 	u = fopen(filename, "r");
-	safe_free(filename);
 	if (!u)
 	{
 		config_warn("[geoip_csv] Cannot open IPv4 ranges list file");
+		safe_free(filename);
 		return 1;
 	}
 	
@@ -409,12 +819,13 @@ static int geoip_csv_read_ipv4(char *file)
 	{
 		config_warn("[geoip_csv] IPv4 list file is empty");
 		fclose(u);
+		safe_free(filename);
 		return 1;
 	}
 	buf[BUFLEN] = '\0';
 	while (fscanf(u, "%23[^/\n]/%d,%" STR(BUFLEN) "[^\n]\n", ip, &cidr, buf) == 3)
 	{
-		if (sscanf(buf, "%d,", &geoid) != 1)
+		if ((sscanf(buf, "%d,", &geoid) != 1) || (geoid <= 0))
 		{
 			/* missing geoid: can happen with valid files */
 			continue;
@@ -426,60 +837,21 @@ static int geoip_csv_read_ipv4(char *file)
 			continue;
 		}
 
-		if (inet_pton(AF_INET, ip, &addr) < 1)
+		if (inet_pton(AF_INET, ip, addr) < 1)
 		{
 			config_warn("[geoip_csv] Invalid IP found! \"%s\" Bad CSV file?", ip);
 			continue;
 		}
-		addr = htonl(addr);
-		
-		mask = 0;
-		while (cidr)
-		{ /* calculate netmask */
-			mask >>= 1;
-			mask |= (1<<31);
-			cidr--;
-		}
-		
-		i=0;
-		do
-		{ /* multiple iterations in case CIDR is <8 and we have multiple first octets matching */
-			uint8_t index = addr>>24;
-			if (!curr[index])
-			{
-				geoip_csv_ip_range_list[index] = safe_alloc(sizeof(struct geoip_csv_ip_range));
-				curr[index] = geoip_csv_ip_range_list[index];
-			} else
-			{
-				curr[index]->next = safe_alloc(sizeof(struct geoip_csv_ip_range));
-				curr[index] = curr[index]->next;
-			}
-			ptr = curr[index];
-			ptr->next = NULL;
-			ptr->addr = addr;
-			ptr->mask = mask;
-			ptr->geoid = geoid;
-			i++;
-			index++;
-		} while (i<=((~mask)>>24));
+
+		geoip_csv_add_network(&networks, &num_networks, &max_networks, addr, 4, cidr, geoid);
 	}
 	fclose(u);
+	geoip_csv_build(&geoip_csv_v4, filename, &st, 32, networks, num_networks);
+	safe_free(networks);
+	safe_free(filename);
 	return 0;
 }
 
-static int geoip_csv_ip6_convert(char *ip, uint16_t out[8])
-{ /* convert text to binary form */
-	uint16_t tmp[8];
-	int i;
-	if (inet_pton(AF_INET6, ip, out) < 1)
-		return 0;
-	for (i=0; i<8; i++)
-	{
-		out[i] = htons(out[i]);
-	}
-	return 1;
-}
-
 #define IPV6_STRING_SIZE	40
 
 static int geoip_csv_read_ipv6(char *file)
@@ -489,27 +861,34 @@ static int geoip_csv_read_ipv6(char *file)
 	char *bptr, *optr;
 	int cidr, geoid;
 	char ip[IPV6_STRING_SIZE];
-	uint16_t addr[8];
-	uint16_t mask[8];
-	struct geoip_csv_ip6_range *curr = NULL;
-	struct geoip_csv_ip6_range *ptr;
+	uint8_t addr[16];
+	struct geoip_csv_network *networks = NULL;
+	int num_networks = 0, max_networks = 0;
+	struct stat st;
 	int error;
 	int length;
 	char *filename = NULL;
 
 	safe_strdup(filename, file);
 	convert_to_absolute_path(&filename, CONFDIR);
+	memset(&st, 0, sizeof(st));
+	if (geoip_csv_read_cached(&geoip_csv_v6, filename, &st, 128))
+	{
+		safe_free(filename);
+		return 0;
+	}
 	u = fopen(filename, "r");
-	safe_free(filename);
 	if (!u)
 	{
 		config_warn("[geoip_csv] Cannot open IPv6 ranges list file");
+		safe_free(filename);
 		return 1;
 	}
 	if (!fgets(buf, BUFLEN, u))
 	{
 		config_warn("[geoip_csv] IPv6 list file is empty");
 		fclose(u);
+		safe_free(filename);
 		return 1;
 	}
 	while (fgets(buf, BUFLEN, u))
@@ -538,44 +917,25 @@ static int geoip_csv_read_ipv6(char *file)
 			continue;
 		*optr = '\0';
 		bptr++;
-		if (!geoip_csv_ip6_convert(ip, addr))
+		if (inet_pton(AF_INET6, ip, addr) < 1)
 		{
 			config_warn("[geoip_csv] Invalid IP found! \"%s\" Bad CSV file?", ip);
 			continue;
 		}
-		sscanf(bptr, "%d,%d,", &cidr, &geoid);
+		if ((sscanf(bptr, "%d,%d,", &cidr, &geoid) != 2) || (geoid <= 0))
+			continue; /* missing geoid */
 		if (cidr < 1 || cidr > 128)
 		{
 			config_warn("[geoip_csv] Invalid CIDR found! CIDR=%d Bad CSV file?", cidr);
 			continue;
 		}
 
-		memset(mask, 0, 16);
-		
-		int mask_bit = 0;
-		while (cidr)
-		{ /* calculate netmask */
-			mask[mask_bit/16] |= 1<<(15-(mask_bit%16));
-			mask_bit++;
-			cidr--;
-		}
-
-		if (!curr)
-		{
-			geoip_csv_ip6_range_list = safe_alloc(sizeof(struct geoip_csv_ip6_range));
-			curr = geoip_csv_ip6_range_list;
-		} else
-		{
-			curr->next = safe_alloc(sizeof(struct geoip_csv_ip6_range));
-			curr = curr->next;
-		}
-		ptr = curr;
-		ptr->next = NULL;
-		memcpy(ptr->addr, addr, 16);
-		memcpy(ptr->mask, mask, 16);
-		ptr->geoid = geoid;
+		geoip_csv_add_network(&networks, &num_networks, &max_networks, addr, 16, cidr, geoid);
 	}
 	fclose(u);
+	geoip_csv_build(&geoip_csv_v6, filename, &st, 128, networks, num_networks);
+	safe_free(networks);
+	safe_free(filename);
 	return 0;
 }
 
@@ -739,70 +1099,26 @@ static struct geoip_csv_country *geoip_csv_get_country(int id)
 
 static int geoip_csv_get_v4_geoid(char *iip)
 {
-	uint32_t addr, tmp_addr;
-	struct geoip_csv_ip_range *curr;
-	int i;
-	int found = 0;
-	if (inet_pton(AF_INET, iip, &addr) < 1)
+	uint8_t addr[4];
+
+	if (inet_pton(AF_INET, iip, addr) < 1)
 	{
 		unreal_log(ULOG_WARNING, "geoip_csv", "UNSUPPORTED_IP", NULL, "Invalid or unsupported client IP $ip", log_data_string("ip", iip));
 		return 0;
 	}
-	addr = htonl(addr);
-	curr = geoip_csv_ip_range_list[addr>>24];
-	if (curr)
-	{
-		i = 0;
-		for (;curr;curr = curr->next)
-		{
-			tmp_addr = addr;
-			tmp_addr &= curr->mask; /* mask the address to filter out net prefix only */
-			if (tmp_addr == curr->addr)
-			{ /* ... and match it to the loaded data */
-				found = 1;
-				break;
-			}
-			i++;
-		}
-	}
-	if (found)
-		return curr->geoid;
-	return 0;
+	return geoip_csv_lpm_lookup(&geoip_csv_v4, addr);
 }
 
 static int geoip_csv_get_v6_geoid(char *iip)
 {
-	uint16_t addr[8];
-	struct geoip_csv_ip6_range *curr;
-	int i;
-	int found = 0;
-	
-	if (!geoip_csv_ip6_convert(iip, addr))
+	uint8_t addr[16];
+
+	if (inet_pton(AF_INET6, iip, addr) < 1)
 	{
 		unreal_log(ULOG_WARNING, "geoip_csv", "UNSUPPORTED_IP", NULL, "Invalid or unsupported client IP $ip", log_data_string("ip", iip));
 		return 0;
 	}
-	curr = geoip_csv_ip6_range_list;
-	if (curr)
-	{
-		for (;curr;curr = curr->next)
-		{
-			found = 1;
-			for (i=0; i<8; i++)
-			{
-				if (curr->addr[i] != (addr[i] & curr->mask[i]))
-				{ /* compare net address to loaded data */
-					found = 0;
-					break;
-				}
-			}
-			if(found)
-				break;
-		}
-	}
-	if (found)
-		return curr->geoid;
-	return 0;
+	return geoip_csv_lpm_lookup(&geoip_csv_v6, addr);
 }
 
 GeoIPResult *geoip_lookup_csv(char *ip)
@@ -5,10 +5,14 @@
 #include "unrealircd.h"
 
 /* This is the memory type backend. It is optimized for speed.
- * For example, per-channel, it caches the field "number of lines"
- * and "oldest record", so frequent cleaning operations such as
+ * Per-channel, the lines are stored in a ring buffer that is
+ * sorted by time, so frequent cleaning operations such as
  * "delete any record older than time T" or "keep only N lines"
- * are executed as fast as possible.
+ * are executed as fast as possible, and CHATHISTORY requests
+ * can use a binary search on the time and a hash lookup on
+ * the msgid, rather than walking through all the lines.
+ * Each line, including its message tags, is packed into
+ * a single memory allocation.
  */
 
 ModuleHeader MOD_HEADER
@@ -23,6 +27,8 @@ ModuleHeader MOD_HEADER
 /* Defines */
 #define OBJECTLEN	((NICKLEN > CHANNELLEN) ? NICKLEN : CHANNELLEN)
 #define HISTORY_BACKEND_MEM_HASH_TABLE_SIZE 1019
+/** Initial size of the ring of lines, grows by powers of two */
+#define HISTORY_RING_MIN_SIZE	16
 
 /* The regular history cleaning (by timer) is spread out
  * a bit, rather than doing ALL channels every T time.
@@ -56,6 +62,18 @@ ModuleHeader MOD_HEADER
 #define HISTORYDB_MAGIC_ENTRY_START	0xFFFFFFFF
 #define HISTORYDB_MAGIC_ENTRY_END	0xEEEEEEEE
 
+/* With 'persist' enabled, new lines are not written by rewriting the
+ * whole database file of a channel. Instead, only the new lines are
+ * written to a segment file (xyz.1.seg, xyz.2.seg, ..) which uses the
+ * same format as the database file (xyz.db). On load the segments are
+ * replayed after the database file, and the usual limits are applied.
+ * The database file is rewritten as a whole (compacted) when lines are
+ * deleted, when there are too many segments, or when more than half of
+ * the lines on disk are no longer in the history (expired or pushed out).
+ * HISTORYDB_MAX_SEGMENTS: maximum number of segment files per channel.
+ */
+#define HISTORYDB_MAX_SEGMENTS		16
+
 /* Definitions (structs, etc.) -- all for persistent history */
 struct cfgstruct {
 	int persist;
@@ -64,19 +82,50 @@ struct cfgstruct {
 	char *db_secret;
 };
 
+/** A line of history, packed into a single allocation.
+ * The data[] contains the message tags, each encoded as a flag byte
+ * (1 if the tag has a value), the name and the value (if any), all
+ * of them NUL-terminated. The line itself follows after that.
+ */
+typedef struct HistoryLogEntry HistoryLogEntry;
+struct HistoryLogEntry {
+	time_t t; /**< Time of the line, from the "time" message tag */
+	uint32_t msgid_hash; /**< Hash of the msgid, for the msgid index */
+	unsigned short time_offset; /**< Offset of the "time" value in data[] */
+	unsigned short msgid_offset; /**< Offset of the "msgid" value in data[], or 0 if none */
+	unsigned short line_offset; /**< Offset of the line in data[] */
+	unsigned short num_mtags; /**< Number of message tags in data[] */
+	char data[1];
+};
+
 typedef struct HistoryLogObject HistoryLogObject;
 struct HistoryLogObject {
 	HistoryLogObject *prev, *next;
-	HistoryLogLine *head; /**< Start of the log (the earliest entry) */
-	HistoryLogLine *tail; /**< End of the log (the latest entry) */
+	HistoryLogEntry **lines; /**< Ring of lines, sorted by time (the earliest entry first) */
+	int lines_size; /**< Size of the ring, always a power of two (or zero) */
+	int first; /**< Position of the earliest entry in the ring */
 	int num_lines; /**< Number of lines of log */
-	time_t oldest_t; /**< Oldest time in log */
+	uint32_t *msgid_index; /**< Open addressing hash table: ring position + 1, or 0 for empty */
+	int msgid_index_size; /**< Size of msgid_index, always a power of two */
 	int max_lines; /**< Maximum number of lines permitted */
 	long max_time; /**< Maximum number of seconds to retain history */
 	int dirty; /**< Dirty flag, used for disk writing */
+	int rewrite; /**< Set if the database file needs to be rewritten as a whole, rather than appended to */
+	int unsaved_lines; /**< Number of lines at the end that are not on disk yet */
+	int disk_lines; /**< Number of lines on disk, in the database file and its segments */
+	int num_segments; /**< Number of append-only segment files that follow the database file */
 	char name[OBJECTLEN+1];
 };
 
+/** Ring position of line 'i' (0 is the earliest entry) */
+#define HBM_SLOT(h, i)	(((h)->first + (i)) & ((h)->lines_size - 1))
+/** Line 'i' of a history object (0 is the earliest entry) */
+#define HBM_LINE(h, i)	((h)->lines[HBM_SLOT(h, i)])
+/** The "time" message tag value of an entry */
+#define HBM_TIME(e)	((e)->data + (e)->time_offset)
+/** The "msgid" message tag value of an entry (only valid if e->msgid_offset is set) */
+#define HBM_MSGID(e)	((e)->data + (e)->msgid_offset)
+
 /* Global variables */
 struct cfgstruct cfg;
 struct cfgstruct test;
@@ -108,6 +157,7 @@ EVENT(history_mem_init);
 static int hbm_read_masterdb(void);
 static void hbm_read_dbs(void);
 static int hbm_read_db(const char *fname);
+static int hbm_read_db_file(const char *fname, HistoryLogObject **hp, int *lines);
 static int hbm_write_masterdb(void);
 static int hbm_write_db(HistoryLogObject *h);
 static void hbm_delete_db(HistoryLogObject *h);
@@ -460,6 +510,7 @@ HistoryLogObject *hbm_find_or_add_object(const char *object)
 	/* Create new one */
 	h = safe_alloc(sizeof(HistoryLogObject));
 	strlcpy(h->name, object, sizeof(h->name));
+	h->rewrite = 1;
 	AddListItem(h, history_hash_table[hashv]);
 	return h;
 }
@@ -489,6 +540,7 @@ int hbm_modechar_del(Channel *channel, int modechar)
 		hbm_delete_db(h);
 
 		h->dirty = 1;
+		h->rewrite = 1;
 		/* The reason for marking the entry as 'dirty' is that someone may later
 		 * set the channel +P again. If we would not set the h->dirty=1 then this
 		 * would mean the history log would not get rewritten until someone speaks.
@@ -498,18 +550,87 @@ int hbm_modechar_del(Channel *channel, int modechar)
 	return 0;
 }
 
-void hbm_duplicate_mtags(HistoryLogLine *l, MessageTag *m)
+/** Hash a msgid, for the msgid index */
+static uint32_t hbm_msgid_hash(const char *msgid)
 {
-	MessageTag *n;
+	return (uint32_t)siphash(msgid, siphashkey_history_backend_mem);
+}
+
+/** Fetch the next message tag from the packed message tags of an entry.
+ * @param p		Current position in HistoryLogEntry->data
+ * @param name		Will be set to the name of the message tag
+ * @param value		Will be set to the value of the message tag (can be NULL)
+ * @returns Position of the next message tag (or the line, if this was the last one)
+ */
+static const char *hbm_next_mtag(const char *p, const char **name, const char **value)
+{
+	int has_value = *p++;
 
-	/* Duplicate all message tags */
-	for (; m; m = m->next)
+	*name = p;
+	p += strlen(p) + 1;
+	if (has_value)
 	{
-		n = duplicate_mtag(m);
-		AppendListItem(n, l->mtags);
+		*value = p;
+		p += strlen(p) + 1;
+	} else {
+		*value = NULL;
+	}
+	return p;
+}
+
+/** Find the message tag 'name' in a packed history entry.
+ * @returns The value of the message tag, or NULL if not found or if it has no value.
+ */
+static const char *hbm_entry_mtag(HistoryLogEntry *e, const char *name)
+{
+	const char *p = e->data;
+	const char *mname, *mvalue;
+	int i;
+
+	for (i = 0; i < e->num_mtags; i++)
+	{
+		p = hbm_next_mtag(p, &mname, &mvalue);
+		if (!strcmp(mname, name))
+			return mvalue;
+	}
+	return NULL;
+}
+
+/** Pack a message tag into HistoryLogEntry->data at position 'p' */
+static char *hbm_pack_mtag(HistoryLogEntry *e, char *p, const char *name, const char *value)
+{
+	*p++ = value ? 1 : 0;
+	strcpy(p, name); /* safe, see hbm_pack_line() */
+	p += strlen(name) + 1;
+	if (value)
+	{
+		if (!e->time_offset && !strcmp(name, "time"))
+			e->time_offset = p - e->data;
+		else if (!e->msgid_offset && !strcmp(name, "msgid"))
+			e->msgid_offset = p - e->data;
+		strcpy(p, value); /* safe, see hbm_pack_line() */
+		p += strlen(value) + 1;
 	}
-	n = find_mtag(l->mtags, "time");
-	if (!n)
+	e->num_mtags++;
+	return p;
+}
+
+/** Create a packed history entry out of a line and its message tags.
+ * All of it is stored in a single allocation. If the message tags
+ * lack a "time" tag, then one is added with the current time.
+ * @returns The new entry, or NULL if the entry would be too large.
+ */
+static HistoryLogEntry *hbm_pack_line(MessageTag *mtags, const char *line)
+{
+	HistoryLogEntry *e;
+	MessageTag *m;
+	char timebuf[64];
+	const char *add_time = NULL;
+	size_t len;
+	char *p;
+
+	m = find_mtag(mtags, "time");
+	if (!m || !m->value)
 	{
 		/* This is duplicate code from src/modules/server-time.c
 		 * which seems silly.
@@ -517,12 +638,11 @@ void hbm_duplicate_mtags(HistoryLogLine *l, MessageTag *m)
 		struct timeval t;
 		struct tm *tm;
 		time_t sec;
-		char buf[64];
 
 		gettimeofday(&t, NULL);
 		sec = t.tv_sec;
 		tm = gmtime(&sec);
-		snprintf(buf, sizeof(buf), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ",
+		snprintf(timebuf, sizeof(timebuf), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ",
 			tm->tm_year + 1900,
 			tm->tm_mon + 1,
 			tm->tm_mday,
@@ -530,65 +650,286 @@ void hbm_duplicate_mtags(HistoryLogLine *l, MessageTag *m)
 			tm->tm_min,
 			tm->tm_sec,
 			(int)(t.tv_usec / 1000));
-
-		n = safe_alloc(sizeof(MessageTag));
-		safe_strdup(n->name, "time");
-		safe_strdup(n->value, buf);
-		AddListItem(n, l->mtags);
+		add_time = timebuf;
 	}
-	/* Now convert the "time" message tag to something we can use in l->t */
-	l->t = server_time_to_unix_time(n->value);
+
+	/* Calculate the size of the data: message tags first, then the line */
+	len = 0;
+	if (add_time)
+		len += 1 + sizeof("time") + strlen(add_time) + 1;
+	for (m = mtags; m; m = m->next)
+		len += 1 + strlen(m->name) + 1 + (m->value ? strlen(m->value) + 1 : 0);
+	if (len > USHRT_MAX)
+		return NULL; /* offsets would not fit, message tags are far smaller than this in practice */
+	len += strlen(line) + 1;
+
+	e = safe_alloc(offsetof(HistoryLogEntry, data) + len);
+	p = e->data;
+	if (add_time)
+		p = hbm_pack_mtag(e, p, "time", add_time);
+	for (m = mtags; m; m = m->next)
+		p = hbm_pack_mtag(e, p, m->name, m->value);
+	e->line_offset = p - e->data;
+	strcpy(p, line); /* safe, see memory allocation above ^ */
+
+	/* Now convert the "time" message tag to something we can use in e->t */
+	e->t = server_time_to_unix_time(HBM_TIME(e));
+	if (e->msgid_offset)
+		e->msgid_hash = hbm_msgid_hash(HBM_MSGID(e));
+	return e;
 }
 
-/** Add a line to a history object */
-void hbm_history_add_line(HistoryLogObject *h, MessageTag *mtags, const char *line)
+/** Create a HistoryLogLine (with a regular MessageTag list) out of a packed entry,
+ * this is what we return to the caller in the HistoryResult.
+ */
+static HistoryLogLine *hbm_unpack_line(HistoryLogEntry *e)
 {
+	const char *line = e->data + e->line_offset;
 	HistoryLogLine *l = safe_alloc(sizeof(HistoryLogLine) + strlen(line));
+	const char *p = e->data;
+	const char *name, *value;
+	MessageTag *m, *tail = NULL;
+	int i;
+
 	strcpy(l->line, line); /* safe, see memory allocation above ^ */
-	hbm_duplicate_mtags(l, mtags);
-	if (h->tail)
+	for (i = 0; i < e->num_mtags; i++)
 	{
-		/* append to tail */
-		h->tail->next = l;
-		l->prev = h->tail;
-		h->tail = l;
-	} else {
-		/* no tail, no head */
-		h->head = h->tail = l;
+		p = hbm_next_mtag(p, &name, &value);
+		m = safe_alloc(sizeof(MessageTag));
+		safe_strdup(m->name, name);
+		safe_strdup(m->value, value);
+		/* Quick append to tail */
+		if (tail)
+		{
+			tail->next = m;
+			m->prev = tail;
+		} else {
+			l->mtags = m;
+		}
+		tail = m;
 	}
-	h->dirty = 1;
-	h->num_lines++;
-	if ((l->t < h->oldest_t) || (h->oldest_t == 0))
-		h->oldest_t = l->t;
+	l->t = e->t;
+	return l;
 }
 
-/** Delete a line from a history object */
-void hbm_history_del_line(HistoryLogObject *h, HistoryLogLine *l)
+/** Add the entry in ring slot 'slot' to the msgid index */
+static void hbm_msgid_index_add(HistoryLogObject *h, int slot)
 {
-	if (l->prev)
-		l->prev->next = l->next;
-	if (l->next)
-		l->next->prev = l->prev;
-	if (h->head == l)
+	HistoryLogEntry *e = h->lines[slot];
+	uint32_t mask = h->msgid_index_size - 1;
+	uint32_t i;
+
+	if (!h->msgid_index || !e->msgid_offset)
+		return;
+
+	for (i = e->msgid_hash & mask; h->msgid_index[i]; i = (i + 1) & mask);
+	h->msgid_index[i] = slot + 1;
+}
+
+/** Remove the entry in ring slot 'slot' from the msgid index */
+static void hbm_msgid_index_del(HistoryLogObject *h, int slot)
+{
+	HistoryLogEntry *e = h->lines[slot];
+	uint32_t mask = h->msgid_index_size - 1;
+	uint32_t i, j, k;
+
+	if (!h->msgid_index || !e->msgid_offset)
+		return;
+
+	for (i = e->msgid_hash & mask; h->msgid_index[i] != slot + 1; i = (i + 1) & mask)
+		if (!h->msgid_index[i])
+			return; /* not found, should be impossible */
+
+	/* Delete it and move up any entries in the same cluster that
+	 * would otherwise become unreachable (no tombstones needed).
+	 */
+	h->msgid_index[i] = 0;
+	for (j = (i + 1) & mask; h->msgid_index[j]; j = (j + 1) & mask)
+	{
+		k = h->lines[h->msgid_index[j] - 1]->msgid_hash & mask;
+		/* If the home position 'k' lies cyclically in (i, j] then the entry can stay */
+		if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+			continue;
+		h->msgid_index[i] = h->msgid_index[j];
+		h->msgid_index[j] = 0;
+		i = j;
+	}
+}
+
+/** The entry that was in ring slot 'old_slot' is now in 'new_slot', update the msgid index */
+static void hbm_msgid_index_move(HistoryLogObject *h, int old_slot, int new_slot)
+{
+	HistoryLogEntry *e = h->lines[new_slot];
+	uint32_t mask = h->msgid_index_size - 1;
+	uint32_t i;
+
+	if (!h->msgid_index || !e->msgid_offset)
+		return;
+
+	for (i = e->msgid_hash & mask; h->msgid_index[i]; i = (i + 1) & mask)
 	{
-		/* New head */
-		h->head = l->next;
+		if (h->msgid_index[i] == old_slot + 1)
+		{
+			h->msgid_index[i] = new_slot + 1;
+			return;
+		}
 	}
-	if (h->tail == l)
+}
+
+/** (Re)build the msgid index from scratch.
+ * The index is only created when the first msgid lookup is done,
+ * so objects that are never queried by msgid don't pay for it.
+ */
+static void hbm_msgid_index_build(HistoryLogObject *h)
+{
+	int i;
+
+	safe_free(h->msgid_index);
+	h->msgid_index_size = h->lines_size * 2;
+	if (!h->msgid_index_size)
+		return;
+	h->msgid_index = safe_alloc(sizeof(uint32_t) * h->msgid_index_size);
+	for (i = 0; i < h->num_lines; i++)
+		hbm_msgid_index_add(h, HBM_SLOT(h, i));
+}
+
+/** Find the line with the specified msgid.
+ * @returns The index of the line (0 is the oldest line), or -1 if not found.
+ */
+static int hbm_find_msgid(HistoryLogObject *h, const char *msgid)
+{
+	uint32_t hashv, mask, i;
+	HistoryLogEntry *e;
+	int slot;
+
+	if (!h->num_lines)
+		return -1;
+
+	if (!h->msgid_index)
+		hbm_msgid_index_build(h);
+
+	hashv = hbm_msgid_hash(msgid);
+	mask = h->msgid_index_size - 1;
+	for (i = hashv & mask; h->msgid_index[i]; i = (i + 1) & mask)
 	{
-		/* New tail */
-		h->tail = l->prev; /* could be NULL now */
+		slot = h->msgid_index[i] - 1;
+		e = h->lines[slot];
+		if ((e->msgid_hash == hashv) && !strcmp(HBM_MSGID(e), msgid))
+			return (slot - h->first) & (h->lines_size - 1);
 	}
+	return -1;
+}
 
-	free_message_tags(l->mtags);
-	safe_free(l);
+/** Find the first line that has a time after 'timestamp'.
+ * @param h		The history log object
+ * @param timestamp	The timestamp in server-time format
+ * @param inclusive	If set, then also a line AT 'timestamp' counts
+ * @returns The index of the line, or h->num_lines if there is no such line.
+ * @note This is a binary search, which works because the lines are always sorted by time.
+ */
+static int hbm_find_time(HistoryLogObject *h, const char *timestamp, int inclusive)
+{
+	int lo = 0, hi = h->num_lines, mid, cmp;
 
-	h->dirty = 1;
-	h->num_lines--;
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		cmp = strcmp(HBM_TIME(HBM_LINE(h, mid)), timestamp);
+		if ((cmp < 0) || (!inclusive && (cmp == 0)))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/** Resize the ring of lines to 'size' entries (a power of two, or zero) */
+static void hbm_resize(HistoryLogObject *h, int size)
+{
+	HistoryLogEntry **lines = NULL;
+	int i;
+
+	if (size)
+	{
+		lines = safe_alloc(sizeof(HistoryLogEntry *) * size);
+		for (i = 0; i < h->num_lines; i++)
+			lines[i] = HBM_LINE(h, i);
+	}
+	safe_free(h->lines);
+	h->lines = lines;
+	h->lines_size = size;
+	h->first = 0;
+	if (h->msgid_index)
+		hbm_msgid_index_build(h);
+}
 
-	/* IMPORTANT: updating h->oldest_t takes place at the caller
-	 * because it is in a better position to optimize the process
+/** Add a line to a history object */
+void hbm_history_add_line(HistoryLogObject *h, MessageTag *mtags, const char *line)
+{
+	HistoryLogEntry *e = hbm_pack_line(mtags, line);
+	const char *timestamp;
+	int i, pos;
+
+	if (!e)
+		return;
+
+	if (h->num_lines == h->lines_size)
+		hbm_resize(h, h->lines_size ? h->lines_size * 2 : HISTORY_RING_MIN_SIZE);
+
+	/* The lines are kept sorted by time. Normally the new line is
+	 * also the newest, so we start looking at the end.
 	 */
+	timestamp = HBM_TIME(e);
+	for (pos = h->num_lines; pos > 0; pos--)
+		if (strcmp(HBM_TIME(HBM_LINE(h, pos - 1)), timestamp) <= 0)
+			break;
+
+	/* Only a line at the end can be appended to the database on disk */
+	if (pos == h->num_lines)
+		h->unsaved_lines++;
+	else
+		h->rewrite = 1;
+
+	/* Make room at 'pos', if it is not at the end */
+	for (i = h->num_lines; i > pos; i--)
+	{
+		HBM_LINE(h, i) = HBM_LINE(h, i - 1);
+		hbm_msgid_index_move(h, HBM_SLOT(h, i - 1), HBM_SLOT(h, i));
+	}
+	HBM_LINE(h, pos) = e;
+	h->num_lines++;
+	hbm_msgid_index_add(h, HBM_SLOT(h, pos));
+	h->dirty = 1;
+}
+
+/** Delete a line from a history object.
+ * @param h		The history log object
+ * @param idx		The index of the line (0 is the oldest line)
+ */
+void hbm_history_del_line(HistoryLogObject *h, int idx)
+{
+	int i;
+
+	hbm_msgid_index_del(h, HBM_SLOT(h, idx));
+	safe_free(HBM_LINE(h, idx));
+
+	if (idx == 0)
+	{
+		/* The common case: deleting the oldest line */
+		h->first = (h->first + 1) & (h->lines_size - 1);
+	} else {
+		for (i = idx; i < h->num_lines - 1; i++)
+		{
+			HBM_LINE(h, i) = HBM_LINE(h, i + 1);
+			hbm_msgid_index_move(h, HBM_SLOT(h, i + 1), HBM_SLOT(h, i));
+		}
+		HBM_LINE(h, h->num_lines - 1) = NULL;
+	}
+
+	h->dirty = 1;
+	h->num_lines--;
+	if (h->unsaved_lines > h->num_lines)
+		h->unsaved_lines = h->num_lines;
 }
 
 /** Add history entry */
@@ -610,20 +951,12 @@ int hbm_history_add(const char *object, MessageTag *mtags, const char *line)
 	if (h->num_lines >= h->max_lines)
 	{
 		/* Delete previous line */
-		hbm_history_del_line(h, h->head);
+		hbm_history_del_line(h, 0);
 	}
 	hbm_history_add_line(h, mtags, line);
 	return 0;
 }
 
-HistoryLogLine *duplicate_log_line(HistoryLogLine *l)
-{
-	HistoryLogLine *n = safe_alloc(sizeof(HistoryLogLine) + strlen(l->line));
-	strcpy(n->line, l->line); /* safe, see memory allocation above ^ */
-	hbm_duplicate_mtags(n, l->mtags);
-	return n;
-}
-
 /** Quickly append a new line 'n' to result 'r' */
 static void hbm_result_append_line(HistoryResult *r, HistoryLogLine *n)
 {
@@ -640,12 +973,17 @@ static void hbm_result_append_line(HistoryResult *r, HistoryLogLine *n)
 	}
 }
 
-/** Quickly prepend a new line 'n' to result 'r' */
-static void hbm_result_prepend_line(HistoryResult *r, HistoryLogLine *n)
+/** Append lines 'from' up to (but not including) 'to' to result 'r'.
+ * @returns Number of lines written
+ */
+static int hbm_result_append_lines(HistoryResult *r, HistoryLogObject *h, int from, int to)
 {
-	if (!r->log)
-		r->log_tail = n;
-	AddListItem(n, r->log);
+	int i;
+
+	for (i = from; i < to; i++)
+		hbm_result_append_line(r, hbm_unpack_line(HBM_LINE(h, i)));
+
+	return (to > from) ? to - from : 0;
 }
 
 /** Put lines in HistoryResult that are after a certain msgid or
@@ -660,47 +998,27 @@ static void hbm_result_prepend_line(HistoryResult *r, HistoryLogLine *n)
  */
 static int hbm_return_after(HistoryResult *r, HistoryLogObject *h, HistoryFilter *filter)
 {
-	HistoryLogLine *l, *n;
-	int written = 0;
-	int started = 0;
-	MessageTag *m;
+	int start = h->num_lines, end, i;
 
-	for (l = h->head; l; l = l->next)
-	{
-		/* Not started yet? Check if this is the starting point... */
-		if (!started)
-		{
-			if (filter->timestamp_a && ((m = find_mtag(l->mtags, "time"))) && (strcmp(m->value, filter->timestamp_a) > 0))
-			{
-				started = 1;
-			} else
-			if (filter->msgid_a && ((m = find_mtag(l->mtags, "msgid"))) && !strcmp(m->value, filter->msgid_a))
-			{
-				started = 1;
-				continue;
-			}
-		}
-		if (started)
-		{
-			/* Check if we need to stop */
-			if (filter->timestamp_b && ((m = find_mtag(l->mtags, "time"))) && (strcmp(m->value, filter->timestamp_b) >= 0))
-			{
-				break;
-			} else
-			if (filter->msgid_b && ((m = find_mtag(l->mtags, "msgid"))) && !strcmp(m->value, filter->msgid_b))
-			{
-				break;
-			}
-
-			/* Add line to the return buffer */
-			n = duplicate_log_line(l);
-			hbm_result_append_line(r, n);
-			if (++written >= filter->limit)
-				break;
-		}
-	}
-
-	return written;
+	/* Starting point: the first line after timestamp_a or after msgid_a,
+	 * whichever comes first.
+	 */
+	if (filter->timestamp_a)
+		start = hbm_find_time(h, filter->timestamp_a, 0);
+	if (filter->msgid_a && ((i = hbm_find_msgid(h, filter->msgid_a)) >= 0) && (i < start))
+		start = i + 1;
+
+	/* Stop at timestamp_b or msgid_b */
+	end = h->num_lines;
+	if (filter->timestamp_b)
+		end = MAX(hbm_find_time(h, filter->timestamp_b, 1), start);
+	if (filter->msgid_b && ((i = hbm_find_msgid(h, filter->msgid_b)) >= start) && (i < end))
+		end = i;
+
+	if (end - start > filter->limit)
+		end = start + filter->limit;
+
+	return hbm_result_append_lines(r, h, start, end);
 }
 
 /** Put lines in HistoryResult that before after a certain msgid or
@@ -713,47 +1031,26 @@ static int hbm_return_after(HistoryResult *r, HistoryLogObject *h, HistoryFilter
  */
 static int hbm_return_before(HistoryResult *r, HistoryLogObject *h, HistoryFilter *filter)
 {
-	HistoryLogLine *l, *n;
-	int written = 0;
-	int started = 0;
-	MessageTag *m;
+	int top = -1, bottom = 0, i;
 
-	for (l = h->tail; l; l = l->prev)
-	{
-		/* Not started yet? Check if this is the starting point... */
-		if (!started)
-		{
-			if (filter->timestamp_a && ((m = find_mtag(l->mtags, "time"))) && (strcmp(m->value, filter->timestamp_a) < 0))
-			{
-				started = 1;
-			} else
-			if (filter->msgid_a && ((m = find_mtag(l->mtags, "msgid"))) && !strcmp(m->value, filter->msgid_a))
-			{
-				started = 1;
-				continue;
-			}
-		}
-		if (started)
-		{
-			/* Check if we need to stop */
-			if (filter->timestamp_b && ((m = find_mtag(l->mtags, "time"))) && (strcmp(m->value, filter->timestamp_b) < 0))
-			{
-				break;
-			} else
-			if (filter->msgid_b && ((m = find_mtag(l->mtags, "msgid"))) && !strcmp(m->value, filter->msgid_b))
-			{
-				break;
-			}
+	/* Starting point (searching backwards): the last line before
+	 * timestamp_a or before msgid_a, whichever comes first.
+	 */
+	if (filter->timestamp_a)
+		top = hbm_find_time(h, filter->timestamp_a, 1) - 1;
+	if (filter->msgid_a && ((i = hbm_find_msgid(h, filter->msgid_a)) > top))
+		top = i - 1;
 
-			/* Add line to the return buffer */
-			n = duplicate_log_line(l);
-			hbm_result_prepend_line(r, n);
-			if (++written >= filter->limit)
-				break;
-		}
-	}
+	/* Stop at timestamp_b or msgid_b */
+	if (filter->timestamp_b)
+		bottom = hbm_find_time(h, filter->timestamp_b, 1);
+	if (filter->msgid_b && ((i = hbm_find_msgid(h, filter->msgid_b)) >= bottom) && (i <= top))
+		bottom = i + 1;
 
-	return written;
+	if (top - bottom + 1 > filter->limit)
+		bottom = top - filter->limit + 1;
+
+	return hbm_result_append_lines(r, h, bottom, top + 1);
 }
 
 /** Put lines in HistoryResult that are 'latest'
@@ -765,25 +1062,17 @@ static int hbm_return_before(HistoryResult *r, HistoryLogObject *h, HistoryFilte
  */
 static int hbm_return_latest(HistoryResult *r, HistoryLogObject *h, HistoryFilter *filter)
 {
-	HistoryLogLine *l, *n;
-	int written = 0;
-	MessageTag *m;
+	int bottom = 0, i;
 
-	for (l = h->tail; l; l = l->prev)
-	{
-		if (filter->timestamp_a && ((m = find_mtag(l->mtags, "time"))) && (strcmp(m->value, filter->timestamp_a) <= 0))
-			break; /* Stop now */
-		else
-		if (filter->msgid_a && ((m = find_mtag(l->mtags, "msgid"))) && !strcmp(m->value, filter->msgid_a))
-			break; /* Stop now */
+	if (filter->timestamp_a)
+		bottom = hbm_find_time(h, filter->timestamp_a, 0);
+	if (filter->msgid_a && ((i = hbm_find_msgid(h, filter->msgid_a)) >= bottom))
+		bottom = i + 1;
 
-		n = duplicate_log_line(l);
-		hbm_result_prepend_line(r, n);
-		if (++written >= filter->limit)
-			break;
-	}
+	if (h->num_lines - bottom > filter->limit)
+		bottom = h->num_lines - filter->limit;
 
-	return written;
+	return hbm_result_append_lines(r, h, bottom, h->num_lines);
 }
 
 /** Put lines in HistoryResult based on a 'simple' request, that is: maximum lines or time
@@ -795,10 +1084,8 @@ static int hbm_return_latest(HistoryResult *r, HistoryLogObject *h, HistoryFilte
  */
 static int hbm_return_simple(HistoryResult *r, HistoryLogObject *h, HistoryFilter *filter)
 {
-	HistoryLogLine *l;
-	int lines_sendable = 0, lines_to_skip = 0, cnt = 0;
+	int start, lo, hi, mid;
 	long redline;
-	int written = 0;
 
 	/* Decide on red line, under this the history is too old.
 	 * Filter can be more strict than history object (but not the other way around):
@@ -808,32 +1095,26 @@ static int hbm_return_simple(HistoryResult *r, HistoryLogObject *h, HistoryFilte
 	else
 		redline = TStime() - h->max_time;
 
+	/* Find the first line that is not too old */
+	lo = 0;
+	hi = h->num_lines;
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (HBM_LINE(h, mid)->t < redline)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	start = lo;
+
 	/* Once the filter API expands, the following will change too.
 	 * For now, this is sufficient, since requests are only about lines:
 	 */
-	lines_sendable = 0;
-	for (l = h->head; l; l = l->next)
-		if (l->t >= redline)
-			lines_sendable++;
-	if (filter && (lines_sendable > filter->last_lines))
-		lines_to_skip = lines_sendable - filter->last_lines;
-
-	for (l = h->head; l; l = l->next)
-	{
-		/* Make sure we don't send too old entries:
-		 * We only have to check for time here, as line count is already
-		 * taken into account in hbm_history_add.
-		 */
-		if (l->t >= redline && (++cnt > lines_to_skip))
-		{
-			/* Add to result */
-			HistoryLogLine *n = duplicate_log_line(l);
-			hbm_result_append_line(r, n);
-			written++;
-		}
-	}
+	if (filter && (h->num_lines - start > filter->last_lines))
+		start = h->num_lines - filter->last_lines;
 
-	return written;
+	return hbm_result_append_lines(r, h, start, h->num_lines);
 }
 
 /** Put lines in HistoryResult that are 'around' a certain point.
@@ -845,55 +1126,62 @@ static int hbm_return_simple(HistoryResult *r, HistoryLogObject *h, HistoryFilte
  */
 static int hbm_return_around(HistoryResult *r, HistoryLogObject *h, HistoryFilter *filter)
 {
-	HistoryLogLine *l, *n, *started = NULL;
-	int written = 0;
-	MessageTag *m;
-
-	for (l = h->tail; l; l = l->prev)
+	int started = -1; /* the mid-point, -1 if not found */
+	int top = -1; /* the last line before the mid-point */
+	int bottom = 0;
+	int hit_time = -1, hit_msgid = -1;
+	int written = 0, before_limit, end, i;
+
+	if (filter->timestamp_a)
+		hit_time = hbm_find_time(h, filter->timestamp_a, 1) - 1;
+	if (filter->msgid_a)
+		hit_msgid = hbm_find_msgid(h, filter->msgid_a);
+
+	if ((hit_msgid >= 0) && (hit_msgid > hit_time))
+	{
+		/* The msgid itself is the mid-point */
+		started = hit_msgid;
+		top = hit_msgid - 1;
+	} else
+	if (hit_time >= 0)
 	{
-		/* Not started yet? Check if this is the starting point... */
-		if (!started)
+		if (hit_time < h->num_lines - 1)
 		{
-			if (filter->timestamp_a && ((m = find_mtag(l->mtags, "time"))) && (strcmp(m->value, filter->timestamp_a) < 0))
-			{
-				started = l->next;
-			} else
-			if (filter->msgid_a && ((m = find_mtag(l->mtags, "msgid"))) && !strcmp(m->value, filter->msgid_a))
-			{
-				started = l;
-				continue;
-			}
-		}
-		if (started)
+			/* The mid-point is the first line at/after the timestamp */
+			started = hit_time + 1;
+			top = hit_time;
+		} else
+		if (hit_time > 0)
 		{
-			/* Check if we need to stop */
-			if (filter->timestamp_b && ((m = find_mtag(l->mtags, "time"))) && (strcmp(m->value, filter->timestamp_b) < 0))
-			{
-				break;
-			} else
-			if (filter->msgid_b && ((m = find_mtag(l->mtags, "msgid"))) && !strcmp(m->value, filter->msgid_b))
-			{
-				break;
-			}
-
-			/* Add line to the return buffer */
-			n = duplicate_log_line(l);
-			hbm_result_prepend_line(r, n);
-			if (started->next)
-			{
-				/* Normal case */
-				if (++written >= filter->limit / 2)
-					break;
-			} else {
-				/* Special case: if started->next is NULL then started is the end
-				 * of the buffer, so fill just /under/ the limit
-				 */
-				if (++written >= filter->limit - 1)
-					break;
-			}
+			/* All lines are before the timestamp: the last line is the mid-point */
+			started = h->num_lines - 1;
+			top = h->num_lines - 2;
 		}
 	}
 
+	if (started >= 0)
+	{
+		/* The messages before the mid-point. If the mid-point is the end
+		 * of the buffer then fill just /under/ the limit.
+		 */
+		if (started < h->num_lines - 1)
+			before_limit = filter->limit / 2;
+		else
+			before_limit = filter->limit - 1;
+
+		/* Check where we need to stop */
+		if (filter->timestamp_b)
+			bottom = hbm_find_time(h, filter->timestamp_b, 1);
+		if (filter->msgid_b && ((i = hbm_find_msgid(h, filter->msgid_b)) >= bottom) && (i <= top))
+			bottom = i + 1;
+
+		/* (we always send at least 1 line here, if there is one) */
+		if (top - bottom + 1 > MAX(before_limit, 1))
+			bottom = top - MAX(before_limit, 1) + 1;
+
+		written = hbm_result_append_lines(r, h, bottom, top + 1);
+	}
+
 	/* Special case:
 	 * The timestamp= was not found in our buffer (or it matched the very top),
 	 * now what to do?
@@ -901,37 +1189,30 @@ static int hbm_return_around(HistoryResult *r, HistoryLogObject *h, HistoryFilte
 	 *   then we will just print the oldest X messages.
 	 * - If it's older than <some time> we don't, resulting in an empty batch.
 	 */
-	if ((written == 0) && filter->timestamp_a && (started == NULL) && h->tail)
+	if ((written == 0) && filter->timestamp_a && (started < 0) && h->num_lines)
 	{
 		time_t requested_ts;
 		time_t oldest_we_have_ts;
-		char *tail_timestamp;
-		m = find_mtag(h->tail->mtags, "time");
-		tail_timestamp = m ? m->value : NULL;
-		if (tail_timestamp)
+
+		requested_ts = server_time_to_unix_time(filter->timestamp_a);
+		oldest_we_have_ts = server_time_to_unix_time(HBM_TIME(HBM_LINE(h, h->num_lines - 1)));
+		if (oldest_we_have_ts - requested_ts < 3600)
 		{
-			requested_ts = server_time_to_unix_time(filter->timestamp_a);
-			oldest_we_have_ts = server_time_to_unix_time(tail_timestamp);
-			if (oldest_we_have_ts - requested_ts < 3600)
-			{
-				/* Just return the oldest # messages */
-				started = h->head;
-				/* we (mis)use the loop further down to achieve this ;) */
-			}
+			/* Just return the oldest # messages */
+			started = 0;
 		}
 	}
 
-	/* In the code at the beginning of this function we added the messages
-	 * before the mid-point. Below we add the message at the mid-point and
+	/* Above we added the messages before the mid-point.
+	 * Below we add the message at the mid-point and
 	 * the messages after the mid-point.
 	 */
-	for (l = started; l; l = l->next)
+	if (started >= 0)
 	{
-		/* Add line to the return buffer */
-		n = duplicate_log_line(l);
-		hbm_result_append_line(r, n);
-		if (++written >= filter->limit)
-			break;
+		end = h->num_lines;
+		if (end - started > filter->limit - written)
+			end = started + MAX(filter->limit - written, 1);
+		written += hbm_result_append_lines(r, h, started, end);
 	}
 
 	return written;
@@ -944,67 +1225,47 @@ static int hbm_return_around(HistoryResult *r, HistoryLogObject *h, HistoryFilte
  */
 static int hbm_return_between_figure_out_direction(HistoryLogObject *h, HistoryFilter *filter)
 {
-	HistoryLogLine *l;
-	int found_a = 0;
-	int found_b = 0;
-	MessageTag *m;
+	int pos_a = h->num_lines;
+	int pos_b = h->num_lines;
+	int i;
 
 	/* Two timestamps? Then we can easily tell the direction. */
 	if (filter->timestamp_a && filter->timestamp_b)
 		return (strcmp(filter->timestamp_a, filter->timestamp_b) <= 0) ? 1 : 0;
 
-	for (l = h->head; l; l = l->next)
+	/* Find the first line matching A and the first line matching B */
+	if (filter->timestamp_a)
+		pos_a = hbm_find_time(h, filter->timestamp_a, 1);
+	if (filter->msgid_a && ((i = hbm_find_msgid(h, filter->msgid_a)) >= 0) && (i < pos_a))
+		pos_a = i;
+	if (filter->timestamp_b)
+		pos_b = hbm_find_time(h, filter->timestamp_b, 1);
+	if (filter->msgid_b && ((i = hbm_find_msgid(h, filter->msgid_b)) >= 0) && (i < pos_b))
+		pos_b = i;
+
+	if ((pos_a <= pos_b) && (pos_a < h->num_lines))
 	{
-		if (!found_a)
+		/* A was found first (or at the same line as B) */
+		if (filter->timestamp_b)
 		{
-			if (filter->timestamp_a && ((m = find_mtag(l->mtags, "time"))) && (strcmp(m->value, filter->timestamp_a) >= 0))
-			{
-				found_a = 1;
-			} else
-			if (filter->msgid_a && ((m = find_mtag(l->mtags, "msgid"))) && !strcmp(m->value, filter->msgid_a))
-			{
-				found_a = 1;
-			}
-			if (found_a)
-			{
-				if (found_b)
-				{
-					/* B was found before A? Then the result is: backwards */
-					return 0;
-				}
-				if (filter->timestamp_b && (m = find_mtag(l->mtags, "time")) && m->value)
-				{
-					/* We can already resolve the direction now: */
-					char *timestamp_a = m->value;
-					return (strcmp(timestamp_a, filter->timestamp_b) <= 0) ? 1 : 0;
-				}
-			}
+			/* We can resolve the direction now: */
+			return (strcmp(HBM_TIME(HBM_LINE(h, pos_a)), filter->timestamp_b) <= 0) ? 1 : 0;
 		}
-		if (!found_b)
+		/* A was found before B? Then the result is: forwards */
+		if (pos_b < h->num_lines)
+			return 1;
+	} else
+	if (pos_b < pos_a)
+	{
+		/* B was found first */
+		if (filter->timestamp_a)
 		{
-			if (filter->timestamp_b && ((m = find_mtag(l->mtags, "time"))) && (strcmp(m->value, filter->timestamp_b) >= 0))
-			{
-				found_b = 1;
-			} else
-			if (filter->msgid_b && ((m = find_mtag(l->mtags, "msgid"))) && !strcmp(m->value, filter->msgid_b))
-			{
-				found_b = 1;
-			}
-			if (found_b)
-			{
-				if (found_a)
-				{
-					/* A was found before B? Then the result is: forwards */
-					return 1;
-				}
-				if (filter->timestamp_a && (m = find_mtag(l->mtags, "time")) && m->value)
-				{
-					/* We can already resolve the direction now: */
-					char *timestamp_b = m->value;
-					return (strcmp(filter->timestamp_a, timestamp_b) <= 0) ? 1 : 0;
-				}
-			}
+			/* We can resolve the direction now: */
+			return (strcmp(filter->timestamp_a, HBM_TIME(HBM_LINE(h, pos_b))) <= 0) ? 1 : 0;
 		}
+		/* B was found before A? Then the result is: backwards */
+		if (pos_a < h->num_lines)
+			return 0;
 	}
 
 	/* Neither points were found OR
@@ -1053,9 +1314,6 @@ HistoryResult *hbm_history_request(const char *object, HistoryFilter *filter)
 {
 	HistoryResult *r;
 	HistoryLogObject *h = hbm_find_object(object);
-	HistoryLogLine *l;
-	int lines_sendable = 0, lines_to_skip = 0, cnt = 0;
-	long redline;
 
 	if (!h)
 		return NULL; /* nothing found */
@@ -1064,7 +1322,7 @@ HistoryResult *hbm_history_request(const char *object, HistoryFilter *filter)
 	 * No need to worry about 'count' as that is being taken care off
 	 * by hbm_history_add().
 	 */
-	if (h->oldest_t < TStime() - h->max_time)
+	if (h->num_lines && (HBM_LINE(h, 0)->t < TStime() - h->max_time))
 		hbm_history_cleanup(h);
 
 	r = safe_alloc(sizeof(HistoryResult));
@@ -1108,11 +1366,10 @@ HistoryResult *hbm_history_request(const char *object, HistoryFilter *filter)
  */
 int hbm_history_delete(const char *object, HistoryFilter *filter, int *rejected_deletes)
 {
-	HistoryLogLine *l;
 	HistoryLogObject *h = hbm_find_object(object);
 	int deleted = 0;
-	int started = 0;
-	MessageTag *m;
+	int start, end, i;
+	const char *account;
 
 	if (rejected_deletes)
 		*rejected_deletes = 0;
@@ -1120,102 +1377,77 @@ int hbm_history_delete(const char *object, HistoryFilter *filter, int *rejected_
 	if (!h)
 		return 0;
 
-	for (l = h->head; l; l = l->next)
-	{
-		/* Not started yet? Check if this is the starting point... */
-		if (!started)
-		{
-			if (filter->timestamp_a && ((m = find_mtag(l->mtags, "time"))) && (strcmp(m->value, filter->timestamp_a) > 0))
-			{
-				started = 1;
-			} else
-			if (filter->msgid_a && ((m = find_mtag(l->mtags, "msgid"))) && !strcmp(m->value, filter->msgid_a))
-			{
-				started = 1;
-			}
-		}
-		if (started)
-		{
-			/* Check if we need to stop */
-			if (filter->timestamp_b && ((m = find_mtag(l->mtags, "time"))) && (strcmp(m->value, filter->timestamp_b) >= 0))
-			{
-				break;
-			} else
-			if (filter->msgid_b && ((m = find_mtag(l->mtags, "msgid"))) && !strcmp(m->value, filter->msgid_b))
-			{
-				break;
-			}
-
-			/* Note: account comparison is case-sensitive, just to be safe in case
-			 * services do not casemap the same way we would.
-			 * This means filter->account should probably not be filled directly
-			 * from user input.
-			 */
-			if (filter->account) {
-				// TODO: check account-tag module is loaded?
-				m = find_mtag(l->mtags, "account");
-				if (!m || strcmp(m->value, filter->account)) {
-					if (rejected_deletes)
-						(*rejected_deletes)++;
-					continue;
-				}
+	/* Starting point: the first line after timestamp_a or the msgid_a line
+	 * itself, whichever comes first.
+	 */
+	start = h->num_lines;
+	if (filter->timestamp_a)
+		start = hbm_find_time(h, filter->timestamp_a, 0);
+	if (filter->msgid_a && ((i = hbm_find_msgid(h, filter->msgid_a)) >= 0) && (i < start))
+		start = i;
+
+	/* Stop at timestamp_b or msgid_b */
+	end = h->num_lines;
+	if (filter->timestamp_b)
+		end = MAX(hbm_find_time(h, filter->timestamp_b, 1), start);
+	if (filter->msgid_b && ((i = hbm_find_msgid(h, filter->msgid_b)) >= start) && (i < end))
+		end = i;
+
+	for (i = start; (i < end) && (deleted < filter->limit);)
+	{
+		/* Note: account comparison is case-sensitive, just to be safe in case
+		 * services do not casemap the same way we would.
+		 * This means filter->account should probably not be filled directly
+		 * from user input.
+		 */
+		if (filter->account) {
+			// TODO: check account-tag module is loaded?
+			account = hbm_entry_mtag(HBM_LINE(h, i), "account");
+			if (!account || strcmp(account, filter->account)) {
+				if (rejected_deletes)
+					(*rejected_deletes)++;
+				i++;
+				continue;
 			}
-
-			/* Remove line from the history */
-			hbm_history_del_line(h, l);
-			if (++deleted >= filter->limit)
-				break;
 		}
 
-		if (deleted >= filter->limit)
-			break;
+		/* Remove line from the history, the next line moves into index 'i' */
+		hbm_history_del_line(h, i);
+		end--;
+		deleted++;
 	}
 
+	/* The deleted lines could still be in a segment, so rewrite it all */
+	if (deleted)
+		h->rewrite = 1;
+
 	return deleted;
 }
 
 /** Clean up expired entries */
 int hbm_history_cleanup(HistoryLogObject *h)
 {
-	HistoryLogLine *l, *l_next = NULL;
 	long redline = TStime() - h->max_time;
+	int size;
 
-	/* First enforce 'h->max_time', after that enforce 'h->max_lines' */
-
-	/* Checking for time */
-	if (h->oldest_t < redline)
-	{
-		h->oldest_t = 0; /* recalculate in next loop */
+	/* First enforce 'h->max_time', after that enforce 'h->max_lines'.
+	 * Since the lines are sorted by time, both are removals from the start.
+	 */
+	while (h->num_lines && (HBM_LINE(h, 0)->t < redline))
+		hbm_history_del_line(h, 0); /* too old, delete it */
 
-		for (l = h->head; l; l = l_next)
-		{
-			l_next = l->next;
-			if (l->t < redline)
-			{
-				hbm_history_del_line(h, l); /* too old, delete it */
-				continue;
-			}
-			if ((h->oldest_t == 0) || (l->t < h->oldest_t))
-				h->oldest_t = l->t;
-		}
-	}
+	while (h->num_lines > h->max_lines)
+		hbm_history_del_line(h, 0);
 
-	if (h->num_lines > h->max_lines)
+	/* Shrink the ring if it is mostly unused */
+	if (h->num_lines == 0)
 	{
-		h->oldest_t = 0; /* recalculate in next loop */
-
-		for (l = h->head; l; l = l_next)
-		{
-			l_next = l->next;
-			if (h->num_lines > h->max_lines)
-			{
-				hbm_history_del_line(h, l);
-				continue;
-			}
-			if ((h->oldest_t == 0) || (l->t < h->oldest_t))
-				h->oldest_t = l->t;
-		}
+		size = 0;
+	} else {
+		for (size = h->lines_size; (size > HISTORY_RING_MIN_SIZE) && (h->num_lines <= size / 4); size /= 2);
 	}
+	if (size != h->lines_size)
+		hbm_resize(h, size);
 
 	return 1;
 }
@@ -1223,22 +1455,15 @@ int hbm_history_cleanup(HistoryLogObject *h)
 int hbm_history_destroy(const char *object)
 {
 	HistoryLogObject *h = hbm_find_object(object);
-	HistoryLogLine *l, *l_next;
+	int i;
 
 	if (!h)
 		return 0;
 
-	for (l = h->head; l; l = l_next)
-	{
-		l_next = l->next;
-		/* We could use hbm_history_del_line() here but
-		 * it does unnecessary work, this is quicker.
-		 * The only danger is that we may forget to free some
-		 * fields that are added later there but not here.
-		 */
-		free_message_tags(l->mtags);
-		safe_free(l);
-	}
+	for (i = 0; i < h->num_lines; i++)
+		safe_free(HBM_LINE(h, i));
+	safe_free(h->lines);
+	safe_free(h->msgid_index);
 
 	hbm_delete_object_hlo(h);
 	return 1;
@@ -1365,6 +1590,14 @@ static int hbm_write_masterdb(void)
 static void hbm_read_dbs(void)
 {
 	char buf[512];
+#ifdef BENCHMARK
+	struct timeval tv_alpha, tv_beta;
+	HistoryLogObject *h;
+	long lines = 0;
+	int i, cnt = 0;
+
+	gettimeofday(&tv_alpha, NULL);
+#endif
 #ifndef _WIN32
 	struct dirent *dir;
 	DIR *fd = opendir(cfg.directory);
@@ -1397,6 +1630,9 @@ static void hbm_read_dbs(void)
 		snprintf(buf, sizeof(buf), "%s/%s", cfg.directory, fname);
 		if (filename_has_suffix(fname, ".db") && strcmp(fname, "master.db"))
 		{
+#ifdef BENCHMARK
+			cnt++;
+#endif
 			if (!hbm_read_db(buf))
 			{
 				/* On error, we move the file to the 'bad' subdirectory,
@@ -1423,6 +1659,17 @@ static void hbm_read_dbs(void)
 	} while (FindNextFile(hFile, &hData));
 	FindClose(hFile);
 #endif
+#ifdef BENCHMARK
+	gettimeofday(&tv_beta, NULL);
+	for (i = 0; i < HISTORY_BACKEND_MEM_HASH_TABLE_SIZE; i++)
+		for (h = history_hash_table[i]; h; h = h->next)
+			lines += h->num_lines;
+	unreal_log(ULOG_DEBUG, "history", "HISTORYDB_BENCHMARK", NULL,
+	           "[history] Benchmark: LOAD DB: $count objects ($lines lines) in $time_msec microseconds",
+	           log_data_integer("count", cnt),
+	           log_data_integer("lines", lines),
+	           log_data_integer("time_msec", ((tv_beta.tv_sec - tv_alpha.tv_sec) * 1000000) + (tv_beta.tv_usec - tv_alpha.tv_usec)));
+#endif
 }
 
 #define RESET_VALUES_LOOP()	do { \
@@ -1452,8 +1699,115 @@ static void hbm_read_dbs(void)
 	} while(0)
 
 
-/** Read a channel history db file */
+/** Get the filename of segment 'n' that belongs to database file 'fname' */
+static const char *hbm_segment_filename(const char *fname, int n)
+{
+	static char segfname[512];
+	int len = strlen(fname);
+
+	if (filename_has_suffix(fname, ".db"))
+		len -= 3;
+	snprintf(segfname, sizeof(segfname), "%.*s.%d.seg", len, fname, n);
+	return segfname;
+}
+
+/** Delete all segment files that belong to database file 'fname' */
+static void hbm_delete_segments(const char *fname)
+{
+	const char *segfname;
+	int n;
+
+	for (n = 1; ; n++)
+	{
+		segfname = hbm_segment_filename(fname, n);
+		if (!file_exists(segfname))
+			break;
+		unlink(segfname);
+	}
+}
+
+/** Check if a line from a segment file is already in the history (or older).
+ * Segments are written in order, so every line in a segment is at least
+ * as new as the lines before it. A crash during compaction can leave
+ * behind segments with lines that are already in the database file,
+ * and these must not be added again.
+ */
+static int hbm_segment_line_is_stale(HistoryLogObject *h, MessageTag *mtags)
+{
+	MessageTag *m;
+	int cmp;
+
+	if (!h->num_lines || !(m = find_mtag(mtags, "time")) || !m->value)
+		return 0;
+
+	cmp = strcmp(m->value, HBM_TIME(HBM_LINE(h, h->num_lines - 1)));
+	if (cmp < 0)
+		return 1;
+	if ((cmp == 0) && (m = find_mtag(mtags, "msgid")) && m->value && (hbm_find_msgid(h, m->value) >= 0))
+		return 1;
+	return 0;
+}
+
+/** Read a channel history db file, and replay the segments that follow it */
 static int hbm_read_db(const char *fname)
+{
+	HistoryLogObject *h = NULL;
+	const char *segfname;
+	int lines = 0;
+	int n;
+
+	if (!hbm_read_db_file(fname, &h, &lines))
+		return 0;
+
+	if (!h)
+	{
+		/* Channel has no +H (and the .db is already deleted) */
+		hbm_delete_segments(fname);
+		return 1;
+	}
+
+	h->rewrite = 0;
+	for (n = 1; ; n++)
+	{
+		segfname = hbm_segment_filename(fname, n);
+		if (!file_exists(segfname))
+			break;
+		if (!hbm_read_db_file(segfname, &h, &lines))
+		{
+			/* Keep what we have, and write a fresh database file on next save,
+			 * which also takes care of deleting the segments.
+			 */
+			h->rewrite = 1;
+			break;
+		}
+	}
+
+	/* Prevent directly rewriting the channel, now that we have just read it.
+	 * This could cause things not to fire in case of corner issues like
+	 * hot-loading but that should be acceptable. The alternative is that
+	 * all log files are written again with identical contents for no reason,
+	 * which is a waste of resources.
+	 */
+	h->dirty = 0;
+	h->unsaved_lines = 0;
+	h->disk_lines = lines;
+	h->num_segments = n - 1;
+
+	/* The msgid index was only needed for skipping duplicates */
+	safe_free(h->msgid_index);
+	return 1;
+}
+
+/** Read a channel history db file or segment file.
+ * @param fname		The file name
+ * @param hp		The history object: if it points to NULL then it is
+ *			set to the history object that the file belongs to,
+ *			otherwise the file must belong to this history object.
+ *			It is left at NULL if the channel does not exist (anymore).
+ * @param lines		The number of lines read is added to this.
+ * @returns 1 on success, 0 on error.
+ */
+static int hbm_read_db_file(const char *fname, HistoryLogObject **hp, int *lines)
 {
 	UnrealDB *db = NULL;
 	// header
@@ -1472,6 +1826,7 @@ static int hbm_read_db(const char *fname)
 	MessageTag *mtags = NULL, *m;
 	char *line = NULL;
 	HistoryLogObject *h;
+	int segment = *hp ? 1 : 0;
 
 	db = unrealdb_open(fname, UNREALDB_MODE_READ, cfg.db_secret);
 	if (!db)
@@ -1520,6 +1875,13 @@ static int hbm_read_db(const char *fname)
 	R_SAFE(unrealdb_read_int64(db, &max_lines));
 	R_SAFE(unrealdb_read_int64(db, &max_time));
 	h = hbm_find_object(object);
+	if (*hp && (h != *hp))
+	{
+		config_warn("[history] Segment '%s' belongs to a different channel (%s). File ignored.",
+			fname, object);
+		R_SAFE_CLEANUP();
+		return 0;
+	}
 	if (!h)
 	{
 		config_warn("Channel %s does not have +H set, deleting history", object);
@@ -1527,6 +1889,7 @@ static int hbm_read_db(const char *fname)
 		unlink(fname);
 		return 1; /* No problem */
 	}
+	*hp = h;
 
 	while(1)
 	{
@@ -1565,17 +1928,11 @@ static int hbm_read_db(const char *fname)
 			R_SAFE_CLEANUP();
 			return 0;
 		}
-		hbm_history_add(object, mtags, line);
+		(*lines)++;
+		if (!segment || !hbm_segment_line_is_stale(h, mtags))
+			hbm_history_add(object, mtags, line);
 	}
 
-	/* Prevent directly rewriting the channel, now that we have just read it.
-	 * This could cause things not to fire in case of corner issues like
-	 * hot-loading but that should be acceptable. The alternative is that
-	 * all log files are written again with identical contents for no reason,
-	 * which is a waste of resources.
-	 */
-	h->dirty = 0;
-
 	R_SAFE_CLEANUP();
 	return 1;
 }
@@ -1691,23 +2048,20 @@ const char *hbm_history_filename(HistoryLogObject *h)
 
 // FIXME: the code below will cause massive floods on disk or I/O errors if hundreds of
 // channel logs fail to write... fun.
-static int hbm_write_db(HistoryLogObject *h)
+/** Write a channel history db file or segment file.
+ * @param h		The history log object
+ * @param realfname	The file name
+ * @param from		Index of the first line to write, eg 0 for all lines
+ * @returns 1 on success, 0 on error.
+ */
+static int hbm_write_db_file(HistoryLogObject *h, const char *realfname, int from)
 {
 	UnrealDB *db;
-	const char *realfname;
 	char tmpfname[512];
-	HistoryLogLine *l;
-	MessageTag *m;
-	Channel *channel;
+	HistoryLogEntry *e;
+	const char *p, *name, *value;
+	int i, j;
 
-	if (!cfg.db_secret)
-		abort();
-
-	channel = find_channel(h->name);
-	if (!channel || !has_channel_mode(channel, 'P'))
-		return 1; /* Don't save this channel, pretend success */
-
-	realfname = hbm_history_filename(h);
 	snprintf(tmpfname, sizeof(tmpfname), "%s.tmp", realfname);
 
 	db = unrealdb_open(tmpfname, UNREALDB_MODE_WRITE, cfg.db_secret);
@@ -1726,18 +2080,21 @@ static int hbm_write_db(HistoryLogObject *h)
 	W_SAFE(unrealdb_write_int64(db, h->max_lines));
 	W_SAFE(unrealdb_write_int64(db, h->max_time));
 
-	for (l = h->head; l; l = l->next)
+	for (i = from; i < h->num_lines; i++)
 	{
+		e = HBM_LINE(h, i);
 		W_SAFE(unrealdb_write_int32(db, HISTORYDB_MAGIC_ENTRY_START));
-		W_SAFE(unrealdb_write_int64(db, l->t));
-		for (m = l->mtags; m; m = m->next)
+		W_SAFE(unrealdb_write_int64(db, e->t));
+		p = e->data;
+		for (j = 0; j < e->num_mtags; j++)
 		{
-			W_SAFE(unrealdb_write_str(db, m->name));
-			W_SAFE(unrealdb_write_str(db, m->value)); /* can be NULL */
+			p = hbm_next_mtag(p, &name, &value);
+			W_SAFE(unrealdb_write_str(db, name));
+			W_SAFE(unrealdb_write_str(db, value)); /* can be NULL */
 		}
 		W_SAFE(unrealdb_write_str(db, NULL));
 		W_SAFE(unrealdb_write_str(db, NULL));
-		W_SAFE(unrealdb_write_str(db, l->line));
+		W_SAFE(unrealdb_write_str(db, e->data + e->line_offset));
 		W_SAFE(unrealdb_write_int32(db, HISTORYDB_MAGIC_ENTRY_END));
 	}
 	W_SAFE(unrealdb_write_int32(db, HISTORYDB_MAGIC_FILE_END));
@@ -1759,7 +2116,63 @@ static int hbm_write_db(HistoryLogObject *h)
 		return 0;
 	}
 
+	return 1;
+}
+
+/** Save a history log object to disk.
+ * Normally only the new lines are written, to a new segment file.
+ * Every now and then the database file is rewritten as a whole,
+ * see the comment at HISTORYDB_MAX_SEGMENTS for when that happens.
+ */
+static int hbm_write_db(HistoryLogObject *h)
+{
+	char realfname[512];
+	Channel *channel;
+	int stale_lines;
+
+	if (!cfg.db_secret)
+		abort();
+
+	channel = find_channel(h->name);
+	if (!channel || !has_channel_mode(channel, 'P'))
+	{
+		/* Don't save this channel, pretend success.
+		 * If the channel is set +P later, then write it as a whole.
+		 */
+		h->rewrite = 1;
+		return 1;
+	}
+
+	strlcpy(realfname, hbm_history_filename(h), sizeof(realfname));
+
+	/* Lines that are on disk but no longer in the history */
+	stale_lines = h->disk_lines - (h->num_lines - h->unsaved_lines);
+
+	if (h->rewrite || (h->num_segments >= HISTORYDB_MAX_SEGMENTS) ||
+	    ((stale_lines > 0) && (stale_lines * 2 > h->disk_lines)))
+	{
+		/* Compaction: rewrite the database file and get rid of the segments */
+		if (!hbm_write_db_file(h, realfname, 0))
+			return 0;
+		hbm_delete_segments(realfname);
+		h->rewrite = 0;
+		h->num_segments = 0;
+		h->disk_lines = h->num_lines;
+	} else
+	if (h->unsaved_lines)
+	{
+		/* Append the new lines as a new segment */
+		if (!hbm_write_db_file(h, hbm_segment_filename(realfname, h->num_segments + 1), h->num_lines - h->unsaved_lines))
+			return 0;
+		h->num_segments++;
+		h->disk_lines += h->unsaved_lines;
+	}
+	/* else: only lines expired or got pushed out, which is taken care of
+	 * when loading, so no need to write anything now.
+	 */
+
 	/* Now that everything was successful, clear the dirty flag */
+	h->unsaved_lines = 0;
 	h->dirty = 0;
 	return 1;
 }
@@ -1777,6 +2190,9 @@ static void hbm_delete_db(HistoryLogObject *h)
 	}
 	fname = hbm_history_filename(h);
 	unlink(fname);
+	hbm_delete_segments(fname);
+	h->num_segments = 0;
+	h->disk_lines = 0;
 }
 
 void hbm_generic_free(ModData *m)
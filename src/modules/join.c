@@ -509,7 +509,7 @@ void _do_join(Client *client, int parc, const char *parv[])
 		if (!channel)
 			continue; /* would be VERY rare, but e.g. for empty chan ('') */
 
-		if (find_membership_link(client->user->channel, channel))
+		if (find_membership(client, channel))
 			continue; /* user already in channel, so JOIN ignored */
 
 		i = HOOK_CONTINUE;
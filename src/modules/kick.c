@@ -220,7 +220,7 @@ CMD_FUNC(cmd_kick)
 		if (!target->user)
 			continue; /* non-user */
 
-		lp = find_membership_link(target->user->channel, channel);
+		lp = find_membership(target, channel);
 		if (!lp)
 		{
 			if (MyUser(client))
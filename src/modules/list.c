@@ -40,7 +40,8 @@ typedef struct ChannelListOptions ChannelListOptions;
 struct ChannelListOptions {
 	NameList *yeslist;
 	NameList *nolist;
-	unsigned int starthash;
+	unsigned long cursor;
+	short int started;
 	short int showall;
 	unsigned short usermin;
 	int  usermax;
@@ -311,6 +312,88 @@ CMD_FUNC(cmd_list)
 
 	sendnumeric(client, RPL_LISTEND);
 }
+
+typedef struct ListContext ListContext;
+struct ListContext {
+	Client *client;
+	ChannelListOptions *lopt;
+	int numsend;
+};
+
+/** Send a single channel of the /LIST output, if it matches the criteria.
+ * This is the callback for hash_scan_channels().
+ */
+static int send_list_channel(HashNode *node, void *data)
+{
+	ListContext *ctx = (ListContext *)data;
+	Client *client = ctx->client;
+	ChannelListOptions *lopt = ctx->lopt;
+	Channel *channel = container_of(node, Channel, channel_hash);
+
+	if (SecretChannel(channel)
+	    && !IsMember(client, channel)
+	    && !ValidatePermissionsForPath("channel:see:list:secret",client,NULL,channel,NULL))
+		return 0;
+
+	/* set::hide-list { deny-channel } */
+	if (!IsOper(client) && iConf.hide_list && find_channel_allowed(client, channel->name))
+		return 0;
+
+	/* Similarly, hide unjoinable channels for non-ircops since it would be confusing */
+	if (!IsOper(client) && !valid_channelname(channel->name))
+		return 0;
+
+	/* Much more readable like this -- codemastr */
+	if ((!lopt->showall))
+	{
+		/* User count must be in range */
+		if ((channel->users < lopt->usermin) ||
+		    ((lopt->usermax >= 0) && (channel->users > lopt->usermax)))
+			return 0;
+
+		/* Creation time must be in range */
+		if ((channel->creationtime && (channel->creationtime < lopt->chantimemin)) ||
+		    (channel->creationtime > lopt->chantimemax))
+			return 0;
+
+		/* Topic time must be in range */
+		if ((channel->topic_time < lopt->topictimemin) ||
+		    (channel->topic_time > lopt->topictimemax))
+			return 0;
+
+		/* Must not be on nolist (if it exists) */
+		if (lopt->nolist && find_name_list_match(lopt->nolist, channel->name))
+			return 0;
+
+		/* Must be on yeslist (if it exists) */
+		if (lopt->yeslist && !find_name_list_match(lopt->yeslist, channel->name))
+			return 0;
+	}
+	modebuf[0] = '[';
+	channel_modes(client, modebuf+1, parabuf, sizeof(modebuf)-1, sizeof(parabuf), channel, 0);
+	if (modebuf[2] == '\0')
+		modebuf[0] = '\0';
+	else
+		strlcat(modebuf, "]", sizeof modebuf);
+	if (!ValidatePermissionsForPath("channel:see:list:secret",client,NULL,channel,NULL))
+		sendnumeric(client, RPL_LIST,
+		    ShowChannel(client,
+		    channel) ? channel->name :
+		    "*", channel->users,
+		    ShowChannel(client, channel) ?
+		    modebuf : "",
+		    ShowChannel(client,
+		    channel) ? (channel->topic ?
+		    channel->topic : "") : "");
+	else
+		sendnumeric(client, RPL_LIST, channel->name,
+		    channel->users,
+		    modebuf,
+		    (channel->topic ? channel->topic : ""));
+	ctx->numsend--;
+	return 0;
+}
+
 /*
  * The function which sends the actual channel list back to the user.
  * Operates by stepping through the hashtable, sending the entries back if
@@ -320,22 +403,26 @@ CMD_FUNC(cmd_list)
  */
 int send_list(Client *client)
 {
-	Channel *channel;
 	ChannelListOptions *lopt = CHANNELLISTOPTIONS(client);
-	unsigned int  hashnum;
-	int numsend = (get_sendq(client) / 768) + 1; /* (was previously hard-coded) */
+	ListContext ctx;
+
+	ctx.client = client;
+	ctx.lopt = lopt;
+	ctx.numsend = (get_sendq(client) / 768) + 1; /* (was previously hard-coded) */
 	/* ^
 	 * numsend = Number (roughly) of lines to send back. Once this number has
 	 * been exceeded, send_list will finish with the current hash bucket,
-	 * and record that number as the number to start next time send_list
+	 * and record the scan cursor to continue from next time send_list
 	 * is called for this user. So, this function will almost always send
 	 * back more lines than specified by numsend (though not by much,
 	 * assuming the hashing algorithm works well). Be conservative in your
 	 * choice of numsend. -Rak
+	 * The cursor stays valid if the channel hash table is resized in
+	 * between calls, see hashtable_scan().
 	 */	
 
 	/* Begin of /LIST? then send official channels first. */
-	if ((lopt->starthash == 0) && conf_offchans)
+	if (!lopt->started && conf_offchans)
 	{
 		ConfigItem_offchans *x;
 		for (x = conf_offchans; x; x = x->next)
@@ -347,79 +434,13 @@ int send_list(Client *client)
 		}
 	}
 
-	for (hashnum = lopt->starthash; hashnum < CHAN_HASH_TABLE_SIZE; hashnum++)
-	{
-		if (numsend > 0)
-			for (channel = hash_get_chan_bucket(hashnum); channel; channel = channel->hnextch)
-			{
-				if (SecretChannel(channel)
-				    && !IsMember(client, channel)
-				    && !ValidatePermissionsForPath("channel:see:list:secret",client,NULL,channel,NULL))
-					continue;
-
-				/* set::hide-list { deny-channel } */
-				if (!IsOper(client) && iConf.hide_list && find_channel_allowed(client, channel->name))
-					continue;
-
-				/* Similarly, hide unjoinable channels for non-ircops since it would be confusing */
-				if (!IsOper(client) && !valid_channelname(channel->name))
-					continue;
-
-				/* Much more readable like this -- codemastr */
-				if ((!lopt->showall))
-				{
-					/* User count must be in range */
-					if ((channel->users < lopt->usermin) ||
-					    ((lopt->usermax >= 0) && (channel->users > lopt->usermax)))
-						continue;
-
-					/* Creation time must be in range */
-					if ((channel->creationtime && (channel->creationtime < lopt->chantimemin)) ||
-					    (channel->creationtime > lopt->chantimemax))
-						continue;
-
-					/* Topic time must be in range */
-					if ((channel->topic_time < lopt->topictimemin) ||
-					    (channel->topic_time > lopt->topictimemax))
-						continue;
-
-					/* Must not be on nolist (if it exists) */
-					if (lopt->nolist && find_name_list_match(lopt->nolist, channel->name))
-						continue;
-
-					/* Must be on yeslist (if it exists) */
-					if (lopt->yeslist && !find_name_list_match(lopt->yeslist, channel->name))
-						continue;
-				}
-				modebuf[0] = '[';
-				channel_modes(client, modebuf+1, parabuf, sizeof(modebuf)-1, sizeof(parabuf), channel, 0);
-				if (modebuf[2] == '\0')
-					modebuf[0] = '\0';
-				else
-					strlcat(modebuf, "]", sizeof modebuf);
-				if (!ValidatePermissionsForPath("channel:see:list:secret",client,NULL,channel,NULL))
-					sendnumeric(client, RPL_LIST,
-					    ShowChannel(client,
-					    channel) ? channel->name :
-					    "*", channel->users,
-					    ShowChannel(client, channel) ?
-					    modebuf : "",
-					    ShowChannel(client,
-					    channel) ? (channel->topic ?
-					    channel->topic : "") : "");
-				else
-					sendnumeric(client, RPL_LIST, channel->name,
-					    channel->users,
-					    modebuf,
-					    (channel->topic ? channel->topic : ""));
-				numsend--;
-			}
-		else
-			break;
-	}
+	do {
+		lopt->started = 1;
+		lopt->cursor = hash_scan_channels(lopt->cursor, send_list_channel, &ctx);
+	} while (lopt->cursor && (ctx.numsend > 0));
 
 	/* All done */
-	if (hashnum == CHAN_HASH_TABLE_SIZE)
+	if (lopt->cursor == 0)
 	{
 		sendnumeric(client, RPL_LISTEND);
 		free_list_options(client);
@@ -430,7 +451,6 @@ int send_list(Client *client)
 	 * We've exceeded the limit on the number of channels to send back
 	 * at once.
 	 */
-	lopt->starthash = hashnum;
 	return 1;
 }
 
@@ -163,7 +163,7 @@ int can_send_to_member_mode(Client *client, Channel *channel, char mode)
 	if (op_can_override("channel:override:message:prefix",client,channel,NULL))
 		return 1;
 
-	lp = find_membership_link(client->user->channel, channel);
+	lp = find_membership(client, channel);
 
 	/* Check if user is allowed to send. RULES:
 	 * Need at least voice (+) in order to send to +,% or @
@@ -647,7 +647,7 @@ int _can_send_to_channel(Client *client, Channel *channel, const char **msgtext,
 
 	member = IsMember(client, channel);
 
-	lp = find_membership_link(client->user->channel, channel);
+	lp = find_membership(client, channel);
 
 	/* Modules can plug in as well */
 	for (h = Hooks[HOOKTYPE_CAN_SEND_TO_CHANNEL]; h; h = h->next)
@@ -680,7 +680,7 @@ int _can_send_to_channel(Client *client, Channel *channel, const char **msgtext,
 		/* Don't send message if the user was previously a member
 		 * and isn't anymore, so if the user is KICK'ed, eg by floodprot.
 		 */
-		if (member && !IsDead(client) && !find_membership_link(client->user->channel, channel))
+		if (member && !IsDead(client) && !find_membership(client, channel))
 			*errmsg = NULL;
 		return 0;
 	}
@@ -794,18 +794,18 @@ void do_mode_char_member_mode_new(Channel *channel, Cmode *handler, const char *
 	if (!target->user)
 		return;
 
-	if (!(membership = find_membership_link(target->user->channel, channel)))
+	if (!(membership = find_membership(target, channel)))
 	{
 		sendnumeric(client, ERR_USERNOTINCHANNEL, target->name, channel->name);
 		return;
 	}
-	member = find_member_link(channel->members, target);
+	member = find_member(channel, target);
 	if (!member)
 	{
 		/* should never happen */
 		unreal_log(ULOG_ERROR, "mode", "BUG_FIND_MEMBER_LINK_FAILED", target,
 			   "[BUG] Client $target.details on channel $channel: "
-			   "found via find_membership_link() but NOT found via find_member_link(). "
+			   "found via find_membership() but NOT found via find_member(). "
 			   "This should never happen! Please report on https://bugs.unrealircd.org/",
 			   log_data_client("target", target),
 			   log_data_channel("channel", channel));
@@ -827,7 +827,7 @@ void do_mode_char_member_mode_new(Channel *channel, Cmode *handler, const char *
 		Membership *my_membership;
 
 		/* Set "my_access" to access flags of the requestor */
-		if (IsUser(client) && (my_membership = find_membership_link(client->user->channel, channel)))
+		if (IsUser(client) && (my_membership = find_membership(client, channel)))
 			my_access = my_membership->member_modes; /* client */
 		else
 			my_access = ""; /* server */
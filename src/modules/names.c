@@ -114,7 +114,7 @@ CMD_FUNC(cmd_names)
 
 	/* cache whether this user is a member of this channel or not */
 	if (IsUser(client))
-		us = find_membership_link(client->user->channel, channel);
+		us = find_membership(client, channel);
 
 	// FIXME: consider rewriting this whole thing to get rid of pointer juggling and stuff.
 
@@ -216,6 +216,7 @@ CMD_FUNC(cmd_nick_remote)
 	/* Finally set new nick name. */
 	del_from_client_hash_table(client->name, client);
 	strlcpy(client->name, nick, sizeof(client->name));
+	client->user->mask_generation++;
 	add_to_client_hash_table(nick, client);
 
 	RunHook(HOOKTYPE_POST_REMOTE_NICKCHANGE, client, mtags, oldnick);
@@ -451,6 +452,8 @@ CMD_FUNC(cmd_nick_local)
 	del_from_client_hash_table(client->name, client);
 
 	strlcpy(client->name, nick, sizeof(client->name));
+	if (client->user)
+		client->user->mask_generation++;
 	add_to_client_hash_table(nick, client);
 
 	/* update fdlist --nenolod */
@@ -122,7 +122,7 @@ CMD_FUNC(cmd_part)
 		 */
 		comment = commentx;
 
-		if (!(lp = find_membership_link(client->user->channel, channel)))
+		if (!(lp = find_membership(client, channel)))
 		{
 			/* Normal to get get when our client did a kick
 			   ** for a remote client (who sends back a PART),
@@ -709,10 +709,12 @@ int reputation_save_db(void)
 	if (cfg.db_secret == NULL)
 		return reputation_save_db_old();
 
-	/* We write to a temporary file. Only to rename it later if everything was ok */
-	snprintf(tmpfname, sizeof(tmpfname), "%s.%x.tmp", cfg.database, getrandom32());
+	/* We only serialize it here. The database writer thread encrypts it,
+	 * writes it to a temporary file and renames it if everything was ok.
+	 */
+	snprintf(tmpfname, sizeof(tmpfname), "%s.tmp", cfg.database);
 
-	db = unrealdb_open(tmpfname, UNREALDB_MODE_WRITE, cfg.db_secret);
+	db = unrealdb_open(cfg.database, UNREALDB_MODE_WRITE_ASYNC, cfg.db_secret);
 	if (!db)
 	{
 		WARN_WRITE_ERROR(tmpfname);
@@ -742,28 +744,15 @@ int reputation_save_db(void)
 		}
 	}
 
+	/* This only queues the write. reputation_writtentime is updated
+	 * from unrealdb_async_written_time() when it is needed.
+	 */
 	if (!unrealdb_close(db))
 	{
 		WARN_WRITE_ERROR(tmpfname);
 		return 0;
 	}
 
-	/* Everything went fine. We rename our temporary file to the existing
-	 * DB file (will overwrite), which is more or less an atomic operation.
-	 */
-#ifdef _WIN32
-	/* The rename operation cannot be atomic on Windows as it will cause a "file exists" error */
-	unlink(cfg.database);
-#endif
-	if (rename(tmpfname, cfg.database) < 0)
-	{
-		config_error("ERROR renaming '%s' to '%s': %s -- DATABASE *NOT* SAVED!!!",
-			tmpfname, cfg.database, strerror(ERRNO));
-		return 0;
-	}
-
-	reputation_writtentime = TStime();
-
 #ifdef BENCHMARK
 	gettimeofday(&tv_beta, NULL);
 	unreal_log(ULOG_DEBUG, "reputation", "REPUTATION_BENCHMARK", NULL,
@@ -1164,6 +1153,9 @@ CMD_FUNC(reputation_user_cmd)
 		sendnotice(client, "Recording for: %lld seconds (since unixtime %lld)",
 			(long long)(TStime() - reputation_starttime),
 			(long long)reputation_starttime);
+		/* The database is written in the background, see reputation_save_db() */
+		if (cfg.db_secret && (unrealdb_async_written_time(cfg.database) > reputation_writtentime))
+			reputation_writtentime = unrealdb_async_written_time(cfg.database);
 		if (reputation_writtentime)
 		{
 			sendnotice(client, "Last successful db write: %lld seconds ago (unixtime %lld)",
@@ -174,7 +174,7 @@ CMD_FUNC(cmd_sajoin)
 				continue;
 			}
 
-			if (!parted && channel && (lp = find_membership_link(target->user->channel, channel)))
+			if (!parted && channel && (lp = find_membership(target, channel)))
 			{
 				sendnumeric(client, ERR_USERONCHANNEL, target->name, name);
 				continue;
@@ -236,7 +236,7 @@ CMD_FUNC(cmd_sajoin)
 			}
 			member_modes = (ChannelExists(name)) ? "" : LEVEL_ON_JOIN;
 			channel = make_channel(name);
-			if (channel && (lp = find_membership_link(target->user->channel, channel)))
+			if (channel && (lp = find_membership(target, channel)))
 				continue;
 
 			i = HOOK_CONTINUE;
@@ -171,7 +171,7 @@ CMD_FUNC(cmd_sapart)
 			continue;
 		}
 
-		if (!(lp = find_membership_link(target->user->channel, channel)))
+		if (!(lp = find_membership(target, channel)))
 		{
 			sendnumeric(client, ERR_USERNOTINCHANNEL, target->name, name);
 			continue;
@@ -289,9 +289,10 @@ CMD_FUNC(cmd_sjoin)
 			safe_free(ban->who);
 			free_ban(ban);
 		}
+		channel->ban_generation++;
 		for (lp = channel->members; lp; lp = lp->next)
 		{
-			Membership *lp2 = find_membership_link(lp->client->user->channel, channel);
+			Membership *lp2 = find_membership(lp->client, channel);
 
 			/* Remove all our modes, one by one */
 			for (p = lp->member_modes; *p; p++)
@@ -300,6 +301,7 @@ CMD_FUNC(cmd_sjoin)
 			}
 			/* And clear all the flags in memory */
 			*lp->member_modes = *lp2->member_modes = '\0';
+			lp->member_modes_mask = lp2->member_modes_mask = 0;
 		}
 		if (b > 1)
 		{
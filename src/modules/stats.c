@@ -85,6 +85,7 @@ int stats_spamfilter(Client *, const char *);
 int stats_fdtable(Client *, const char *);
 int stats_linecache(Client *client, const char *para);
 int stats_maxperip(Client *, const char *);
+int stats_hash(Client *, const char *);
 
 #define SERVER_AS_PARA 0x1
 #define FLAGS_AS_PARA 0x2
@@ -99,6 +100,8 @@ struct statstab {
 /* Must be listed lexicographically */
 /* Long flags must be lowercase */
 struct statstab StatsTable[] = {
+	{ '8', "maxperip",	stats_maxperip,		0		},
+	{ '9', "linecache",	stats_linecache,	0		},
 	{ 'B', "banversion",	stats_banversion,	0		},
 	{ 'C', "link", 		stats_links,		0 		},
 	{ 'G', "gline",		stats_gline,		FLAGS_AS_PARA	},
@@ -136,8 +139,7 @@ struct statstab StatsTable[] = {
 	{ 'v', "denyver",	stats_denyver,		0 		},
 	{ 'x', "notlink",	stats_notlink,		0 		},
 	{ 'y', "class",		stats_class,		0 		},
-	{ '8', "maxperip",	stats_maxperip,		0		},
-	{ '9', "linecache",	stats_linecache,	0		},
+	{ 'z', "hash",		stats_hash,		0		},
 	{ 0, 	NULL, 		NULL, 			0		}
 };
 
@@ -228,6 +230,7 @@ static inline void stats_help(Client *client)
 	sendnumeric(client, RPL_STATSHELP, "W - fdtable - Send the FD table listing");
 	sendnumeric(client, RPL_STATSHELP, "X - notlink - Send the list of servers that are not current linked");
 	sendnumeric(client, RPL_STATSHELP, "Y - class - Send the class block list");
+	sendnumeric(client, RPL_STATSHELP, "z - hash - Send hash table statistics");
 }
 
 static inline int allow_user_stats_short(char c)
@@ -491,13 +494,11 @@ int stats_allow(Client *client, const char *para)
 
 int stats_command(Client *client, const char *para)
 {
-	int i;
 	RealCommand *mptr;
-	for (i = 0; i < 256; i++)
-		for (mptr = CommandHash[i]; mptr; mptr = mptr->next)
-			if (mptr->count)
-			sendnumeric(client, RPL_STATSCOMMANDS, mptr->cmd,
-				mptr->count, mptr->bytes);
+	for (mptr = CommandList; mptr; mptr = mptr->next)
+		if (mptr->count)
+		sendnumeric(client, RPL_STATSCOMMANDS, mptr->cmd,
+			mptr->count, mptr->bytes);
 
 	return 0;
 }
@@ -1082,13 +1083,34 @@ int stats_linecache(Client *client, const char *para)
 	return 0;
 }
 
-int stats_maxperip(Client *client, const char *para)
+static void stats_maxperip_bucket(Client *client, HashNode *node, int family)
 {
-	int i;
-	IpUsersBucket *e;
+	IpUsersBucket *e = container_of(node, IpUsersBucket, hash);
 	char ipbuf[256];
 	const char *ip;
 
+	ip = inetntop(family, e->rawip, ipbuf, sizeof(ipbuf));
+	if (!ip)
+		ip = "<invalid>";
+	sendtxtnumeric(client, "%s %s: %d local / %d global",
+		       family == AF_INET ? "IPv4" : "IPv6",
+		       ip, e->local_clients, e->global_clients);
+}
+
+static int stats_maxperip_ipv4(HashNode *node, void *data)
+{
+	stats_maxperip_bucket((Client *)data, node, AF_INET);
+	return 0;
+}
+
+static int stats_maxperip_ipv6(HashNode *node, void *data)
+{
+	stats_maxperip_bucket((Client *)data, node, AF_INET6);
+	return 0;
+}
+
+int stats_maxperip(Client *client, const char *para)
+{
 	if (!ValidatePermissionsForPath("server:info:stats",client,NULL,NULL,NULL))
 	{
 		sendnumeric(client, ERR_NOPRIVILEGES);
@@ -1096,30 +1118,22 @@ int stats_maxperip(Client *client, const char *para)
 	}
 
 	sendtxtnumeric(client, "MaxPerIp IPv4 hash table:");
-	for (i=0; i < IPUSERS_HASH_TABLE_SIZE; i++)
-	{
-		for (e = IpUsersHash_ipv4[i]; e; e = e->next)
-		{
-			ip = inetntop(AF_INET, e->rawip, ipbuf, sizeof(ipbuf));
-			if (!ip)
-				ip = "<invalid>";
-			sendtxtnumeric(client, "IPv4 #%d %s: %d local / %d global",
-				       i, ip, e->local_clients, e->global_clients);
-		}
-	}
+	hashtable_foreach(&ipusersTable_ipv4, stats_maxperip_ipv4, client);
 
 	sendtxtnumeric(client, "MaxPerIp IPv6 hash table:");
-	for (i=0; i < IPUSERS_HASH_TABLE_SIZE; i++)
+	hashtable_foreach(&ipusersTable_ipv6, stats_maxperip_ipv6, client);
+
+	return 0;
+}
+
+int stats_hash(Client *client, const char *para)
+{
+	if (!ValidatePermissionsForPath("server:info:stats",client,NULL,NULL,NULL))
 	{
-		for (e = IpUsersHash_ipv6[i]; e; e = e->next)
-		{
-			ip = inetntop(AF_INET6, e->rawip, ipbuf, sizeof(ipbuf));
-			if (!ip)
-				ip = "<invalid>";
-			sendtxtnumeric(client, "IPv6 #%d %s: %d local / %d global",
-				       i, ip, e->local_clients, e->global_clients);
-		}
+		sendnumeric(client, ERR_NOPRIVILEGES);
+		return 0;
 	}
 
+	report_hash_tables(client);
 	return 0;
 }
@@ -116,6 +116,7 @@ CMD_FUNC(cmd_svsnick)
 	           log_data_string("new_nick_name", nickname));
 
 	strlcpy(acptr->name, nickname, sizeof acptr->name);
+	acptr->user->mask_generation++;
 	add_to_client_hash_table(nickname, acptr);
 	RunHook(HOOKTYPE_POST_LOCAL_NICKCHANGE, acptr, mtags, oldnickname);
 	free_message_tags(mtags);
@@ -82,6 +82,7 @@ static void _tkl_check_local_remove_shun(TKL *tmp);
 char *_tkl_uhost(TKL *tkl, char *buf, size_t buflen, int options);
 void tkl_expire_entry(TKL * tmp);
 EVENT(tkl_check_expire);
+EVENT(spamfilter_check_users);
 int _find_tkline_match(Client *client, int skip_soft);
 int _find_shun(Client *client);
 int _find_spamfilter_user(Client *client, int flags);
@@ -110,6 +111,7 @@ int _find_tkl_exception(int ban_type, Client *client);
 int _server_ban_parse_mask(Client *client, int add, char type, const char *str, char **usermask_out, char **hostmask_out, int *soft, const char **error);
 int _server_ban_exception_parse_mask(Client *client, int add, const char *bantypes, const char *str, char **usermask_out, char **hostmask_out, int *soft, const char **error);
 static void add_default_exempts(void);
+static int comp_with_mask(void *addr, void *dest, u_int mask);
 int parse_extended_server_ban(const char *mask_in, Client *client, char **error, int skip_checking, char *buf1, size_t buf1len, char *buf2, size_t buf2len);
 void _tkl_added(Client *client, TKL *tkl);
 int spamfilter_pre_command(Client *from, MessageTag *mtags, const char *buf);
@@ -169,6 +171,12 @@ int mtag_spamfilters_present = 0; /**< Are any spamfilters with type SPAMF_MTAG
 int raw_spamfilters_present = 0; /**< Are any spamfilters with type SPAMF_RAW present? */
 long previous_spamfilter_utf8 = 0;
 static int firstboot = 0;
+static LiteralMatcher *spamfilter_prefilter = NULL; /**< Literal prefilter for all spamfilters, see match_spamfilter() */
+static int spamfilter_prefilter_dirty = 1; /**< Set when spamfilters are added or removed, so the prefilter is rebuilt */
+static uint64_t spamfilter_prefilter_serial = 0;
+static int spamfilter_check_users_pending = 1; /**< Set when spamfilters are flagged with TKL_FLAG_CHECK_USERS */
+static void spamfilter_prefilter_build(void);
+static void spamfilter_prefilter_hit(void *data, void *ctx);
 
 MOD_TEST()
 {
@@ -259,12 +267,15 @@ MOD_LOAD()
 	check_special_spamfilters_present();
 	check_set_spamfilter_utf8_setting_changed();
 	EventAdd(modinfo->handle, "tklexpire", tkl_check_expire, NULL, 5000, 0);
+	EventAdd(modinfo->handle, "spamfilter_check_users", spamfilter_check_users, NULL, 1000, 0);
 	return MOD_SUCCESS;
 }
 
 MOD_UNLOAD()
 {
 	SavePersistentLong(modinfo, previous_spamfilter_utf8);
+	literal_matcher_free(spamfilter_prefilter);
+	spamfilter_prefilter = NULL;
 	return MOD_SUCCESS;
 }
 
@@ -1059,6 +1070,7 @@ void recompile_spamfilters(void)
 		tkl->ptr.spamfilter->match = m; /* set new one */
 		converted++;
 	}
+	spamfilter_prefilter_dirty = 1;
 	unreal_log(ULOG_INFO, "tkl", "SPAMFILTER_UTF8_CONVERTED", NULL,
 	           "Spamfilter: Recompiled $count spamfilters due to set::spamfilter::utf8 change.",
 	           log_data_integer("count", converted));
@@ -2618,6 +2630,301 @@ int tkl_banexception_matches_type(TKL *except, int bantype)
 	return 0;
 }
 
+/* Server bans and exceptions on a CIDR mask (eg 1.2.0.0/16) are stored in
+ * tklines_ip_hash[index][TKLIPHASH_CIDR] and are also put in a radix tree,
+ * tklines_cidr_tree[index][ipv6]. On lookup we only need to walk the path
+ * of the client IP in that tree, instead of checking every CIDR entry.
+ */
+
+/** Maximum number of nodes on a path in the CIDR tree (/0 up to and including /128) */
+#define TKL_CIDR_MAXNODES	129
+
+/** Get bit 'n' of an address (0 is the most significant bit) */
+#define CIDR_BIT(addr, n)	(((addr)[(n) >> 3] >> (7 - ((n) & 7))) & 1)
+
+/** Clear all bits after the first 'bits' bits of an IPv4 or IPv6 address */
+static void tkl_cidr_clear_host_bits(unsigned char *addr, int bits)
+{
+	int i;
+
+	for (i = bits; i < 128; i++)
+		addr[i >> 3] &= ~(0x80 >> (i & 7));
+}
+
+/** Parse a CIDR mask like 1.2.0.0/16 or 2001:db8::/32.
+ * This is stricter than match_user(). Anything we don't accept here
+ * simply stays on the normal TKL list, where it is matched like before.
+ * @param mask		The host mask
+ * @param addr		The address (16 bytes), with the host bits cleared
+ * @param bits		The prefix length
+ * @param ipv6		Set to 1 for IPv6, 0 for IPv4
+ * @returns 1 if it is a valid CIDR mask, 0 if not.
+ */
+static int tkl_cidr_parse(const char *mask, unsigned char *addr, int *bits, int *ipv6)
+{
+	char buf[64];
+	const char *p;
+	int i;
+
+	p = strchr(mask, '/');
+	if (!p || (p - mask >= sizeof(buf)) || !p[1] || (strlen(p+1) > 3))
+		return 0;
+	for (i = 1; p[i]; i++)
+		if (!isdigit(p[i]))
+			return 0;
+	memcpy(buf, mask, p - mask);
+	buf[p - mask] = '\0';
+	*bits = atoi(p+1);
+
+	memset(addr, 0, 16);
+	if (strchr(buf, ':'))
+	{
+		if ((inet_pton(AF_INET6, buf, addr) != 1) || (*bits <= 0) || (*bits > 128))
+			return 0;
+		*ipv6 = 1;
+	} else {
+		if ((inet_pton(AF_INET, buf, addr) != 1) || (*bits <= 0) || (*bits > 32))
+			return 0;
+		*ipv6 = 0;
+	}
+	tkl_cidr_clear_host_bits(addr, *bits);
+	return 1;
+}
+
+/** Returns the host mask of a server ban or ban exception if it goes in the CIDR tree, NULL otherwise */
+static const char *tkl_cidr_hostmask(TKL *tkl)
+{
+	unsigned char addr[16];
+	int bits, ipv6;
+	const char *usermask, *hostmask;
+
+	if (TKLIsServerBan(tkl))
+	{
+		usermask = tkl->ptr.serverban->usermask;
+		hostmask = tkl->ptr.serverban->hostmask;
+	} else
+	if (TKLIsBanException(tkl))
+	{
+		usermask = tkl->ptr.banexception->usermask;
+		hostmask = tkl->ptr.banexception->hostmask;
+	} else
+		return NULL;
+
+	/* Extended server bans don't match on IP, eg ~realname:1.2.3.0/24 */
+	if (is_extended_server_ban(usermask))
+		return NULL;
+
+	if (!tkl_cidr_parse(hostmask, addr, &bits, &ipv6))
+		return NULL;
+
+	return hostmask;
+}
+
+static TKLCidrNode *tkl_cidr_node_new(const unsigned char *addr, int bits)
+{
+	TKLCidrNode *n = safe_alloc(sizeof(TKLCidrNode));
+
+	memcpy(n->addr, addr, sizeof(n->addr));
+	tkl_cidr_clear_host_bits(n->addr, bits);
+	n->bits = bits;
+	return n;
+}
+
+static void tkl_cidr_node_add_tkl(TKLCidrNode *n, TKL *tkl)
+{
+	if (n->num_tkls == n->max_tkls)
+	{
+		n->max_tkls = n->max_tkls ? n->max_tkls * 2 : 2;
+		n->tkls = safe_realloc(n->tkls, sizeof(TKL *) * n->max_tkls);
+	}
+	n->tkls[n->num_tkls++] = tkl;
+}
+
+/** Number of leading bits that are the same in 'a' and 'b', up to 'maxbits' */
+static int tkl_cidr_common_bits(const unsigned char *a, const unsigned char *b, int maxbits)
+{
+	int i;
+
+	for (i = 0; (i < maxbits) && (a[i >> 3] == b[i >> 3]); i += 8)
+		;
+	for (; i < maxbits; i++)
+		if (CIDR_BIT(a, i) != CIDR_BIT(b, i))
+			return i;
+	return maxbits;
+}
+
+/** Add a TKL entry to the CIDR tree 'root' for prefix 'addr'/'bits' */
+static void tkl_cidr_add(TKLCidrNode **root, const unsigned char *addr, int bits, TKL *tkl)
+{
+	TKLCidrNode **p = root;
+	TKLCidrNode *n, *glue;
+	int common;
+
+	while ((n = *p))
+	{
+		common = tkl_cidr_common_bits(n->addr, addr, MIN(n->bits, bits));
+		if (common < n->bits)
+		{
+			/* The new prefix is a parent of this node, or branches off here */
+			glue = tkl_cidr_node_new(addr, common);
+			glue->child[CIDR_BIT(n->addr, common)] = n;
+			*p = glue;
+			if (common == bits)
+			{
+				tkl_cidr_node_add_tkl(glue, tkl);
+				return;
+			}
+			p = &glue->child[CIDR_BIT(addr, common)];
+			break;
+		}
+		if (n->bits == bits)
+		{
+			tkl_cidr_node_add_tkl(n, tkl);
+			return;
+		}
+		p = &n->child[CIDR_BIT(addr, n->bits)];
+	}
+
+	n = tkl_cidr_node_new(addr, bits);
+	tkl_cidr_node_add_tkl(n, tkl);
+	*p = n;
+}
+
+/** Remove a TKL entry from the CIDR (sub)tree 'n'.
+ * @returns The new top of the (sub)tree, as nodes that are no longer needed are freed.
+ */
+static TKLCidrNode *tkl_cidr_del(TKLCidrNode *n, const unsigned char *addr, int bits, TKL *tkl, int *found)
+{
+	TKLCidrNode *child;
+	int i;
+
+	if (!n || (n->bits > bits) || !comp_with_mask(n->addr, (void *)addr, n->bits))
+		return n;
+
+	if (n->bits < bits)
+	{
+		i = CIDR_BIT(addr, n->bits);
+		n->child[i] = tkl_cidr_del(n->child[i], addr, bits, tkl, found);
+	} else {
+		for (i = 0; i < n->num_tkls; i++)
+		{
+			if (n->tkls[i] == tkl)
+			{
+				n->tkls[i] = n->tkls[--n->num_tkls];
+				*found = 1;
+				break;
+			}
+		}
+	}
+
+	if (n->num_tkls || (n->child[0] && n->child[1]))
+		return n;
+
+	/* Node has no entries and at most one child: remove it */
+	child = n->child[0] ? n->child[0] : n->child[1];
+	safe_free(n->tkls);
+	safe_free(n);
+	return child;
+}
+
+/** Add a CIDR TKL entry to tklines_cidr_tree[index] */
+static void tkl_cidr_add_tkl(int index, TKL *tkl)
+{
+	const char *hostmask = tkl_cidr_hostmask(tkl);
+	unsigned char addr[16];
+	int bits, ipv6;
+
+	if (!hostmask || !tkl_cidr_parse(hostmask, addr, &bits, &ipv6))
+		abort(); /* impossible, caller checked with tkl_ip_hash_tkl() */
+	tkl_cidr_add(&tklines_cidr_tree[index][ipv6], addr, bits, tkl);
+}
+
+/** Remove a CIDR TKL entry from tklines_cidr_tree[index].
+ * @returns 1 if the entry was found and removed, 0 if not.
+ */
+static int tkl_cidr_del_tkl(int index, TKL *tkl)
+{
+	const char *hostmask = tkl_cidr_hostmask(tkl);
+	unsigned char addr[16];
+	int bits, ipv6;
+	int found = 0;
+
+	if (!hostmask || !tkl_cidr_parse(hostmask, addr, &bits, &ipv6))
+		return 0;
+	tklines_cidr_tree[index][ipv6] = tkl_cidr_del(tklines_cidr_tree[index][ipv6], addr, bits, tkl, &found);
+	return found;
+}
+
+/** Find the node in the CIDR tree for exactly this mask.
+ * @param tpe		The TKL type character
+ * @param usermask	The user mask
+ * @param hostmask	The host mask
+ * @param node		Set to the node (or NULL if no entries with this prefix exist)
+ * @returns 1 if this mask would be in the CIDR tree, 0 if not (and 'node' is not set).
+ */
+static int tkl_cidr_find_node(char tpe, const char *usermask, const char *hostmask, TKLCidrNode **node)
+{
+	unsigned char addr[16];
+	int index, bits, ipv6;
+	TKLCidrNode *n;
+
+	index = tkl_ip_hash_type(tpe);
+	if ((index < 0) || is_extended_server_ban(usermask) || !tkl_cidr_parse(hostmask, addr, &bits, &ipv6))
+		return 0;
+
+	for (n = tklines_cidr_tree[index][ipv6]; n; n = n->child[CIDR_BIT(addr, n->bits)])
+	{
+		if ((n->bits > bits) || !comp_with_mask(n->addr, addr, n->bits))
+			break;
+		if (n->bits == bits)
+		{
+			*node = n;
+			return 1;
+		}
+	}
+	*node = NULL;
+	return 1;
+}
+
+/** Find the nodes in tklines_cidr_tree[index] that cover the IP of the client.
+ * Only nodes that have TKL entries are returned.
+ * @param index		The index, see tkl_ip_hash_type()
+ * @param client	The client
+ * @param nodes		Array of TKL_CIDR_MAXNODES entries
+ * @returns The number of nodes stored in 'nodes'.
+ */
+static int tkl_cidr_find(int index, Client *client, TKLCidrNode **nodes)
+{
+	unsigned char addr[16];
+	int ipv6, maxbits, num = 0;
+	TKLCidrNode *n;
+
+	if (!client->ip)
+		return 0;
+
+	if (strchr(client->ip, ':'))
+	{
+		if (inet_pton(AF_INET6, client->ip, addr) != 1)
+			return 0;
+		ipv6 = 1;
+		maxbits = 128;
+	} else {
+		if (inet_pton(AF_INET, client->ip, addr) != 1)
+			return 0;
+		ipv6 = 0;
+		maxbits = 32;
+	}
+
+	for (n = tklines_cidr_tree[index][ipv6]; n && comp_with_mask(n->addr, addr, n->bits); n = n->child[CIDR_BIT(addr, n->bits)])
+	{
+		if (n->num_tkls)
+			nodes[num++] = n;
+		if (n->bits >= maxbits)
+			break;
+	}
+	return num;
+}
+
 /** Used for finding out which element of the tkl_ip hash table is used (primary element) */
 int _tkl_ip_hash(char *ip)
 {
@@ -2635,7 +2942,7 @@ int _tkl_ip_hash(char *ip)
 		                 (ipbuf[1] << 16) +
 		                 (ipbuf[2] << 8)  +
 		                 ipbuf[3];
-		return v % TKLIPHASHLEN2;
+		return v % TKLIPHASH_CIDR;
 	} else
 	if (inet_pton(AF_INET6, ip, &ipbuf) == 1)
 	{
@@ -2648,7 +2955,7 @@ int _tkl_ip_hash(char *ip)
 		                 (ipbuf[5] << 16) +
 		                 (ipbuf[6] << 8)  +
 		                 ipbuf[7];
-		return (v1 ^ v2) % TKLIPHASHLEN2;
+		return (v1 ^ v2) % TKLIPHASH_CIDR;
 	} else
 	{
 		return -1;
@@ -2658,6 +2965,8 @@ int _tkl_ip_hash(char *ip)
 // TODO: consider efunc
 int tkl_ip_hash_tkl(TKL *tkl)
 {
+	if (tkl_cidr_hostmask(tkl))
+		return TKLIPHASH_CIDR;
 	if (TKLIsServerBan(tkl))
 		return tkl_ip_hash(tkl->ptr.serverban->hostmask);
 	if (TKLIsBanException(tkl))
@@ -2778,6 +3087,7 @@ TKL *_tkl_add_spamfilter(int type, const char *id, unsigned short target, BanAct
 		mtag_spamfilters_present = 1;
 	if (target & SPAMF_RAW)
 		raw_spamfilters_present = 1;
+	spamfilter_prefilter_dirty = 1;
 
 	return tkl;
 }
@@ -2831,6 +3141,8 @@ TKL *_tkl_add_serverban(int type, char *usermask, char *hostmask, char *reason,
 		if (index2 >= 0)
 		{
 			AddListItem(tkl, tklines_ip_hash[index][index2]);
+			if (index2 == TKLIPHASH_CIDR)
+				tkl_cidr_add_tkl(index, tkl);
 			return tkl;
 		}
 	}
@@ -2896,6 +3208,8 @@ TKL *_tkl_add_banexception(int type, char *usermask, char *hostmask, SecurityGro
 		if (index2 >= 0)
 		{
 			AddListItem(tkl, tklines_ip_hash[index][index2]);
+			if (index2 == TKLIPHASH_CIDR)
+				tkl_cidr_add_tkl(index, tkl);
 			return tkl;
 		}
 	}
@@ -3018,10 +3332,16 @@ void _tkl_del_line(TKL *tkl)
 		index2 = tkl_ip_hash_tkl(tkl);
 		if (index2 >= 0)
 		{
+			int in_cidr_tree = 0;
+			if (index2 == TKLIPHASH_CIDR)
+				in_cidr_tree = tkl_cidr_del_tkl(index, tkl);
 #if 1
 			/* Temporary validation until an rmtkl(?) bug is fixed */
 			TKL *d;
 			int really_found = 0;
+			if (index2 == TKLIPHASH_CIDR)
+				really_found = in_cidr_tree; /* the list can be long, don't walk it */
+			else
 			for (d = tklines_ip_hash[index][index2]; d; d = d->next)
 				if (d == tkl)
 				{
@@ -3049,6 +3369,9 @@ void _tkl_del_line(TKL *tkl)
 		DelListItem(tkl, tklines[index]);
 	}
 
+	if (TKLIsSpamfilter(tkl))
+		spamfilter_prefilter_dirty = 1;
+
 	/* Finally, free the entry */
 	free_tkl(tkl);
 	check_special_spamfilters_present();
@@ -3288,6 +3611,8 @@ int _find_tkl_exception(int ban_type, Client *client)
 {
 	TKL *tkl;
 	int index, index2;
+	TKLCidrNode *nodes[TKL_CIDR_MAXNODES];
+	int num_nodes, i, j;
 	Hook *hook;
 
 	if (IsServer(client) || IsMe(client))
@@ -3305,6 +3630,17 @@ int _find_tkl_exception(int ban_type, Client *client)
 		}
 	}
 
+	/* Then the CIDR entries that cover the IP.. */
+	num_nodes = tkl_cidr_find(index, client, nodes);
+	for (i = 0; i < num_nodes; i++)
+	{
+		for (j = 0; j < nodes[i]->num_tkls; j++)
+		{
+			if (find_tkl_exception_matcher(client, ban_type, nodes[i]->tkls[j]))
+				return 1; /* exempt */
+		}
+	}
+
 	/* If not banned (yet), then check regular entries.. */
 	for (tkl = tklines[tkl_hash('e')]; tkl; tkl = tkl->next)
 	{
@@ -3359,6 +3695,8 @@ int _find_tkline_match(Client *client, int skip_soft)
 	TKL *tkl;
 	int banned = 0;
 	int index, index2;
+	TKLCidrNode *nodes[TKL_CIDR_MAXNODES];
+	int num_nodes, i, j;
 
 	if (IsServer(client) || IsMe(client))
 		return 0;
@@ -3380,6 +3718,22 @@ int _find_tkline_match(Client *client, int skip_soft)
 		}
 	}
 
+	/* Then the CIDR entries that cover the IP.. */
+	for (index = 0; !banned && (index < TKLIPHASHLEN1); index++)
+	{
+		num_nodes = tkl_cidr_find(index, client, nodes);
+		for (i = 0; !banned && (i < num_nodes); i++)
+		{
+			for (j = 0; j < nodes[i]->num_tkls; j++)
+			{
+				tkl = nodes[i]->tkls[j];
+				banned = find_tkline_match_matcher(client, skip_soft, tkl);
+				if (banned)
+					break;
+			}
+		}
+	}
+
 	/* If not banned (yet), then check regular entries.. */
 	if (!banned)
 	{
@@ -3511,21 +3865,58 @@ int _find_spamfilter_user(Client *client, int flags)
 	return match_spamfilter(client, spamfilter_user, SPAMF_USER, NULL, NULL, flags, NULL);
 }
 
-/** Check a spamfilter against all local users and print a message.
- * This is only used for the 'warn' action (BAN_ACT_WARN).
+/** Check new spamfilters against all local users and print a message.
+ * This is only used for the 'warn' action (BAN_ACT_WARN), for spamfilters
+ * that were flagged with TKL_FLAG_CHECK_USERS by tkl_added().
+ * All spamfilters added since the previous run are checked in one pass
+ * over the users, using the prefilter to skip the ones that cannot match.
  */
-int spamfilter_check_users(TKL *tkl)
+EVENT(spamfilter_check_users)
 {
 	char spamfilter_user[NICKLEN + USERLEN + HOSTLEN + REALLEN + 64]; /* n!u@h:r */
-	char buf[1024];
-	int matches = 0;
+	TKL *tkl, **pending = NULL;
+	int num_pending = 0, max_pending = 0;
+	uint64_t prefilter_serial;
 	Client *client;
+	int i;
+
+	if (!spamfilter_check_users_pending)
+		return;
+	spamfilter_check_users_pending = 0;
+
+	for (tkl = tklines[tkl_hash('F')]; tkl; tkl = tkl->next)
+	{
+		if (!(tkl->flags & TKL_FLAG_CHECK_USERS))
+			continue;
+		tkl->flags &= ~TKL_FLAG_CHECK_USERS;
+		if (num_pending == max_pending)
+		{
+			max_pending = max_pending ? max_pending * 2 : 8;
+			pending = safe_realloc(pending, sizeof(TKL *) * max_pending);
+		}
+		pending[num_pending++] = tkl;
+	}
+
+	if (!num_pending)
+		return;
+
+	if (spamfilter_prefilter_dirty)
+		spamfilter_prefilter_build();
 
 	list_for_each_entry_reverse(client, &lclient_list, lclient_node)
 	{
-		if (MyUser(client))
+		if (!MyUser(client))
+			continue;
+
+		spamfilter_build_user_string(spamfilter_user, client->name, client);
+		prefilter_serial = ++spamfilter_prefilter_serial;
+		literal_matcher_scan(spamfilter_prefilter, spamfilter_user, spamfilter_prefilter_hit, &prefilter_serial);
+
+		for (i = 0; i < num_pending; i++)
 		{
-			spamfilter_build_user_string(spamfilter_user, client->name, client);
+			tkl = pending[i];
+			if (tkl->ptr.spamfilter->prefilter && (tkl->ptr.spamfilter->prefilter_serial < prefilter_serial))
+				continue; /* Required literal not present */
 			if (!unreal_match(tkl->ptr.spamfilter->match, spamfilter_user))
 				continue; /* No match */
 
@@ -3537,11 +3928,10 @@ int spamfilter_check_users(TKL *tkl)
 				   log_data_string("str", spamfilter_user));
 
 			RunHook(HOOKTYPE_LOCAL_SPAMFILTER, client, spamfilter_user, spamfilter_user, SPAMF_USER, NULL, tkl);
-			matches++;
 		}
 	}
 
-	return matches;
+	safe_free(pending);
 }
 
 /** Check if the nick or channel name is banned (Q-Line).
@@ -3617,6 +4007,8 @@ TKL *_find_tkline_match_zap(Client *client)
 {
 	TKL *tkl, *ret;
 	int index, index2;
+	TKLCidrNode *nodes[TKL_CIDR_MAXNODES];
+	int num_nodes, i, j;
 
 	if (IsServer(client) || IsMe(client))
 		return NULL;
@@ -3634,6 +4026,18 @@ TKL *_find_tkline_match_zap(Client *client)
 		}
 	}
 
+	/* Then the CIDR entries that cover the IP.. */
+	num_nodes = tkl_cidr_find(index, client, nodes);
+	for (i = 0; i < num_nodes; i++)
+	{
+		for (j = 0; j < nodes[i]->num_tkls; j++)
+		{
+			ret = find_tkline_match_zap_matcher(client, nodes[i]->tkls[j]);
+			if (ret)
+				return ret;
+		}
+	}
+
 	/* If not banned (yet), then check regular entries.. */
 	for (tkl = tklines[tkl_hash('z')]; tkl; tkl = tkl->next)
 	{
@@ -4084,10 +4488,29 @@ TKL *_find_tkl_serverban(int type, char *usermask, char *hostmask, int softban)
 {
 	char tpe = tkl_typetochar(type);
 	TKL *head, *tkl;
+	TKLCidrNode *node;
+	int i;
 
 	if (!TKLIsServerBanType(type))
 		abort();
 
+	/* CIDR entries: only the ones with the same prefix need to be checked */
+	if (tkl_cidr_find_node(tpe, usermask, hostmask, &node))
+	{
+		for (i = 0; node && (i < node->num_tkls); i++)
+		{
+			tkl = node->tkls[i];
+			if ((tkl->type == type) &&
+			    !strcasecmp(tkl->ptr.serverban->hostmask, hostmask) &&
+			    !strcasecmp(tkl->ptr.serverban->usermask, usermask) &&
+			    ((tkl->ptr.serverban->subtype & TKL_SUBTYPE_SOFT) == softban))
+			{
+				return tkl;
+			}
+		}
+		return NULL; /* Not found */
+	}
+
 	head = tkl_find_head(tpe, hostmask, tklines[tkl_hash(tpe)]);
 	for (tkl = head; tkl; tkl = tkl->next)
 	{
@@ -4110,10 +4533,29 @@ TKL *_find_tkl_banexception(int type, char *usermask, char *hostmask, int softba
 {
 	char tpe = tkl_typetochar(type);
 	TKL *head, *tkl;
+	TKLCidrNode *node;
+	int i;
 
 	if (!TKLIsBanExceptionType(type))
 		abort();
 
+	/* CIDR entries: only the ones with the same prefix need to be checked */
+	if (tkl_cidr_find_node(tpe, usermask, hostmask, &node))
+	{
+		for (i = 0; node && (i < node->num_tkls); i++)
+		{
+			tkl = node->tkls[i];
+			if ((tkl->type == type) &&
+			    !strcasecmp(tkl->ptr.banexception->hostmask, hostmask) &&
+			    !strcasecmp(tkl->ptr.banexception->usermask, usermask) &&
+			    ((tkl->ptr.banexception->subtype & TKL_SUBTYPE_SOFT) == softban))
+			{
+				return tkl;
+			}
+		}
+		return NULL; /* Not found */
+	}
+
 	head = tkl_find_head(tpe, hostmask, tklines[tkl_hash(tpe)]);
 	for (tkl = head; tkl; tkl = tkl->next)
 	{
@@ -4264,7 +4706,9 @@ void _tkl_added(Client *client, TKL *tkl)
 	    has_actions_of_type(tkl->ptr.spamfilter->action, BAN_ACT_WARN) &&
 	    (tkl->ptr.spamfilter->target & SPAMF_USER))
 	{
-		spamfilter_check_users(tkl);
+		/* Checked against all users in one go by spamfilter_check_users() */
+		tkl->flags |= TKL_FLAG_CHECK_USERS;
+		spamfilter_check_users_pending = 1;
 	}
 
 	/* Ban checking executes during run loop for efficiency */
@@ -5220,6 +5664,43 @@ static void match_spamfilter_hit(Client *client, const char *str_in, const char
 
 }
 
+/** Rebuild the spamfilter prefilter.
+ * For every spamfilter we find a literal that must be present in a string
+ * for the spamfilter to match (eg "free money" for the regex "free money\s+now").
+ * All these literals are put in one Aho-Corasick automaton, so with a single
+ * pass over a message we know which spamfilters could possibly match.
+ * Spamfilters without such a literal are always run.
+ */
+static void spamfilter_prefilter_build(void)
+{
+	TKL *tkl;
+	char literal[256];
+
+	literal_matcher_free(spamfilter_prefilter);
+	spamfilter_prefilter = literal_matcher_new();
+
+	for (tkl = tklines[tkl_hash('F')]; tkl; tkl = tkl->next)
+	{
+		Spamfilter *sf = tkl->ptr.spamfilter;
+
+		sf->prefilter = 0;
+		if (sf->match && unreal_match_literal(sf->match, literal, sizeof(literal)))
+		{
+			literal_matcher_add(spamfilter_prefilter, literal, sf);
+			sf->prefilter = 1;
+		}
+	}
+
+	literal_matcher_compile(spamfilter_prefilter);
+	spamfilter_prefilter_dirty = 0;
+}
+
+/* Callback for literal_matcher_scan(): mark the spamfilter as a candidate */
+static void spamfilter_prefilter_hit(void *data, void *ctx)
+{
+	((Spamfilter *)data)->prefilter_serial = *(uint64_t *)ctx;
+}
+
 /** match_spamfilter: executes the spamfilter on the input string.
  * @param str		The text (eg msg text, notice text, part text, quit text, etc
  * @param target	The spamfilter target (SPAMF_*)
@@ -5247,6 +5728,7 @@ int _match_spamfilter(Client *client, const char *str_in, int target, const char
 	int stop_processing_general_spamfilters = 0;
 	int stop_processing_central_spamfilters = 0;
 	int content_revealed = 0;
+	uint64_t prefilter_serial;
 
 	if (rettkl)
 		*rettkl = NULL; /* initialize to NULL */
@@ -5274,11 +5756,25 @@ int _match_spamfilter(Client *client, const char *str_in, int target, const char
 	if (user_allowed_by_security_group(client, iConf.central_spamfilter_except))
 		user_is_exempt_central = 1;
 
+	/* Run the prefilter, this marks all spamfilters that can possibly match.
+	 * A spamfilter is a candidate if its prefilter_serial is >= ours.
+	 * Using >= and not == keeps this correct if we are called recursively,
+	 * a nested call can only cause additional candidates.
+	 */
+	if (spamfilter_prefilter_dirty)
+		spamfilter_prefilter_build();
+	prefilter_serial = ++spamfilter_prefilter_serial;
+	literal_matcher_scan(spamfilter_prefilter, str, spamfilter_prefilter_hit, &prefilter_serial);
+
 	for (tkl = tklines[tkl_hash('F')]; tkl; tkl = tkl->next)
 	{
 		if (!(tkl->ptr.spamfilter->target & target))
 			continue;
 
+		/* The literal of this spamfilter is not in the text, so it can't match */
+		if (tkl->ptr.spamfilter->prefilter && (tkl->ptr.spamfilter->prefilter_serial < prefilter_serial))
+			continue;
+
 		/* Skip spamfilters due to a 'stop' action from an earlier spamfilter
 		 * or set::spamfilter::stop-on-first-match.
 		 * We treat such stops as separate for central & general spamfilters
@@ -291,9 +291,10 @@ int write_tkldb(void)
 	gettimeofday(&tv_alpha, NULL);
 #endif
 
-	// Write to a tempfile first, then rename it if everything succeeded
-	snprintf(tmpfname, sizeof(tmpfname), "%s.%x.tmp", cfg.database, getrandom32());
-	db = unrealdb_open(tmpfname, UNREALDB_MODE_WRITE, cfg.db_secret);
+	// Only serialize it here, the database writer thread encrypts it,
+	// writes it to a tempfile and renames it if everything succeeded
+	snprintf(tmpfname, sizeof(tmpfname), "%s.tmp", cfg.database);
+	db = unrealdb_open(cfg.database, UNREALDB_MODE_WRITE_ASYNC, cfg.db_secret);
 	if (!db)
 	{
 		WARN_WRITE_ERROR(tmpfname);
@@ -365,21 +366,12 @@ int write_tkldb(void)
 		}
 	}
 
-	// Everything seems to have gone well, attempt to close and rename the tempfile
+	// Everything seems to have gone well, hand it over to the writer thread
 	if (!unrealdb_close(db))
 	{
 		WARN_WRITE_ERROR(tmpfname);
 		return 0;
 	}
-#ifdef _WIN32
-	/* The rename operation cannot be atomic on Windows as it will cause a "file exists" error */
-	unlink(cfg.database);
-#endif
-	if (rename(tmpfname, cfg.database) < 0)
-	{
-		config_error("[tkldb] Error renaming '%s' to '%s': %s (DATABASE NOT SAVED)", tmpfname, cfg.database, strerror(errno));
-		return 0;
-	}
 #ifdef BENCHMARK
 	gettimeofday(&tv_beta, NULL);
 	config_status("[tkldb] Benchmark: SAVE DB: %lld microseconds",
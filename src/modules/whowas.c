@@ -54,7 +54,6 @@ MOD_UNLOAD()
 
 /* externally defined functions */
 extern WhoWas MODVAR WHOWAS[NICKNAMEHISTORYLENGTH];
-extern WhoWas MODVAR *WHOWASHASH[WHOWAS_HASH_TABLE_SIZE];
 
 /*
 ** cmd_whowas
@@ -64,6 +63,7 @@ CMD_FUNC(cmd_whowas)
 {
 	char request[BUFSIZE];
 	WhoWas *temp;
+	HashNode *n;
 	int  cur = 0;
 	int  max = -1, found = 0;
 	char *p, *nick;
@@ -92,10 +92,10 @@ CMD_FUNC(cmd_whowas)
 		*p = '\0'; /* cut off at first */
 
 	nick = request;
-	temp = WHOWASHASH[hash_whowas_name(nick)];
 	found = 0;
-	for (; temp; temp = temp->next)
+	hashtable_for_each_match(&whowasTable, n, hash_whowas_name(nick))
 	{
+		temp = container_of(n, WhoWas, hash);
 		if (!mycmp(nick, temp->name))
 		{
 			sendnumeric(client, RPL_WHOWASUSER, temp->name,
@@ -93,7 +93,6 @@ int read_whowasdb(void);
 
 /* External variables */
 extern WhoWas MODVAR WHOWAS[NICKNAMEHISTORYLENGTH];
-extern WhoWas MODVAR *WHOWASHASH[WHOWAS_HASH_TABLE_SIZE];
 extern MODVAR int whowas_next;
 
 /* Global variables */
@@ -301,9 +300,10 @@ int write_whowasdb(void)
 	gettimeofday(&tv_alpha, NULL);
 #endif
 
-	// Write to a tempfile first, then rename it if everything succeeded
-	snprintf(tmpfname, sizeof(tmpfname), "%s.%x.tmp", cfg.database, getrandom32());
-	db = unrealdb_open(tmpfname, UNREALDB_MODE_WRITE, cfg.db_secret);
+	// Only serialize it here, the database writer thread encrypts it,
+	// writes it to a tempfile and renames it if everything succeeded
+	snprintf(tmpfname, sizeof(tmpfname), "%s.tmp", cfg.database);
+	db = unrealdb_open(cfg.database, UNREALDB_MODE_WRITE_ASYNC, cfg.db_secret);
 	if (!db)
 	{
 		WARN_WRITE_ERROR(tmpfname);
@@ -345,22 +345,12 @@ int write_whowasdb(void)
 	}
 
 
-	// Everything seems to have gone well, attempt to close and rename the tempfile
+	// Everything seems to have gone well, hand it over to the writer thread
 	if (!unrealdb_close(db))
 	{
 		WARN_WRITE_ERROR(tmpfname);
 		return 0;
 	}
-
-#ifdef _WIN32
-	/* The rename operation cannot be atomic on Windows as it will cause a "file exists" error */
-	unlink(cfg.database);
-#endif
-	if (rename(tmpfname, cfg.database) < 0)
-	{
-		config_error("[whowasdb] Error renaming '%s' to '%s': %s (DATABASE NOT SAVED)", tmpfname, cfg.database, strerror(errno));
-		return 0;
-	}
 #ifdef BENCHMARK
 	gettimeofday(&tv_beta, NULL);
 	config_status("[whowasdb] Benchmark: SAVE DB: %ld microseconds",
@@ -592,13 +582,12 @@ int read_whowasdb(void)
 			 * But we have no choice, as we can't use that function since we don't have a Client *.
 			 */
 			WhoWas *e = &WHOWAS[whowas_next];
-			if (e->hashv != -1)
+			if (e->name)
 				free_whowas_entry(e);
 			/* Set values */
 			//unreal_log(ULOG_DEBUG, "whowasdb", "WHOWASDB_READ_RECORD", NULL,
 			//           "[whowasdb] Adding '$nick'...",
 			//           log_data_string("nick", nick));
-			e->hashv = hash_whowas_name(nick);
 			e->event = event;
 			e->connected_since = connected_since;
 			e->logon = logontime;
@@ -617,7 +606,7 @@ int read_whowasdb(void)
 			e->online = NULL;
 			/* Server is special - scache shit */
 			/* Add to hash table */
-			add_whowas_to_list(&WHOWASHASH[e->hashv], e);
+			hashtable_add(&whowasTable, &e->hash, hash_whowas_name(e->name));
 			/* And advance pointer (well, integer) */
 			whowas_next++;
 			if (whowas_next == NICKNAMEHISTORYLENGTH)
@@ -511,7 +511,7 @@ static void who_common_channel(Client *client, Channel *channel,
 	Hook *h;
 	int i = 0;
 
-	us = find_membership_link(client->user->channel, channel);
+	us = find_membership(client, channel);
 	if (!us)
 		abort(); /* impossible, we are in who_common_channel... */
 
@@ -624,7 +624,7 @@ static void who_global(Client *client, char *mask, int operspy, struct who_forma
 static void do_who_on_channel(Client *client, Channel *channel,
 	int member, int operspy, struct who_format *fmt)
 {
-	Membership *us = find_membership_link(client->user->channel, channel);
+	Membership *us = find_membership(client, channel);
 	Member *cm;
 	Hook *h;
 	int i = 0;
@@ -739,7 +739,7 @@ static void do_who(Client *client, Client *acptr, Channel *channel, struct who_f
 	{
 		Membership *lp;
 
-		if ((lp = find_membership_link(acptr->user->channel, channel)))
+		if ((lp = find_membership(acptr, channel)))
 		{
 			if (!(fmt->fields || HasCapability(client, "multi-prefix")))
 			{
@@ -96,12 +96,21 @@ void parse_client_queued(Client *client)
 {
 	int dolen = 0;
 	char buf[READBUFSIZE];
+	char *line;
 
 	if (IsDNSLookup(client))
-		return; /* we delay processing of data until the host is resolved */
+	{
+		/* we delay processing of data until the host is resolved */
+		mark_data_to_process(client);
+		return;
+	}
 
 	if (IsIdentLookup(client))
-		return; /* we delay processing of data until identd has replied */
+	{
+		/* we delay processing of data until identd has replied */
+		mark_data_to_process(client);
+		return;
+	}
 
 	/* Handshake delay and such.. */
 	if (!IsUser(client) && !IsServer(client) && !IsUnixSocket(client) && !IsLocalhost(client))
@@ -111,6 +120,7 @@ void parse_client_queued(Client *client)
 		    (TStime() - client->local->creationtime < iConf.handshake_delay))
 		{
 			/* delay processing of data until set::handshake-delay is reached */
+			mark_data_to_process(client);
 			return;
 		}
 		if ((iConf.handshake_boot_delay > 0) &&
@@ -121,22 +131,28 @@ void parse_client_queued(Client *client)
 			/* the first few seconds after boot we only accept server connections
 			 * (set::handshake-boot-delay).
 			 */
+			mark_data_to_process(client);
 			return;
 		}
 	}
 
 	while (DBufLength(&client->local->recvQ) && !client_lagged_up(client))
 	{
-		dolen = dbuf_getmsg(&client->local->recvQ, buf);
+		dolen = dbuf_getmsg_nocopy(&client->local->recvQ, buf, &line);
 
 		if (dolen == 0)
 			return;
 
-		dopacket(client, buf, dolen);
-		
+		dopacket(client, line, dolen);
+		dbuf_getmsg_done(&client->local->recvQ);
+
 		if (IsDead(client))
 			return;
 	}
+
+	/* If we stopped due to (fake) lag then continue later */
+	if (DBufLength(&client->local->recvQ))
+		mark_data_to_process(client);
 }
 
 /*
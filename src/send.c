@@ -36,8 +36,7 @@ struct LineCacheLine
 	LineCacheUserType user_type;
 	unsigned long caps;
 	int line_opts;			/**< Cached line message options (rare) */
-	char *line;			/**< Entire cached line, including message tags (if appropriate) and \r\n */
-	int linelen;			/**< strlen(line) */
+	dbufshared *line;		/**< Entire cached line, including message tags (if appropriate) and \r\n */
 };
 
 typedef struct LineCache LineCache;
@@ -54,7 +53,8 @@ static int vmakebuf_local_withprefix(char *buf, size_t buflen, Client *from, con
 static void vsendto_prefix_one_cached(LineCache *cache, int line_opts, Client *to, Client *from, MessageTag *mtags, const char *pattern, va_list vl) __attribute__((format(printf,6,0)));
 static LineCache *linecache_init(void);
 static void linecache_free(LineCache *cache);
-static void linecache_add(LineCache *cache, int line_opts, Client *to, const char *line, int linelen);
+static LineCacheLine *linecache_add(LineCache *cache, int line_opts, Client *to, const char *line, int linelen);
+static void sendbufto_one_real(Client *to, char *msg, unsigned int quick, dbufshared *shared);
 static LineCacheLine *linecache_get(LineCache *cache, int line_opts, Client *to);
 
 #define ADD_CRLF(buf, len) { if (len > 510) len = 510; \
@@ -74,7 +74,8 @@ static char sendbuf2[MAXLINELENGTH];
 MODVAR int  current_serial;
 
 /** This is a callback function from the event loop.
- * All it does is call send_queued().
+ * All it does is call send_queued(), or hand the
+ * work over to an I/O thread if those are enabled.
  */
 void send_queued_cb(int fd, int revents, void *data)
 {
@@ -83,73 +84,230 @@ void send_queued_cb(int fd, int revents, void *data)
 	if (IsDeadSocket(to))
 		return;
 
+	if (io_threads_queue(to, IOJOB_WRITE))
+		return;
+
 	send_queued(to);
 }
 
-/** This function is called when queued data might be ready to be
- * sent to the client. It is called from the event loop and also
- * a couple of other places (such as when closing the connection).
+/** Maximum number of sendQ blocks to write with one writev() call */
+#ifdef IOV_MAX
+ #define SENDQ_MAX_IOV	IOV_MAX
+#else
+ #define SENDQ_MAX_IOV	1024
+#endif
+
+/** Size of the buffer for coalescing sendQ blocks for TLS clients.
+ * This is the maximum TLS record size, so every SSL_write() results
+ * in one full record instead of a small record for every block.
  */
-int send_queued(Client *to)
+#define SENDQ_TLS_COALESCE_SIZE	16384
+
+/** Write as much of the sendQ of 'to' as possible.
+ * This does NOT remove anything from the sendQ and does not
+ * touch any other shared state, so it is safe to call from
+ * an I/O thread. The caller must call send_queued_completed()
+ * afterwards from the main thread.
+ * @param to		The client
+ * @param want_read	Set to 1 if TLS needs to read first (see deliver_it_raw)
+ * @returns Number of bytes written, or <0 on fatal error (errno is set).
+ */
+int send_queued_raw(Client *to, int *want_read)
 {
-	int  len, rlen;
 	dbufbuf *block;
-	int want_read;
+	struct list_head *head = &to->local->sendQ.dbuf_list;
+	char buf[SENDQ_TLS_COALESCE_SIZE];
+	size_t offset = 0, len, amount;
+	int rlen, total = 0;
 
-	/* We NEVER write to dead sockets. */
-	if (IsDeadSocket(to))
-		return -1;
+	*want_read = 0;
 
-	while (DBufLength(&to->local->sendQ) > 0)
+#ifndef _WIN32
+	/* Plaintext: write (up to) SENDQ_MAX_IOV blocks with one system call */
+	if (!IsTLS(to) || !to->local->ssl)
 	{
-		block = container_of(to->local->sendQ.dbuf_list.next, dbufbuf, dbuf_node);
-		len = block->size;
+		struct iovec iov[SENDQ_MAX_IOV];
+		int iovcnt = 0;
 
-		/* Deliver it and check for fatal error.. */
-		if ((rlen = deliver_it(to, block->data, len, &want_read)) < 0)
+		list_for_each_entry2(block, dbufbuf, head, dbuf_node)
 		{
-			char buf[256];
-			snprintf(buf, 256, "Write error: %s", STRERROR(ERRNO));
-			return dead_socket(to, buf);
+			iov[iovcnt].iov_base = block->start;
+			iov[iovcnt].iov_len = block->size;
+			if (++iovcnt == SENDQ_MAX_IOV)
+				break;
 		}
-		dbuf_delete(&to->local->sendQ, rlen);
-		if (want_read)
+		return deliver_it_iov_raw(to, iov, iovcnt);
+	}
+#endif
+
+	/* TLS (and Windows): coalesce the blocks into 'buf' and write
+	 * that in one go. We continue as long as everything is written.
+	 * 'block' and 'offset' track where the next write starts.
+	 */
+	block = container_of(head->next, dbufbuf, dbuf_node);
+	while (&block->dbuf_node != head)
+	{
+		if ((block->size - offset >= sizeof(buf)) || (block->dbuf_node.next == head))
 		{
-			/* SSL_write indicated that it cannot write data at this
-			 * time and needs to READ data first. Let's stop talking
-			 * to the user and ask to notify us when there's data
-			 * to read.
-			 */
-			fd_setselect(to->local->fd, FD_SELECT_READ, send_queued_cb, to);
-			fd_setselect(to->local->fd, FD_SELECT_WRITE, NULL, to);
-			break;
+			/* Large enough (or nothing else): no need to copy */
+			rlen = deliver_it_raw(to, block->start + offset, block->size - offset, want_read);
+			len = block->size - offset;
+		} else {
+			dbufbuf *b = block;
+			size_t o = offset;
+
+			for (len = 0; (len < sizeof(buf)) && (&b->dbuf_node != head); len += amount)
+			{
+				amount = MIN(b->size - o, sizeof(buf) - len);
+				memcpy(buf + len, b->start + o, amount);
+				o = 0;
+				b = container_of(b->dbuf_node.next, dbufbuf, dbuf_node);
+			}
+			rlen = deliver_it_raw(to, buf, len, want_read);
 		}
-		/* Restore handling of reads towards read_packet(), since
-		 * it may be overwritten in an earlier call to send_queued(),
-		 * to handle reads by send_queued_cb(), see directly above.
-		 */
-		fd_setselect(to->local->fd, FD_SELECT_READ, read_packet, to);
-		if (rlen < len)
-		{
-			/* incomplete write due to EWOULDBLOCK, reschedule */
-			fd_setselect(to->local->fd, FD_SELECT_WRITE, send_queued_cb, to);
+		if (rlen < 0)
+			return -1;
+		total += rlen;
+		if (*want_read || (rlen < len))
 			break;
+
+		/* Everything was written, advance past it */
+		offset += len;
+		while ((&block->dbuf_node != head) && (offset >= block->size))
+		{
+			offset -= block->size;
+			block = container_of(block->dbuf_node.next, dbufbuf, dbuf_node);
 		}
 	}
-	
-	/* Nothing left to write, stop asking for write-ready notification. */
-	if ((DBufLength(&to->local->sendQ) == 0) && (to->local->fd >= 0))
+
+	return total;
+}
+
+/** Finish a send_queued_raw() call.
+ * This removes the written data from the sendQ, updates the
+ * traffic statistics and (re)sets the I/O notification.
+ * @param to		The client
+ * @param rlen		The return value of send_queued_raw()
+ * @param want_read	The want_read value from send_queued_raw()
+ * @param saved_errno	The errno value directly after send_queued_raw()
+ * @returns -1 if the client is dead, 0 otherwise.
+ */
+int send_queued_completed(Client *to, int rlen, int want_read, int saved_errno)
+{
+	if (IsDeadSocket(to))
+		return -1;
+
+	if (rlen < 0)
+	{
+		char buf[256];
+		snprintf(buf, 256, "Write error: %s", STRERROR(saved_errno));
+		return dead_socket(to, buf);
+	}
+
+	if (rlen > 0)
+	{
+		to->local->traffic.bytes_sent += rlen;
+		me.local->traffic.bytes_sent += rlen;
+		dbuf_delete(&to->local->sendQ, rlen);
+	}
+
+	if (want_read)
+	{
+		/* SSL_write indicated that it cannot write data at this
+		 * time and needs to READ data first. Let's stop talking
+		 * to the user and ask to notify us when there's data
+		 * to read.
+		 */
+		SetWriteBlocked(to);
+		fd_setselect(to->local->fd, FD_SELECT_READ, send_queued_cb, to);
 		fd_setselect(to->local->fd, FD_SELECT_WRITE, NULL, to);
+		return 0;
+	}
 
-	return (IsDeadSocket(to)) ? -1 : 0;
+	/* Restore handling of reads towards read_packet(), since
+	 * it may be overwritten in an earlier call to send_queued(),
+	 * to handle reads by send_queued_cb(), see directly above.
+	 */
+	fd_setselect(to->local->fd, FD_SELECT_READ, read_packet, to);
+
+	if (DBufLength(&to->local->sendQ) > 0)
+	{
+		/* incomplete write due to EWOULDBLOCK, reschedule */
+		SetWriteBlocked(to);
+		fd_setselect(to->local->fd, FD_SELECT_WRITE, send_queued_cb, to);
+	} else {
+		/* Nothing left to write, stop asking for write-ready notification. */
+		ClearWriteBlocked(to);
+		fd_setselect(to->local->fd, FD_SELECT_WRITE, NULL, to);
+	}
+
+	return 0;
+}
+
+/** This function is called when queued data might be ready to be
+ * sent to the client. It is called from the event loop and also
+ * a couple of other places (such as when closing the connection).
+ */
+int send_queued(Client *to)
+{
+	int rlen;
+	int want_read;
+
+	/* We NEVER write to dead sockets. */
+	if (IsDeadSocket(to))
+		return -1;
+
+	if (DBufLength(&to->local->sendQ) == 0)
+	{
+		ClearWriteBlocked(to);
+		if (to->local->fd >= 0)
+			fd_setselect(to->local->fd, FD_SELECT_WRITE, NULL, to);
+		return 0;
+	}
+
+	rlen = send_queued_raw(to, &want_read);
+	return send_queued_completed(to, rlen, want_read, ERRNO);
 }
 
-/** Mark "to" with "there is data to be send" */
+/** Mark "to" with "there is data to be send".
+ * The data is not sent right away but at the end of the current
+ * SocketLoop() iteration by flush_dirty_clients(), so everything
+ * that is queued for a client in the meantime goes out in one write.
+ */
 void mark_data_to_send(Client *to)
 {
 	if (!IsDeadSocket(to) && (to->local->fd >= 0) && (DBufLength(&to->local->sendQ) > 0))
 	{
-		fd_setselect(to->local->fd, FD_SELECT_WRITE, send_queued_cb, to);
+		/* If the socket was not writable then we are already waiting
+		 * for the event loop to tell us when it is writable again.
+		 */
+		if (IsWriteBlocked(to))
+			return;
+		if (list_empty(&to->dirty_node))
+			list_add_tail(&to->dirty_node, &dirty_list);
+	}
+}
+
+/** Write the sendQ of all clients that have new data queued (dirty_list).
+ * This is called from SocketLoop() once per iteration.
+ */
+void flush_dirty_clients(void)
+{
+	Client *client;
+	struct list_head todo;
+
+	/* Clients are never freed while we are in here,
+	 * see also the comment in process_clients().
+	 */
+	INIT_LIST_HEAD(&todo);
+	list_splice_init(&dirty_list, &todo);
+
+	while (!list_empty(&todo))
+	{
+		client = list_first_entry(&todo, Client, dirty_node);
+		list_del_init(&client->dirty_node);
+		if (!IsDeadSocket(client) && (client->local->fd >= 0) && DBufLength(&client->local->sendQ))
+			send_queued_cb(client->local->fd, FD_SELECT_WRITE, client);
 	}
 }
 
@@ -309,6 +467,27 @@ static int sendbufto_one_prepare_line(Client *to, char *msg)
  *   effects not mentioned here.
  */
 void sendbufto_one(Client *to, char *msg, unsigned int quick)
+{
+	sendbufto_one_real(to, msg, quick, NULL);
+}
+
+/** Send a shared line buffer to the client.
+ * This is like sendbufto_one() with 'quick' set, except that
+ * the sendQ of the client will reference the shared buffer
+ * instead of holding its own copy of the line.
+ * @param to		The client to which the buffer should be send.
+ * @param shared	The shared buffer, which must contain a line
+ *			that is prepared by sendbufto_one_prepare_line().
+ */
+static void sendbufto_one_shared(Client *to, dbufshared *shared)
+{
+	if (shared->size == 0)
+		return; /* malformed message, see sendbufto_one_prepare_line() */
+	sendbufto_one_real(to, shared->data, shared->size, shared);
+}
+
+/** The actual implementation of sendbufto_one() and sendbufto_one_shared() */
+static void sendbufto_one_real(Client *to, char *msg, unsigned int quick, dbufshared *shared)
 {
 	int len;
 	Hook *h;
@@ -394,7 +573,13 @@ void sendbufto_one(Client *to, char *msg, unsigned int quick)
 		return;
 	}
 
-	dbuf_put(&to->local->sendQ, msg, len);
+	/* Reference the shared buffer if there is one,
+	 * unless a hook has replaced the message.
+	 */
+	if (shared && (msg == shared->data) && (len == shared->size))
+		dbuf_put_shared(&to->local->sendQ, shared);
+	else
+		dbuf_put(&to->local->sendQ, msg, len);
 
 	/*
 	 * Update statistics. The following is slightly incorrect
@@ -473,17 +658,19 @@ void sendto_channel(Channel *channel, Client *from, Client *skip,
 	Member *lp;
 	Client *acptr;
 	char member_modes_ext[64];
+	uint64_t member_modes_mask = 0;
+	uint64_t see_invisible_mask = 0;
 	LineCache *cache;
-	char check_invisible = 0;
 
 	if (member_modes)
 	{
 		channel_member_modes_generate_equal_or_greater(member_modes, member_modes_ext, sizeof(member_modes_ext));
-		member_modes = member_modes_ext;
+		member_modes_mask = member_modes_to_mask(member_modes_ext);
 	}
 
+	/* If 'from' is invisible then only members with any of these modes may see it */
 	if ((sendflags & CHECK_INVISIBLE) && invisible_user_in_channel(from, channel))
-		check_invisible = 1;
+		see_invisible_mask = member_modes_to_mask("hoaq");
 
 	++current_serial;
 	cache = linecache_init();
@@ -501,10 +688,10 @@ void sendto_channel(Channel *channel, Client *from, Client *skip,
 		if (has_user_mode(acptr, 'T') && (sendflags & SKIP_CTCP))
 			continue;
 		/* Sender ('from') is invisible for 'acptr' and we were asked to CHECK_INVISIBLE */
-		if (check_invisible && !check_channel_access_member(lp, "hoaq") && (from != acptr))
+		if (see_invisible_mask && !(lp->member_modes_mask & see_invisible_mask) && (from != acptr))
 			continue;
 		/* Now deal with 'member_modes' (if not NULL) */
-		if (member_modes && !check_channel_access_member(lp, member_modes))
+		if (member_modes && !(lp->member_modes_mask & member_modes_mask))
 			continue;
 		/* Now deal with 'clicap' (if non-zero) */
 		if (clicap && MyUser(acptr) && ((clicap & CAP_INVERT) ? HasCapabilityFast(acptr, clicap) : !HasCapabilityFast(acptr, clicap)))
@@ -1018,7 +1205,7 @@ static void linecache_free(LineCache *cache)
 	for (e = cache->items; e; e = e_next)
 	{
 		e_next = e->next;
-		safe_free(e->line);
+		dbuf_shared_release(e->line);
 		safe_free(e);
 	}
 	safe_free(cache);
@@ -1049,14 +1236,14 @@ static unsigned long linecache_caps(Client *to)
 	}
 }
 
-static void linecache_add(LineCache *cache, int line_opts, Client *to, const char *line, int linelen)
+static LineCacheLine *linecache_add(LineCache *cache, int line_opts, Client *to, const char *line, int linelen)
 {
 	LineCacheLine *e = safe_alloc(sizeof(LineCacheLine));
 	e->user_type = linecache_usertype(to);
 	e->caps = linecache_caps(to);
-	safe_strdup(e->line, line);
-	e->linelen = linelen ? linelen : strlen(line);
+	e->line = dbuf_shared_new(line, linelen);
 	AddListItem(e, cache->items);
+	return e;
 }
 
 static LineCacheLine *linecache_get(LineCache *cache, int line_opts, Client *to)
@@ -1089,7 +1276,7 @@ static void vsendto_prefix_one_cached(LineCache *cache, int line_opts, Client *t
 
 	if ((l = linecache_get(cache, line_opts, to)))
 	{
-		sendbufto_one(to, l->line, l->linelen);
+		sendbufto_one_shared(to, l->line);
 		return;
 	}
 
@@ -1104,15 +1291,14 @@ static void vsendto_prefix_one_cached(LineCache *cache, int line_opts, Client *t
 	{
 		/* Simple message without message tags */
 		len = sendbufto_one_prepare_line(to, sendbuf);
-		linecache_add(cache, line_opts, to, sendbuf, len);
-		sendbufto_one(to, sendbuf, len);
+		l = linecache_add(cache, line_opts, to, sendbuf, len);
 	} else {
 		/* Message tags need to be prepended */
 		snprintf(sendbuf2, sizeof(sendbuf2)-3, "@%s %s", mtags_str, sendbuf);
 		len = sendbufto_one_prepare_line(to, sendbuf2);
-		linecache_add(cache, line_opts, to, sendbuf2, len);
-		sendbufto_one(to, sendbuf2, 0);
+		l = linecache_add(cache, line_opts, to, sendbuf2, len);
 	}
+	sendbufto_one_shared(to, l->line);
 }
 
 /** Introduce user to all other servers, except the one to skip.
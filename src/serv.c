@@ -49,6 +49,8 @@ MOTDFile smotd;
 MODVAR TKL *tklines[TKLISTLEN];
 /** 2D hash list of TKL entries + IP address */
 MODVAR TKL *tklines_ip_hash[TKLIPHASHLEN1][TKLIPHASHLEN2];
+/** Radix trees of CIDR TKL entries, per tklines_ip_hash row and for IPv4 [0] / IPv6 [1] */
+MODVAR TKLCidrNode *tklines_cidr_tree[TKLIPHASHLEN1][2];
 int MODVAR spamf_ugly_vchanoverride = 0;
 
 void read_motd(const char *filename, MOTDFile *motd);
@@ -1203,6 +1205,7 @@ void tkl_init(void)
 {
 	memset(tklines, 0, sizeof(tklines));
 	memset(tklines_ip_hash, 0, sizeof(tklines_ip_hash));
+	memset(tklines_cidr_tree, 0, sizeof(tklines_cidr_tree));
 }
 
 /** Called when a server link is lost.
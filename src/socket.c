@@ -596,6 +596,9 @@ void completed_connection(int fd, int revents, void *data)
 	Client *client = data;
 	ConfigItem_link *aconf = client->server ? client->server->conf : NULL;
 
+	/* The connect() is done, from now on all writes can simply be tried */
+	fd_write_edge(fd);
+
 	if (IsHandshake(client))
 	{
 		/* Due to delayed unreal_tls_connect call */
@@ -1138,6 +1141,7 @@ void start_of_normal_client_handshake(Client *client)
 
 	start_dns_and_ident_lookup(client);
 
+	fd_write_edge(client->local->fd);
 	fd_setselect(client->local->fd, FD_SELECT_READ, read_packet, client);
 }
 
@@ -1155,6 +1159,171 @@ void proceed_normal_client_handshake(Client *client, struct hostent *he)
 		dns_finished(client, DNS_FINISHED_FAIL);
 }
 
+/** Read data from a client socket (plaintext or TLS).
+ * This only does the actual recv() or SSL_read() and does not touch
+ * anything else, so it is safe to call from an I/O thread.
+ * @param client	The client
+ * @param buf		The buffer to read into
+ * @param buflen	The size of the buffer
+ * @param want		Set to FD_SELECT_READ or FD_SELECT_WRITE if TLS
+ *                      needs to read or write before we can continue,
+ *                      otherwise set to 0.
+ * @returns The number of bytes read, 0 on EOF or <0 on error,
+ *          in which case errno is set (also on EWOULDBLOCK).
+ */
+int read_packet_raw(Client *client, char *buf, int buflen, int *want)
+{
+	int length;
+
+	*want = 0;
+
+	if (IsTLS(client) && client->local->ssl != NULL)
+	{
+		/* The OpenSSL error queue is per-thread and SSL_get_error()
+		 * looks at it, so make sure no stale error from an earlier
+		 * call (possibly for another client) is in there.
+		 */
+		ERR_clear_error();
+		length = SSL_read(client->local->ssl, buf, buflen);
+
+		if (length < 0)
+		{
+			int err = SSL_get_error(client->local->ssl, length);
+
+			switch (err)
+			{
+			case SSL_ERROR_WANT_WRITE:
+				*want = FD_SELECT_WRITE;
+				length = -1;
+				SET_ERRNO(P_EWOULDBLOCK);
+				break;
+			case SSL_ERROR_WANT_READ:
+				*want = FD_SELECT_READ;
+				length = -1;
+				SET_ERRNO(P_EWOULDBLOCK);
+				break;
+			case SSL_ERROR_SYSCALL:
+				break;
+			case SSL_ERROR_SSL:
+				if (ERRNO == P_EAGAIN)
+					break;
+			default:
+				/*length = 0;
+				SET_ERRNO(0);
+				^^ why this? we should error. -- todo: is errno correct?
+				*/
+				break;
+			}
+		}
+	}
+	else
+		length = recv(client->local->fd, buf, buflen, 0);
+
+	return length;
+}
+
+/** Update the I/O notification after a read_packet_raw() call.
+ * @param fd		File descriptor
+ * @param want		The 'want' value from read_packet_raw()
+ * @param client	The client
+ */
+static void read_packet_want(int fd, int want, Client *client)
+{
+	if (want == FD_SELECT_WRITE)
+	{
+		fd_setselect(fd, FD_SELECT_READ, NULL, client);
+		fd_setselect(fd, FD_SELECT_WRITE, read_packet, client);
+	} else
+	if (want == FD_SELECT_READ)
+	{
+		fd_setselect(fd, FD_SELECT_READ, read_packet, client);
+	}
+}
+
+/** Handle the result of a read_packet_raw() call that did not return data.
+ * @param client	The client
+ * @param length	The return value of read_packet_raw()
+ * @param saved_errno	The errno value directly after read_packet_raw()
+ * @returns 1 if the client is still alive (EWOULDBLOCK and such), 0 if it was killed.
+ */
+static int read_packet_error(Client *client, int length, int saved_errno)
+{
+	if (length < 0 && ((saved_errno == P_EWOULDBLOCK) || (saved_errno == P_EAGAIN) || (saved_errno == P_EINTR)))
+		return 1;
+
+	SET_ERRNO(saved_errno);
+
+	if (IsServer(client) || client->server) /* server or outgoing connection */
+		lost_server_link(client, NULL);
+
+	exit_client(client, NULL, ERRNO ? "Read error" : "Connection closed");
+	return 0;
+}
+
+/** Process a chunk of data that was read from a client.
+ * @param client	The client
+ * @param buf		The data
+ * @param length	The length of the data
+ * @returns 1 if the client is still alive, 0 if it was killed.
+ */
+static int read_packet_process(Client *client, char *buf, int length)
+{
+	Hook *h;
+	int processdata;
+
+	client->local->last_msg_received = TStime();
+	if (client->local->last_msg_received > client->local->fake_lag)
+		client->local->fake_lag = client->local->last_msg_received;
+	/* FIXME: Is this correct? I have my doubts. */
+	ClearPingSent(client);
+
+	ClearPingWarning(client);
+
+	processdata = 1;
+	for (h = Hooks[HOOKTYPE_RAWPACKET_IN]; h; h = h->next)
+	{
+		processdata = (*(h->func.intfunc))(client, buf, &length);
+		if (processdata == 0)
+			break; /* if hook tells to ignore the data, then break now */
+		if (processdata < 0)
+			return 0; /* if hook tells client is dead, return now */
+	}
+
+	if (processdata && !process_packet(client, buf, length, 0))
+		return 0;
+
+	return 1;
+}
+
+/** Read and process data from a client until there is nothing left.
+ * @param fd		File descriptor
+ * @param client	The client
+ */
+static void read_packet_loop(int fd, Client *client)
+{
+	int length;
+	int want;
+
+	while (1)
+	{
+		length = read_packet_raw(client, readbuf, sizeof(readbuf), &want);
+		read_packet_want(fd, want, client);
+
+		if (length <= 0)
+		{
+			read_packet_error(client, length, ERRNO);
+			return;
+		}
+
+		if (!read_packet_process(client, readbuf, length))
+			return;
+
+		/* bail on short read! */
+		if (length < sizeof(readbuf))
+			return;
+	}
+}
+
 /** Read a packet from a client.
  * @param fd		File descriptor
  * @param revents	Read events (ignored)
@@ -1163,10 +1332,6 @@ void proceed_normal_client_handshake(Client *client, struct hostent *he)
 void read_packet(int fd, int revents, void *data)
 {
 	Client *client = data;
-	int length = 0;
-	time_t now = TStime();
-	Hook *h;
-	int processdata;
 
 	/* Don't read from dead sockets */
 	if (IsDeadSocket(client))
@@ -1175,6 +1340,10 @@ void read_packet(int fd, int revents, void *data)
 		return;
 	}
 
+	/* Let an I/O thread do the actual reading, if enabled */
+	if (io_threads_queue(client, IOJOB_READ))
+		return;
+
 	SET_ERRNO(0);
 
 	fd_setselect(fd, FD_SELECT_READ, read_packet, client);
@@ -1185,147 +1354,90 @@ void read_packet(int fd, int revents, void *data)
 	 */
 	fd_setselect(fd, FD_SELECT_WRITE, send_queued_cb, client);
 
-	while (1)
-	{
-		if (IsTLS(client) && client->local->ssl != NULL)
-		{
-			length = SSL_read(client->local->ssl, readbuf, sizeof(readbuf));
+	read_packet_loop(fd, client);
+}
 
-			if (length < 0)
-			{
-				int err = SSL_get_error(client->local->ssl, length);
+/** Finish a read that was done by an I/O thread.
+ * This does everything that read_packet() does after the actual read.
+ * @param client	The client
+ * @param buf		The buffer that was read into
+ * @param length	The return value of read_packet_raw()
+ * @param want		The 'want' value from read_packet_raw()
+ * @param saved_errno	The errno value from the I/O thread
+ */
+void read_packet_completed(Client *client, char *buf, int length, int want, int saved_errno)
+{
+	int fd = client->local->fd;
+	int n;
 
-				switch (err)
-				{
-				case SSL_ERROR_WANT_WRITE:
-					fd_setselect(fd, FD_SELECT_READ, NULL, client);
-					fd_setselect(fd, FD_SELECT_WRITE, read_packet, client);
-					length = -1;
-					SET_ERRNO(P_EWOULDBLOCK);
-					break;
-				case SSL_ERROR_WANT_READ:
-					fd_setselect(fd, FD_SELECT_READ, read_packet, client);
-					length = -1;
-					SET_ERRNO(P_EWOULDBLOCK);
-					break;
-				case SSL_ERROR_SYSCALL:
-					break;
-				case SSL_ERROR_SSL:
-					if (ERRNO == P_EAGAIN)
-						break;
-				default:
-					/*length = 0;
-					SET_ERRNO(0);
-					^^ why this? we should error. -- todo: is errno correct?
-					*/
-					break;
-				}
-			}
-		}
-		else
-			length = recv(client->local->fd, readbuf, sizeof(readbuf), 0);
+	if (IsDeadSocket(client) || (fd < 0))
+		return;
 
-		if (length <= 0)
-		{
-			if (length < 0 && ((ERRNO == P_EWOULDBLOCK) || (ERRNO == P_EAGAIN) || (ERRNO == P_EINTR)))
-				return;
+	fd_setselect(fd, FD_SELECT_READ, read_packet, client);
+	fd_setselect(fd, FD_SELECT_WRITE, send_queued_cb, client);
+	read_packet_want(fd, want, client);
 
-			if (IsServer(client) || client->server) /* server or outgoing connection */
-				lost_server_link(client, NULL);
+	if (length <= 0)
+	{
+		read_packet_error(client, length, saved_errno);
+		return;
+	}
 
-			exit_client(client, NULL, ERRNO ? "Read error" : "Connection closed");
+	/* Feed the data in the same chunk size as read_packet() does,
+	 * since that is what the RAWPACKET_IN hooks are used to.
+	 */
+	while (length > 0)
+	{
+		n = MIN(length, sizeof(readbuf));
+		if (!read_packet_process(client, buf, n))
 			return;
-		}
-
-		client->local->last_msg_received = now;
-		if (client->local->last_msg_received > client->local->fake_lag)
-			client->local->fake_lag = client->local->last_msg_received;
-		/* FIXME: Is this correct? I have my doubts. */
-		ClearPingSent(client);
-
-		ClearPingWarning(client);
-
-		processdata = 1;
-		for (h = Hooks[HOOKTYPE_RAWPACKET_IN]; h; h = h->next)
-		{
-			processdata = (*(h->func.intfunc))(client, readbuf, &length);
-			if (processdata == 0)
-				break; /* if hook tells to ignore the data, then break now */
-			if (processdata < 0)
-				return; /* if hook tells client is dead, return now */
-		}
+		buf += n;
+		length -= n;
+	}
 
-		if (processdata && !process_packet(client, readbuf, length, 0))
-			return;
+	/* SSL_read() returns data from one TLS record at a time, which can
+	 * be larger than what the I/O thread read. The rest of the record
+	 * is then already decrypted and waiting in OpenSSL, and the socket
+	 * will not become readable for it, so we read it here.
+	 */
+	if (IsTLS(client) && client->local->ssl && SSL_pending(client->local->ssl) && !IsDeadSocket(client))
+		read_packet_loop(fd, client);
+}
 
-		/* bail on short read! */
-		if (length < sizeof(readbuf))
-			return;
-	}
+/** Mark "client" with "there is data in the recvQ that still needs to be processed".
+ * This is used when parse_client_queued() could not process all data
+ * right away, eg. due to fake lag or because of a pending DNS/ident lookup.
+ * The client is then picked up again by process_clients().
+ */
+void mark_data_to_process(Client *client)
+{
+	if ((client->local->fd >= 0) && DBufLength(&client->local->recvQ) && list_empty(&client->ready_node))
+		list_add_tail(&client->ready_node, &ready_list);
 }
 
 /** Process input from clients that may have been deliberately delayed due to fake lag */
 void process_clients(void)
 {
 	Client *client;
-        
-	/* Problem:
-	 * When processing a client, that current client may exit due to eg QUIT.
-	 * Similarly, current->next may be killed due to /KILL.
-	 * When a client is killed, in the past we were not allowed to touch it anymore
-	 * so that was a bit problematic. Now we can touch current->next, but it may
-	 * have been removed from the lclient_list or unknown_list.
-	 * In other words, current->next->next may be NULL even though there are more
-	 * clients on the list.
-	 * This is why the whole thing is wrapped in an additional do { } while() loop
-	 * to make sure we re-run the list if we ended prematurely.
-	 * We could use some kind of 'tagging' to mark already processed clients.
-	 * However, parse_client_queued() already takes care not to read (fake) lagged
-	 * clients, and we don't actually read/recv anything in the meantime, so clients
-	 * in the beginning of the list won't benefit, they won't get higher prio.
-	 * Another alternative is not to run the loop again, but that WOULD be
-	 * unfair to clients later in the list which wouldn't be processed then
-	 * under a heavy (kill) load scenario.
-	 * I think the chosen solution is best, though it remains silly. -- Syzop
+	struct list_head todo;
+
+	/* Take over the entire ready_list first. Clients that can still not
+	 * be processed will be put back by parse_client_queued() and then
+	 * we handle them next time, rather than looping here forever.
+	 * Note that clients are never freed while we are in here (that only
+	 * happens in the check_deadsockets event), so it is safe to use
+	 * clients on the todo list even if they are killed in the meantime.
 	 */
+	INIT_LIST_HEAD(&todo);
+	list_splice_init(&ready_list, &todo);
 
-	do {
-		list_for_each_entry(client, &lclient_list, lclient_node)
-		{
-			if ((client->local->fd >= 0) && DBufLength(&client->local->recvQ) && !IsDead(client))
-			{
-				parse_client_queued(client);
-				if (IsDead(client))
-					break;
-			}
-		}
-	} while(&client->lclient_node != &lclient_list);
-
-	do {
-		list_for_each_entry(client, &unknown_list, lclient_node)
-		{
-			if ((client->local->fd >= 0) && DBufLength(&client->local->recvQ) && !IsDead(client))
-			{
-				parse_client_queued(client);
-				if (IsDead(client) || (client->status > CLIENT_STATUS_UNKNOWN))
-					break;
-			}
-		}
-	} while(&client->lclient_node != &unknown_list);
-
-	do {
-		list_for_each_entry(client, &control_list, lclient_node)
-		{
-			if ((client->local->fd >= 0) && DBufLength(&client->local->recvQ) && !IsDead(client))
-			{
-				parse_client_queued(client);
-				if (IsDead(client))
-					break;
-			}
-		}
-	} while(&client->lclient_node != &control_list);
-
-
+	while (!list_empty(&todo))
+	{
+		client = list_first_entry(&todo, Client, ready_node);
+		list_del_init(&client->ready_node);
+		if ((client->local->fd >= 0) && DBufLength(&client->local->recvQ) && !IsDead(client))
+			parse_client_queued(client);
+	}
 }
 
 /** Check if 'ip' is a valid IP address, and if so what type.
@@ -1374,9 +1486,24 @@ int unix_sockets_capable(void)
 	return 1;
 }
 
-/** Attempt to deliver data to a client.
- * This function is only called from send_queued() and will deal
- * with sending to the TLS or plaintext connection.
+/** Is the client in a state where we can write data to it? */
+static int deliver_it_possible(Client *client)
+{
+	if (IsDeadSocket(client) ||
+	    (!IsServer(client) && !IsUser(client) && !IsHandshake(client) &&
+	     !IsTLSHandshake(client) && !IsUnknown(client) &&
+	     !IsControl(client) && !IsRPC(client)))
+	{
+		return 0;
+	}
+	return 1;
+}
+
+/** Attempt to deliver data to a client, without updating statistics.
+ * This function is only called from send_queued() (directly or via
+ * an I/O thread) and will deal with sending to the TLS or plaintext
+ * connection. It does not touch any shared state, so it is safe to
+ * call from an I/O thread.
  * @param cptr The client
  * @param str  The string to send
  * @param len  The length of the string
@@ -1394,22 +1521,18 @@ int unix_sockets_capable(void)
  *             zero return. Upper level routine will have to
  *             decide what to do with those unwritten bytes...
  */
-int deliver_it(Client *client, char *str, int len, int *want_read)
+int deliver_it_raw(Client *client, char *str, int len, int *want_read)
 {
 	int  retval;
 
 	*want_read = 0;
 
-	if (IsDeadSocket(client) ||
-	    (!IsServer(client) && !IsUser(client) && !IsHandshake(client) &&
-	     !IsTLSHandshake(client) && !IsUnknown(client) &&
-	     !IsControl(client) && !IsRPC(client)))
-	{
+	if (!deliver_it_possible(client))
 		return -1;
-	}
 
 	if (IsTLS(client) && client->local->ssl != NULL)
 	{
+		ERR_clear_error(); /* see read_packet_raw() */
 		retval = SSL_write(client->local->ssl, str, len);
 
 		if (retval < 0)
@@ -1453,13 +1576,53 @@ int deliver_it(Client *client, char *str, int len, int *want_read)
 # endif
 			retval = 0;
 
+	return (retval);
+}
+
+#ifndef _WIN32
+/** Attempt to deliver multiple buffers to a plaintext client at once.
+ * This is like deliver_it_raw() but it uses writev(), so a whole
+ * series of sendQ blocks can be written with a single system call.
+ * It may not be used for TLS clients.
+ * @param client	The client
+ * @param iov		The buffers
+ * @param iovcnt	Number of buffers in 'iov'
+ * @returns The number of bytes written, 0 on EWOULDBLOCK and
+ *          similar conditions and -1 on error.
+ */
+int deliver_it_iov_raw(Client *client, struct iovec *iov, int iovcnt)
+{
+	ssize_t retval;
+
+	if (!deliver_it_possible(client))
+		return -1;
+
+	retval = writev(client->local->fd, iov, iovcnt);
+	if (retval < 0 && (errno == EWOULDBLOCK || errno == EAGAIN ||
+	    errno == ENOBUFS))
+	{
+		retval = 0;
+	}
+
+	return retval;
+}
+#endif
+
+/** Attempt to deliver data to a client.
+ * This is deliver_it_raw() plus updating the traffic statistics.
+ * See deliver_it_raw() for the parameters and return value.
+ */
+int deliver_it(Client *client, char *str, int len, int *want_read)
+{
+	int retval = deliver_it_raw(client, str, len, want_read);
+
 	if (retval > 0)
 	{
 		client->local->traffic.bytes_sent += retval;
 		me.local->traffic.bytes_sent += retval;
 	}
 
-	return (retval);
+	return retval;
 }
 
 /** Initiate an outgoing connection, the actual connect() call. */
@@ -768,6 +768,27 @@ void *safe_alloc(size_t size)
 	return p;
 }
 
+/** Resize previously allocated memory - should always be used instead of realloc.
+ * @param ptr  The memory returned by safe_alloc() or safe_realloc(), or NULL
+ * @param size The new size in bytes
+ * @returns A pointer to the resized memory.
+ * @note Unlike safe_alloc(), any newly added space is NOT zeroed.
+ * @note If out of memory then the IRCd will exit.
+ */
+void *safe_realloc(void *ptr, size_t size)
+{
+	void *p;
+	if (size == 0)
+	{
+		free(ptr);
+		return NULL;
+	}
+	p = realloc(ptr, size);
+	if (!p)
+		outofmemory(size);
+	return p;
+}
+
 /** Safely duplicate a string */
 char *our_strdup(const char *str)
 {
@@ -312,6 +312,17 @@ SSL_CTX *init_ctx(TLSOptions *tlsoptions, int server)
  #error "Your system has an outdated OpenSSL version. Please upgrade OpenSSL."
 #endif
 	SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+	/* send_queued_raw() may retry an SSL_write() from a different buffer */
+	SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_ENABLE_KTLS
+	/* Kernel TLS: after the handshake OpenSSL hands the keys to the kernel
+	 * which then does the encryption and decryption. OpenSSL silently
+	 * falls back to doing it itself if the kernel (tls module), the
+	 * OpenSSL build or the negotiated cipher does not support it.
+	 */
+	if (tlsoptions->options & TLSFLAG_KTLS)
+		SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
 
 	if (SSL_CTX_use_certificate_chain_file(ctx, tlsoptions->certificate_file) <= 0)
 	{
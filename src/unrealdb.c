@@ -19,6 +19,11 @@
  */
 
 #include "unrealircd.h"
+#ifndef _WIN32
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#endif
 
 /** @file
  * @brief UnrealIRCd database API - see @ref UnrealDBFunctions
@@ -69,10 +74,23 @@
 static SecretCache *find_secret_cache(Secret *secr, UnrealDBConfig *cfg);
 static void unrealdb_add_to_secret_cache(Secret *secr, UnrealDBConfig *cfg);
 static void unrealdb_set_error(UnrealDB *c, UnrealDBError errcode, FORMAT_STRING(const char *pattern), ...) __attribute__((format(printf,3,4)));
+static int unrealdb_write(UnrealDB *c, const void *wbuf, int len);
+static int unrealdb_flush_buffer(UnrealDB *c, int final);
+static int unrealdb_async_close(UnrealDB *c);
+static void unrealdb_async_wait(const char *filename);
 
 UnrealDBError unrealdb_last_error_code;
 static char *unrealdb_last_error_string = NULL;
 
+/** When the last asynchronous write of a file completed, see unrealdb_async_written_time() */
+typedef struct UnrealDBWritten UnrealDBWritten;
+struct UnrealDBWritten {
+	UnrealDBWritten *prev, *next;
+	char *filename;
+	time_t written;
+};
+static UnrealDBWritten *unrealdb_written = NULL;
+
 /** Set error condition on unrealdb 'c' (internal function).
  * @param c		The unrealdb file handle
  * @param pattern	The format string
@@ -90,6 +108,8 @@ static void unrealdb_set_error(UnrealDB *c, UnrealDBError errcode, FORMAT_STRING
 	{
 		c->error_code = errcode;
 		safe_strdup(c->error_string, buf);
+		if (c->writer_thread)
+			return;
 	}
 	unrealdb_last_error_code = errcode;
 	safe_strdup(unrealdb_last_error_string, buf);
@@ -100,9 +120,27 @@ static void unrealdb_free(UnrealDB *c)
 {
 	unrealdb_free_config(c->config);
 	safe_free(c->error_string);
+	safe_free(c->filename);
+#ifndef _WIN32
+	if (c->map)
+		munmap(c->map, c->maplen);
+#endif
+	if (c->membuf)
+		sodium_memzero(c->membuf, c->membufsize);
+	safe_free(c->membuf);
+	safe_free_sensitive(c->buf);
+	safe_free(c->cbuf);
 	safe_free_sensitive(c);
 }
 
+/** Allocate the read/write buffer(s) of c->bufsize bytes (internal function) */
+static void unrealdb_alloc_buffer(UnrealDB *c)
+{
+	c->buf = safe_alloc_sensitive(c->bufsize);
+	if (c->crypted)
+		c->cbuf = safe_alloc(c->bufsize + crypto_secretstream_xchacha20poly1305_ABYTES);
+}
+
 static int unrealdb_kdf(UnrealDB *c, Secret *secr)
 {
 	if (c->config->kdf != UNREALDB_KDF_ARGON2ID)
@@ -125,6 +163,114 @@ static int unrealdb_kdf(UnrealDB *c, Secret *secr)
 	return 1;
 }
 
+/** Write the file header (internal function).
+ * For encrypted files this also initializes the crypto state,
+ * so c->config must be set, including the key.
+ */
+static int unrealdb_write_header(UnrealDB *c)
+{
+	char header[crypto_secretstream_xchacha20poly1305_HEADERBYTES];
+	char buf[32]; /* don't change this */
+	uint32_t chunk_size = c->bufsize;
+
+	unrealdb_alloc_buffer(c);
+
+	if (!c->crypted)
+	{
+#ifdef UNREALDB_WRITE_V1
+		memset(buf, 0, sizeof(buf));
+		snprintf(buf, sizeof(buf), "UnrealIRCd-DB-v1");
+		if ((fwrite(buf, 1, sizeof(buf), c->fd) != sizeof(buf)) ||
+		    !unrealdb_write_int64(c, c->creationtime))
+		{
+			unrealdb_set_error(c, UNREALDB_ERROR_IO, "Unable to write header (A1)");
+			return 0;
+		}
+#endif
+		return 1;
+	}
+
+	/* Write the:
+	 * - generic header ("UnrealIRCd-DB" + some zeroes)
+	 * - the salt
+	 * - the chunk size (v2 only)
+	 * - the crypto header
+	 * We only write v2 if a non-default chunk size is used,
+	 * so people can still downgrade otherwise.
+	 */
+	memset(buf, 0, sizeof(buf));
+	if (chunk_size == UNREALDB_CRYPT_FILE_CHUNK_SIZE)
+		snprintf(buf, sizeof(buf), "UnrealIRCd-DB-Crypted-v1");
+	else
+		snprintf(buf, sizeof(buf), "UnrealIRCd-DB-Crypted-v2");
+	if (fwrite(buf, 1, sizeof(buf), c->fd) != sizeof(buf))
+	{
+		unrealdb_set_error(c, UNREALDB_ERROR_IO, "Unable to write header (1)");
+		return 0; /* Unable to write header nr 1 */
+	}
+
+	/* Write KDF and cipher parameters */
+	if ((fwrite(&c->config->kdf, 1, sizeof(c->config->kdf), c->fd) != sizeof(c->config->kdf)) ||
+	    (fwrite(&c->config->t_cost, 1, sizeof(c->config->t_cost), c->fd) != sizeof(c->config->t_cost)) ||
+	    (fwrite(&c->config->m_cost, 1, sizeof(c->config->m_cost), c->fd) != sizeof(c->config->m_cost)) ||
+	    (fwrite(&c->config->p_cost, 1, sizeof(c->config->p_cost), c->fd) != sizeof(c->config->p_cost)) ||
+	    (fwrite(&c->config->saltlen, 1, sizeof(c->config->saltlen), c->fd) != sizeof(c->config->saltlen)) ||
+	    (fwrite(c->config->salt, 1, c->config->saltlen, c->fd) != c->config->saltlen) ||
+	    (fwrite(&c->config->cipher, 1, sizeof(c->config->cipher), c->fd) != sizeof(c->config->cipher)) ||
+	    (fwrite(&c->config->keylen, 1, sizeof(c->config->keylen), c->fd) != sizeof(c->config->keylen)) ||
+	    ((chunk_size != UNREALDB_CRYPT_FILE_CHUNK_SIZE) &&
+	     (fwrite(&chunk_size, 1, sizeof(chunk_size), c->fd) != sizeof(chunk_size))))
+	{
+		unrealdb_set_error(c, UNREALDB_ERROR_IO, "Unable to write header (2)");
+		return 0;
+	}
+
+	crypto_secretstream_xchacha20poly1305_init_push(&c->st, header, c->config->key);
+	if (fwrite(header, 1, sizeof(header), c->fd) != sizeof(header))
+	{
+		unrealdb_set_error(c, UNREALDB_ERROR_IO, "Unable to write header (3)");
+		return 0; /* Unable to write crypto header */
+	}
+	if (!unrealdb_write_str(c, "UnrealIRCd-DB-Crypted-Now") ||
+	    !unrealdb_write_int64(c, c->creationtime))
+	{
+		/* error is already set by unrealdb_write_str() */
+		return 0; /* Unable to write crypto header */
+	}
+	return 1;
+}
+
+/** Map the rest of a file that is opened for reading into memory (internal function).
+ * This is done after the header has been read. All further reads are
+ * then served from memory, rather than doing an fread() for every field
+ * (unencrypted) or every chunk (encrypted), and a truncated file is
+ * noticed without doing any I/O.
+ * If mapping is not possible, for whatever reason, then we simply
+ * continue with fread().
+ */
+static void unrealdb_map_file(UnrealDB *c)
+{
+#ifndef _WIN32
+	struct stat st;
+	long pos;
+	void *map;
+
+	pos = ftell(c->fd);
+	if ((pos < 0) || (fstat(fileno(c->fd), &st) < 0) || (st.st_size <= pos))
+		return;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(c->fd), 0);
+	if (map == MAP_FAILED)
+		return;
+#ifdef MADV_SEQUENTIAL
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif
+	c->map = map;
+	c->maplen = st.st_size;
+	c->mappos = pos;
+#endif
+}
+
 /**
  * @addtogroup UnrealDBFunctions
  * @{
@@ -167,16 +313,25 @@ UnrealDB *unrealdb_open(const char *filename, UnrealDBMode mode, char *secret_bl
 	Secret *secr=NULL;
 	SecretCache *dbcache;
 	int cached = 0;
+	int version = 1;
+	uint32_t chunk_size;
 	char *err;
 
 	errno = 0;
 
-	if ((mode != UNREALDB_MODE_READ) && (mode != UNREALDB_MODE_WRITE))
+	if ((mode != UNREALDB_MODE_READ) && (mode != UNREALDB_MODE_WRITE) && (mode != UNREALDB_MODE_WRITE_ASYNC))
 	{
 		unrealdb_set_error(c, UNREALDB_ERROR_API, "unrealdb_open request for neither read nor write");
 		goto unrealdb_open_fail;
 	}
 
+	/* Make sure any earlier asynchronous writes of this file are on disk,
+	 * so we never read an old file or write the same file twice
+	 * at the same time.
+	 */
+	if (mode != UNREALDB_MODE_WRITE_ASYNC)
+		unrealdb_async_wait(filename);
+
 	/* Do this check early, before we try to create any file */
 	if (secret_block != NULL)
 	{
@@ -195,8 +350,25 @@ UnrealDB *unrealdb_open(const char *filename, UnrealDBMode mode, char *secret_bl
 	}
 
 	c->mode = mode;
-	c->fd = fopen(filename, (c->mode == UNREALDB_MODE_WRITE) ? "wb" : "rb");
-	if (!c->fd)
+	c->creationtime = TStime();
+	if (c->mode != UNREALDB_MODE_READ)
+	{
+		/* When reading, the chunk size comes from the header */
+		if (secret_block != NULL)
+			c->bufsize = MAX(iConf.database_chunk_size, UNREALDB_CRYPT_FILE_CHUNK_SIZE);
+		else
+			c->bufsize = UNREALDB_WRITE_BUFFER_SIZE;
+		c->fsync_mode = iConf.database_fsync;
+	}
+	if (c->mode == UNREALDB_MODE_WRITE_ASYNC)
+	{
+		/* Don't touch the file now, that's for the writer thread */
+		safe_strdup(c->filename, filename);
+	} else
+	{
+		c->fd = fopen(filename, (c->mode == UNREALDB_MODE_WRITE) ? "wb" : "rb");
+	}
+	if (!c->fd && (c->mode != UNREALDB_MODE_WRITE_ASYNC))
 	{
 		if (errno == ENOENT)
 			unrealdb_set_error(c, UNREALDB_ERROR_FILENOTFOUND, "File not found: %s", strerror(errno));
@@ -247,19 +419,15 @@ UnrealDB *unrealdb_open(const char *filename, UnrealDBMode mode, char *secret_bl
 					/* SUCCESS = fallthrough */
 				}
 			}
-		} else {
-#ifdef UNREALDB_WRITE_V1
+		} else
+		if (c->mode == UNREALDB_MODE_WRITE)
+		{
 			/* WRITE */
-			memset(buf, 0, sizeof(buf));
-			snprintf(buf, sizeof(buf), "UnrealIRCd-DB-v1");
-			if ((fwrite(buf, 1, sizeof(buf), c->fd) != sizeof(buf)) ||
-			    !unrealdb_write_int64(c, TStime()))
-			{
-				unrealdb_set_error(c, UNREALDB_ERROR_IO, "Unable to write header (A1)");
+			if (!unrealdb_write_header(c))
 				goto unrealdb_open_fail;
-			}
-#endif
 		}
+		if (c->mode == UNREALDB_MODE_READ)
+			unrealdb_map_file(c);
 		safe_free(unrealdb_last_error_string);
 		unrealdb_last_error_code = UNREALDB_ERROR_SUCCESS;
 		return c;
@@ -267,21 +435,8 @@ UnrealDB *unrealdb_open(const char *filename, UnrealDBMode mode, char *secret_bl
 
 	c->crypted = 1;
 
-	if (c->mode == UNREALDB_MODE_WRITE)
+	if (c->mode != UNREALDB_MODE_READ)
 	{
-		/* Write the:
-		 * - generic header ("UnrealIRCd-DB" + some zeroes)
-		 * - the salt
-		 * - the crypto header
-		 */
-		memset(buf, 0, sizeof(buf));
-		snprintf(buf, sizeof(buf), "UnrealIRCd-DB-Crypted-v1");
-		if (fwrite(buf, 1, sizeof(buf), c->fd) != sizeof(buf))
-		{
-			unrealdb_set_error(c, UNREALDB_ERROR_IO, "Unable to write header (1)");
-			goto unrealdb_open_fail; /* Unable to write header nr 1 */
-		}
-
 		if (secr->cache && secr->cache->config)
 		{
 			/* Use first found cached config for this secret */
@@ -305,20 +460,6 @@ UnrealDB *unrealdb_open(const char *filename, UnrealDBMode mode, char *secret_bl
 		if (c->config->kdf == 0)
 			abort();
 
-		/* Write KDF and cipher parameters */
-		if ((fwrite(&c->config->kdf, 1, sizeof(c->config->kdf), c->fd) != sizeof(c->config->kdf)) ||
-		    (fwrite(&c->config->t_cost, 1, sizeof(c->config->t_cost), c->fd) != sizeof(c->config->t_cost)) ||
-		    (fwrite(&c->config->m_cost, 1, sizeof(c->config->m_cost), c->fd) != sizeof(c->config->m_cost)) ||
-		    (fwrite(&c->config->p_cost, 1, sizeof(c->config->p_cost), c->fd) != sizeof(c->config->p_cost)) ||
-		    (fwrite(&c->config->saltlen, 1, sizeof(c->config->saltlen), c->fd) != sizeof(c->config->saltlen)) ||
-		    (fwrite(c->config->salt, 1, c->config->saltlen, c->fd) != c->config->saltlen) ||
-		    (fwrite(&c->config->cipher, 1, sizeof(c->config->cipher), c->fd) != sizeof(c->config->cipher)) ||
-		    (fwrite(&c->config->keylen, 1, sizeof(c->config->keylen), c->fd) != sizeof(c->config->keylen)))
-		{
-			unrealdb_set_error(c, UNREALDB_ERROR_IO, "Unable to write header (2)");
-			goto unrealdb_open_fail;
-		}
-		
 		if (cached)
 		{
 #ifdef DEBUGMODE
@@ -340,18 +481,9 @@ UnrealDB *unrealdb_open(const char *filename, UnrealDBMode mode, char *secret_bl
 			}
 		}
 
-		crypto_secretstream_xchacha20poly1305_init_push(&c->st, header, c->config->key);
-		if (fwrite(header, 1, sizeof(header), c->fd) != sizeof(header))
-		{
-			unrealdb_set_error(c, UNREALDB_ERROR_IO, "Unable to write header (3)");
-			goto unrealdb_open_fail; /* Unable to write crypto header */
-		}
-		if (!unrealdb_write_str(c, "UnrealIRCd-DB-Crypted-Now") ||
-		    !unrealdb_write_int64(c, TStime()))
-		{
-			/* error is already set by unrealdb_write_str() */
-			goto unrealdb_open_fail; /* Unable to write crypto header */
-		}
+		if ((c->mode == UNREALDB_MODE_WRITE) && !unrealdb_write_header(c))
+			goto unrealdb_open_fail;
+
 		if (!cached)
 			unrealdb_add_to_secret_cache(secr, c->config);
 	} else
@@ -364,7 +496,22 @@ UnrealDB *unrealdb_open(const char *filename, UnrealDBMode mode, char *secret_bl
 			unrealdb_set_error(c, UNREALDB_ERROR_NOTCRYPTED, "Not a crypted file (file too small)");
 			goto unrealdb_open_fail; /* Header too short */
 		}
-		if (strncmp(buf, "UnrealIRCd-DB-Crypted-v1", 24))
+		if (!strncmp(buf, "UnrealIRCd-DB-Crypted-v1", 24))
+		{
+			version = 1;
+		} else
+		if (!strncmp(buf, "UnrealIRCd-DB-Crypted-v2", 24))
+		{
+			version = 2;
+		} else
+		if (!strncmp(buf, "UnrealIRCd-DB-Crypted-v", 23))
+		{
+			unrealdb_set_error(c, UNREALDB_ERROR_HEADER,
+					   "Unsupported version of database. Is this database perhaps created on "
+					   "a new version of UnrealIRCd and are you trying to use it on an older "
+					   "UnrealIRCd version? (Downgrading is not supported!)");
+			goto unrealdb_open_fail;
+		} else
 		{
 			unrealdb_set_error(c, UNREALDB_ERROR_NOTCRYPTED, "Not a crypted file");
 			goto unrealdb_open_fail; /* Invalid header */
@@ -411,6 +558,22 @@ UnrealDB *unrealdb_open(const char *filename, UnrealDBMode mode, char *secret_bl
 			unrealdb_set_error(c, UNREALDB_ERROR_HEADER, "Header is corrupt (keylen=%d)", (int)c->config->keylen);
 			goto unrealdb_open_fail; /* Something must be wrong, this makes no sense. */
 		}
+		if (version == 1)
+		{
+			chunk_size = UNREALDB_CRYPT_FILE_CHUNK_SIZE;
+		} else
+		if (fread(&chunk_size, 1, sizeof(chunk_size), c->fd) != sizeof(chunk_size))
+		{
+			unrealdb_set_error(c, UNREALDB_ERROR_HEADER, "Header is corrupt/unknown/invalid (4)");
+			goto unrealdb_open_fail;
+		}
+		if ((chunk_size < UNREALDB_CRYPT_FILE_CHUNK_SIZE) || (chunk_size > UNREALDB_CRYPT_FILE_MAX_CHUNK_SIZE))
+		{
+			unrealdb_set_error(c, UNREALDB_ERROR_HEADER, "Header is corrupt (chunk size=%u)", (unsigned int)chunk_size);
+			goto unrealdb_open_fail;
+		}
+		c->bufsize = chunk_size;
+		unrealdb_alloc_buffer(c);
 		c->config->key = safe_alloc_sensitive(c->config->keylen);
 
 		dbcache = find_secret_cache(secr, c->config);
@@ -465,6 +628,7 @@ UnrealDB *unrealdb_open(const char *filename, UnrealDBMode mode, char *secret_bl
 			goto unrealdb_open_fail;
 		}
 		unrealdb_add_to_secret_cache(secr, c->config);
+		unrealdb_map_file(c);
 	}
 	sodium_stackzero(1024);
 	safe_free(unrealdb_last_error_string);
@@ -479,49 +643,63 @@ unrealdb_open_fail:
 	return NULL;
 }
 
-/** Close an unrealdb file.
- * @param c	The struct pointing to an unrealdb file
- * @returns 1 if the final close was graceful and 0 if not (eg: out of disk space on final flush).
- *          In all cases the file handle is closed and 'c' is freed.
- * @note Upon error (NULL return value) you can call unrealdb_get_error_code() and
- *       unrealdb_get_error_string() to see the actual error.
+/** Flush the remaining data and close the file, but don't free 'c' (internal function).
+ * @returns 1 on success, 0 on failure.
  */
-int unrealdb_close(UnrealDB *c)
+static int unrealdb_close_file(UnrealDB *c)
 {
-	/* If this is file was opened for writing then flush the remaining data with a TAG_FINAL
-	 * (or push a block of 0 bytes with TAG_FINAL)
+	/* If this is file was opened for writing then flush the remaining data,
+	 * for encrypted files with a TAG_FINAL (or push a block of 0 bytes with TAG_FINAL)
 	 */
-	if (c->crypted && (c->mode == UNREALDB_MODE_WRITE))
+	if ((c->mode == UNREALDB_MODE_WRITE) && !c->error_code && !unrealdb_flush_buffer(c, 1))
 	{
-		char buf_out[UNREALDB_CRYPT_FILE_CHUNK_SIZE + crypto_secretstream_xchacha20poly1305_ABYTES];
-		unsigned long long out_len = sizeof(buf_out);
+		/* Final write failed, error condition */
+		fclose(c->fd);
+		return 0;
+	}
 
-		crypto_secretstream_xchacha20poly1305_push(&c->st, buf_out, &out_len, c->buf, c->buflen, NULL, 0, crypto_secretstream_xchacha20poly1305_TAG_FINAL);
-		if (out_len > 0)
-		{
-			if (fwrite(buf_out, 1, out_len, c->fd) != out_len)
-			{
-				/* Final write failed, error condition */
-				unrealdb_set_error(c, UNREALDB_ERROR_IO, "Write error: %s", strerror(errno));
-				fclose(c->fd);
-				unrealdb_free(c);
-				return 0;
-			}
-		}
+#ifndef _WIN32
+	/* Make sure everything is on disk before the file is renamed */
+	if (c->sync_on_close && ((fflush(c->fd) != 0) || (fsync(fileno(c->fd)) != 0)))
+	{
+		unrealdb_set_error(c, UNREALDB_ERROR_IO, "Write error: %s", strerror(errno));
+		fclose(c->fd);
+		return 0;
 	}
+#endif
 
 	if (fclose(c->fd) != 0)
 	{
 		/* Final close failed, error condition */
 		unrealdb_set_error(c, UNREALDB_ERROR_IO, "Write error: %s", strerror(errno));
-		unrealdb_free(c);
 		return 0;
 	}
 
-	unrealdb_free(c);
 	return 1;
 }
 
+/** Close an unrealdb file.
+ * @param c	The struct pointing to an unrealdb file
+ * @returns 1 if the final close was graceful and 0 if not (eg: out of disk space on final flush).
+ *          In all cases the file handle is closed and 'c' is freed.
+ * @note Upon error (NULL return value) you can call unrealdb_get_error_code() and
+ *       unrealdb_get_error_string() to see the actual error.
+ * @note For files opened with UNREALDB_MODE_WRITE_ASYNC this only hands the
+ *       data over to the writer thread, which writes it to a temporary file
+ *       and then renames it to the real file. Any errors are logged later.
+ */
+int unrealdb_close(UnrealDB *c)
+{
+	int ret;
+
+	if (c->mode == UNREALDB_MODE_WRITE_ASYNC)
+		return unrealdb_async_close(c);
+
+	ret = unrealdb_close_file(c);
+	unrealdb_free(c);
+	return ret;
+}
+
 /** Test if there is something fatally wrong with the configuration of the DB file,
  * in which case we suggest to reject the /rehash or boot request.
  * This tests for "wrong password" and for "trying to open an encrypted file without providing a password"
@@ -561,6 +739,43 @@ char *unrealdb_test_db(const char *filename, char *secret_block)
 
 /** @} */
 
+/** Write the data in the buffer to the file (internal function).
+ * @param c		Database file open for writing
+ * @param final		For encrypted files: push the chunk with TAG_FINAL,
+ *			this must be the last chunk of the file.
+ * @returns 1 on success, 0 on failure.
+ */
+static int unrealdb_flush_buffer(UnrealDB *c, int final)
+{
+	unsigned long long out_len;
+
+	if (!c->crypted)
+	{
+		if ((c->buflen > 0) && (fwrite(c->buf, 1, c->buflen, c->fd) != c->buflen))
+		{
+			unrealdb_set_error(c, UNREALDB_ERROR_IO, "Write error: %s", strerror(errno));
+			return 0;
+		}
+		c->buflen = 0;
+		return 1;
+	}
+
+	if (crypto_secretstream_xchacha20poly1305_push(&c->st, c->cbuf, &out_len, c->buf, c->buflen, NULL, 0,
+	                                               final ? crypto_secretstream_xchacha20poly1305_TAG_FINAL : 0) != 0)
+	{
+		unrealdb_set_error(c, UNREALDB_ERROR_INTERNAL, "Failed to encrypt a block");
+		return 0;
+	}
+	if (fwrite(c->cbuf, 1, out_len, c->fd) != out_len)
+	{
+		unrealdb_set_error(c, UNREALDB_ERROR_IO, "Write error: %s", strerror(errno));
+		return 0;
+	}
+	/* Buffer is now flushed for sure */
+	c->buflen = 0;
+	return 1;
+}
+
 /** Write to an unrealdb file.
  * This code uses extra buffering to avoid writing small records
  * and wasting for example a 32 bytes encryption block for a 8 byte write request.
@@ -574,67 +789,63 @@ char *unrealdb_test_db(const char *filename, char *secret_block)
  */
 static int unrealdb_write(UnrealDB *c, const void *wbuf, int len)
 {
-	char buf_out[UNREALDB_CRYPT_FILE_CHUNK_SIZE + crypto_secretstream_xchacha20poly1305_ABYTES];
-	unsigned long long out_len;
 	const char *buf = wbuf;
+	int n;
 
 	if (c->error_code)
 		return 0;
 
+	if (c->mode == UNREALDB_MODE_WRITE_ASYNC)
+	{
+		/* Only store it, the writer thread does the rest */
+		if (c->membuflen + len > c->membufsize)
+		{
+			/* Not a realloc(), since that could leave a copy of
+			 * the (unencrypted) data behind in freed memory.
+			 */
+			size_t newsize = c->membufsize ? c->membufsize : UNREALDB_CRYPT_FILE_CHUNK_SIZE;
+			char *newbuf;
+
+			while (c->membuflen + len > newsize)
+				newsize *= 2;
+			newbuf = safe_alloc(newsize);
+			if (c->membuf)
+			{
+				memcpy(newbuf, c->membuf, c->membuflen);
+				sodium_memzero(c->membuf, c->membufsize);
+				safe_free(c->membuf);
+			}
+			c->membuf = newbuf;
+			c->membufsize = newsize;
+		}
+		memcpy(c->membuf + c->membuflen, buf, len);
+		c->membuflen += len;
+		return 1;
+	}
+
 	if (c->mode != UNREALDB_MODE_WRITE)
 	{
 		unrealdb_set_error(c, UNREALDB_ERROR_API, "Write operation requested on a file opened for reading");
 		return 0;
 	}
 
-	if (!c->crypted)
+	/* Collect the data in c->buf and only write it out when the
+	 * buffer is full: that is one fwrite() per UNREALDB_WRITE_BUFFER_SIZE
+	 * for unencrypted files, and one encrypted chunk for encrypted files.
+	 * Note that a full buffer is only flushed on the next write, so
+	 * the last chunk can be pushed with TAG_FINAL in unrealdb_close().
+	 */
+	while (len > 0)
 	{
-		if (fwrite(buf, 1, len, c->fd) != len)
-		{
-			unrealdb_set_error(c, UNREALDB_ERROR_IO, "Write error: %s", strerror(errno));
+		if ((c->buflen == c->bufsize) && !unrealdb_flush_buffer(c, 0))
 			return 0;
-		}
-		return 1;
+		n = MIN(len, c->bufsize - c->buflen);
+		memcpy(c->buf + c->buflen, buf, n);
+		c->buflen += n;
+		buf += n;
+		len -= n;
 	}
 
-	do {
-		if (c->buflen + len < UNREALDB_CRYPT_FILE_CHUNK_SIZE)
-		{
-			/* New data fits in new buffer. Then we are done with writing.
-			 * This can happen both for the first block (never write)
-			 * or the remainder (tail after X writes which is less than
-			 * UNREALDB_CRYPT_FILE_CHUNK_SIZE, a common case)
-			 */
-			memcpy(c->buf + c->buflen, buf, len);
-			c->buflen += len;
-			break; /* Done! */
-		} else
-		{
-			/* Fill up c->buf with UNREALDB_CRYPT_FILE_CHUNK_SIZE
-			 * Note that 'av_bytes' can be 0 here if c->buflen
-			 * happens to be exactly UNREALDB_CRYPT_FILE_CHUNK_SIZE,
-			 * that's okay.
-			 */
-			int av_bytes = UNREALDB_CRYPT_FILE_CHUNK_SIZE - c->buflen;
-			if (av_bytes > 0)
-				memcpy(c->buf + c->buflen, buf, av_bytes);
-			buf += av_bytes;
-			len -= av_bytes;
-		}
-		if (crypto_secretstream_xchacha20poly1305_push(&c->st, buf_out, &out_len, c->buf, UNREALDB_CRYPT_FILE_CHUNK_SIZE, NULL, 0, 0) != 0)
-		{
-			unrealdb_set_error(c, UNREALDB_ERROR_INTERNAL, "Failed to encrypt a block");
-			return 0;
-		}
-		if (fwrite(buf_out, 1, out_len, c->fd) != out_len)
-		{
-			unrealdb_set_error(c, UNREALDB_ERROR_IO, "Write error: %s", strerror(errno));
-			return 0;
-		}
-		/* Buffer is now flushed for sure */
-		c->buflen = 0;
-	} while(len > 0);
-
 	return 1;
 }
 
@@ -750,7 +961,7 @@ int unrealdb_write_char(UnrealDB *c, char t)
  */
 static int unrealdb_read(UnrealDB *c, void *rbuf, int len)
 {
-	char buf_in[UNREALDB_CRYPT_FILE_CHUNK_SIZE + crypto_secretstream_xchacha20poly1305_ABYTES];
+	const char *in;
 	unsigned long long out_len;
 	unsigned char tag;
 	size_t rlen;
@@ -765,6 +976,20 @@ static int unrealdb_read(UnrealDB *c, void *rbuf, int len)
 		return 0;
 	}
 
+	if (!c->crypted && c->map)
+	{
+		if (c->maplen - c->mappos < len)
+		{
+			unrealdb_set_error(c, UNREALDB_ERROR_IO, "Short read - premature end of file (want:%d, got:%d bytes)",
+				len, (int)(c->maplen - c->mappos));
+			c->mappos = c->maplen;
+			return 0;
+		}
+		memcpy(buf, c->map + c->mappos, len);
+		c->mappos += len;
+		return 1;
+	}
+
 	if (!c->crypted)
 	{
 		rlen = fread(buf, 1, len, c->fd);
@@ -781,9 +1006,8 @@ static int unrealdb_read(UnrealDB *c, void *rbuf, int len)
 	if (c->buflen)
 	{
 		int av_bytes = MIN(c->buflen, len);
-		memcpy(buf, c->buf, av_bytes);
-		if (c->buflen - av_bytes > 0)
-			memmove(c->buf, c->buf + av_bytes, c->buflen - av_bytes);
+		memcpy(buf, c->buf + c->bufpos, av_bytes);
+		c->bufpos += av_bytes;
 		c->buflen -= av_bytes;
 		len -= av_bytes;
 		if (len == 0)
@@ -796,20 +1020,29 @@ static int unrealdb_read(UnrealDB *c, void *rbuf, int len)
 
 	/* If we get here then we need to read some data */
 	do {
-		rlen = fread(buf_in, 1, sizeof(buf_in), c->fd);
+		if (c->map)
+		{
+			/* Decrypt directly from the mapped file */
+			rlen = MIN(c->maplen - c->mappos, c->bufsize + crypto_secretstream_xchacha20poly1305_ABYTES);
+			in = c->map + c->mappos;
+			c->mappos += rlen;
+		} else {
+			rlen = fread(c->cbuf, 1, c->bufsize + crypto_secretstream_xchacha20poly1305_ABYTES, c->fd);
+			in = c->cbuf;
+		}
 		if (rlen == 0)
 		{
 			unrealdb_set_error(c, UNREALDB_ERROR_IO, "Short read - premature end of file??");
 			return 0;
 		}
-		if (crypto_secretstream_xchacha20poly1305_pull(&c->st, c->buf, &out_len, &tag, buf_in, rlen, NULL, 0) != 0)
+		if (crypto_secretstream_xchacha20poly1305_pull(&c->st, c->buf, &out_len, &tag, in, rlen, NULL, 0) != 0)
 		{
 			unrealdb_set_error(c, UNREALDB_ERROR_IO, "Failed to decrypt a block - either corrupt or wrong key");
 			return 0;
 		}
 
 		/* This should be impossible as this is guaranteed not to happen by libsodium */
-		if (out_len > UNREALDB_CRYPT_FILE_CHUNK_SIZE)
+		if (out_len > c->bufsize)
 			abort();
 
 		if (len > out_len)
@@ -821,12 +1054,11 @@ static int unrealdb_read(UnrealDB *c, void *rbuf, int len)
 		} else {
 			/* This is the only (or last) block we need, we are satisfied */
 			memcpy(buf, c->buf, len);
+			c->bufpos = len;
 			c->buflen = out_len - len;
-			if (c->buflen > 0)
-				memmove(c->buf, c->buf+len, c->buflen);
 			return 1; /* Done */
 		}
-	} while(!feof(c->fd));
+	} while(c->map ? (c->mappos < c->maplen) : !feof(c->fd));
 
 	unrealdb_set_error(c, UNREALDB_ERROR_IO, "Short read - premature end of file?");
 	return 0;
@@ -1001,7 +1233,8 @@ void unrealdb_test_speed(char *key)
 	int i, len;
 	char *str;
 	char buf[1024];
-	int written = 0, read = 0;
+	int written = 0, read = 0, records = 0;
+	long long usecs;
 	struct timeval tv_start, tv_end;
 
 	fprintf(stderr, "*** WRITE TEST ***\n");
@@ -1036,24 +1269,110 @@ void unrealdb_test_speed(char *key)
 		if (!unrealdb_read_str(c, &str))
 			fatal_error("Error on read at position %d/%d: %s", read, written, c->error_string);
 		read += strlen(str) + 2; /* same calculation as earlier */
+		records++;
 		safe_free(str);
 	} while(read < written);
+	fprintf(stderr, "File was %s\n", c->map ? "memory mapped" : "read using stdio");
 	if (!unrealdb_close(c))
 		fatal_error("Error on close");
 	gettimeofday(&tv_end, NULL);
-	fprintf(stderr, "Done with reading: %lld usecs\n\n",
-		(long long)(((tv_end.tv_sec - tv_start.tv_sec) * 1000000) + (tv_end.tv_usec - tv_start.tv_usec)));
+	usecs = ((tv_end.tv_sec - tv_start.tv_sec) * 1000000) + (tv_end.tv_usec - tv_start.tv_usec);
+	fprintf(stderr, "Done with reading: %lld usecs, %d records, %.1f MB/s\n\n",
+		usecs, records, usecs ? ((double)read / usecs) : 0.0);
 
 	fprintf(stderr, "All good.\n");
 }
 
+#define UNREALDB_RECORDS_TEST_COUNT 1000000
+
+/** Benchmark writing and reading lots of small records.
+ * This is similar to what channeldb, tkldb, etc. do: each record
+ * is a couple of integers and short strings.
+ * @param key		The secret block, or NULL for unencrypted
+ * @param chunk_size	The chunk size to use for encrypted files
+ */
+void unrealdb_test_records(char *key, int chunk_size)
+{
+	UnrealDB *c;
+	int i;
+	char buf[64];
+	char *str;
+	uint64_t v64;
+	uint32_t v32;
+	uint16_t v16;
+	long long usecs;
+	struct timeval tv_start, tv_end;
+
+	iConf.database_chunk_size = chunk_size;
+
+	fprintf(stderr, "*** WRITE TEST: %d records, chunk size %d ***\n", UNREALDB_RECORDS_TEST_COUNT, chunk_size);
+	gettimeofday(&tv_start, NULL);
+	c = unrealdb_open("/tmp/test.db", UNREALDB_MODE_WRITE, key);
+	if (!c)
+		fatal_error("Could not open test db for writing: %s", strerror(errno));
+	for (i = 0; i < UNREALDB_RECORDS_TEST_COUNT; i++)
+	{
+		snprintf(buf, sizeof(buf), "#channel%d", i);
+		if (!unrealdb_write_int32(c, i) ||
+		    !unrealdb_write_str(c, buf) ||
+		    !unrealdb_write_int64(c, 1600000000 + i) ||
+		    !unrealdb_write_str(c, "nick!user@host") ||
+		    !unrealdb_write_int16(c, i & 0xffff))
+		{
+			fatal_error("Error on writing record %d: %s", i, c->error_string);
+		}
+	}
+	if (!unrealdb_close(c))
+		fatal_error("Error on close");
+	gettimeofday(&tv_end, NULL);
+	usecs = ((tv_end.tv_sec - tv_start.tv_sec) * 1000000) + (tv_end.tv_usec - tv_start.tv_usec);
+	fprintf(stderr, "Done with writing: %lld usecs, %.0f records/sec\n\n",
+		usecs, usecs ? ((double)UNREALDB_RECORDS_TEST_COUNT * 1000000 / usecs) : 0.0);
+
+	fprintf(stderr, "*** READ TEST: %d records ***\n", UNREALDB_RECORDS_TEST_COUNT);
+	gettimeofday(&tv_start, NULL);
+	c = unrealdb_open("/tmp/test.db", UNREALDB_MODE_READ, key);
+	if (!c)
+		fatal_error("Could not open test db for reading: %s", strerror(errno));
+	for (i = 0; i < UNREALDB_RECORDS_TEST_COUNT; i++)
+	{
+		if (!unrealdb_read_int32(c, &v32) ||
+		    !unrealdb_read_str(c, &str))
+		{
+			fatal_error("Error on reading record %d: %s", i, c->error_string);
+		}
+		snprintf(buf, sizeof(buf), "#channel%d", i);
+		if ((v32 != i) || strcmp(str, buf))
+			fatal_error("Record %d has unexpected contents", i);
+		safe_free(str);
+		if (!unrealdb_read_int64(c, &v64) ||
+		    !unrealdb_read_str(c, &str) ||
+		    !unrealdb_read_int16(c, &v16))
+		{
+			fatal_error("Error on reading record %d: %s", i, c->error_string);
+		}
+		safe_free(str);
+	}
+	if (!unrealdb_close(c))
+		fatal_error("Error on close");
+	gettimeofday(&tv_end, NULL);
+	usecs = ((tv_end.tv_sec - tv_start.tv_sec) * 1000000) + (tv_end.tv_usec - tv_start.tv_usec);
+	fprintf(stderr, "Done with reading: %lld usecs, %.0f records/sec\n\n",
+		usecs, usecs ? ((double)UNREALDB_RECORDS_TEST_COUNT * 1000000 / usecs) : 0.0);
+
+	iConf.database_chunk_size = UNREALDB_CRYPT_FILE_CHUNK_SIZE;
+}
+
 void unrealdb_test(void)
 {
 	//unrealdb_test_simple();
 	fprintf(stderr, "**** TESTING ENCRYPTED ****\n");
 	unrealdb_test_speed("test");
+	unrealdb_test_records("test", UNREALDB_CRYPT_FILE_CHUNK_SIZE);
+	unrealdb_test_records("test", 65536);
 	fprintf(stderr, "**** TESTING UNENCRYPTED ****\n");
 	unrealdb_test_speed(NULL);
+	unrealdb_test_records(NULL, UNREALDB_CRYPT_FILE_CHUNK_SIZE);
 }
 #endif
 
@@ -1172,3 +1491,421 @@ EVENT(unrealdb_expire_secret_cache)
 		}
 	}
 }
+
+/* Asynchronous writing (UNREALDB_MODE_WRITE_ASYNC).
+ *
+ * On the main thread the caller writes all its data as usual, but
+ * it is only stored in memory (c->membuf), which is cheap.
+ * On unrealdb_close() the handle is queued for the writer thread,
+ * which does the expensive work: encrypting the data, writing it to
+ * a temporary file, fsync() and renaming it to the real file.
+ * With set::database-fsync batch the writer thread first writes all
+ * the files that are queued at that moment and only then does the
+ * fsync() and rename of each of them, so the OS can flush them together.
+ * Finished jobs are picked up by unrealdb_async_run() from the main
+ * loop, which logs any errors.
+ *
+ * There is only one writer thread and it processes the jobs in order,
+ * so two writes of the same file can never run at the same time.
+ * Opening a database file in another mode first waits for the pending
+ * jobs of that same file, see unrealdb_async_wait(). Other files are
+ * not waited for, so a synchronous write of a small file (eg. history)
+ * does not have to wait for a big write to finish.
+ */
+
+/** Rename the temporary file of an asynchronous job to the real file (internal function).
+ * @returns 1 on success, 0 on failure (error is set on 'c').
+ */
+static int unrealdb_async_rename(UnrealDB *c, const char *filename)
+{
+	char tmpfname[512];
+
+	snprintf(tmpfname, sizeof(tmpfname), "%s.tmp", filename);
+#ifdef _WIN32
+	/* The rename operation cannot be atomic on Windows as it will cause a "file exists" error */
+	unlink(filename);
+#endif
+	if (rename(tmpfname, filename) < 0)
+	{
+		unrealdb_set_error(c, UNREALDB_ERROR_IO, "Error renaming '%s' to '%s': %s", tmpfname, filename, strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+/** Write the file of an asynchronous job (internal function).
+ * This is called from the writer thread, or from the main thread
+ * if there is no writer thread. It does not touch any global state.
+ * On return, job->error_code and job->error_string are set on failure.
+ * With UNREALDB_FSYNC_BATCH in the writer thread the file is left open
+ * in job->fd, see unrealdb_async_sync_file().
+ */
+static void unrealdb_async_write_file(UnrealDB *job)
+{
+	UnrealDB *c = safe_alloc_sensitive(sizeof(UnrealDB));
+	char tmpfname[512];
+	size_t done, n;
+
+	snprintf(tmpfname, sizeof(tmpfname), "%s.tmp", job->filename);
+
+	c->mode = UNREALDB_MODE_WRITE;
+	c->writer_thread = job->writer_thread;
+	c->crypted = job->crypted;
+	c->creationtime = job->creationtime;
+	c->bufsize = job->bufsize;
+	c->sync_on_close = job->writer_thread && (job->fsync_mode == UNREALDB_FSYNC_YES);
+	c->config = job->config; /* moved, not copied */
+	job->config = NULL;
+
+	c->fd = fopen(tmpfname, "wb");
+	if (!c->fd)
+	{
+		unrealdb_set_error(c, UNREALDB_ERROR_IO, "Could not open file: %s", strerror(errno));
+		goto unrealdb_async_write_file_end;
+	}
+
+	if (!unrealdb_write_header(c))
+	{
+		fclose(c->fd);
+		goto unrealdb_async_write_file_end;
+	}
+
+	for (done = 0; done < job->membuflen; done += n)
+	{
+		n = MIN(job->membuflen - done, 1048576);
+		if (!unrealdb_write(c, job->membuf + done, n))
+			break;
+	}
+	if (c->error_code)
+	{
+		fclose(c->fd);
+		goto unrealdb_async_write_file_end;
+	}
+
+	if (job->writer_thread && (job->fsync_mode == UNREALDB_FSYNC_BATCH))
+	{
+		/* Write out everything, the rest is done by unrealdb_async_sync_file() */
+		if (!unrealdb_flush_buffer(c, 1) || (fflush(c->fd) != 0))
+		{
+			if (!c->error_code)
+				unrealdb_set_error(c, UNREALDB_ERROR_IO, "Write error: %s", strerror(errno));
+			fclose(c->fd);
+			goto unrealdb_async_write_file_end;
+		}
+		job->fd = c->fd;
+		goto unrealdb_async_write_file_end;
+	}
+
+	if (!unrealdb_close_file(c))
+		goto unrealdb_async_write_file_end;
+
+	unrealdb_async_rename(c, job->filename);
+
+unrealdb_async_write_file_end:
+	if (c->error_code)
+	{
+		job->error_code = c->error_code;
+		job->error_string = c->error_string;
+		c->error_string = NULL;
+	}
+	unrealdb_free(c);
+	sodium_stackzero(1024);
+}
+
+#ifndef _WIN32
+/** Finish a file written with UNREALDB_FSYNC_BATCH (internal function).
+ * This does the fsync(), closes the file and renames it to the real file.
+ * Only called from the writer thread.
+ */
+static void unrealdb_async_sync_file(UnrealDB *job)
+{
+	FILE *fd = job->fd;
+
+	job->fd = NULL;
+	if (fsync(fileno(fd)) != 0)
+	{
+		unrealdb_set_error(job, UNREALDB_ERROR_IO, "Write error: %s", strerror(errno));
+		fclose(fd);
+		return;
+	}
+	if (fclose(fd) != 0)
+	{
+		unrealdb_set_error(job, UNREALDB_ERROR_IO, "Write error: %s", strerror(errno));
+		return;
+	}
+	unrealdb_async_rename(job, job->filename);
+}
+#endif
+
+/** Remember that an asynchronous write of this file completed successfully (internal function) */
+static void unrealdb_async_set_written(const char *filename)
+{
+	UnrealDBWritten *w;
+
+	for (w = unrealdb_written; w; w = w->next)
+		if (!strcmp(w->filename, filename))
+			break;
+	if (!w)
+	{
+		w = safe_alloc(sizeof(UnrealDBWritten));
+		safe_strdup(w->filename, filename);
+		AddListItem(w, unrealdb_written);
+	}
+	w->written = TStime();
+}
+
+/** Log the result of a finished asynchronous job and free it (internal function) */
+static void unrealdb_async_completed(UnrealDB *job)
+{
+	if (job->error_code)
+	{
+		unreal_log(ULOG_ERROR, "unrealdb", "UNREALDB_ASYNC_WRITE_ERROR", NULL,
+		           "Error writing database file $filename: $error",
+		           log_data_string("filename", job->filename),
+		           log_data_string("error", job->error_string));
+	} else {
+		unrealdb_async_set_written(job->filename);
+	}
+	unrealdb_free(job);
+}
+
+#ifndef _WIN32
+static pthread_t unrealdb_writer;
+static int unrealdb_writer_started = 0;
+static pthread_mutex_t unrealdb_writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t unrealdb_writer_start_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t unrealdb_writer_done_cond = PTHREAD_COND_INITIALIZER;
+static UnrealDB *unrealdb_writer_queue = NULL; /**< Jobs to do (first in, first out) */
+static UnrealDB *unrealdb_writer_queue_tail = NULL;
+static UnrealDB *unrealdb_writer_done = NULL; /**< Finished jobs */
+static UnrealDB *unrealdb_writer_batch = NULL; /**< Jobs that are being written right now */
+
+/** The main function of the writer thread */
+static void *unrealdb_writer_main(void *arg)
+{
+	UnrealDB *batch, *job, *last = NULL;
+
+	pthread_mutex_lock(&unrealdb_writer_lock);
+	while (1)
+	{
+		while (!unrealdb_writer_queue)
+			pthread_cond_wait(&unrealdb_writer_start_cond, &unrealdb_writer_lock);
+		/* Take all the queued jobs */
+		batch = unrealdb_writer_queue;
+		unrealdb_writer_queue = unrealdb_writer_queue_tail = NULL;
+		unrealdb_writer_batch = batch;
+		pthread_mutex_unlock(&unrealdb_writer_lock);
+
+		for (job = batch; job; job = job->next)
+			unrealdb_async_write_file(job);
+		/* With UNREALDB_FSYNC_BATCH the files are still open */
+		for (job = batch; job; job = job->next)
+		{
+			if (job->fd)
+				unrealdb_async_sync_file(job);
+			last = job;
+		}
+
+		pthread_mutex_lock(&unrealdb_writer_lock);
+		last->next = unrealdb_writer_done;
+		unrealdb_writer_done = batch;
+		unrealdb_writer_batch = NULL;
+		pthread_cond_broadcast(&unrealdb_writer_done_cond);
+	}
+	return NULL;
+}
+
+/** Start the writer thread, if it is not running yet.
+ * @returns 1 if the writer thread is running, 0 if not.
+ */
+static int unrealdb_writer_start(void)
+{
+	sigset_t newmask, oldmask;
+
+	if (unrealdb_writer_started)
+		return 1;
+
+	/* Signals should only be handled by the main thread */
+	sigfillset(&newmask);
+	pthread_sigmask(SIG_BLOCK, &newmask, &oldmask);
+	if (pthread_create(&unrealdb_writer, NULL, unrealdb_writer_main, NULL) == 0)
+		unrealdb_writer_started = 1;
+	else
+		unreal_log(ULOG_WARNING, "unrealdb", "UNREALDB_WRITER_THREAD_FAILED", NULL,
+		           "Could not create database writer thread: $system_error. "
+		           "Database files will be written by the main thread.",
+		           log_data_string("system_error", strerror(errno)));
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+	return unrealdb_writer_started;
+}
+
+/** Is there a job for this file in the queue or being written?
+ * Must be called with unrealdb_writer_lock held (internal function).
+ */
+static int unrealdb_writer_has_job(const char *filename)
+{
+	UnrealDB *job;
+
+	for (job = unrealdb_writer_queue; job; job = job->next)
+		if (!strcmp(job->filename, filename))
+			return 1;
+	for (job = unrealdb_writer_batch; job; job = job->next)
+		if (!strcmp(job->filename, filename))
+			return 1;
+	return 0;
+}
+#endif
+
+/** Wait until all the asynchronous writes of this file are done (internal function).
+ * Unlike unrealdb_async_flush() this does not wait for the writes of other files.
+ */
+static void unrealdb_async_wait(const char *filename)
+{
+#ifndef _WIN32
+	if (!unrealdb_writer_started)
+		return;
+
+	pthread_mutex_lock(&unrealdb_writer_lock);
+	while (unrealdb_writer_has_job(filename))
+		pthread_cond_wait(&unrealdb_writer_done_cond, &unrealdb_writer_lock);
+	pthread_mutex_unlock(&unrealdb_writer_lock);
+#endif
+}
+
+/** Close a database file opened with UNREALDB_MODE_WRITE_ASYNC (internal function).
+ * @returns 1 if the job is queued or written, 0 on failure.
+ */
+static int unrealdb_async_close(UnrealDB *c)
+{
+	if (c->error_code)
+	{
+		unrealdb_free(c);
+		return 0;
+	}
+
+#ifndef _WIN32
+	/* When terminating we write directly, as we are about to exit */
+	if (!loop.terminating && unrealdb_writer_start())
+	{
+		UnrealDB *job, *prev = NULL, *superseded = NULL;
+
+		c->writer_thread = 1;
+		pthread_mutex_lock(&unrealdb_writer_lock);
+		/* If an older write of the same file is still queued then drop it,
+		 * our data is newer anyway. This way the writer thread never has
+		 * two jobs for the same file in one batch, which would both use
+		 * the same temporary file.
+		 */
+		for (job = unrealdb_writer_queue; job; job = job->next)
+		{
+			if (!strcmp(job->filename, c->filename))
+			{
+				superseded = job;
+				if (prev)
+					prev->next = job->next;
+				else
+					unrealdb_writer_queue = job->next;
+				if (unrealdb_writer_queue_tail == job)
+					unrealdb_writer_queue_tail = prev;
+				break; /* there can only be one */
+			}
+			prev = job;
+		}
+		if (unrealdb_writer_queue_tail)
+			unrealdb_writer_queue_tail->next = c;
+		else
+			unrealdb_writer_queue = c;
+		unrealdb_writer_queue_tail = c;
+		pthread_cond_signal(&unrealdb_writer_start_cond);
+		pthread_mutex_unlock(&unrealdb_writer_lock);
+		if (superseded)
+			unrealdb_free(superseded);
+		return 1;
+	}
+#endif
+
+	/* No writer thread, do it ourselves (errors are set globally as usual).
+	 * A write of the same file may still be queued from before, eg. when
+	 * terminating, so wait for those first: they would write to the same
+	 * temporary file and could rename an older copy over ours.
+	 */
+	unrealdb_async_flush();
+	unrealdb_async_write_file(c);
+	if (c->error_code)
+	{
+		unrealdb_free(c);
+		return 0;
+	}
+	unrealdb_async_set_written(c->filename);
+	unrealdb_free(c);
+	return 1;
+}
+
+/**
+ * @addtogroup UnrealDBFunctions
+ * @{
+ */
+
+/** Process the jobs that the database writer thread has finished.
+ * This is called from the main loop.
+ */
+void unrealdb_async_run(void)
+{
+#ifndef _WIN32
+	UnrealDB *job, *job_next;
+
+	if (!unrealdb_writer_started)
+		return;
+
+	pthread_mutex_lock(&unrealdb_writer_lock);
+	job = unrealdb_writer_done;
+	unrealdb_writer_done = NULL;
+	pthread_mutex_unlock(&unrealdb_writer_lock);
+
+	for (; job; job = job_next)
+	{
+		job_next = job->next;
+		unrealdb_async_completed(job);
+	}
+#endif
+}
+
+/** When did the last UNREALDB_MODE_WRITE_ASYNC write of a file complete?
+ * Since unrealdb_close() only queues such a write, this is the way
+ * to find out when the data actually made it to disk.
+ * @param filename	The filename, as passed to unrealdb_open()
+ * @returns The time of the last successful write, or 0 if there
+ *          was none (yet) since we booted.
+ */
+time_t unrealdb_async_written_time(const char *filename)
+{
+	UnrealDBWritten *w;
+
+	for (w = unrealdb_written; w; w = w->next)
+		if (!strcmp(w->filename, filename))
+			return w->written;
+	return 0;
+}
+
+/** Wait until all asynchronous writes are done.
+ * This should be called before exiting. Note that unrealdb_open()
+ * only waits for the writes of the file that is being opened,
+ * see unrealdb_async_wait().
+ */
+void unrealdb_async_flush(void)
+{
+#ifndef _WIN32
+	if (!unrealdb_writer_started)
+		return;
+
+	pthread_mutex_lock(&unrealdb_writer_lock);
+	while (unrealdb_writer_queue || unrealdb_writer_batch)
+		pthread_cond_wait(&unrealdb_writer_done_cond, &unrealdb_writer_lock);
+	pthread_mutex_unlock(&unrealdb_writer_lock);
+
+	unrealdb_async_run();
+#endif
+}
+
+/** @} */
@@ -25,11 +25,8 @@
 
 void add_whowas_to_clist(WhoWas **, WhoWas *);
 void del_whowas_from_clist(WhoWas **, WhoWas *);
-void add_whowas_to_list(WhoWas **, WhoWas *);
-void del_whowas_from_list(WhoWas **, WhoWas *);
 
 WhoWas MODVAR WHOWAS[NICKNAMEHISTORYLENGTH];
-WhoWas MODVAR *WHOWASHASH[WHOWAS_HASH_TABLE_SIZE];
 
 MODVAR int whowas_next = 0;
 
@@ -52,22 +49,19 @@ void free_whowas_fields(WhoWas *e)
 	e->logon = 0;
 	e->logoff = 0;
 	e->connected_since = 0;
-	e->hashv = -1;
 }
 
 /** Free whowas entry. This is the function you normally want to use. */
 void free_whowas_entry(WhoWas *e)
 {
-	int hashv = e->hashv;
 	free_whowas_fields(e);
 	if (e->online)
 		del_whowas_from_clist(&(e->online->user->whowas), e);
-	del_whowas_from_list(&WHOWASHASH[hashv], e);
+	hashtable_del(&whowasTable, &e->hash);
 }
 
 void create_whowas_entry(Client *client, WhoWas *e, WhoWasEvent event)
 {
-	e->hashv = hash_whowas_name(client->name);
 	e->event = event;
 	e->connected_since = get_creationtime(client);
 	e->logon = client->lastnick;
@@ -99,7 +93,7 @@ void add_history(Client *client, int online, WhoWasEvent event)
 
 	new = &WHOWAS[whowas_next];
 
-	if (new->hashv != -1)
+	if (new->name)
 		free_whowas_entry(new);
 
 	create_whowas_entry(client, new, event);
@@ -111,7 +105,7 @@ void add_history(Client *client, int online, WhoWasEvent event)
 	} else {
 		new->online = NULL;
 	}
-	add_whowas_to_list(&WHOWASHASH[new->hashv], new);
+	hashtable_add(&whowasTable, &new->hash, hash_whowas_name(new->name));
 	whowas_next++;
 	if (whowas_next == NICKNAMEHISTORYLENGTH)
 		whowas_next = 0;
@@ -131,14 +125,13 @@ void off_history(Client *client)
 
 Client *get_history(const char *nick, time_t timelimit)
 {
+	HashNode *n;
 	WhoWas *temp;
-	int  blah;
 
 	timelimit = TStime() - timelimit;
-	blah = hash_whowas_name(nick);
-	temp = WHOWASHASH[blah];
-	for (; temp; temp = temp->next)
+	hashtable_for_each_match(&whowasTable, n, hash_whowas_name(nick))
 	{
+		temp = container_of(n, WhoWas, hash);
 		if (mycmp(nick, temp->name))
 			continue;
 		if (temp->logoff < timelimit)
@@ -158,7 +151,7 @@ void count_whowas_memory(int *wwu, u_long *wwum)
 	/* count up the memory used of whowas structs in um */
 
 	for (i = 0, tmp = &WHOWAS[0]; i < NICKNAMEHISTORYLENGTH; i++, tmp++)
-		if (tmp->hashv != -1)
+		if (tmp->name)
 		{
 			u++;
 			um += sizeof(WhoWas);
@@ -173,12 +166,7 @@ void initwhowas()
 	int  i;
 
 	for (i = 0; i < NICKNAMEHISTORYLENGTH; i++)
-	{
 		memset(&WHOWAS[i], 0, sizeof(WhoWas));
-		WHOWAS[i].hashv = -1;
-	}
-	for (i = 0; i < WHOWAS_HASH_TABLE_SIZE; i++)
-		WHOWASHASH[i] = NULL;
 }
 
 void add_whowas_to_clist(WhoWas ** bucket, WhoWas * whowas)
@@ -198,21 +186,3 @@ void del_whowas_from_clist(WhoWas ** bucket, WhoWas * whowas)
 	if (whowas->cnext)
 		whowas->cnext->cprev = whowas->cprev;
 }
-
-void add_whowas_to_list(WhoWas ** bucket, WhoWas * whowas)
-{
-	whowas->prev = NULL;
-	if ((whowas->next = *bucket) != NULL)
-		whowas->next->prev = whowas;
-	*bucket = whowas;
-}
-
-void del_whowas_from_list(WhoWas ** bucket, WhoWas * whowas)
-{
-	if (whowas->prev)
-		whowas->prev->next = whowas->next;
-	else
-		*bucket = whowas->next;
-	if (whowas->next)
-		whowas->next->prev = whowas->prev;
-}